@@ -11,6 +11,19 @@ QEMU_CFG_FLAGS := -M virt -smp 1 -serial stdio \
 
 RECORDING_FILENAME:=virt.recording
 
+# A second disk to swap to, e.g. 'make swap.img && SWAP=swap.img make qemu'.
+# Only disks that start with the swap header are used for swap
+ifneq ($(SWAP),)
+QEMU_CFG_FLAGS+= \
+	-drive id=swap,if=none,format=raw,file=$(SWAP) \
+	-device virtio-blk-device,drive=swap,bus=virtio-mmio-bus.5 \
+
+endif
+
+swap.img:
+	qemu-img create -f raw swap.img 256M
+	printf 'PI0SWAP1' | dd of=swap.img conv=notrunc status=none
+
 export QEMU_BOARD_SPECIFIC_TARGETS := snapshot-drive.qcow2
 snapshot-drive.qcow2:
 	qemu-img create -f qcow2 snapshot-drive.qcow2 4G
@@ -17,6 +17,7 @@ typedef enum Errors {
     ERR_NOEXEC = 8,	        /* Exec format error */
     ERR_BADF = 9,           /* Bad file number */
     ERR_NOMEM =	12,	        /* Not enough space */
+    ERR_FAULT = 14,	        /* Bad address */
     ERR_BUSY = 16,	        /* Device or resource busy */
     ERR_EXIST = 17,	        /* File exists */
     ERR_NODEV = 19,	        /* No such device */
@@ -70,6 +71,9 @@ typedef enum SyscallIdentifiers {
     SYS_SetCwd = 24,
     SYS_GetCwd = 25,
     SYS_IsTty = 26,
+    SYS_MUnmap = 27,
+    SYS_Brk = 28,
+    SYS_FTruncate = 29,
 
     SYS_MilliSleep = 31,
     SYS_GetTicks = 32,
@@ -327,11 +331,48 @@ static inline int sys_mkdir(const char *path, int mode)
     return syscall(SYS_MakeDirectory, (sysarg_t) path, (sysarg_t) mode, 0, 0);
 }
 
+#define MF_SHARED       0x0001  /* Regular files: pages are shared with other mappings, read-only except for /shm/ */
+#define MF_PRIVATE      0x0002  /* Regular files: read-only, same as MF_SHARED as nobody can write. Not for /shm/ */
+#define MF_ANONYMOUS    0x0020  /* Zero-filled memory, 'fd' is ignored */
+
+/**
+ * Maps 'fd' (or anonymous memory) at 'addr', or wherever there is room if 'addr' is NULL.
+ * Regular files are mapped read-only from their start and need either MF_SHARED or MF_PRIVATE.
+ * Shared memory objects in /shm/ are mapped read-write with MF_SHARED, from an O_RDWR 'fd'.
+ * Returns the address of the mapping, or a negative error code.
+ */
 static inline int sys_mmap(int fd, void *addr, size_t length, uint32_t flags)
 {
     return syscall(SYS_MMap, (sysarg_t) fd, (sysarg_t) addr, (sysarg_t) length, (sysarg_t) flags);
 }
 
+/**
+ * Unmaps whatever is in [addr, addr+length). The heap, which only moves with sys_brk,
+ * and the stacks can't be unmapped: ranges that overlap them fail with -ERR_INVAL.
+ */
+static inline int sys_munmap(void *addr, size_t length)
+{
+    return syscall(SYS_MUnmap, (sysarg_t) addr, (sysarg_t) length, 0, 0);
+}
+
+/**
+ * Sets the size of a regular file, e.g. of a shared memory object before mapping it.
+ * Returns 0 on success, or a negative error code.
+ */
+static inline int sys_ftruncate(int fd, size_t length)
+{
+    return syscall(SYS_FTruncate, (sysarg_t) fd, (sysarg_t) length, 0, 0);
+}
+
+/**
+ * Moves the end of the heap to 'addr', NULL leaves it where it is.
+ * Returns the new end of the heap, which is the old one if it could not be moved.
+ */
+static inline int sys_brk(void *addr)
+{
+    return syscall(SYS_Brk, (sysarg_t) addr, 0, 0, 0);
+}
+
 static inline int sys_isatty(int fd)
 {
     return syscall(SYS_IsTty, (sysarg_t) fd, 0, 0, 0);
@@ -365,10 +406,28 @@ typedef struct FramebufferDisplayInfo {
     uint32_t bytes_per_pixel;
 } FramebufferDisplayInfo;
 
+typedef struct FramebufferRect {
+    uint32_t x, y;
+    uint32_t width, height;
+} FramebufferRect;
+
+/*
+ * Argument of FBIO_REFRESH_RECTS: the regions of the framebuffer that changed
+ * since the last refresh. More than FBIO_MAX_DAMAGE_RECTS rectangles, or a
+ * NULL argument, refresh the whole display.
+ */
+typedef struct FramebufferDamage {
+    uint32_t count;
+    FramebufferRect const *rects;
+} FramebufferDamage;
+
+#define FBIO_MAX_DAMAGE_RECTS 16
+
 enum FramebufferIoctl {
     FBIO_GET_DISPLAY_INFO = 1,
     FBIO_REFRESH = 2,
     FBIO_MAP = 3,
+    FBIO_REFRESH_RECTS = 4,
 };
 
 enum RealTimeClockIoctl {
@@ -384,6 +443,27 @@ enum PtyIoctl {
     PTYIO_GETSLAVE = 1,
 };
 
+/*
+ * Argument of ZRAMIO_GET_STATS. Blocks that were never written, or only
+ * ever with zeroes, take no memory. memory_used also counts the per-block
+ * bookkeeping and the blocks set aside for when the kernel heap is full, so
+ * it can exceed compressed_bytes on a mostly empty disk.
+ */
+typedef struct CompressedRamDiskStats {
+    uint64_t disk_size;
+    uint32_t stored_blocks;
+    uint32_t incompressible_blocks;
+    uint32_t zero_blocks;
+    uint64_t original_bytes;
+    uint64_t compressed_bytes;
+    uint64_t memory_used;
+} CompressedRamDiskStats;
+
+enum CompressedRamDiskIoctl {
+    ZRAMIO_GET_STATS = 1,
+    ZRAMIO_PRINT_STATS = 2,
+};
+
 #ifdef __cplusplus
 }
 #endif
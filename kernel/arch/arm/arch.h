@@ -18,6 +18,86 @@ static inline void memory_barrier()
         : "r3");
 }
 
+/**
+ * Smallest D-cache line size of the supported cores: this is the stride
+ * used by the by-MVA maintenance operations below and the alignment that
+ * buffers shared with a DMA-capable device must respect so that they never
+ * share a cache line with unrelated data.
+*/
+#ifdef CONFIG_ARMV6
+#define ARCH_CACHE_LINE_SIZE 32
+#else
+#define ARCH_CACHE_LINE_SIZE 64
+#endif
+
+static inline void data_sync_barrier()
+{
+    asm volatile("mcr p15, 0, %0, c7, c10, 4" :: "r"(0) : "memory");
+}
+
+/**
+ * \brief Write back to memory the D-cache lines covering [start, start+len)
+ * Use this before a device reads memory that the CPU wrote through a cacheable mapping
+*/
+static inline void dcache_clean_range(void const *start, size_t len)
+{
+    uintptr_t addr = reinterpret_cast<uintptr_t>(start) & ~(ARCH_CACHE_LINE_SIZE - 1);
+    uintptr_t end = reinterpret_cast<uintptr_t>(start) + len;
+    for (; addr < end; addr += ARCH_CACHE_LINE_SIZE)
+        asm volatile("mcr p15, 0, %0, c7, c10, 1" :: "r"(addr) : "memory");
+    data_sync_barrier();
+}
+
+/**
+ * \brief Write back and then discard the D-cache lines covering [start, start+len)
+*/
+static inline void dcache_clean_and_invalidate_range(void const *start, size_t len)
+{
+    uintptr_t addr = reinterpret_cast<uintptr_t>(start) & ~(ARCH_CACHE_LINE_SIZE - 1);
+    uintptr_t end = reinterpret_cast<uintptr_t>(start) + len;
+    for (; addr < end; addr += ARCH_CACHE_LINE_SIZE)
+        asm volatile("mcr p15, 0, %0, c7, c14, 1" :: "r"(addr) : "memory");
+    data_sync_barrier();
+}
+
+/**
+ * \brief Discard the D-cache lines covering [start, start+len)
+ * Use this after a device wrote to memory, before the CPU reads it.
+ * Lines that are only partially covered by the range are also written back
+ * so that the data of whoever shares them is not lost.
+*/
+static inline void dcache_invalidate_range(void const *start, size_t len)
+{
+    uintptr_t addr = reinterpret_cast<uintptr_t>(start);
+    uintptr_t end = addr + len;
+
+    if (addr & (ARCH_CACHE_LINE_SIZE - 1)) {
+        addr &= ~(ARCH_CACHE_LINE_SIZE - 1);
+        asm volatile("mcr p15, 0, %0, c7, c14, 1" :: "r"(addr) : "memory");
+        addr += ARCH_CACHE_LINE_SIZE;
+    }
+    if (end & (ARCH_CACHE_LINE_SIZE - 1) && end > addr) {
+        end &= ~(ARCH_CACHE_LINE_SIZE - 1);
+        asm volatile("mcr p15, 0, %0, c7, c14, 1" :: "r"(end) : "memory");
+    }
+    for (; addr < end; addr += ARCH_CACHE_LINE_SIZE)
+        asm volatile("mcr p15, 0, %0, c7, c6, 1" :: "r"(addr) : "memory");
+    data_sync_barrier();
+}
+
+/**
+ * \brief Make instructions written through the D-cache visible to instruction fetches
+*/
+static inline void icache_sync_range(void const *start, size_t len)
+{
+    dcache_clean_range(start, len);
+    asm volatile(
+        "mcr p15, 0, %0, c7, c5, 0  \n" // Invalidate instruction cache
+        "mcr p15, 0, %0, c7, c5, 6  \n" // Invalidate BTB
+        "mcr p15, 0, %0, c7, c5, 4  \n" // Prefetch flush
+        :: "r"(0) : "memory");
+}
+
 static inline uint8_t ioread8(uintptr_t reg)
 {
     memory_barrier();
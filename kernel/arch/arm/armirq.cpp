@@ -60,10 +60,13 @@ extern "C" void irq_and_exception_handler(uint32_t vector_offset, InterruptFrame
                 frame->r[1], frame->r[2], frame->r[3],
                 frame->r[4]);
         }
+        scheduler_preempt_if_needed(frame);
         break;
     }
     case InterruptVector::IRQ: {
         dispatch_irq(frame);
+        // Only after the interrupt controller got its end-of-interrupt
+        scheduler_preempt_if_needed(frame);
         break;
     }
     
@@ -87,14 +90,14 @@ extern "C" void irq_and_exception_handler(uint32_t vector_offset, InterruptFrame
 
 static void data_abort_handler(InterruptFrame* state)
 {
-    state->lr -= 8;
+    // The trampoline already took 4 off the 'aborted instruction + 8' in lr,
+    // what is left is where to return to in order to retry the access
+    state->lr -= 4;
 
     uintptr_t faulting_addr = read_fault_address_register();
-    auto result = vm_try_fix_page_fault(state->lr, faulting_addr);
-    if (result == PageFaultHandlerResult::Fixed) {
-        LOGI("Data abort while accessing %p, but fixed :)\n", faulting_addr);
+    auto result = vm_try_fix_page_fault(state->lr, faulting_addr, dfsr_is_write(read_dfsr()));
+    if (result == PageFaultHandlerResult::Fixed)
         return;
-    }
     
     if (result == PageFaultHandlerResult::ProcessFatal) {
         uint32_t dfsr = read_dfsr();
@@ -127,9 +130,36 @@ static void data_abort_handler(InterruptFrame* state)
         FORMAT_ARGS_TASK_STATE(state));
 }
 
-static void prefetch_abort_handler(InterruptFrame*)
+static void prefetch_abort_handler(InterruptFrame* state)
 {
-    panic("unhandled PREFETCH_ABORT");
+    // lr was already adjusted by the trampoline to the instruction that failed to be fetched
+    uintptr_t faulting_addr = read_instruction_fault_address_register();
+    auto result = vm_try_fix_page_fault(state->lr, faulting_addr, false);
+    if (result == PageFaultHandlerResult::Fixed)
+        return;
+
+    uint32_t fault_status = dfsr_fault_status(read_ifsr());
+    if (result == PageFaultHandlerResult::ProcessFatal) {
+        LOGW(
+            "[PREFETCH ABORT]: Process %s crashed\n"
+            "Reason: %s fetching instruction at %p\n"
+            FORMAT_TASK_STATE "\n",
+            cpu_current_process()->name,
+            dfsr_status_to_string(fault_status),
+            faulting_addr,
+            FORMAT_ARGS_TASK_STATE(state)
+        );
+        sys$exit(-1);
+        return;
+    }
+
+    kassert(result == PageFaultHandlerResult::KernelFatal);
+    panic(
+        "[PREFETCH ABORT]: %s fetching instruction at %p\n"
+        FORMAT_TASK_STATE "\n",
+        dfsr_status_to_string(fault_status),
+        faulting_addr,
+        FORMAT_ARGS_TASK_STATE(state));
 }
 
 static void undefined_instruction_handler(InterruptFrame*)
@@ -144,8 +174,16 @@ void arch_irq_init()
 
     void *vector_table = (void*) phys2virt(page2addr(page));
     memcpy(vector_table, vector_table_data_start, vector_table_data_end - vector_table_data_start);
+    icache_sync_range(vector_table, vector_table_data_end - vector_table_data_start);
+
+    // The vectors are mapped once in the kernel's half of the address space,
+    // instead of at 0x0 in every process
+    MUST(vm_map(vm_kernel_address_space(), page, areas::HIGH_VECTORS_ADDR, PageAccessPermissions::PriviledgedOnly));
 
-    MUST(vm_map(vm_current_address_space(), page, 0, PageAccessPermissions::PriviledgedOnly));
+    uint32_t sctlr;
+    ARM_MRC(p15, 0, sctlr, c1, c0, 0);
+    sctlr |= 1 << 13;   // V: High exception vectors
+    ARM_MCR(p15, 0, sctlr, c1, c0, 0);
 }
 
 extern "C" void _arch_context_switch(ContextSwitchFrame **from, ContextSwitchFrame *to);
@@ -182,6 +220,7 @@ void arch_create_initial_kernel_stack(
     // just because it makes debugging easier
     for (uint32_t i = 0; i < 13; i++)
         ctx->r[i] = i;
+    ctx->cpsr = 0xd3;   // Supervisor mode with IRQs and FIQs disabled, like at trap entry
     ctx->lr = reinterpret_cast<uintptr_t>(pop_iframe_and_return);
 
     *kernel_stack_ptr = sp;
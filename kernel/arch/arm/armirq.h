@@ -12,6 +12,7 @@ struct InterruptFrame {
     uint32_t spsr;              // "Saved Program Status Register", pushed immediately at trap entrys
 
     void set_syscall_return_value(uint32_t value) { r[0] = value; }
+    bool is_from_user_mode() const { return (spsr & 0x1f) == 0x10; }
     void set_thread_start_values(uintptr_t entrypoint, uintptr_t userstack)
     {
         this->lr = entrypoint;
@@ -20,6 +21,7 @@ struct InterruptFrame {
 };
 
 struct ContextSwitchFrame {
+    uint32_t cpsr;              // Mode and interrupt mask bits, a thread can be switched out from an interrupt handler
     uint32_t r[13];             // The r0-r12 registers, used by the kernel at the time of the context switch
     uint32_t lr;
 };
@@ -17,11 +17,69 @@ static inline void invalidate_tlb()
     asm volatile("mcr p15, 0, %0, c8, c7, 0" ::"r"(0));
 }
 
+/**
+ * \brief Invalidate the TLB entry for a single page
+ * The low bits of 'virt_addr' select the ASID of a non-global entry,
+ * global entries are invalidated regardless of the ASID
+*/
 static inline void invalidate_tlb_entry(uintptr_t virt_addr)
 {
     asm volatile("mcr p15, 0, %0, c8, c7, 1" ::"r"(virt_addr));
 }
 
+static inline void invalidate_tlb_entry(uintptr_t virt_addr, uint8_t asid)
+{
+    invalidate_tlb_entry((virt_addr & ~0xfff) | asid);
+}
+
+/**
+ * \brief Invalidate all the non-global TLB entries tagged with 'asid'
+*/
+static inline void invalidate_tlb_asid(uint8_t asid)
+{
+    asm volatile("mcr p15, 0, %0, c8, c7, 2" ::"r"(asid));
+}
+
+/**
+ * \brief Set the ASID used to tag and match non-global TLB entries
+*/
+static inline void write_contextidr(uint8_t asid)
+{
+    asm volatile(
+        "mcr p15, 0, %0, c13, c0, 1 \n"
+        "mcr p15, 0, %1, c7, c5, 4  \n" // Prefetch flush
+        :: "r"(asid), "r"(0) : "memory");
+}
+
+static inline void write_ttbr0(uintptr_t ttbr0)
+{
+    asm volatile(
+        "mcr p15, 0, %0, c2, c0, 0  \n"
+        "mcr p15, 0, %1, c7, c5, 4  \n" // Prefetch flush
+        :: "r"(ttbr0), "r"(0) : "memory");
+}
+
+static inline void write_ttbr1(uintptr_t ttbr1)
+{
+    asm volatile(
+        "mcr p15, 0, %0, c2, c0, 1  \n"
+        "mcr p15, 0, %1, c7, c5, 4  \n" // Prefetch flush
+        :: "r"(ttbr1), "r"(0) : "memory");
+}
+
+/**
+ * \brief Set the 'N' field of the Translation Table Base Control Register
+ * Addresses below 2^(32-N) are translated through TTBR0, whose table then
+ * shrinks to 16KB >> N, everything else goes through TTBR1
+*/
+static inline void write_ttbcr(uint32_t n)
+{
+    asm volatile(
+        "mcr p15, 0, %0, c2, c0, 2  \n"
+        "mcr p15, 0, %1, c7, c5, 4  \n" // Prefetch flush
+        :: "r"(n & 0x7), "r"(0) : "memory");
+}
+
 /**
  * \brief Read the 'Data Fault Status' register
  */
@@ -32,6 +90,14 @@ static inline uint32_t read_dfsr()
     return status;
 }
 
+/**
+ * \brief Whether the access that caused a data abort was a write
+*/
+static inline bool dfsr_is_write(uint32_t dfsr)
+{
+    return (dfsr >> 11) & 1;
+}
+
 /**
  * \brief Extract the "Fault Status" value from a "Data Fault Status Register"
 */
@@ -49,6 +115,26 @@ static inline uintptr_t read_fault_address_register()
     return addr;
 }
 
+/**
+ * \brief Read the 'Instruction Fault Status' register
+ */
+static inline uint32_t read_ifsr()
+{
+    uint32_t status;
+    asm volatile("mrc p15, 0, %0, c5, c0, 1" :"=r"(status));
+    return status;
+}
+
+/**
+ * \brief Read the 'Instruction Fault Address' register
+ */
+static inline uintptr_t read_instruction_fault_address_register()
+{
+    uintptr_t addr;
+    asm volatile("mrc p15, 0, %0, c6, c0, 2" :"=r"(addr));
+    return addr;
+}
+
 enum class PageAccessPermissions : uint8_t {
     Unmapped = 0b00,
     PriviledgedOnly = 0b01,
@@ -56,6 +142,50 @@ enum class PageAccessPermissions : uint8_t {
     UserFullAccess = 0b11
 };
 
+/**
+ * \brief Memory region attributes of a mapping
+ * 
+ * Normal:          Outer and Inner Write-Back, Write-Allocate. Use this for RAM
+ * WriteCombine:    Normal, Outer and Inner Non-cacheable. Writes can still be merged
+ *                  in the write buffer, use this for framebuffers
+ * Device:          Shareable device memory, use this for memory mapped peripherals
+ * StronglyOrdered: Every access completes before the next one can start
+*/
+enum class MemoryType : uint8_t {
+    Normal,
+    WriteCombine,
+    Device,
+    StronglyOrdered,
+};
+
+/**
+ * Encoding of a MemoryType in the TEX[2:0], C and B bits of a descriptor,
+ * assuming TEX remap is disabled (SCTLR.TRE == 0)
+*/
+struct MemoryTypeEncoding {
+    uint8_t tex;
+    uint8_t cachable;
+    uint8_t bufferable;
+
+    static constexpr MemoryTypeEncoding from(MemoryType type)
+    {
+        switch (type) {
+        case MemoryType::Normal:            return { .tex = 0b001, .cachable = 1, .bufferable = 1 };
+        case MemoryType::WriteCombine:      return { .tex = 0b001, .cachable = 0, .bufferable = 0 };
+        case MemoryType::Device:            return { .tex = 0b000, .cachable = 0, .bufferable = 1 };
+        case MemoryType::StronglyOrdered:   return { .tex = 0b000, .cachable = 0, .bufferable = 0 };
+        }
+        return { .tex = 0b000, .cachable = 0, .bufferable = 0 };
+    }
+
+    static constexpr MemoryType decode(uint8_t tex, uint8_t cachable, uint8_t bufferable)
+    {
+        if (tex == 0b001)
+            return cachable ? MemoryType::Normal : MemoryType::WriteCombine;
+        return bufferable ? MemoryType::Device : MemoryType::StronglyOrdered;
+    }
+};
+
 // Note: In ARMv7 this changed name from "Coarse Page Table" to simply "Page Table"
 static constexpr uint32_t COARSE_PAGE_TABLE_ENTRY_ID = 0b01;
 struct CoarsePageTableEntry {
@@ -102,18 +232,21 @@ struct SectionEntry {
     uint32_t base_addr : 12;
 
     uintptr_t base_address() const { return base_addr << 20; }
+    PageAccessPermissions permissions() const { return static_cast<PageAccessPermissions>(access_permission); }
+    MemoryType memory_type() const { return MemoryTypeEncoding::decode(tex, cachable, bufferable_writes); }
 
-    static SectionEntry make_entry(uintptr_t addr, PageAccessPermissions permissions)
+    static SectionEntry make_entry(uintptr_t addr, PageAccessPermissions permissions, MemoryType type = MemoryType::Normal)
     {
+        auto encoding = MemoryTypeEncoding::from(type);
         return {
             .identifier = SECTION_ENTRY_ID,
-            .bufferable_writes = 0,
-            .cachable = 0,
+            .bufferable_writes = encoding.bufferable,
+            .cachable = encoding.cachable,
             .execute_never = 0,
             .domain = 0,
             .impl_defined = 0,
             .access_permission = static_cast<uint8_t>(permissions),
-            .tex = 0b000,
+            .tex = encoding.tex,
             .access_permission_extension = 0,
             .shared = 0,
             .not_global = 0,
@@ -139,15 +272,28 @@ struct SmallPageEntry {
 
     uintptr_t base_address() const { return address << 12; }
     PageAccessPermissions permissions() const { return static_cast<PageAccessPermissions>(access_permission); }
+    /**
+     * A copy-on-write page keeps the permissions it will get back once it
+     * gets copied, but has APX set: this makes it read-only for both the
+     * user and the kernel, so that writes from either side will fault.
+    */
+    bool is_copy_on_write() const
+    {
+        return access_permission_extension && permissions() == PageAccessPermissions::UserFullAccess;
+    }
+    void set_copy_on_write(bool cow) { access_permission_extension = cow ? 1 : 0; }
 
-    static SmallPageEntry make_entry(uintptr_t address, PageAccessPermissions permissions)
+    MemoryType memory_type() const { return MemoryTypeEncoding::decode(tex, cachable, bufferable_writes); }
+
+    static SmallPageEntry make_entry(uintptr_t address, PageAccessPermissions permissions, MemoryType type = MemoryType::Normal)
     {
+        auto encoding = MemoryTypeEncoding::from(type);
         return {
             .identifier = SMALL_PAGE_ENTRY_ID,
-            .bufferable_writes = 0,
-            .cachable = 0,
+            .bufferable_writes = encoding.bufferable,
+            .cachable = encoding.cachable,
             .access_permission = static_cast<uint8_t>(permissions),
-            .tex = 0b000,
+            .tex = encoding.tex,
             .access_permission_extension = 0,
             .shared = 0,
             .non_global = 0,
@@ -157,6 +303,49 @@ struct SmallPageEntry {
 };
 static_assert(sizeof(SmallPageEntry) == 4, "SmallPageEntry is not 32 bits");
 
+/**
+ * A 64KB page, the same entry must be repeated in the 16 consecutive
+ * slots of the level 2 table that it covers
+*/
+static constexpr uint32_t LARGE_PAGE_ENTRY_ID = 0b01;
+static constexpr size_t LARGE_PAGE_REPEAT = _64KB / _4KB;
+struct LargePageEntry {
+    uint32_t identifier : 2;
+    uint32_t bufferable_writes : 1;
+    uint32_t cachable : 1;
+    uint32_t access_permission : 2;
+    uint32_t sbz : 3;
+    uint32_t access_permission_extension : 1;
+    uint32_t shared : 1;
+    uint32_t non_global : 1;
+    uint32_t tex : 3;
+    uint32_t execute_never : 1;
+    uint32_t address : 16;
+
+    uintptr_t base_address() const { return address << 16; }
+    PageAccessPermissions permissions() const { return static_cast<PageAccessPermissions>(access_permission); }
+    MemoryType memory_type() const { return MemoryTypeEncoding::decode(tex, cachable, bufferable_writes); }
+
+    static LargePageEntry make_entry(uintptr_t address, PageAccessPermissions permissions, MemoryType type = MemoryType::Normal)
+    {
+        auto encoding = MemoryTypeEncoding::from(type);
+        return {
+            .identifier = LARGE_PAGE_ENTRY_ID,
+            .bufferable_writes = encoding.bufferable,
+            .cachable = encoding.cachable,
+            .access_permission = static_cast<uint8_t>(permissions),
+            .sbz = 0,
+            .access_permission_extension = 0,
+            .shared = 0,
+            .non_global = 0,
+            .tex = encoding.tex,
+            .execute_never = 0,
+            .address = ((uint32_t)address >> 16) & 0xffff,
+        };
+    }
+};
+static_assert(sizeof(LargePageEntry) == 4, "LargePageEntry is not 32 bits");
+
 union FirstLevelEntry {
     uint32_t raw;
     CoarsePageTableEntry coarse;
@@ -171,5 +360,21 @@ static_assert(sizeof(FirstLevelEntry) == 4, "FirstLevelEntry is not 32 bits");
 union SecondLevelEntry {
     uint32_t raw;
     SmallPageEntry small_page;
+    LargePageEntry large_page;
+
+    // Bit 0 of a small page is XN, so only bit 1 identifies it
+    bool is_small_page() const { return (raw & 0b10) != 0; }
+    bool is_large_page() const { return (raw & 0b11) == LARGE_PAGE_ENTRY_ID; }
+
+    /**
+     * \brief The physical address of the 4KB page mapped by the entry at 'index' in its table
+     * Each of the repeated entries of a large page maps a different part of it
+    */
+    uintptr_t page_address(size_t index) const
+    {
+        if (is_large_page())
+            return large_page.base_address() + (index % LARGE_PAGE_REPEAT) * _4KB;
+        return small_page.base_address();
+    }
 };
 static_assert(sizeof(SecondLevelEntry) == 4, "SecondLevelEntry is not 32 bits");
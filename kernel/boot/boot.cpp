@@ -13,7 +13,7 @@ extern "C" uint8_t __bundle_dtb_end[];
 
 #define CONFIG_KERNEL_VIRT_START_ADDRESS        (0xc0000000)
 #define CONFIG_PHYSICAL_MEMORY_HOLE_ADDRESS     (0xe0000000)
-#define CONFIG_PHYSICAL_MEMORY_HOLE_SIZE        (512 * _1MB)
+#define CONFIG_PHYSICAL_MEMORY_HOLE_SIZE        (511 * _1MB)  // The last MB holds the high vectors
 #define CONFIG_KERNEL_STACK_SIZE                (64 * _1KB)
 
 extern "C" [[noreturn]] void activate_mmu_and_jump_to_kernel(uint32_t ttbr0, uint32_t stack, uint32_t pc);
@@ -9,6 +9,10 @@
 
 static constexpr uint32_t VIRTQ_SIZE = 64;
 
+// A request can be queued behind others, the time it is given grows with its size
+static constexpr uint32_t REQUEST_TIMEOUT_MS = 2000;
+static constexpr uint32_t REQUEST_TIMEOUT_MS_PER_4KB = 100;
+
 enum VirtioBlockDeviceFeatures: uint32_t {
     ReadOnly = 1 << 5,
 };
@@ -49,6 +53,7 @@ int32_t VirtioBlockDevice::init()
         goto failed;
     }
     
+    waitqueue_init(m_completions);
     irq_install(m_config.irq, [](InterruptFrame*, void *arg) {
         static_cast<VirtioBlockDevice*>(arg)->handle_irq();
     }, this);
@@ -71,6 +76,13 @@ int32_t VirtioBlockDevice::block_device_init()
     if (rc)
         return rc;
 
+    // Requests are identified by their first descriptor, so there is
+    // one DMA area for each descriptor in the queue
+    static_assert(VIRTQ_SIZE * sizeof(VirtioBlockRequestDmaArea) <= _4KB);
+    if (!physical_page_alloc(PageOrder::_4KB, m_dma_page).is_success())
+        return -ERR_NOMEM;
+    m_dma_areas = reinterpret_cast<VirtioBlockRequestDmaArea*>(phys2virt(page2addr(m_dma_page)));
+
     // 5.2.5 Device Initialization
 
     // 1. The device size can be read from capacity.
@@ -92,80 +104,87 @@ int32_t VirtioBlockDevice::block_device_init()
     return 0;
 }
 
-int VirtioBlockDevice::enqueue_block_request(uint32_t type, uint32_t sector, uint8_t *buffer, VirtioBlockRequest *req)
+int VirtioBlockDevice::enqueue_block_request(uint32_t type, uint64_t sector, BlockSegment const *segments, size_t segment_count, VirtioBlockRequest *req)
 {
     SplitVirtQueue *q = m_vqueue;
     int rc = 0;
-    int header_idx = 0;
-    int body_idx = 0;
-    int status_idx = 0;
-
-    // The output buffer must not cross a page boundary, see the comment in 'read_sector' for why
-    {
-        uintptr_t pageidx1 = (uintptr_t) buffer >> 12;
-        uintptr_t pageidx2 = ((uintptr_t) buffer + 512 - 1) >> 12;
-        kassert(pageidx1 == pageidx2);
-    }
+    size_t descriptor_count = segment_count + 2;
 
-    header_idx = virtio_virtq_alloc_desc(q);
-    body_idx = virtio_virtq_alloc_desc(q);
-    status_idx = virtio_virtq_alloc_desc(q);
-    if (header_idx < 0 || body_idx < 0 || status_idx < 0) {
-        LOGE("Failed to allocate virtqueue descriptors");
-        rc = -ERR_NOMEM;
-        goto failed;
-    }
+    kassert(segment_count > 0 && segment_count <= MAX_SEGMENTS);
 
-    LOGI("Enqueuing block request: type=%d, sector=%d, desc=(%d, %d, %d)", type, sector, header_idx, body_idx, status_idx);
     *req = VirtioBlockRequest {
         .prev = nullptr,
         .next = nullptr,
-        
+
         .queue = m_vqueue,
-        .descriptor_idx = {(uint16_t) header_idx, (uint16_t) body_idx, (uint16_t) status_idx},
-        .completed = SPINLOCK_START,
-        .req = {
-            .header = {
-                .type = type,
-                .reserved = 0,
-                .sector = sector,
-            },
-            .data = buffer,
-            .footer = {
-                .status = 0,
-            }
+        .descriptor_idx = {},
+        .descriptor_count = 0,
+        .completed = false,
+        .dma = nullptr,
+        .segments = segments,
+        .segment_count = segment_count,
+    };
+    for (size_t i = 0; i < descriptor_count; i++) {
+        int idx = virtio_virtq_alloc_desc(q);
+        if (idx < 0) {
+            LOGE("Failed to allocate virtqueue descriptors");
+            rc = -ERR_NOMEM;
+            goto failed;
+        }
+        req->descriptor_idx[req->descriptor_count++] = (uint16_t) idx;
+    }
+
+    LOGD("Enqueuing block request: type=%d, sector=%" PRIu64 ", %u segments", type, sector, segment_count);
+    req->dma = &m_dma_areas[req->descriptor_idx[0]];
+    *req->dma = VirtioBlockRequestDmaArea {
+        .header = {
+            .type = type,
+            .reserved = 0,
+            .sector = sector,
+        },
+        .footer = {
+            .status = 0xff,
         }
     };
-    spinlock_take(req->completed);
+    dcache_clean_and_invalidate_range(req->dma, sizeof(*req->dma));
+    for (size_t i = 0; i < segment_count; i++)
+        dcache_clean_and_invalidate_range((void*) phys2virt(segments[i].phys_addr), segments[i].length);
     {
         auto lock = irq_lock();
         m_requests.add(req);
         release(lock);
     }
 
-    q->desc_table[header_idx].addr = virt2phys((uintptr_t) &(req->req.header));
-    q->desc_table[header_idx].len = 16;
-    q->desc_table[header_idx].flags = VIRTQ_DESC_F_NEXT;
-    q->desc_table[header_idx].next = (le16) body_idx;
-
-    q->desc_table[body_idx].addr = virt2phys((uintptr_t) req->req.data);
-    q->desc_table[body_idx].len = 512;
-    q->desc_table[body_idx].flags = VIRTQ_DESC_F_NEXT | (type == VIRTIO_BLK_T_IN ? VIRTQ_DESC_F_WRITE : 0);
-    q->desc_table[body_idx].next = (le16) status_idx;
+    // The data goes straight to/from the segments, chained between the header and the status
+    q->desc_table[req->descriptor_idx[0]].addr = virt2phys((uintptr_t) &(req->dma->header));
+    q->desc_table[req->descriptor_idx[0]].len = 16;
+    q->desc_table[req->descriptor_idx[0]].flags = VIRTQ_DESC_F_NEXT;
+    q->desc_table[req->descriptor_idx[0]].next = (le16) req->descriptor_idx[1];
+
+    for (size_t i = 0; i < segment_count; i++) {
+        auto& desc = q->desc_table[req->descriptor_idx[i + 1]];
+        desc.addr = segments[i].phys_addr;
+        desc.len = segments[i].length;
+        desc.flags = VIRTQ_DESC_F_NEXT | (type == VIRTIO_BLK_T_IN ? VIRTQ_DESC_F_WRITE : 0);
+        desc.next = (le16) req->descriptor_idx[i + 2];
+    }
 
-    q->desc_table[status_idx].addr = virt2phys((uintptr_t) &(req->req.footer));
-    q->desc_table[status_idx].len = 1;
-    q->desc_table[status_idx].flags = VIRTQ_DESC_F_WRITE;
-    q->desc_table[status_idx].next = 0;
+    {
+        auto& desc = q->desc_table[req->descriptor_idx[descriptor_count - 1]];
+        desc.addr = virt2phys((uintptr_t) &(req->dma->footer));
+        desc.len = 1;
+        desc.flags = VIRTQ_DESC_F_WRITE;
+        desc.next = 0;
+    }
 
-    virtio_virtq_enqueue_desc(r, q, header_idx);
+    virtio_virtq_enqueue_desc(r, q, req->descriptor_idx[0]);
 
     return rc;
 
 failed:
-    virtio_virtq_free_desc(q, header_idx);
-    virtio_virtq_free_desc(q, body_idx);
-    virtio_virtq_free_desc(q, status_idx);
+    for (size_t i = 0; i < req->descriptor_count; i++)
+        virtio_virtq_free_desc(q, req->descriptor_idx[i]);
+    req->descriptor_count = 0;
     return rc;
 }
 
@@ -174,17 +193,16 @@ void VirtioBlockDevice::cleanup_block_request(VirtioBlockRequest *req)
     if (req == nullptr)
         return;
 
+    // Completed requests were already taken off the list, and the list does not
+    // reset their links: removing them again would corrupt it
     auto lock = irq_lock();
-    if (req->next) {
+    if (req->dma != nullptr && !req->completed)
         m_requests.remove(req);
-    }
     release(lock);
 
-    for (unsigned i = 0; i < array_size(req->descriptor_idx); i++) {
-        if (req->descriptor_idx[i] == req->queue->size)
-            continue;
+    for (size_t i = 0; i < req->descriptor_count; i++)
         virtio_virtq_free_desc(m_vqueue, req->descriptor_idx[i]);
-    }
+    req->descriptor_count = 0;
 }
 
 void VirtioBlockDevice::process_used_buffer(SplitVirtQueue *q, uint32_t idx)
@@ -197,9 +215,17 @@ void VirtioBlockDevice::process_used_buffer(SplitVirtQueue *q, uint32_t idx)
         panic("Failed to find request with descriptor %u", idx);
     }
 
-    LOGI("Received result for descriptor %u", idx);
-    spinlock_release(req->completed);
+    LOGD("Received result for descriptor %u", idx);
+    dcache_invalidate_range(req->dma, sizeof(*req->dma));
+    // SimpleBlockDevice makes sure that the buffers of reads start and end on a
+    // cache line, invalidating them can't write back anybody else's data
+    if (req->dma->header.type == VIRTIO_BLK_T_IN) {
+        for (size_t i = 0; i < req->segment_count; i++)
+            dcache_invalidate_range((void*) phys2virt(req->segments[i].phys_addr), req->segments[i].length);
+    }
+    req->completed = true;
     m_requests.remove(req);
+    waitqueue_wake_all(m_completions);
 }
 
 void VirtioBlockDevice::handle_irq()
@@ -208,62 +234,89 @@ void VirtioBlockDevice::handle_irq()
 
     uint32_t irq_status = ioread32(&r->InterruptStatus);
     if (irq_status & VIRTIO_IRQ_USED_BUFFER) {
-        SplitVirtQueue *q = m_vqueue;
-        uint16_t used = q->used->idx % q->size;
-        for (uint16_t idx = q->last_seen_used_idx; idx != used; idx = (idx + 1) % q->size) {
-            process_used_buffer(q, q->used->ring[idx].id);
-        }
-        q->last_seen_used_idx = used;
+        m_vqueue->foreach_used_descriptor([&](SplitVirtQueue *q, uint32_t idx) { process_used_buffer(q, idx); });
     }
     iowrite32(&r->InterruptAck, 0b11);
 }
 
-static Spinlock s_read_tempbuffer_lock = SPINLOCK_START;
-static uint8_t s_read_tempbuffer[512]
-__attribute__((aligned(512)));
+static uint32_t request_timeout_ms(BlockSegment const *segments, size_t segment_count)
+{
+    size_t size = 0;
+    for (size_t i = 0; i < segment_count; i++)
+        size += segments[i].length;
+
+    return REQUEST_TIMEOUT_MS + REQUEST_TIMEOUT_MS_PER_4KB * (round_up<size_t>(size, _4KB) / _4KB);
+}
+
+/**
+ * \brief Resets the device after 'req' timed out, failing all the pending requests
+ * Until the reset the device could still write to the descriptors and the buffers
+ * of the requests, so they can't be given back before.
+ * \return false if 'req' completed in the meantime, and nothing was done
+*/
+bool VirtioBlockDevice::reset_stuck_device(VirtioBlockRequest const& req)
+{
+    auto lock = irq_lock();
+    if (req.completed) {
+        release(lock);
+        return false;
+    }
+
+    LOGE("%s is not answering, resetting it: all pending requests fail", name());
+    if (virtio_util_reset(r) != 0)
+        panic("%s did not acknowledge the reset, it might still be writing anywhere", name());
+    m_failed = true;
 
-int64_t VirtioBlockDevice::read_sector(int64_t sector_idx, uint8_t *buffer)
+    // They are left with the status the driver put in, which is not VIRTIO_BLK_S_OK
+    while (auto *pending = m_requests.first()) {
+        pending->completed = true;
+        m_requests.remove(pending);
+    }
+    release(lock);
+
+    waitqueue_wake_all(m_completions);
+    return true;
+}
+
+int64_t VirtioBlockDevice::do_block_request(uint32_t type, uint64_t sector, BlockSegment const *segments, size_t segment_count)
 {
     int rc = 0;
     VirtioBlockRequest req;
 
-    spinlock_take(s_read_tempbuffer_lock);
+    if (m_failed)
+        return -ERR_IO;
 
-    LOGI("Reading sector %" PRId64, sector_idx);
-    rc = enqueue_block_request(VIRTIO_BLK_T_IN, sector_idx, s_read_tempbuffer, &req);
+    rc = enqueue_block_request(type, sector, segments, segment_count, &req);
     if (rc != 0) {
         LOGE("Failed to enqueue block request: %d", rc);
         goto cleanup;
     }
-    rc = spinlock_take_with_timeout(req.completed, 100);
-    if (rc != 0) {
-        LOGE("Timed out waiting for request to complete");
+    rc = waitqueue_wait_until(m_completions, [&]() { return req.completed; }, request_timeout_ms(segments, segment_count));
+    if (rc != 0 && reset_stuck_device(req)) {
+        LOGE("Timed out waiting for the request at sector %" PRIu64 " to complete", sector);
         rc = -ERR_TIMEDOUT;
-    } else if (req.req.footer.status != 0) {
+    } else if (req.dma->footer.status != VIRTIO_BLK_S_OK) {
         rc = -ERR_IO;
-        LOGE("Failed to read sector %" PRId64 ": virtio returned status %d", sector_idx, req.req.footer.status);
+        LOGE("Block request at sector %" PRIu64 " failed: virtio returned status %d", sector, req.dma->footer.status);
     } else {
-        /**
-         * Unfortunately we cannot pass the user's buffer to virtio directly because
-         * if the buffer crosses between 2 pages then it's not guaranteed that the
-         * buffer was virtually-mapped to those 2 consecutive pages.
-         * 
-         * Ideally we would split virtio's body descriptor into 2 parts for the 
-         * 2 different pages if we detect that the buffer crosses between 2 pages.
-         * This is not yet implemented though, so the slow CPU copy will do.
-         */
-        memcpy(buffer, s_read_tempbuffer, 512);
+        rc = 0;
     }
 
 cleanup:
     cleanup_block_request(&req);
-    spinlock_release(s_read_tempbuffer_lock);
     return rc;
 }
 
-int64_t VirtioBlockDevice::write_sector(int64_t, uint8_t const*)
+int64_t VirtioBlockDevice::read_sectors(int64_t first_sector, size_t sector_count, BlockSegment const *segments, size_t segment_count)
 {
-    return -ERR_NOTSUP;
+    LOGD("Reading %u sectors from %" PRId64, sector_count, first_sector);
+    return do_block_request(VIRTIO_BLK_T_IN, first_sector, segments, segment_count);
+}
+
+int64_t VirtioBlockDevice::write_sectors(int64_t first_sector, size_t sector_count, BlockSegment const *segments, size_t segment_count)
+{
+    LOGD("Writing %u sectors at %" PRId64, sector_count, first_sector);
+    return do_block_request(VIRTIO_BLK_T_OUT, first_sector, segments, segment_count);
 }
 
 int32_t VirtioBlockDevice::ioctl(uint32_t, void*)
@@ -1,22 +1,32 @@
 #pragma once
 
 #include <kernel/drivers/device.h>
-#include <kernel/locking/spinlock.h>
+#include <kernel/locking/waitqueue.h>
 #include <kernel/drivers/bus/virtio/virtio.h>
 
 
+/**
+ * The parts of a request that are read and written by the device.
+ * Each one lives in its own cache line so that it can be cleaned and
+ * invalidated without touching anything else.
+*/
+struct alignas(ARCH_CACHE_LINE_SIZE) VirtioBlockRequestDmaArea {
+    virtio_blk_req_header header;
+    virtio_blk_req_footer footer;
+};
+
 struct VirtioBlockRequest {
     INTRUSIVE_LINKED_LIST_HEADER(VirtioBlockRequest);
 
     SplitVirtQueue *queue;
-    uint16_t descriptor_idx[3];
-    Spinlock completed;
-
-    struct {
-        virtio_blk_req_header header;
-        uint8_t *data;
-        virtio_blk_req_footer footer;
-    } req;
+    // Header, one for each data segment, status
+    uint16_t descriptor_idx[SimpleBlockDevice::MAX_SEGMENTS + 2];
+    size_t descriptor_count;
+    bool completed;
+
+    VirtioBlockRequestDmaArea *dma;
+    BlockSegment const *segments;
+    size_t segment_count;
 };
 
 class VirtioBlockDevice: public SimpleBlockDevice
@@ -37,8 +47,8 @@ public:
     virtual uint64_t size() const override { return m_capacity; }
 
 protected:
-    virtual int64_t read_sector(int64_t sector_idx, uint8_t *buffer) override;
-    virtual int64_t write_sector(int64_t sector_idx, uint8_t const *buffer) override;
+    virtual int64_t read_sectors(int64_t first_sector, size_t sector_count, BlockSegment const *segments, size_t segment_count) override;
+    virtual int64_t write_sectors(int64_t first_sector, size_t sector_count, BlockSegment const *segments, size_t segment_count) override;
     virtual bool is_read_only() const override { return m_readonly; }
 
 private:
@@ -47,18 +57,26 @@ private:
     int32_t block_device_init();
     int32_t init_virtqueue(uint32_t index, uint32_t max_size);
 
-    int enqueue_block_request(uint32_t type, uint32_t sector, uint8_t *buffer, VirtioBlockRequest *req);
+    int enqueue_block_request(uint32_t type, uint64_t sector, BlockSegment const *segments, size_t segment_count, VirtioBlockRequest *req);
+    int64_t do_block_request(uint32_t type, uint64_t sector, BlockSegment const *segments, size_t segment_count);
     void process_used_buffer(SplitVirtQueue *q, uint32_t idx);
     void handle_irq();
     void cleanup_block_request(VirtioBlockRequest *req);
+    bool reset_stuck_device(VirtioBlockRequest const& req);
 
     Config m_config;
     VirtioRegisterMap volatile *r;
     bool m_ready { false };
     SplitVirtQueue *m_vqueue;
+    PhysicalPage *m_dma_page { nullptr };
+    VirtioBlockRequestDmaArea *m_dma_areas { nullptr };
 
     IntrusiveLinkedList<VirtioBlockRequest> m_requests;
+    // Woken up by the interrupt handler whenever some request completes
+    WaitQueue m_completions;
 
     bool m_readonly;
+    // The device stopped answering and was reset, nothing can be sent to it anymore
+    bool m_failed { false };
     uint64_t m_capacity;
 };
@@ -0,0 +1,342 @@
+#include <kernel/lib/lz4.h>
+#include <kernel/memory/areas.h>
+#include <kernel/memory/kheap.h>
+#include "zram.h"
+
+#ifdef CONFIG_ZRAM_SWAP
+#include <kernel/memory/swap.h>
+#endif
+
+// #define LOG_ENABLED
+#define LOG_TAG "ZRAM"
+#include <kernel/log.h>
+
+
+// A block that does not shrink at least this much is not worth decompressing
+static constexpr size_t MAX_COMPRESSED_SIZE = CompressedRamDisk::BLOCK_SIZE * 3 / 4;
+
+static bool is_zero_filled(uint8_t const *data, size_t size)
+{
+    // Kernel buffers are not always word aligned
+    for (size_t i = 0; i < size; i += sizeof(uint32_t)) {
+        uint32_t word;
+        memcpy(&word, data + i, sizeof(word));
+        if (word != 0)
+            return false;
+    }
+
+    return true;
+}
+
+int32_t CompressedRamDisk::init()
+{
+    m_block_count = m_config.size / BLOCK_SIZE;
+    if (m_block_count == 0)
+        return -ERR_INVAL;
+
+    m_blocks = static_cast<Block*>(malloc(m_block_count * sizeof(Block)));
+    m_hash_table = static_cast<uint16_t*>(malloc(LZ4_HASH_ENTRIES * sizeof(uint16_t)));
+    m_compressed = static_cast<uint8_t*>(malloc(MAX_COMPRESSED_SIZE));
+    m_block_buffer = static_cast<uint8_t*>(malloc(BLOCK_SIZE));
+    if (m_config.reserve_blocks > 0)
+        m_reserve = static_cast<uint8_t*>(malloc(m_config.reserve_blocks * BLOCK_SIZE));
+    if (!m_blocks || !m_hash_table || !m_compressed || !m_block_buffer || (m_config.reserve_blocks > 0 && !m_reserve)) {
+        shutdown();
+        return -ERR_NOMEM;
+    }
+
+    for (size_t i = m_config.reserve_blocks; i-- > 0;) {
+        uint8_t *data = m_reserve + i * BLOCK_SIZE;
+        memcpy(data, &m_reserve_free, sizeof(m_reserve_free));
+        m_reserve_free = data;
+    }
+
+    for (size_t i = 0; i < m_block_count; i++) {
+        m_blocks[i] = Block {
+            .data = nullptr,
+            .length = 0,
+            .state = BlockState::Empty,
+        };
+    }
+    memset(m_hash_table, 0, LZ4_HASH_ENTRIES * sizeof(uint16_t));
+
+#ifdef CONFIG_ZRAM_SWAP
+    // Formatted as swap space, so that swap_init() picks it up
+    memset(m_block_buffer, 0, BLOCK_SIZE);
+    memcpy(m_block_buffer, SWAP_MAGIC, sizeof(SWAP_MAGIC) - 1);
+    if (int32_t rc = store_block(0, m_block_buffer); rc != 0) {
+        shutdown();
+        return rc;
+    }
+#endif
+
+    LOGI("%s: %" PRIu32 " blocks of %uKB, %" PRIu32 " reserved", name(), static_cast<uint32_t>(m_block_count), BLOCK_SIZE / _1KB, m_config.reserve_blocks);
+    return 0;
+}
+
+int32_t CompressedRamDisk::shutdown()
+{
+    if (m_blocks != nullptr) {
+        for (size_t i = 0; i < m_block_count; i++)
+            free_block(m_blocks[i]);
+    }
+
+    free(m_blocks);
+    free(m_hash_table);
+    free(m_compressed);
+    free(m_block_buffer);
+    free(m_reserve);
+    m_blocks = nullptr;
+    m_hash_table = nullptr;
+    m_compressed = nullptr;
+    m_block_buffer = nullptr;
+    m_reserve = nullptr;
+    m_reserve_free = nullptr;
+    m_block_count = 0;
+
+    return 0;
+}
+
+void CompressedRamDisk::free_block(Block& block)
+{
+    switch (block.state) {
+    case BlockState::Empty:
+        return;
+    case BlockState::Zero:
+        m_stats.zero_blocks--;
+        break;
+    case BlockState::Compressed:
+        m_stats.compressed_blocks--;
+        m_stats.compressed_bytes -= block.length;
+        break;
+    case BlockState::Raw:
+        m_stats.raw_blocks--;
+        m_stats.compressed_bytes -= block.length;
+        break;
+    }
+
+    free_data(block.data);
+    block = Block {
+        .data = nullptr,
+        .length = 0,
+        .state = BlockState::Empty,
+    };
+}
+
+uint8_t *CompressedRamDisk::alloc_data(size_t length)
+{
+    if (auto *data = static_cast<uint8_t*>(malloc(length)); data != nullptr)
+        return data;
+
+    uint8_t *data = m_reserve_free;
+    if (data != nullptr) {
+        memcpy(&m_reserve_free, data, sizeof(m_reserve_free));
+        m_stats.reserved_blocks++;
+        LOGW("%s: heap is full, %" PRIu32 " of %" PRIu32 " reserved blocks in use", name(), m_stats.reserved_blocks, m_config.reserve_blocks);
+    }
+
+    return data;
+}
+
+void CompressedRamDisk::free_data(uint8_t *data)
+{
+    if (!is_reserved(data)) {
+        free(data);
+        return;
+    }
+
+    memcpy(data, &m_reserve_free, sizeof(m_reserve_free));
+    m_reserve_free = data;
+    m_stats.reserved_blocks--;
+}
+
+int32_t CompressedRamDisk::load_block(size_t index, uint8_t *out)
+{
+    Block const& block = m_blocks[index];
+
+    switch (block.state) {
+    case BlockState::Empty:
+    case BlockState::Zero:
+        memset(out, 0, BLOCK_SIZE);
+        return 0;
+    case BlockState::Raw:
+        memcpy(out, block.data, BLOCK_SIZE);
+        return 0;
+    case BlockState::Compressed:
+        if (!lz4_decompress(block.data, block.length, out, BLOCK_SIZE)) {
+            LOGE("%s: block %u is corrupted", name(), index);
+            return -ERR_IO;
+        }
+        return 0;
+    }
+
+    return -ERR_IO;
+}
+
+int32_t CompressedRamDisk::store_block(size_t index, uint8_t const *data)
+{
+    Block& block = m_blocks[index];
+
+    if (is_zero_filled(data, BLOCK_SIZE)) {
+        free_block(block);
+        block.state = BlockState::Zero;
+        m_stats.zero_blocks++;
+        return 0;
+    }
+
+    size_t length = lz4_compress(data, BLOCK_SIZE, m_compressed, MAX_COMPRESSED_SIZE, m_hash_table);
+    BlockState state = length == 0 ? BlockState::Raw : BlockState::Compressed;
+    if (state == BlockState::Raw)
+        length = BLOCK_SIZE;
+
+    // The old contents stay there if there is no memory for the new ones
+    uint8_t *stored = alloc_data(length);
+    if (stored == nullptr)
+        return -ERR_NOMEM;
+    memcpy(stored, state == BlockState::Raw ? data : m_compressed, length);
+
+    free_block(block);
+    block = Block {
+        .data = stored,
+        .length = static_cast<uint16_t>(length),
+        .state = state,
+    };
+    if (state == BlockState::Raw)
+        m_stats.raw_blocks++;
+    else
+        m_stats.compressed_blocks++;
+    m_stats.compressed_bytes += length;
+
+    return 0;
+}
+
+int64_t CompressedRamDisk::read(int64_t offset, uint8_t *buffer, size_t size)
+{
+    if (offset < 0)
+        return -ERR_INVAL;
+    if (static_cast<uint64_t>(offset) >= this->size())
+        return 0;
+    size = min<uint64_t>(this->size() - offset, size);
+
+    // Copying to a user buffer can fault and sleep, the shared buffer could be
+    // reused in the meantime: decompress into one that belongs to this request
+    uint8_t *work = m_block_buffer;
+    bool is_user_buffer = areas::user_area.contains(reinterpret_cast<uintptr_t>(buffer));
+    if (is_user_buffer && (work = static_cast<uint8_t*>(malloc(BLOCK_SIZE))) == nullptr)
+        return -ERR_NOMEM;
+
+    int32_t rc = 0;
+    size_t done = 0;
+    while (done < size) {
+        size_t index = (offset + done) / BLOCK_SIZE;
+        size_t in_block = (offset + done) % BLOCK_SIZE;
+        size_t chunk = min(BLOCK_SIZE - in_block, size - done);
+
+        if (chunk == BLOCK_SIZE && !is_user_buffer) {
+            rc = load_block(index, buffer + done);
+        } else if ((rc = load_block(index, work)) == 0) {
+            memcpy(buffer + done, work + in_block, chunk);
+        }
+        if (rc != 0)
+            break;
+        done += chunk;
+    }
+
+    if (is_user_buffer)
+        free(work);
+
+    return done > 0 ? static_cast<int64_t>(done) : rc;
+}
+
+int64_t CompressedRamDisk::write(int64_t offset, const uint8_t *buffer, size_t size)
+{
+    if (offset < 0)
+        return -ERR_INVAL;
+    if (static_cast<uint64_t>(offset) >= this->size())
+        return 0;
+    size = min<uint64_t>(this->size() - offset, size);
+
+    // User data is copied out first, so that nothing can sleep between
+    // reading a partially written block and storing it back
+    uint8_t *staging = nullptr;
+    bool is_user_buffer = areas::user_area.contains(reinterpret_cast<uintptr_t>(buffer));
+    if (is_user_buffer && (staging = static_cast<uint8_t*>(malloc(BLOCK_SIZE))) == nullptr)
+        return -ERR_NOMEM;
+
+    int32_t rc = 0;
+    size_t done = 0;
+    while (done < size) {
+        size_t index = (offset + done) / BLOCK_SIZE;
+        size_t in_block = (offset + done) % BLOCK_SIZE;
+        size_t chunk = min(BLOCK_SIZE - in_block, size - done);
+
+        uint8_t const *data = buffer + done;
+        if (is_user_buffer) {
+            memcpy(staging, data, chunk);
+            data = staging;
+        }
+
+        if (chunk == BLOCK_SIZE) {
+            rc = store_block(index, data);
+        } else if ((rc = load_block(index, m_block_buffer)) == 0) {
+            memcpy(m_block_buffer + in_block, data, chunk);
+            rc = store_block(index, m_block_buffer);
+        }
+        if (rc != 0)
+            break;
+        done += chunk;
+    }
+
+    free(staging);
+
+    return done > 0 ? static_cast<int64_t>(done) : rc;
+}
+
+api::CompressedRamDiskStats CompressedRamDisk::statistics() const
+{
+    uint32_t stored_blocks = m_stats.compressed_blocks + m_stats.raw_blocks;
+    return api::CompressedRamDiskStats {
+        .disk_size = size(),
+        .stored_blocks = stored_blocks,
+        .incompressible_blocks = m_stats.raw_blocks,
+        .zero_blocks = m_stats.zero_blocks,
+        .original_bytes = static_cast<uint64_t>(stored_blocks) * BLOCK_SIZE,
+        .compressed_bytes = m_stats.compressed_bytes,
+        .memory_used = m_stats.compressed_bytes + m_block_count * sizeof(Block) +
+            LZ4_HASH_ENTRIES * sizeof(uint16_t) + MAX_COMPRESSED_SIZE + BLOCK_SIZE +
+            static_cast<uint64_t>(m_config.reserve_blocks - m_stats.reserved_blocks) * BLOCK_SIZE,
+    };
+}
+
+void CompressedRamDisk::print_statistics() const
+{
+    auto stats = statistics();
+
+    // In hundredths, there is no floating point in the kernel
+    uint32_t ratio = stats.compressed_bytes == 0 ? 0 : stats.original_bytes * 100 / stats.compressed_bytes;
+    kprintf("%s: %" PRIu32 " blocks stored (%" PRIu32 " incompressible), %" PRIu32 " zero-filled\n",
+        name(), stats.stored_blocks, stats.incompressible_blocks, stats.zero_blocks);
+    kprintf("%s: %" PRIu32 "KB compressed to %" PRIu32 "KB, ratio %" PRIu32 ".%02" PRIu32 ", %" PRIu32 "KB of memory used\n",
+        name(),
+        static_cast<uint32_t>(stats.original_bytes / _1KB),
+        static_cast<uint32_t>(stats.compressed_bytes / _1KB),
+        ratio / 100, ratio % 100,
+        static_cast<uint32_t>(stats.memory_used / _1KB));
+    kprintf("%s: %" PRIu32 " of %" PRIu32 " reserved blocks in use\n", name(), m_stats.reserved_blocks, m_config.reserve_blocks);
+}
+
+int32_t CompressedRamDisk::ioctl(uint32_t request, void *argp)
+{
+    switch (request) {
+        case api::ZRAMIO_GET_STATS: {
+            *reinterpret_cast<api::CompressedRamDiskStats*>(argp) = statistics();
+            return 0;
+        }
+        case api::ZRAMIO_PRINT_STATS: {
+            print_statistics();
+            return 0;
+        }
+        default:
+            return -ERR_NOTSUP;
+    }
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <kernel/drivers/device.h>
+
+
+/**
+ * A disk that lives in RAM, with each 4KB block compressed on its own with
+ * LZ4. Memory is only taken by the blocks that were written with something
+ * other than zeroes, and only as much as they take once compressed.
+ * Blocks that do not compress well are kept as they are, decompressing them
+ * would cost time for nothing.
+ *
+ * Reading and writing never sleeps, the disk is as fast as the CPU can
+ * compress: much faster than an SD card as a swap device.
+ *
+ * Some blocks are set aside when the disk is created, the writes that find
+ * the kernel heap full go there instead of failing.
+*/
+class CompressedRamDisk: public BlockDevice
+{
+public:
+    static constexpr size_t BLOCK_SIZE = 4 * _1KB;
+
+    struct Config {
+        uint64_t size;
+        uint32_t reserve_blocks;
+    };
+
+    CompressedRamDisk(Config const *config)
+        : BlockDevice(512, "zram"), m_config(*config)
+    {}
+
+    virtual int32_t init() override;
+    virtual int32_t shutdown() override;
+
+    virtual int64_t read(int64_t offset, uint8_t *buffer, size_t size) override;
+    virtual int64_t write(int64_t offset, const uint8_t *buffer, size_t size) override;
+    virtual int32_t ioctl(uint32_t request, void *argp) override;
+    virtual uint64_t size() const override { return m_block_count * BLOCK_SIZE; }
+
+    api::CompressedRamDiskStats statistics() const;
+    void print_statistics() const;
+
+private:
+    enum class BlockState: uint8_t {
+        Empty,
+        Zero,
+        Compressed,
+        Raw,
+    };
+
+    struct Block {
+        uint8_t *data;
+        uint16_t length;
+        BlockState state;
+    };
+
+    /**
+     * \brief Copies the contents of block 'index' into 'out', which is BLOCK_SIZE bytes
+    */
+    int32_t load_block(size_t index, uint8_t *out);
+
+    /**
+     * \brief Replaces the contents of block 'index' with the BLOCK_SIZE bytes at 'data'
+    */
+    int32_t store_block(size_t index, uint8_t const *data);
+
+    void free_block(Block& block);
+
+    /**
+     * \brief Memory for 'length' bytes of a block, from the reserve if the heap is full
+    */
+    uint8_t *alloc_data(size_t length);
+    void free_data(uint8_t *data);
+
+    bool is_reserved(uint8_t const *data) const
+    {
+        return data >= m_reserve && data < m_reserve + m_config.reserve_blocks * BLOCK_SIZE;
+    }
+
+    Config m_config;
+    size_t m_block_count { 0 };
+    Block *m_blocks { nullptr };
+
+    // Scratch space for compressing, shared by all requests because none of them sleep
+    uint16_t *m_hash_table { nullptr };
+    uint8_t *m_compressed { nullptr };
+    uint8_t *m_block_buffer { nullptr };
+
+    // Free blocks of the reserve are linked through their first bytes
+    uint8_t *m_reserve { nullptr };
+    uint8_t *m_reserve_free { nullptr };
+
+    struct {
+        uint32_t compressed_blocks;
+        uint32_t raw_blocks;
+        uint32_t zero_blocks;
+        uint32_t reserved_blocks;
+        uint64_t compressed_bytes;
+    } m_stats {};
+};
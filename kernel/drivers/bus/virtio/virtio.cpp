@@ -1,4 +1,5 @@
 #include <kernel/memory/vm.h>
+#include <kernel/timer.h>
 #include "virtio.h"
 
 #define LOG_ENABLED
@@ -43,12 +44,15 @@ static SplitVirtQueue *virtq_alloc(size_t idx, size_t size)
     LOGD("Virtqueue of size %u is allocated at 0x%p", size, mem);
     uint8_t *end = mem + _4KB;
 
+    // Each part is also aligned to a cache line: the driver writes to the
+    // descriptor table and the available ring while the device writes to
+    // the used ring, so they must never share a line in the D-cache
     uint8_t *desc_table = mem;
-    mem += 16 * size;
+    mem += round_up<size_t>(16 * size, ARCH_CACHE_LINE_SIZE);
     uint8_t *avail = mem;
-    mem += round_up<size_t>(6 + 2 * size, 8);
+    mem += round_up<size_t>(6 + 2 * size, ARCH_CACHE_LINE_SIZE);
     uint8_t *used = mem;
-    mem += round_up<size_t>(6 + 8 * size, 8);
+    mem += round_up<size_t>(6 + 8 * size, ARCH_CACHE_LINE_SIZE);
 
     SplitVirtQueue *q = (SplitVirtQueue*) mem;
     mem += sizeof(SplitVirtQueue);
@@ -73,6 +77,7 @@ static SplitVirtQueue *virtq_alloc(size_t idx, size_t size)
         q->desc_table[i].flags = 0;
         q->desc_table[i].next = i + 1;
     }
+    dcache_clean_and_invalidate_range(desc_table, used + 6 + 8 * size - desc_table);
 
     return q;
 }
@@ -217,6 +222,23 @@ int32_t virtio_util_init_failure(VirtioRegisterMap volatile *r)
     return 0;
 }
 
+int32_t virtio_util_reset(VirtioRegisterMap volatile *r)
+{
+    static constexpr uint32_t RESET_TIMEOUT_MS = 100;
+
+    // 4.2.2.1 "Upon writing 0 to Status, the driver MUST wait for a read
+    //  of Status to return 0 before reinitializing the device"
+    iowrite32(&r->Status, 0);
+    uint32_t start = get_ticks_ms();
+    while (ioread32(&r->Status) != 0) {
+        if (get_ticks_ms() - start > RESET_TIMEOUT_MS)
+            return -ERR_TIMEDOUT;
+        cpu_relax();
+    }
+
+    return 0;
+}
+
 int32_t virtio_util_setup_virtq(
     VirtioRegisterMap volatile *r,
     uint32_t index, uint32_t size,
@@ -318,8 +340,11 @@ void virtio_virtq_enqueue_desc(
 )
 {
     q->avail->ring[q->avail->idx % q->size] = (le16) desc_idx;
+    dcache_clean_range((void const*) q->desc_table, 16 * q->size);
+    dcache_clean_range((void const*) q->avail, 6 + 2 * q->size);
     memory_barrier();
     q->avail->idx = q->avail->idx + 1;
+    dcache_clean_range((void const*) &q->avail->idx, sizeof(q->avail->idx));
     memory_barrier();
     iowrite32(&r->QueueNotify, q->idx);
 }
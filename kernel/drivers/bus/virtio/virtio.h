@@ -2,6 +2,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <kernel/arch/arch.h>
 #include <kernel/memory/physicalalloc.h>
 #include "virtio_queue.h"
 
@@ -27,6 +28,7 @@ struct SplitVirtQueue {
 
     template<typename F>
     void foreach_used_descriptor(F func) {
+        dcache_invalidate_range((void const*) this->used, 6 + 8 * this->size);
         uint16_t used = this->used->idx % this->size;
         for (uint16_t idx = this->last_seen_used_idx; idx != used; idx = (idx + 1) % this->size) {
             func(this, this->used->ring[idx].id);
@@ -139,6 +141,12 @@ int32_t virtio_util_complete_init_step(VirtioRegisterMap volatile *r);
 
 int32_t virtio_util_init_failure(VirtioRegisterMap volatile *r);
 
+/**
+ * \brief Resets the device, once this returns it does not access its queues anymore
+ * \return -ERR_TIMEDOUT if the device did not acknowledge the reset
+*/
+int32_t virtio_util_reset(VirtioRegisterMap volatile *r);
+
 int32_t virtio_util_setup_virtq(
     VirtioRegisterMap volatile *r,
     uint32_t index,
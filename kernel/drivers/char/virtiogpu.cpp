@@ -16,19 +16,26 @@ static constexpr uint32_t PIXEL_FORMAT = VIRTIO_GPU_FORMAT_A8R8G8B8_UNORM;
 static constexpr uint32_t BYTES_PER_PIXEL = 4;
 
 
-/**
- * This is a hack because it's not easy to allocate a very large contiguous
- * area in our physical memory allocator right now.
- */
-static __attribute__((aligned(4096))) uint8_t g_framebuffer_storage[1920 * 1080 * BYTES_PER_PIXEL];
-
 static int32_t alloc_framebuffer_storage(size_t size, uintptr_t *out_paddr)
 {
-    kassert(size <= array_size(g_framebuffer_storage));
-    *out_paddr = virt2phys(reinterpret_cast<uintptr_t>(g_framebuffer_storage));
+    PhysicalPage *first_page;
+    if (!physical_page_alloc_contiguous(vm_align_up_to_page(size) / _4KB, first_page).is_success())
+        return -ERR_NOMEM;
+
+    // Userspace maps the framebuffer as write-combine, make sure no line
+    // from the kernel's cacheable alias can later be written back on top of it
+    void *storage = reinterpret_cast<void*>(phys2virt(page2addr(first_page)));
+    memset(storage, 0, size);
+    dcache_clean_and_invalidate_range(storage, size);
+    *out_paddr = page2addr(first_page);
     return 0;
 }
 
+static void free_framebuffer_storage(uintptr_t paddr, size_t size)
+{
+    physical_page_free_contiguous(addr2page(paddr), vm_align_up_to_page(size) / _4KB);
+}
+
 int32_t VirtioGPU::init()
 {
     int32_t rc;
@@ -87,29 +94,53 @@ failed:
 }
 
 int32_t VirtioGPU::refresh()
+{
+    api::FramebufferRect whole_display = {
+        .x = 0,
+        .y = 0,
+        .width = m_displayinfo.width,
+        .height = m_displayinfo.height,
+    };
+    return refresh_rects(&whole_display, 1);
+}
+
+int32_t VirtioGPU::refresh_rects(api::FramebufferRect const *rects, size_t count)
 {
     int32_t rc;
+    uint32_t x1 = m_displayinfo.width, y1 = m_displayinfo.height;
+    uint32_t x2 = 0, y2 = 0;
 
     // 5.7.6.2 Device Operation: Update a framebuffer and scanout
     // Render to your framebuffer memory
     // Use VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D to update the host resource from guest memory.
-    rc = cmd_transfer_to_host_2d(VIRTIO_RESOURCE_ID_FB, {
-        .x = 0,
-        .y = 0,
-        .width = m_displayinfo.width,
-        .height = m_displayinfo.height
-    });
-    if (rc != 0) {
-        LOGE("Failed to transfer framebuffer: %" PRId32, rc);
-        goto failed;
+    for (size_t i = 0; i < count; i++) {
+        auto const& rect = rects[i];
+        // The offset is where the rectangle starts in the guest's backing memory
+        uint64_t offset = rect.y * m_displayinfo.pitch + rect.x * m_displayinfo.bytes_per_pixel;
+        rc = cmd_transfer_to_host_2d(VIRTIO_RESOURCE_ID_FB, {
+            .x = rect.x,
+            .y = rect.y,
+            .width = rect.width,
+            .height = rect.height
+        }, offset);
+        if (rc != 0) {
+            LOGE("Failed to transfer framebuffer: %" PRId32, rc);
+            goto failed;
+        }
+
+        x1 = min(x1, rect.x);
+        y1 = min(y1, rect.y);
+        x2 = max(x2, rect.x + rect.width);
+        y2 = max(y2, rect.y + rect.height);
     }
     
     // Use VIRTIO_GPU_CMD_RESOURCE_FLUSH to flush the updated resource to the display.
+    // One flush of the area covering everything is cheaper than one for each rectangle
     rc = cmd_resource_flush(VIRTIO_RESOURCE_ID_FB, {
-        .x = 0,
-        .y = 0,
-        .width = m_displayinfo.width,
-        .height = m_displayinfo.height
+        .x = x1,
+        .y = y1,
+        .width = x2 - x1,
+        .height = y2 - y1
     });
     if (rc != 0) {
         LOGE("Failed to flush framebuffer: %" PRId32, rc);
@@ -276,7 +307,7 @@ failed:
     return rc;
 }
 
-int32_t VirtioGPU::cmd_transfer_to_host_2d(uint32_t resource_id, virtio_gpu_rect rect)
+int32_t VirtioGPU::cmd_transfer_to_host_2d(uint32_t resource_id, virtio_gpu_rect rect, uint64_t offset)
 {
     int32_t rc = 0;
     struct virtio_gpu_transfer_to_host_2d cmd {
@@ -289,7 +320,7 @@ int32_t VirtioGPU::cmd_transfer_to_host_2d(uint32_t resource_id, virtio_gpu_rect
             .padding = {0, 0, 0}
         },
         .r = rect,
-        .offset = 0,
+        .offset = offset,
         .resource_id = resource_id,
         .padding = VIRTIO_FB_PADDING
     };
@@ -350,7 +381,7 @@ failed:
 int32_t VirtioGPU::setup_framebuffer()
 {
     int32_t rc = 0;
-    uintptr_t fb_paddr;
+    uintptr_t fb_paddr = 0;
     struct virtio_gpu_rect display0;
 
     // 5.7.5 Device Requirements: Device Initialization
@@ -414,9 +445,8 @@ int32_t VirtioGPU::setup_framebuffer()
     return 0;
 
 failed:
-    if (fb_paddr != 0) {
-        LOGW("Freeing framebuffer storage is not implemented yet");
-    }
+    if (fb_paddr != 0)
+        free_framebuffer_storage(fb_paddr, BYTES_PER_PIXEL * display0.width * display0.height);
     return rc;
 }
 
@@ -503,6 +533,7 @@ int32_t VirtioGPU::cmd_send_receive(
     resp_pa_addr = page2addr(storage) + round_up(cmd_size, 8);
 
     memcpy((void*) phys2virt(cmd_pa_addr), cmd, cmd_size);
+    dcache_clean_and_invalidate_range((void*) phys2virt(cmd_pa_addr), resp_pa_addr + resp_size - cmd_pa_addr);
 
     q->desc_table[cmd_desc_idx].addr = cmd_pa_addr;
     q->desc_table[cmd_desc_idx].len = cmd_size;
@@ -524,6 +555,7 @@ int32_t VirtioGPU::cmd_send_receive(
 
     virtio_virtq_enqueue_desc(r, q, cmd_desc_idx);
     mutex_take(request.completed);
+    dcache_invalidate_range((void*) phys2virt(resp_pa_addr), resp_size);
     memcpy(resp, (void*) phys2virt(resp_pa_addr), resp_size);
 
 cleanup:
@@ -27,6 +27,7 @@ public:
 
     virtual FramebufferDevice::DisplayInfo display_info() const override { return m_displayinfo; }
     virtual int32_t refresh() override; 
+    virtual int32_t refresh_rects(api::FramebufferRect const *rects, size_t count) override;
 
 private:
     int32_t device_specific_init();
@@ -38,7 +39,7 @@ private:
     int32_t cmd_resource_create_2d(uint32_t id, uint32_t pixelformat, uint32_t width, uint32_t height);
     int32_t cmd_resource_attach_backing(uint32_t id, uintptr_t paddr, uint32_t length);
     int32_t cmd_set_scanout(virtio_gpu_rect rect, uint32_t resource_id, uint32_t scanout_id);
-    int32_t cmd_transfer_to_host_2d(uint32_t resource_id, virtio_gpu_rect rect);
+    int32_t cmd_transfer_to_host_2d(uint32_t resource_id, virtio_gpu_rect rect, uint64_t offset);
     int32_t cmd_resource_flush(uint32_t resource_id, virtio_gpu_rect rect);
 
     int32_t cmd_send_receive(
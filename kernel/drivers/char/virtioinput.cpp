@@ -64,8 +64,9 @@ void VirtioInputDevice::mark_descriptor_as_available(int desc_idx)
 {
     SplitVirtQueue *q = m_eventq;
     m_eventsbuf[desc_idx] = {};
+    dcache_clean_and_invalidate_range(&m_eventsbuf[desc_idx], sizeof(m_eventsbuf[desc_idx]));
 
-    uintptr_t eventbuf = reinterpret_cast<uintptr_t>(&m_eventsbuf[desc_idx]);
+    uintptr_t eventbuf = reinterpret_cast<uintptr_t>(&m_eventsbuf[desc_idx].event);
     q->desc_table[desc_idx].addr = virt2phys(eventbuf);
     q->desc_table[desc_idx].len = sizeof(virtio_input_event);
     q->desc_table[desc_idx].flags = VIRTQ_DESC_F_WRITE;
@@ -98,12 +99,12 @@ int32_t VirtioInputDevice::device_specific_init()
         goto failed;
     }
 
-    static_assert(4 * _1KB / sizeof(virtio_input_event) >= EVENTQ_SIZE);
+    static_assert(4 * _1KB / sizeof(VirtioInputEventSlot) >= EVENTQ_SIZE);
     if (!physical_page_alloc(PageOrder::_4KB, m_eventsbuf_page).is_success()) {
         LOGE("Failed to alloc memory for storing the received input buffers");
         goto failed;
     }
-    m_eventsbuf = reinterpret_cast<virtio_input_event*>(phys2virt(page2addr(m_eventsbuf_page)));
+    m_eventsbuf = reinterpret_cast<VirtioInputEventSlot*>(phys2virt(page2addr(m_eventsbuf_page)));
 
     rc = virtio_util_setup_virtq(r, 1, STATUSQ_SIZE, &m_statusq);
     if (rc) {
@@ -131,8 +132,8 @@ int32_t VirtioInputDevice::shutdown()
 
 void VirtioInputDevice::process_event(SplitVirtQueue*, int desc_idx)
 {
-    virtio_input_event event = m_eventsbuf[desc_idx];
-    m_eventsbuf[desc_idx] = {};
+    dcache_invalidate_range(&m_eventsbuf[desc_idx], sizeof(m_eventsbuf[desc_idx]));
+    virtio_input_event event = m_eventsbuf[desc_idx].event;
     LOGD("Event { Type: %" PRIu16 ", Code: %" PRIu16 ", Value: %" PRIu32 "}", event.type, event.code, event.value);
 
     switch (event.type) {
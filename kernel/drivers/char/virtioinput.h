@@ -4,6 +4,14 @@
 #include <kernel/drivers/bus/virtio/virtio.h>
 
 
+/**
+ * The device writes each event into its own cache line, so that the ones
+ * already received can be invalidated while others are still in flight
+*/
+struct alignas(ARCH_CACHE_LINE_SIZE) VirtioInputEventSlot {
+    virtio_input_event event;
+};
+
 class VirtioInputDevice: public InputDevice
 {
 public:
@@ -33,5 +41,5 @@ private:
     SplitVirtQueue *m_statusq = nullptr;
 
     PhysicalPage *m_eventsbuf_page = nullptr;
-    virtio_input_event *m_eventsbuf = nullptr;
+    VirtioInputEventSlot *m_eventsbuf = nullptr;
 };
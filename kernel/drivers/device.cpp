@@ -1,4 +1,6 @@
 #include "device.h"
+#include <malloc.h>
+#include <kernel/locking/irqlock.h>
 
 #define LOG_ENABLED
 #define LOG_TAG "DEVICE"
@@ -18,6 +20,161 @@ FileDevice::FileDevice(uint8_t major, uint8_t minor, char const* name)
     : m_major(major), m_minor(minor)
 {
     sprintf(m_name, "%s%d", name, (int) minor);
+    waitqueue_init(m_waitqueue);
+}
+
+static void unpin_block_segments(BlockSegment const *segments, size_t segment_count)
+{
+    for (size_t i = 0; i < segment_count; i++) {
+        uintptr_t end = segments[i].phys_addr + segments[i].length;
+        for (uintptr_t page = round_down<uintptr_t>(segments[i].phys_addr, _4KB); page < end; page += _4KB)
+            MUST(physical_page_free(addr2page(page), PageOrder::_4KB));
+    }
+}
+
+/**
+ * Splits a virtually contiguous buffer into physically contiguous segments.
+ * Every page is touched first so that lazily populated or copy-on-write
+ * user pages are faulted in before the device accesses them.
+ * Returns how many bytes the segments cover, less than 'size' if more
+ * than 'max_segments' would have been needed, or -ERR_FAULT if the user
+ * buffer is not mapped or the device would write to a read-only part of it.
+ *
+ * The device then reaches the pages by their physical address while the thread
+ * sleeps: with 'pin' each page gets an extra reference right away, so that it
+ * is not swapped out or freed before \ref unpin_block_segments
+*/
+static int64_t build_block_segments(
+    uint8_t *buffer, size_t size, bool device_writes, bool pin,
+    BlockSegment *segments, size_t max_segments, size_t *out_segment_count
+)
+{
+    size_t covered = 0, count = 0;
+
+    while (covered < size) {
+        uintptr_t virt = reinterpret_cast<uintptr_t>(buffer) + covered;
+        size_t chunk = min<size_t>(size - covered, _4KB - (virt & (_4KB - 1)));
+
+        // Touching the page must not fault in the kernel, only user buffers can be bad
+        if (areas::user_area.contains(virt)) {
+            auto *region = vm_current_address_space().regions.find([&](VmRegion *r) { return r->contains(virt); });
+            if (region == nullptr || (device_writes && region->permissions != PageAccessPermissions::UserFullAccess)) {
+                if (pin)
+                    unpin_block_segments(segments, count);
+                return -ERR_FAULT;
+            }
+        }
+
+        auto *byte = reinterpret_cast<uint8_t volatile*>(virt);
+        uint8_t value = *byte;
+        if (device_writes)
+            *byte = value;
+
+        uintptr_t phys = virt2phys(virt);
+        if (count > 0 && segments[count - 1].phys_addr + segments[count - 1].length == phys) {
+            segments[count - 1].length += chunk;
+        } else {
+            if (count == max_segments)
+                break;
+            segments[count++] = BlockSegment { .phys_addr = phys, .length = (uint32_t) chunk };
+        }
+        if (pin)
+            addr2page(phys)->ref_count++;
+        covered += chunk;
+    }
+
+    *out_segment_count = count;
+    return covered;
+}
+
+int64_t SimpleBlockDevice::transfer_sectors_direct(bool is_write, int64_t first_sector, uint8_t *buffer, size_t size)
+{
+    BlockSegment segments[MAX_SEGMENTS], pinned[MAX_SEGMENTS];
+    size_t sector_size = block_size();
+    bool is_user_buffer = areas::user_area.contains(reinterpret_cast<uintptr_t>(buffer));
+    int64_t rc = 0;
+
+    kassert(size % sector_size == 0);
+    while (size > 0) {
+        size_t segment_count;
+        int64_t built = build_block_segments(buffer, size, !is_write, is_user_buffer, segments, array_size(segments), &segment_count);
+        if (built < 0)
+            return built;
+        size_t covered = built;
+
+        // Trimming can leave some pinned pages out of the request
+        size_t pinned_count = is_user_buffer ? segment_count : 0;
+        memcpy(pinned, segments, pinned_count * sizeof(BlockSegment));
+
+        // Requests must end on a sector boundary, leave the rest for the next one
+        size_t excess = covered % sector_size;
+        covered -= excess;
+        while (excess > 0) {
+            auto& last = segments[segment_count - 1];
+            if (last.length <= excess) {
+                excess -= last.length;
+                segment_count--;
+            } else {
+                last.length -= excess;
+                excess = 0;
+            }
+        }
+        kassert(covered > 0);
+
+        if (is_write)
+            rc = write_sectors(first_sector, covered / sector_size, segments, segment_count);
+        else
+            rc = read_sectors(first_sector, covered / sector_size, segments, segment_count);
+        unpin_block_segments(pinned, pinned_count);
+        if (rc != 0)
+            return rc;
+
+        first_sector += covered / sector_size;
+        buffer += covered;
+        size -= covered;
+    }
+
+    return 0;
+}
+
+/**
+ * Buffers that the device writes to have their cache lines invalidated once it is
+ * done, and the lines they only partially cover are written back first. If the
+ * CPU dirtied whoever shares them in the meantime, that would overwrite what the
+ * device wrote: a sector on an edge that is not cache line aligned is read into
+ * an aligned buffer, after the others
+*/
+int64_t SimpleBlockDevice::transfer_sectors(bool is_write, int64_t first_sector, uint8_t *buffer, size_t size)
+{
+    size_t sector_size = block_size();
+    size_t sector_count = size / sector_size;
+    size_t head = reinterpret_cast<uintptr_t>(buffer) % ARCH_CACHE_LINE_SIZE != 0 ? 1 : 0;
+    size_t tail = (reinterpret_cast<uintptr_t>(buffer) + size) % ARCH_CACHE_LINE_SIZE != 0 && sector_count > head ? 1 : 0;
+    if (is_write || (head == 0 && tail == 0))
+        return transfer_sectors_direct(is_write, first_sector, buffer, size);
+
+    uint8_t *bounce = alloc_sector_buffer();
+    if (bounce == nullptr)
+        return -ERR_NOMEM;
+
+    int64_t rc = 0;
+    if (sector_count > head + tail)
+        rc = transfer_sectors_direct(false, first_sector + head, buffer + head * sector_size, (sector_count - head - tail) * sector_size);
+    if (rc == 0 && head > 0 && (rc = transfer_sectors_direct(false, first_sector, bounce, sector_size)) == 0)
+        memcpy(buffer, bounce, sector_size);
+    if (rc == 0 && tail > 0 && (rc = transfer_sectors_direct(false, first_sector + sector_count - 1, bounce, sector_size)) == 0)
+        memcpy(buffer + size - sector_size, bounce, sector_size);
+
+    free(bounce);
+    return rc;
+}
+
+/**
+ * \brief A buffer for a single sector, with its own cache lines
+*/
+uint8_t *SimpleBlockDevice::alloc_sector_buffer() const
+{
+    return static_cast<uint8_t*>(memalign(ARCH_CACHE_LINE_SIZE, round_up<size_t>(block_size(), ARCH_CACHE_LINE_SIZE)));
 }
 
 int64_t SimpleBlockDevice::read(int64_t offset, uint8_t *buffer, size_t size)
@@ -30,14 +187,17 @@ int64_t SimpleBlockDevice::read(int64_t offset, uint8_t *buffer, size_t size)
     offset = clamp<int64_t>(0, offset, this->size());
     size = clamp<int64_t>(0, size, this->size() - offset);
 
-    if (offset % sector_size != 0) {
-        temp_buffer = (uint8_t*) malloc(sector_size);
+    // Only the partial sectors at the edges need to go through a temporary buffer
+    if (offset % sector_size != 0 || size % sector_size != 0) {
+        temp_buffer = alloc_sector_buffer();
         if (temp_buffer == nullptr) {
             rc = -ERR_NOMEM;
             goto cleanup;
         }
+    }
 
-        rc = read_sector(offset / sector_size, temp_buffer);
+    if (offset % sector_size != 0) {
+        rc = transfer_sectors(false, offset / sector_size, temp_buffer, sector_size);
         if (rc != 0)
             goto cleanup;
         
@@ -50,29 +210,21 @@ int64_t SimpleBlockDevice::read(int64_t offset, uint8_t *buffer, size_t size)
     }
 
     kassert(offset % sector_size == 0);
-    while (size >= sector_size) {
-        rc = read_sector(offset / sector_size, buffer);
+    to_read = round_down<int64_t>(size, sector_size);
+    if (to_read > 0) {
+        rc = transfer_sectors(false, offset / sector_size, buffer, to_read);
         if (rc != 0)
             goto cleanup;
 
-        read += sector_size;
-        offset += sector_size;
-        buffer += sector_size;
-        size -= sector_size;
+        read += to_read;
+        offset += to_read;
+        buffer += to_read;
+        size -= to_read;
     }
 
     kassert(size < sector_size);
-    kassert(offset % sector_size == 0);
     if (size > 0) {
-        if (temp_buffer == nullptr) {
-            temp_buffer = (uint8_t*) malloc(sector_size);
-            if (temp_buffer == nullptr) {
-                rc = -ERR_NOMEM;
-                goto cleanup;
-            }
-        }
-
-        rc = read_sector(offset / sector_size, temp_buffer);
+        rc = transfer_sectors(false, offset / sector_size, temp_buffer, sector_size);
         if (rc != 0)
             goto cleanup;
         memcpy(buffer, temp_buffer, size);
@@ -103,21 +255,23 @@ int64_t SimpleBlockDevice::write(int64_t offset, const uint8_t *buffer, size_t s
     offset = clamp<int64_t>(0, offset, this->size());
     size = clamp<int64_t>(0, size, this->size() - offset);
 
-    if (offset % sector_size != 0) {
-        temp_buffer = (uint8_t*) malloc(sector_size);
+    if (offset % sector_size != 0 || size % sector_size != 0) {
+        temp_buffer = alloc_sector_buffer();
         if (temp_buffer == nullptr) {
             rc = -ERR_NOMEM;
             goto cleanup;
         }
+    }
 
-        rc = read_sector(offset / sector_size, temp_buffer);
+    if (offset % sector_size != 0) {
+        rc = transfer_sectors(false, offset / sector_size, temp_buffer, sector_size);
         if (rc != 0)
             goto cleanup;
         
         to_write = min<int64_t>(size, sector_size - (offset % sector_size));
         memcpy(&temp_buffer[offset % sector_size], buffer, to_write);
 
-        rc = write_sector(offset / sector_size, temp_buffer);
+        rc = transfer_sectors(true, offset / sector_size, temp_buffer, sector_size);
         if (rc != 0)
             goto cleanup;
 
@@ -128,34 +282,27 @@ int64_t SimpleBlockDevice::write(int64_t offset, const uint8_t *buffer, size_t s
     }
 
     kassert(offset % sector_size == 0);
-    while (size >= sector_size) {
-        rc = write_sector(offset / sector_size, buffer);
+    to_write = round_down<int64_t>(size, sector_size);
+    if (to_write > 0) {
+        // The device only reads from the buffer
+        rc = transfer_sectors(true, offset / sector_size, const_cast<uint8_t*>(buffer), to_write);
         if (rc != 0)
             goto cleanup;
 
-        written += sector_size;
-        offset += sector_size;
-        buffer += sector_size;
-        size -= sector_size;
+        written += to_write;
+        offset += to_write;
+        buffer += to_write;
+        size -= to_write;
     }
 
     kassert(size < sector_size);
-    kassert(offset % sector_size == 0);
     if (size > 0) {
-        if (temp_buffer == nullptr) {
-            temp_buffer = (uint8_t*) malloc(sector_size);
-            if (temp_buffer == nullptr) {
-                rc = -ERR_NOMEM;
-                goto cleanup;
-            }
-        }
-
-        rc = read_sector(offset / sector_size, temp_buffer);
+        rc = transfer_sectors(false, offset / sector_size, temp_buffer, sector_size);
         if (rc != 0)
             goto cleanup;
         memcpy(temp_buffer, buffer, size);
 
-        rc = write_sector(offset / sector_size, temp_buffer);
+        rc = transfer_sectors(true, offset / sector_size, temp_buffer, sector_size);
         if (rc != 0)
             goto cleanup;
 
@@ -230,6 +377,7 @@ void TTY::emit(uint8_t ch)
         }
     } else {
         m_input_buffer.push(ch);
+        waitqueue_wake_all(waitqueue());
     }
 
     if (m_termios.c_lflag & ECHO) {
@@ -312,6 +460,7 @@ void TTY::flush_line()
     }
     m_linebuffer_size = 0;
     m_available_lines++;
+    waitqueue_wake_all(waitqueue());
     LOGD("TTY: Flushing line, m_available_lines=%lu, m_input_buffer.size()=%lu", m_available_lines, m_input_buffer.available());
 }
 
@@ -363,6 +512,7 @@ int32_t PtyMaster::ioctl(uint32_t request, void*)
 void PtySlave::echo_raw(uint8_t ch)
 {
     m_master.m_buf.push(ch);
+    waitqueue_wake_all(m_master.waitqueue());
 }
 
 int64_t GPIOController::read(uint8_t *, size_t)
@@ -416,22 +566,24 @@ int64_t InputDevice::read(uint8_t *buffer, size_t size)
 
 void InputDevice::notify_event(api::InputEvent event)
 {
-    mutex_take(this->m_events.lock);
+    auto lock = irq_lock();
     m_events.events.push(event);
-    mutex_release(this->m_events.lock);
+    release(lock);
+
+    waitqueue_wake_all(waitqueue());
 }
 
 bool InputDevice::get_next_event(api::InputEvent& event)
 {
-    mutex_take(m_events.lock);
+    auto lock = irq_lock();
     bool res = m_events.events.pop(event);
-    mutex_release(m_events.lock);
+    release(lock);
     return res;
 }
 
 int32_t InputDevice::poll(uint32_t events, uint32_t *out_revents) const
 {
-    mutex_take(m_events.lock);
+    auto lock = irq_lock();
 
     if ((events & F_POLLIN) && !m_events.events.is_empty()) {
         *out_revents |= F_POLLIN;
@@ -440,7 +592,7 @@ int32_t InputDevice::poll(uint32_t events, uint32_t *out_revents) const
     if ((events & F_POLLOUT) && !m_events.events.is_full()) {
         *out_revents |= F_POLLOUT;
     }
-    mutex_release(m_events.lock);
+    release(lock);
 
     return 0;
 }
@@ -472,6 +624,33 @@ int32_t FramebufferDevice::ioctl(uint32_t request, void *argp)
         }
         case api::FBIO_REFRESH:
             return this->refresh();
+        case api::FBIO_REFRESH_RECTS: {
+            if (argp == nullptr)
+                return this->refresh();
+
+            auto const& damage = *reinterpret_cast<api::FramebufferDamage const*>(argp);
+            auto display_info = this->display_info();
+            api::FramebufferRect rects[FBIO_MAX_DAMAGE_RECTS];
+            size_t count = 0;
+
+            if (damage.count > array_size(rects))
+                return this->refresh();
+
+            for (uint32_t i = 0; i < damage.count; i++) {
+                api::FramebufferRect rect = damage.rects[i];
+                if (rect.x >= display_info.width || rect.y >= display_info.height)
+                    continue;
+                rect.width = min(rect.width, display_info.width - rect.x);
+                rect.height = min(rect.height, display_info.height - rect.y);
+                if (rect.width == 0 || rect.height == 0)
+                    continue;
+                rects[count++] = rect;
+            }
+
+            if (count == 0)
+                return 0;
+            return this->refresh_rects(rects, count);
+        }
         default:
             return -ERR_NOTSUP;
     }
@@ -491,8 +670,8 @@ int32_t FramebufferDevice::mmap(AddressSpace *as, uintptr_t vaddr, uint32_t leng
         PhysicalPage *page = addr2page(fb_phys_addr + offset);
         kassert(page != nullptr);
         page->ref_count++;
-        kassert(vm_map(*as, page, vaddr + offset, PageAccessPermissions::UserFullAccess).is_success());
     }
+    kassert(vm_map_contiguous(*as, fb_phys_addr, vaddr, fb_length, PageAccessPermissions::UserFullAccess, MemoryType::WriteCombine).is_success());
 
     return 0;
 }
@@ -82,9 +82,16 @@ public:
     virtual bool is_tty() const { return false; }
     virtual int32_t mmap(AddressSpace*, uintptr_t, uint32_t, uint32_t) { return -ERR_NOTSUP; }
 
+    /**
+     * Threads blocked on a read, write or poll of this device sleep here:
+     * implementations must wake it up whenever the result of poll() might have changed
+    */
+    WaitQueue& waitqueue() { return m_waitqueue; }
+
 private:
     uint8_t m_major, m_minor;
     char m_name[32];
+    WaitQueue m_waitqueue;
 };
 
 class CharacterDevice: public FileDevice
@@ -122,9 +129,19 @@ private:
     int64_t m_block_size;
 };
 
+/**
+ * A physically contiguous piece of the memory involved in a block transfer
+*/
+struct BlockSegment {
+    uintptr_t phys_addr;
+    uint32_t length;
+};
+
 class SimpleBlockDevice: public BlockDevice
 {
 public:
+    static constexpr size_t MAX_SEGMENTS = 32;
+
     SimpleBlockDevice(int64_t block_size, const char *name)
         : BlockDevice(block_size, name)
     {}
@@ -134,12 +151,20 @@ public:
     virtual int64_t write(int64_t, const uint8_t *buffer, size_t size) override;
 
 protected:
-    virtual int64_t read_sector(int64_t sector_idx, uint8_t *buffer) = 0;
-    virtual int64_t write_sector(int64_t sector_idx, uint8_t const *buffer) = 0;
+    /**
+     * \brief Transfers 'sector_count' consecutive sectors in a single request
+     * The segments are at most MAX_SEGMENTS and their lengths add up to
+     * exactly 'sector_count * block_size()' bytes.
+     * \return 0 on success, a negative error code otherwise
+    */
+    virtual int64_t read_sectors(int64_t first_sector, size_t sector_count, BlockSegment const *segments, size_t segment_count) = 0;
+    virtual int64_t write_sectors(int64_t first_sector, size_t sector_count, BlockSegment const *segments, size_t segment_count) = 0;
     virtual bool is_read_only() const { return false; }
 
 private:
-    uint8_t *m_temp_buffer;
+    int64_t transfer_sectors(bool is_write, int64_t first_sector, uint8_t *buffer, size_t size);
+    int64_t transfer_sectors_direct(bool is_write, int64_t first_sector, uint8_t *buffer, size_t size);
+    uint8_t *alloc_sector_buffer() const;
 };
 
 class Console: public CharacterDevice
@@ -317,7 +342,6 @@ public:
     InputDevice()
         : CharacterDevice(Maj_Input, s_next_minor++, "input")
     {
-        mutex_init(this->m_events.lock, MutexInitialState::Unlocked);
     }
 
     virtual ~InputDevice() {};
@@ -333,8 +357,8 @@ protected:
 private:
     bool get_next_event(api::InputEvent&);
 
+    // Filled from interrupt context, protect it with irq_lock()
     struct {
-        Mutex lock;
         RingBuffer<32, api::InputEvent> events;
     } m_events;
 };
@@ -360,6 +384,12 @@ public:
     virtual DisplayInfo display_info() const = 0;
     virtual int32_t refresh() = 0;
 
+    /**
+     * Only the given regions changed since the last refresh, they are
+     * already clipped to the display. By default the whole display is refreshed.
+    */
+    virtual int32_t refresh_rects(api::FramebufferRect const*, size_t) { return refresh(); }
+
     virtual int64_t read(uint8_t*, size_t) override { return -ERR_NOTSUP; }
     virtual int64_t write(const uint8_t*, size_t) override { return -ERR_NOTSUP; }
     virtual int32_t ioctl(uint32_t request, void *argp) override;
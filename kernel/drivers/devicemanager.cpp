@@ -3,6 +3,7 @@
 #include "devicemanager.h"
 
 #include "block/virtioblk.h"
+#include "block/zram.h"
 
 #include "char/bcm2835_aux_uart.h"
 #include "char/bcm2835_gpio.h"
@@ -24,6 +25,8 @@ static void raspi0_load_peripherals();
 static void virt_init_log_device();
 static void virt_load_peripherals();
 
+static void load_compressed_ram_disk();
+
 
 static Device *s_devices[64];
 static struct {
@@ -58,6 +61,7 @@ static constexpr Driver s_drivers[] = {
     basic_init<BCM2835SystemTimer>("brcm,bcm2835-system-timer"),
     basic_init<ARMv7Timer>("arm,armv7-timer"),
     basic_init<PL031>("arm,pl031"),
+    basic_init<CompressedRamDisk>("zram"),
 
     // This is not right: the compatible should be "virtio,mmio" which handles
     // all virtio devices, not separate compatibles for each device class
@@ -169,6 +173,57 @@ SystemTimer *devicemanager_get_system_timer_device() { return s_defaults.systime
 
 BlockDevice *devicemanager_get_root_block_device() { return s_defaults.storage; }
 
+BlockDevice *devicemanager_get_block_device(size_t index)
+{
+    for (size_t i = 0; i < array_size(s_devices); i++) {
+        if (s_devices[i] == nullptr || s_devices[i]->device_type() != Device::Type::BlockDevice)
+            continue;
+        if (index-- == 0)
+            return static_cast<BlockDevice*>(s_devices[i]);
+    }
+
+    return nullptr;
+}
+
+/**
+ * Size of the compressed RAM disk, 0 to go without. Memory is only taken by
+ * what is written to it, and only as much as it takes compressed
+*/
+#ifndef CONFIG_ZRAM_SIZE
+#define CONFIG_ZRAM_SIZE (32 * _1MB)
+#endif
+
+/**
+ * Blocks of the compressed RAM disk that are set aside when it is created, for
+ * the writes that come when the kernel heap is full. As a swap device that is
+ * when it is needed the most: enough for a whole batch of swapped out pages
+*/
+#ifndef CONFIG_ZRAM_RESERVE_BLOCKS
+#define CONFIG_ZRAM_RESERVE_BLOCKS 32
+#endif
+
+static void load_compressed_ram_disk()
+{
+    if (CONFIG_ZRAM_SIZE == 0)
+        return;
+
+    Driver const *zram_drv = find_driver("zram");
+    kassert(zram_drv != nullptr);
+    CompressedRamDisk::Config zram_config {
+        .size = CONFIG_ZRAM_SIZE,
+        .reserve_blocks = CONFIG_ZRAM_RESERVE_BLOCKS,
+    };
+    kprintf("Initializing compressed RAM disk (%" PRIu32 "KB)...\n", static_cast<uint32_t>(zram_config.size / _1KB));
+    auto *zram_dev = reinterpret_cast<CompressedRamDisk*>(zram_drv->load(zram_drv->compatible, mustmalloc(zram_drv->required_space), &zram_config));
+    int32_t rc = zram_dev->init();
+    if (rc != 0) {
+        // It is only a nice to have, the system works fine without it
+        kprintf("Failed to initialize compressed RAM disk: %" PRId32 "\n", rc);
+        return;
+    }
+    register_device(zram_dev);
+}
+
 /////////////////////////////// RASPBERRY PI 0 ////////////////////////////////
 
 static constexpr uintptr_t RASPI0_IOBASE = 0x20000000;
@@ -245,6 +300,8 @@ static void raspi0_load_peripherals()
     if (rc != 0)
         panic("Failed to initialize system timer: %d\n", rc);
     s_defaults.systimer = systimer_dev;
+
+    load_compressed_ram_disk();
 }
 
 ////////////////////////////////// QEMU VIRT //////////////////////////////////
@@ -396,4 +453,7 @@ static void virt_load_peripherals()
         }
 
     }
+
+    // After the virtio disks, so that a swap disk among them is found first
+    load_compressed_ram_disk();
 }
@@ -17,3 +17,8 @@ InterruptController *devicemanager_get_interrupt_controller_device();
 SystemTimer *devicemanager_get_system_timer_device();
 
 BlockDevice *devicemanager_get_root_block_device();
+
+/**
+ * \brief The 'index'-th block device that was found, nullptr past the last one
+*/
+BlockDevice *devicemanager_get_block_device(size_t index);
@@ -137,6 +137,7 @@ struct Error {
 static constexpr Error Success { GenericErrorCode::Success, 0, "Success", nullptr };
 static constexpr Error ResponseTimeout { GenericErrorCode::ResponseTimeout, 0, "Device did not response in time", nullptr };
 static constexpr Error BadParameters { GenericErrorCode::BadParameters, 0, "Bad parameters", nullptr };
+static constexpr Error BadResponse { GenericErrorCode::BadResponse, 0, "Device returned a bad response", nullptr };
 static constexpr Error DeviceNotInitialized { GenericErrorCode::NotInitialized, 0, "Device was not initialized before usage", nullptr };
 static constexpr Error DeviceNotConnected { GenericErrorCode::NotConnected, 0, "Device is not connected", nullptr };
 static constexpr Error DeviceNotReady { GenericErrorCode::DeviceNotReady, 0, "Device is not yet ready, retry the operation", nullptr };
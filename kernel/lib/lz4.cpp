@@ -0,0 +1,183 @@
+#include "lz4.h"
+
+
+// Every match is at least this long, its length is stored minus this
+static constexpr size_t MIN_MATCH = 4;
+// The block always ends with this many literals
+static constexpr size_t LAST_LITERALS = 5;
+// No match can start this close to the end of the block
+static constexpr size_t MATCH_FIND_LIMIT = 12;
+// Literal and match lengths that do not fit in the 4 bits of the token
+static constexpr size_t RUN_MASK = 15;
+static constexpr size_t MAX_OFFSET = 0xffff;
+
+static inline uint32_t read32(uint8_t const *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t lz4_hash(uint32_t sequence)
+{
+    return (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+/**
+ * \brief Writes the bytes that follow a length of at least RUN_MASK in the token
+*/
+static bool write_length(uint8_t *&op, uint8_t const *oend, size_t length)
+{
+    for (; length >= 255; length -= 255) {
+        if (op == oend)
+            return false;
+        *op++ = 255;
+    }
+    if (op == oend)
+        return false;
+    *op++ = length;
+
+    return true;
+}
+
+static bool read_length(uint8_t const *&ip, uint8_t const *iend, size_t& length)
+{
+    uint8_t byte;
+    do {
+        if (ip == iend)
+            return false;
+        byte = *ip++;
+        length += byte;
+    } while (byte == 255);
+
+    return true;
+}
+
+/**
+ * \brief Writes 'literal_length' bytes at 'literals' followed by a match, if 'match_length' is not 0
+*/
+static bool write_sequence(
+    uint8_t *&op, uint8_t const *oend,
+    uint8_t const *literals, size_t literal_length,
+    size_t offset, size_t match_length
+)
+{
+    if (op == oend)
+        return false;
+
+    uint8_t *token = op++;
+    *token = min(literal_length, RUN_MASK) << 4;
+    if (literal_length >= RUN_MASK && !write_length(op, oend, literal_length - RUN_MASK))
+        return false;
+    if (static_cast<size_t>(oend - op) < literal_length)
+        return false;
+    memcpy(op, literals, literal_length);
+    op += literal_length;
+
+    if (match_length == 0)
+        return true;
+
+    if (oend - op < 2)
+        return false;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+
+    match_length -= MIN_MATCH;
+    *token |= min(match_length, RUN_MASK);
+    if (match_length >= RUN_MASK && !write_length(op, oend, match_length - RUN_MASK))
+        return false;
+
+    return true;
+}
+
+size_t lz4_compress(uint8_t const *src, size_t size, uint8_t *dst, size_t capacity, uint16_t *hash_table)
+{
+    kassert(size <= LZ4_MAX_INPUT_SIZE);
+
+    uint8_t const *ip = src;
+    uint8_t const *anchor = src;
+    uint8_t const *end = src + size;
+    uint8_t *op = dst;
+    uint8_t const *oend = dst + capacity;
+
+    if (size > MATCH_FIND_LIMIT) {
+        uint8_t const *match_end_limit = end - LAST_LITERALS;
+        uint8_t const *search_limit = end - MATCH_FIND_LIMIT;
+
+        while (ip < search_limit) {
+            uint32_t h = lz4_hash(read32(ip));
+            uint8_t const *candidate = src + hash_table[h];
+            hash_table[h] = ip - src;
+
+            // The table can hold positions from another block, or from further ahead
+            if (candidate >= ip || static_cast<size_t>(ip - candidate) > MAX_OFFSET || read32(candidate) != read32(ip)) {
+                // Data that does not compress is skipped faster and faster
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            uint8_t const *match_end = ip + MIN_MATCH;
+            uint8_t const *c = candidate + MIN_MATCH;
+            while (match_end < match_end_limit && *match_end == *c) {
+                match_end++;
+                c++;
+            }
+
+            if (!write_sequence(op, oend, anchor, ip - anchor, ip - candidate, match_end - ip))
+                return 0;
+            ip = match_end;
+            anchor = ip;
+        }
+    }
+
+    if (!write_sequence(op, oend, anchor, end - anchor, 0, 0))
+        return 0;
+
+    return op - dst;
+}
+
+bool lz4_decompress(uint8_t const *src, size_t src_size, uint8_t *dst, size_t size)
+{
+    uint8_t const *ip = src;
+    uint8_t const *iend = src + src_size;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + size;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+
+        size_t literal_length = token >> 4;
+        if (literal_length == RUN_MASK && !read_length(ip, iend, literal_length))
+            return false;
+        if (static_cast<size_t>(iend - ip) < literal_length || static_cast<size_t>(oend - op) < literal_length)
+            return false;
+        memcpy(op, ip, literal_length);
+        ip += literal_length;
+        op += literal_length;
+
+        // Only the last sequence has no match
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return false;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > static_cast<size_t>(op - dst))
+            return false;
+
+        size_t match_length = token & RUN_MASK;
+        if (match_length == RUN_MASK && !read_length(ip, iend, match_length))
+            return false;
+        match_length += MIN_MATCH;
+        if (static_cast<size_t>(oend - op) < match_length)
+            return false;
+
+        // The match can overlap what it is writing, e.g. a run of the same byte
+        uint8_t const *match = op - offset;
+        while (match_length-- > 0)
+            *op++ = *match++;
+    }
+
+    return op == oend;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <kernel/base.h>
+
+
+/**
+ * A compressor for the LZ4 block format: no frame, no checksums, just the
+ * sequences of literals and back-references. It favours speed over ratio,
+ * it is meant for blocks of a few KB that get compressed all the time.
+ *
+ * Matches are found through a hash table of positions that the caller owns,
+ * so that it does not have to live on the kernel stack. Its contents do not
+ * need to be cleared between calls, stale positions are checked anyway.
+*/
+
+static constexpr size_t LZ4_HASH_BITS = 12;
+static constexpr size_t LZ4_HASH_ENTRIES = 1 << LZ4_HASH_BITS;
+// Positions in the hash table are 16 bits
+static constexpr size_t LZ4_MAX_INPUT_SIZE = 64 * _1KB;
+
+/**
+ * \brief Compresses 'size' bytes of 'src' into at most 'capacity' bytes of 'dst'
+ * \return The compressed size, 0 if it would take more than 'capacity' bytes
+*/
+size_t lz4_compress(uint8_t const *src, size_t size, uint8_t *dst, size_t capacity, uint16_t *hash_table);
+
+/**
+ * \brief Decompresses a block made by \ref lz4_compress into exactly 'size' bytes of 'dst'
+ * \return false if the block is corrupted or does not decompress to 'size' bytes
+*/
+bool lz4_decompress(uint8_t const *src, size_t src_size, uint8_t *dst, size_t size);
@@ -1,33 +1,44 @@
 #include "mutex.h"
 #include <kernel/scheduler.h>
 
-// TODO: A real implementation, this is just a placeholder
 
 void mutex_init(Mutex& mutex, MutexInitialState state)
 {
     mutex.lock = SPINLOCK_START;
+    waitqueue_init(mutex.waiters);
     if (state == MutexInitialState::Locked)
         spinlock_take(mutex.lock);
 }
 
-void mutex_take(Mutex const& mutex)
+static bool mutex_try_take(Mutex const& mutex)
 {
-    if (scheduler_has_started()) {
-        while (spinlock_is_taken(mutex.lock))
-            sys$yield();
-    }
+    return try_acquire(const_cast<uint32_t*>(&mutex.lock.is_taken));
+}
 
-    spinlock_take(mutex.lock);
+void mutex_take(Mutex const& mutex)
+{
+    auto& waiters = const_cast<WaitQueue&>(mutex.waiters);
+    waitqueue_wait_until(waiters, [&]() { return mutex_try_take(mutex); });
 }
 
 int mutex_take_with_timeout(Mutex const& mutex, uint32_t timeout_ms)
 {
-    return spinlock_take_with_timeout(mutex.lock, timeout_ms);
+    auto& waiters = const_cast<WaitQueue&>(mutex.waiters);
+    if (timeout_ms == 0)
+        return mutex_try_take(mutex) ? 0 : -ERR_TIMEDOUT;
+
+    int rc = waitqueue_wait_until(waiters, [&]() { return mutex_try_take(mutex); }, timeout_ms);
+    // We might have been woken up by a release right before giving up, pass it on
+    if (rc != 0 && !spinlock_is_taken(mutex.lock))
+        waitqueue_wake_one(waiters);
+
+    return rc;
 }
 
 void mutex_release(Mutex const& mutex)
 {
     spinlock_release(mutex.lock);
+    waitqueue_wake_one(const_cast<WaitQueue&>(mutex.waiters));
 }
 
 bool mutex_is_locked(Mutex const& mutex)
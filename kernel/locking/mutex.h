@@ -2,10 +2,17 @@
 
 #include <kernel/base.h>
 #include "spinlock.h"
+#include "waitqueue.h"
 
 
+/**
+ * A sleeping lock: threads that fail to take it are blocked until
+ * it gets released. Releasing is safe from interrupt context, which
+ * makes a locked Mutex usable as a one-shot completion.
+*/
 struct Mutex {
     Spinlock lock;
+    WaitQueue waiters;
 };
 
 enum class MutexInitialState { Unlocked, Locked };
@@ -0,0 +1,93 @@
+#include <kernel/scheduler.h>
+#include <kernel/timer.h>
+#include "irqlock.h"
+#include "waitqueue.h"
+
+
+void waitqueue_init(WaitQueue& queue)
+{
+    queue.waiters = {nullptr, nullptr};
+}
+
+static void wake_thread(Thread *thread)
+{
+    if (thread != nullptr && thread->state == ThreadState::Blocked)
+        thread->state = ThreadState::Runnable;
+}
+
+void waitqueue_prepare_wait(WaitQueue& queue, WaitQueue::Waiter& waiter)
+{
+    auto lock = irq_lock();
+    waiter.thread = cpu_current_thread();
+    queue.waiters.append(&waiter);
+    if (scheduler_has_started()) {
+        waiter.previous_state = waiter.thread->state;
+        waiter.thread->state = ThreadState::Blocked;
+    }
+    release(lock);
+}
+
+void waitqueue_finish_wait(WaitQueue& queue, WaitQueue::Waiter& waiter)
+{
+    auto lock = irq_lock();
+    queue.waiters.remove(&waiter);
+    // If something woke the thread up it stays runnable, even if an outer wait had blocked it
+    if (scheduler_has_started() && waiter.thread->state == ThreadState::Blocked)
+        waiter.thread->state = waiter.previous_state;
+    release(lock);
+}
+
+int waitqueue_block(uint32_t timeout_ms)
+{
+    struct TimeoutCtx {
+        Thread *thread;
+        bool expired;
+    } ctx { cpu_current_thread(), false };
+    Timer *timer = nullptr;
+
+    if (!scheduler_has_started()) {
+        // Nothing else can run and wake us up, only an interrupt can
+        cpu_relax();
+        return 0;
+    }
+
+    if (timeout_ms != 0) {
+        timer = timer_exec_once(timeout_ms, [](void *arg) {
+            auto *ctx = static_cast<TimeoutCtx*>(arg);
+            ctx->expired = true;
+            wake_thread(ctx->thread);
+        }, &ctx);
+    }
+
+    if (ctx.thread->state == ThreadState::Blocked)
+        sys$yield();
+
+    auto lock = irq_lock();
+    // One-shot timers are freed right after they fire
+    if (timer != nullptr && !ctx.expired)
+        timer_cancel(timer);
+    release(lock);
+
+    return ctx.expired ? -ERR_TIMEDOUT : 0;
+}
+
+void waitqueue_wake_one(WaitQueue& queue)
+{
+    auto lock = irq_lock();
+    // Waiters that were already woken up will check the condition again anyway
+    auto *waiter = queue.waiters.find([](WaitQueue::Waiter *waiter) {
+        return waiter->thread != nullptr && waiter->thread->state == ThreadState::Blocked;
+    });
+    if (waiter != nullptr)
+        wake_thread(waiter->thread);
+    release(lock);
+}
+
+void waitqueue_wake_all(WaitQueue& queue)
+{
+    auto lock = irq_lock();
+    queue.waiters.foreach([](WaitQueue::Waiter *waiter) {
+        wake_thread(waiter->thread);
+    });
+    release(lock);
+}
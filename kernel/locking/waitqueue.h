@@ -0,0 +1,94 @@
+#pragma once
+
+#include <kernel/base.h>
+#include <kernel/timer.h>
+#include <kernel/lib/intrusivelinkedlist.h>
+
+
+struct Thread;
+enum class ThreadState;
+
+/**
+ * A list of threads sleeping until some condition becomes true.
+ *
+ * Whoever changes the state the sleepers are waiting on must call
+ * \ref waitqueue_wake_all (or \ref waitqueue_wake_one) afterwards.
+ * Waking is safe from interrupt context, waiting is not.
+*/
+struct WaitQueue {
+    struct Waiter {
+        INTRUSIVE_LINKED_LIST_HEADER(Waiter);
+
+        Thread *thread;
+        // What the thread was doing before this wait marked it as blocked
+        ThreadState previous_state;
+    };
+
+    IntrusiveLinkedList<Waiter> waiters;
+};
+
+void waitqueue_init(WaitQueue&);
+
+/**
+ * \brief Registers the current thread on the queue and marks it as blocked
+ *
+ * This must happen before the condition is checked: a wake up that arrives
+ * between the check and \ref waitqueue_block marks the thread runnable again,
+ * so it is never lost.
+ * A thread can be prepared on multiple queues at once, the first one to be
+ * woken up makes it runnable.
+*/
+void waitqueue_prepare_wait(WaitQueue&, WaitQueue::Waiter&);
+
+/**
+ * \brief Unregisters the waiter and undoes what \ref waitqueue_prepare_wait did to the thread state
+ *
+ * Waits can nest, e.g. taking a mutex while preparing to sleep on something
+ * else: the thread stays blocked for the outer wait, unless it was woken up
+ * in the meantime.
+*/
+void waitqueue_finish_wait(WaitQueue&, WaitQueue::Waiter&);
+
+/**
+ * \brief Gives up the CPU until one of the queues the thread was prepared on is woken up
+ * \param timeout_ms If not 0, the thread is also woken up after this many milliseconds
+ * \return -ERR_TIMEDOUT if the timeout expired, 0 otherwise
+*/
+int waitqueue_block(uint32_t timeout_ms);
+
+void waitqueue_wake_one(WaitQueue&);
+
+void waitqueue_wake_all(WaitQueue&);
+
+/**
+ * \brief Sleeps on the queue until \p condition returns true
+ * \param timeout_ms Maximum time to wait, 0 means forever
+ * \return 0 when the condition is true, -ERR_TIMEDOUT if the timeout expired first
+*/
+template<typename Condition>
+int waitqueue_wait_until(WaitQueue& queue, Condition condition, uint32_t timeout_ms = 0)
+{
+    uint32_t start = get_ticks_ms();
+    WaitQueue::Waiter waiter;
+
+    while (true) {
+        waitqueue_prepare_wait(queue, waiter);
+        if (condition()) {
+            waitqueue_finish_wait(queue, waiter);
+            return 0;
+        }
+
+        uint32_t remaining = 0;
+        if (timeout_ms != 0) {
+            uint32_t elapsed = get_ticks_ms() - start;
+            if (elapsed >= timeout_ms) {
+                waitqueue_finish_wait(queue, waiter);
+                return -ERR_TIMEDOUT;
+            }
+            remaining = timeout_ms - elapsed;
+        }
+
+        waitqueue_block(remaining);
+        waitqueue_finish_wait(queue, waiter);
+    }
+}
@@ -1,11 +1,13 @@
 #include <kernel/boot/boot.h>
 #include <kernel/drivers/devicemanager.h>
 #include <kernel/kprintf.h>
+#include <kernel/memory/swap.h>
 #include <kernel/scheduler.h>
 #include <kernel/timer.h>
 #include <kernel/vfs/devfs/devfs.h>
 #include <kernel/vfs/pipefs/pipefs.h>
 #include <kernel/vfs/ptyfs/ptyfs.h>
+#include <kernel/vfs/shmfs/shmfs.h>
 #include <kernel/vfs/tempfs/tempfs.h>
 #include <kernel/vfs/vfs.h>
 #include <api/syscalls.h>
@@ -94,6 +96,17 @@ extern "C" void kernel_main(BootParams const *boot_params)
     rc = vfs_mount("/tmp/", *tmpfs);
     kassert(rc == 0);
 
+    Filesystem *shmfs;
+    rc = shmfs_create(&shmfs);
+    if (rc < 0) {
+        panic("Failed to create shmfs: %d\n", rc);
+    }
+    rc = vfs_mount("/shm/", *shmfs);
+    kassert(rc == 0);
+
+    kprintf("Looking for a swap device...\n");
+    swap_init();
+
     kprintf("Running the first process...\n");
     create_first_process(proc1);
     scheduler_start();
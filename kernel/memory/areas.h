@@ -9,10 +9,22 @@ namespace areas {
 static constexpr uintptr_t KERNEL_VIRT_START_ADDR = 0xc0000000;
 static constexpr uintptr_t PHYS_MEM_START_ADDR =    0xe0000000;
 
+// Translated through TTBR0, each process has its own tables for this range.
+// Everything above it goes through TTBR1, which is shared by every process
+static constexpr uintptr_t USER_VIRT_END_ADDR =     0x40000000;
+static constexpr uintptr_t HIGH_VECTORS_ADDR =      0xffff0000;
+
+static constexpr Range user_area = { 0, USER_VIRT_END_ADDR };
+// Where anonymous mmaps go when the process doesn't ask for an address, the
+// heap grows up to this from the end of the executable and the stacks of
+// the threads grow down from the end of the user area
+static constexpr Range user_mmap = { 0x10000000, 0x30000000 };
 static constexpr Range kernel_area = { KERNEL_VIRT_START_ADDR, 0xffffffff };
 static constexpr Range kernel_code = Range::from_start_and_size(kernel_area.start, 16 * _1MB);
 static constexpr Range peripherals = Range::from_start_and_size(kernel_code.end, 32 * _1MB);
 static constexpr Range kernel_heap = Range {peripherals.end, PHYS_MEM_START_ADDR};
-static constexpr Range physical_mem = Range::from_start_and_size(PHYS_MEM_START_ADDR, 512 * _1MB);
+static constexpr Range physical_mem = Range::from_start_and_size(PHYS_MEM_START_ADDR, 511 * _1MB);
+// The last MB is left for the exception vectors
+static constexpr Range high_vectors = Range { physical_mem.end, 0xffffffff };
 
 }
@@ -0,0 +1,119 @@
+#include <kernel/vfs/vfs.h>
+#include "imagecache.h"
+
+// #define LOG_ENABLED
+#define LOG_TAG "IMGCACHE"
+#include <kernel/log.h>
+
+
+static struct {
+    // There is one segment for each read-only mapping of the programs that
+    // are currently running, a list is good enough
+    IntrusiveLinkedList<ImageSegment> segments;
+} s_imagecache;
+
+static size_t segment_page_count(ImageSegment const *segment)
+{
+    return segment->size / _4KB;
+}
+
+static size_t segment_page_index(ImageSegment const *segment, size_t offset)
+{
+    kassert(offset < segment->size);
+    return offset / _4KB;
+}
+
+ImageSegment *imagecache_get(
+    FileCustody *file,
+    size_t size,
+    uint64_t file_offset,
+    size_t data_offset,
+    size_t data_size
+)
+{
+    Inode const *inode = file->inode;
+    auto *segment = s_imagecache.segments.find([&](ImageSegment *s) {
+        return s->filesystem == inode->filesystem &&
+            s->identifier == inode->identifier &&
+            s->modification_time.seconds == inode->modification_time.seconds &&
+            s->modification_time.nanoseconds == inode->modification_time.nanoseconds &&
+            s->size == size &&
+            s->file_offset == file_offset &&
+            s->data_offset == data_offset && s->data_size == data_size;
+    });
+    if (segment != nullptr)
+        return imagecache_ref(segment);
+
+    segment = static_cast<ImageSegment*>(malloc(sizeof(ImageSegment)));
+    if (segment == nullptr)
+        return nullptr;
+
+    *segment = ImageSegment {
+        .prev = nullptr,
+        .next = nullptr,
+        .filesystem = inode->filesystem,
+        .identifier = inode->identifier,
+        .modification_time = inode->modification_time,
+        .size = size,
+        .file_offset = file_offset,
+        .data_offset = data_offset,
+        .data_size = data_size,
+        .refcount = 1,
+        .pages = nullptr,
+    };
+    segment->pages = static_cast<PhysicalPage**>(calloc(segment_page_count(segment), sizeof(PhysicalPage*)));
+    if (segment->pages == nullptr) {
+        free(segment);
+        return nullptr;
+    }
+
+    LOGD("New segment of %u bytes at file offset %u", size, (uint32_t) file_offset);
+    s_imagecache.segments.add(segment);
+    return segment;
+}
+
+ImageSegment *imagecache_ref(ImageSegment *segment)
+{
+    kassert(segment->refcount > 0);
+    segment->refcount++;
+    return segment;
+}
+
+void imagecache_put(ImageSegment *segment)
+{
+    kassert(segment->refcount > 0);
+    if (--segment->refcount > 0)
+        return;
+
+    LOGD("Dropping segment of %u bytes at file offset %u", segment->size, (uint32_t) segment->file_offset);
+    s_imagecache.segments.remove(segment);
+    for (size_t i = 0; i < segment_page_count(segment); i++) {
+        if (segment->pages[i] != nullptr)
+            MUST(physical_page_free(segment->pages[i], PageOrder::_4KB));
+    }
+    free(segment->pages);
+    free(segment);
+}
+
+PhysicalPage *imagecache_find_page(ImageSegment *segment, size_t offset)
+{
+    PhysicalPage *page = segment->pages[segment_page_index(segment, offset)];
+    if (page != nullptr)
+        page->ref_count++;
+
+    return page;
+}
+
+PhysicalPage *imagecache_add_page(ImageSegment *segment, size_t offset, PhysicalPage *page)
+{
+    auto &slot = segment->pages[segment_page_index(segment, offset)];
+    if (slot != nullptr) {
+        MUST(physical_page_free(page, PageOrder::_4KB));
+        slot->ref_count++;
+        return slot;
+    }
+
+    page->ref_count++;
+    slot = page;
+    return page;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <kernel/base.h>
+#include <kernel/lib/intrusivelinkedlist.h>
+#include <kernel/memory/physicalalloc.h>
+#include <kernel/vfs/fs.h>
+
+
+struct FileCustody;
+
+/**
+ * The pages of a read-only file mapping (e.g. the text of an executable),
+ * shared by every address space that maps the same range of the same file.
+ *
+ * A segment is identified by the inode, its modification time and the
+ * layout of the mapping relative to its start, so a file that changed on
+ * disk gets a new one while the same file mapped at different addresses
+ * shares the same pages.
+ * The cache holds one reference to each page it knows about and every
+ * mapping of the page holds another: when the last region using the
+ * segment goes away the cache drops its own references, so pages are
+ * freed as soon as nobody maps them anymore.
+*/
+struct ImageSegment {
+    INTRUSIVE_LINKED_LIST_HEADER(ImageSegment);
+
+    Filesystem *filesystem;
+    InodeIdentifier identifier;
+    api::TimeSpec modification_time;
+    size_t size;
+    uint64_t file_offset;
+    size_t data_offset;
+    size_t data_size;
+
+    int refcount;
+    PhysicalPage **pages;
+};
+
+/**
+ * \brief Finds, or creates, the shared pages for a read-only mapping of 'file'
+ * The mapping is 'size' bytes long and has 'data_size' bytes of the file, starting
+ * at 'file_offset', placed 'data_offset' bytes after its start (see \ref vm_map_file)
+ * \return The segment with a reference for the caller, nullptr if out of memory
+*/
+ImageSegment *imagecache_get(
+    FileCustody *file,
+    size_t size,
+    uint64_t file_offset,
+    size_t data_offset,
+    size_t data_size
+);
+
+ImageSegment *imagecache_ref(ImageSegment*);
+
+void imagecache_put(ImageSegment*);
+
+/**
+ * \return The page 'offset' bytes into the segment with a reference for the caller,
+ *         nullptr if nobody read it yet
+*/
+PhysicalPage *imagecache_find_page(ImageSegment*, size_t offset);
+
+/**
+ * \brief Shares a freshly read page, the cache takes its own reference to it
+ * If another thread added the same page in the meantime, the caller's page
+ * is released and the cached one is returned instead
+ * \return The page the caller should map, with a reference for the caller
+*/
+PhysicalPage *imagecache_add_page(ImageSegment*, size_t offset, PhysicalPage*);
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <kernel/memory/areas.h>
 #include <kernel/memory/physicalalloc.h>
+#include <kernel/memory/shrinker.h>
 #include <kernel/memory/vm.h>
 
 
@@ -9,43 +10,108 @@
 #define LOG_TAG "BRK"
 #include <kernel/log.h>
 
-static uintptr_t g_last_mapped_chunk = areas::kernel_heap.start;
+static uintptr_t g_mapped_end = areas::kernel_heap.start;
 static uintptr_t g_brk = areas::kernel_heap.start;
 
-static size_t CHUNK_SIZE = 4 * _1KB;
+// The heap grows a large page at a time, so that it needs fewer TLB entries
+static constexpr size_t CHUNK_SIZE = _64KB;
+static constexpr size_t PAGES_PER_CHUNK = CHUNK_SIZE / _4KB;
+static_assert(areas::kernel_heap.start % CHUNK_SIZE == 0);
 
-static Error brk(uintptr_t new_brk)
+/**
+ * \brief Unmaps the heap pages between 'start' and 'end' and frees them
+*/
+static void unmap_pages(uintptr_t start, uintptr_t end)
 {
-    LOGD("Moving brk from %p to brk: %p", g_brk, new_brk);
-    if (new_brk < areas::kernel_heap.start || new_brk > areas::kernel_heap.end)
-        return BadParameters;
+    for (uintptr_t addr = start; addr < end; addr += _4KB) {
+        uintptr_t previously_mapped_physical_address = 0;
 
-    auto must_be_mapped_up_to = round_down<uintptr_t>(new_brk, CHUNK_SIZE);
-    if (g_last_mapped_chunk < must_be_mapped_up_to) {
-        auto chunks_to_add = (must_be_mapped_up_to - g_last_mapped_chunk) / CHUNK_SIZE;
+        MUST(vm_unmap(vm_current_address_space(), addr, previously_mapped_physical_address));
+        if (previously_mapped_physical_address != 0)
+            MUST(physical_page_free(addr2page(previously_mapped_physical_address), PageOrder::_4KB));
+        LOGD("Unmapping page %p from %p", previously_mapped_physical_address, addr);
+    }
+}
 
-        for (size_t i = 0; i < chunks_to_add; i++) {
-            struct PhysicalPage* page;
+/**
+ * \brief Maps a chunk of the heap at 'virt_addr' as a single large page
+ * Fails if there is not enough contiguous memory for it, nothing is left mapped then
+*/
+static Error map_chunk(uintptr_t virt_addr)
+{
+    auto& as = vm_current_address_space();
 
-            MUST(physical_page_alloc(PageOrder::_4KB, page));
-            LOGD("Mapping page %p at %p", page2addr(page), g_last_mapped_chunk + CHUNK_SIZE);
-            MUST(vm_map(vm_current_address_space(), page, g_last_mapped_chunk + CHUNK_SIZE, PageAccessPermissions::PriviledgedOnly));
+    PhysicalPage *first_page;
+    TRY(physical_page_alloc_contiguous(PAGES_PER_CHUNK, first_page));
 
-            g_last_mapped_chunk += CHUNK_SIZE;
+    LOGD("Mapping pages %p at %p", page2addr(first_page), virt_addr);
+    Error rc = vm_map_contiguous(as, page2addr(first_page), virt_addr, CHUNK_SIZE, PageAccessPermissions::PriviledgedOnly);
+    if (!rc.is_success()) {
+        for (uintptr_t addr = virt_addr; addr < virt_addr + CHUNK_SIZE; addr += _4KB) {
+            uintptr_t previously_mapped_physical_address;
+            MUST(vm_unmap(as, addr, previously_mapped_physical_address));
         }
-    } else if (must_be_mapped_up_to < g_last_mapped_chunk) {
-        auto chunks_to_remove = (g_last_mapped_chunk - must_be_mapped_up_to) / CHUNK_SIZE;
+        physical_page_free_contiguous(first_page, PAGES_PER_CHUNK);
+    }
+
+    return rc;
+}
 
-        for (size_t i = 0; i < chunks_to_remove; i++) {
-            struct PhysicalPage* to_free;
-            uintptr_t previously_mapped_physical_address = 0;
+static Error map_page(uintptr_t virt_addr)
+{
+    PhysicalPage *page;
+    TRY(physical_page_alloc(PageOrder::_4KB, page));
 
-            MUST(vm_unmap(vm_current_address_space(), g_last_mapped_chunk, previously_mapped_physical_address));
-            to_free = addr2page(previously_mapped_physical_address);
-            MUST(physical_page_free(to_free, PageOrder::_4KB));
-            LOGD("Unmapping page %p from %p", previously_mapped_physical_address, g_last_mapped_chunk);
+    LOGD("Mapping page %p at %p", page2addr(page), virt_addr);
+    Error rc = vm_map(vm_current_address_space(), page, virt_addr, PageAccessPermissions::PriviledgedOnly);
+    if (!rc.is_success())
+        MUST(physical_page_free(page, PageOrder::_4KB));
 
-            g_last_mapped_chunk -= CHUNK_SIZE;
+    return rc;
+}
+
+/**
+ * \brief Maps the heap up to 'end', which is page aligned
+ * Whole chunks are used where they fit, when memory is too fragmented for them
+ * only the pages that are needed are mapped. On failure, the heap is left as it was
+*/
+static Error grow_heap(uintptr_t end)
+{
+    uintptr_t old_mapped_end = g_mapped_end;
+    while (g_mapped_end < end) {
+        if (g_mapped_end % CHUNK_SIZE == 0 && g_mapped_end + CHUNK_SIZE <= areas::kernel_heap.end && map_chunk(g_mapped_end).is_success()) {
+            g_mapped_end += CHUNK_SIZE;
+            continue;
+        }
+
+        if (Error rc = map_page(g_mapped_end); !rc.is_success()) {
+            unmap_pages(old_mapped_end, g_mapped_end);
+            g_mapped_end = old_mapped_end;
+            return rc;
+        }
+        g_mapped_end += _4KB;
+    }
+
+    return Success;
+}
+
+static Error brk(uintptr_t new_brk)
+{
+    LOGD("Moving brk from %p to brk: %p", g_brk, new_brk);
+    if (new_brk < areas::kernel_heap.start || new_brk > areas::kernel_heap.end)
+        return BadParameters;
+
+    auto must_be_mapped_up_to = round_up<uintptr_t>(new_brk, _4KB);
+    if (g_mapped_end < must_be_mapped_up_to) {
+        // Out of memory is not fatal: malloc returns nullptr, and callers like
+        // zram have a fallback for exactly this
+        TRY(grow_heap(must_be_mapped_up_to));
+    } else {
+        // Only whole chunks go away, the large pages are never split
+        auto can_be_unmapped_from = round_up<uintptr_t>(new_brk, CHUNK_SIZE);
+        if (can_be_unmapped_from < g_mapped_end) {
+            unmap_pages(can_be_unmapped_from, g_mapped_end);
+            g_mapped_end = can_be_unmapped_from;
         }
     }
 
@@ -71,7 +137,8 @@ extern "C" void* _sbrk(int incr)
     uintptr_t addr;
     auto err = sbrk(incr, addr);
     if (!err.is_success()) {
-        return nullptr;
+        // Like sbrk(2): newlib's malloc looks for -1, then returns nullptr itself
+        return reinterpret_cast<void*>(-1);
     }
 
     return reinterpret_cast<void*>(addr);
@@ -79,17 +146,14 @@ extern "C" void* _sbrk(int incr)
 
 Error kheap_init()
 {
-    struct PhysicalPage* first_page;
-
-    TRY(physical_page_alloc(PageOrder::_4KB, first_page));
-    MUST(vm_map(vm_current_address_space(), first_page, g_last_mapped_chunk, PageAccessPermissions::PriviledgedOnly));
-
-    return Success;
+    return grow_heap(areas::kernel_heap.start + CHUNK_SIZE);
 }
 
 Error _kmalloc(size_t size, uintptr_t& address)
 {
     void *addr = malloc(size);
+    while (addr == nullptr && shrinker_reclaim(SHRINKER_RECLAIM_BATCH) > 0)
+        addr = malloc(size);
     if (addr == nullptr)
         return OutOfMemory;
 
@@ -97,6 +161,15 @@ Error _kmalloc(size_t size, uintptr_t& address)
     return Success;
 }
 
+void *mustmalloc(size_t size)
+{
+    uintptr_t address;
+    if (!_kmalloc(size, address).is_success())
+        panic("malloc failed\n");
+
+    return reinterpret_cast<void*>(address);
+}
+
 Error _kfree(uintptr_t address)
 {
     free(reinterpret_cast<void*>(address));
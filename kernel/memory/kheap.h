@@ -7,14 +7,7 @@
 
 Error kheap_init();
 
-static inline void *mustmalloc(size_t size)
-{
-    void *ptr = malloc(size);
-    if (ptr == nullptr) {
-        panic("malloc failed\n");
-    }
-    return ptr;
-}
+void *mustmalloc(size_t size);
 
 Error _kmalloc(size_t size, uintptr_t& address);
 Error _kfree(uintptr_t address);
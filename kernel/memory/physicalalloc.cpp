@@ -1,4 +1,5 @@
 #include <kernel/base.h>
+#include <kernel/locking/irqlock.h>
 #include <kernel/memory/areas.h>
 #include <kernel/memory/physicalalloc.h>
 #include <kernel/memory/vm.h>
@@ -8,6 +9,22 @@
 #include <kernel/log.h>
 
 
+/* The pool is refilled up to the high watermark once it drops below the low one */
+#ifndef CONFIG_ZERO_POOL_LOW_WATERMARK
+#define CONFIG_ZERO_POOL_LOW_WATERMARK 32
+#endif
+
+#ifndef CONFIG_ZERO_POOL_HIGH_WATERMARK
+#define CONFIG_ZERO_POOL_HIGH_WATERMARK 128
+#endif
+
+/* The pool is not refilled when there are less than these many KBs of free memory */
+#ifndef CONFIG_ZERO_POOL_MIN_FREE_KB
+#define CONFIG_ZERO_POOL_MIN_FREE_KB 4096
+#endif
+
+static_assert(CONFIG_ZERO_POOL_LOW_WATERMARK <= CONFIG_ZERO_POOL_HIGH_WATERMARK);
+
 struct {
     PhysicalPage* data;
     size_t len;
@@ -15,41 +32,35 @@ struct {
 
 static uintptr_t s_physical_ram_starting_address;
 
-struct PhysicalPage* g_free_pages_lists[] = {
-    [static_cast<size_t>(PageOrder::_1KB)] = nullptr,
-    [static_cast<size_t>(PageOrder::_4KB)] = nullptr,
-    [static_cast<size_t>(PageOrder::_16KB)] = nullptr,
-};
-
-static PageOrder bigger_order(PageOrder order)
-{
-    switch (order) {
-    case PageOrder::_1KB:
-        return PageOrder::_4KB;
-    case PageOrder::_4KB:
-        return PageOrder::_16KB;
-    case PageOrder::_16KB:
-        panic("bigger_order: order=_16KB");
-        break;
-    }
-
-    kassert_not_reached();
-}
-
-static PageOrder smaller_order(PageOrder order)
-{
-    switch (order) {
-    case PageOrder::_1KB:
-        panic("smaller_order: order=_1KB");
-        break;
-    case PageOrder::_4KB:
-        return PageOrder::_1KB;
-    case PageOrder::_16KB:
-        return PageOrder::_4KB;
-    }
-
-    kassert_not_reached();
-}
+/**
+ * Binary buddy allocator: a free block of order N can be split in two
+ * buddies of order N-1, whose frame indices only differ by bit N-1, and
+ * they are merged back as soon as both are free again.
+ * Blocks are aligned to their own size relative to the start of RAM.
+ * The lists are only touched with interrupts disabled, since pages can
+ * be given back from interrupt context (e.g. by the slab caches).
+*/
+static struct {
+    IntrusiveLinkedList<PhysicalPage> free_lists[PAGE_ORDER_COUNT];
+    size_t free_blocks[PAGE_ORDER_COUNT];
+} s_buddy;
+
+/**
+ * 4KB pages that were zeroed while the CPU had nothing better to do.
+ * They are taken out of the buddy allocator, but they still count as
+ * free memory: when an allocation fails they are given back to it.
+*/
+static struct {
+    IntrusiveLinkedList<PhysicalPage> pages;
+    size_t count;
+    bool refilling;
+    size_t hits;
+    size_t misses;
+} s_zero_pool;
+
+static constexpr size_t FRAMES_PER_4KB_PAGE = _4KB / _1KB;
+
+static constexpr size_t order2frames(size_t order) { return static_cast<size_t>(1) << order; }
 
 struct PhysicalPage* addr2page(uintptr_t addr)
 {
@@ -66,53 +77,26 @@ uintptr_t page2addr(struct PhysicalPage* page) {
 }
 static size_t page2array_index(struct PhysicalPage* page) { return page - g_pages.data; }
 
-static void append_page_to_free_pages_list(struct PhysicalPage* page, PageOrder order)
+static void push_free_block(size_t idx, size_t order)
 {
-    kassert(page != nullptr);
-    kassert(page->next == nullptr);
-
-    page->next = g_free_pages_lists[static_cast<size_t>(order)];
-    g_free_pages_lists[static_cast<size_t>(order)] = page;
-}
-
-static struct PhysicalPage* pop_page_from_free_pages_list(PageOrder order)
-{
-    kassert(g_free_pages_lists[static_cast<size_t>(order)] != nullptr);
-
-    auto* page = g_free_pages_lists[static_cast<size_t>(order)];
-    g_free_pages_lists[static_cast<size_t>(order)] = page->next;
-    page->next = nullptr;
-
+    auto *page = &g_pages.data[idx];
+    kassert(page->free_order == PAGE_NOT_FREE);
     kassert(page->ref_count == 0);
 
-    return page;
+    page->free_order = order;
+    s_buddy.free_lists[order].add(page);
+    s_buddy.free_blocks[order]++;
 }
 
-static void remove_page_from_free_pages_list(struct PhysicalPage* page, PageOrder order)
+static void remove_free_block(PhysicalPage *page)
 {
-    kassert(page != nullptr);
-
-    if (g_free_pages_lists[static_cast<size_t>(order)] == nullptr)
-        return;
-
-    if (g_free_pages_lists[static_cast<size_t>(order)] == page) {
-        g_free_pages_lists[static_cast<size_t>(order)] = page->next;
-        page->next = nullptr;
-        return;
-    }
+    size_t order = page->free_order;
+    kassert(order < PAGE_ORDER_COUNT);
 
-    auto* prev = g_free_pages_lists[static_cast<size_t>(order)];
-    while (prev->next != nullptr) {
-        if (prev->next == page) {
-            prev->next = page->next;
-            page->next = nullptr;
-            return;
-        }
-
-        prev = prev->next;
-    }
-
-    kassert_not_reached();
+    s_buddy.free_lists[order].remove(page);
+    s_buddy.free_blocks[order]--;
+    page->free_order = PAGE_NOT_FREE;
+    page->prev = page->next = nullptr;
 }
 
 Error physical_page_allocator_init(BootParams const *boot_params)
@@ -131,160 +115,237 @@ Error physical_page_allocator_init(BootParams const *boot_params)
     g_pages.data = reinterpret_cast<PhysicalPage*>(start_of_pages_data_addr);
 
     memset(g_pages.data, 0, g_pages.len * sizeof(PhysicalPage));
+    for (size_t i = 0; i < g_pages.len; i++)
+        g_pages.data[i].free_order = PAGE_NOT_FREE;
+
+    // Cover the free memory with the biggest blocks that fit
+    size_t idx = (end_of_pages_data_addr - areas::physical_mem.start) / _1KB;
+    while (idx < g_pages.len) {
+        size_t order = PAGE_ORDER_COUNT - 1;
+        while (idx % order2frames(order) != 0 || idx + order2frames(order) > g_pages.len)
+            order--;
+
+        push_free_block(idx, order);
+        idx += order2frames(order);
+    }
 
-    auto idx_step = _16KB / _1KB;
-    auto first_free_page_idx = (end_of_pages_data_addr - areas::physical_mem.start) / _1KB;
-    auto last_free_page_idx = total_physical_memory_size / _1KB - idx_step;
+    return Success;
+}
 
-    for (auto i = last_free_page_idx; i >= first_free_page_idx; i -= idx_step) {
-        g_pages.data[i].next = g_free_pages_lists[static_cast<size_t>(PageOrder::_16KB)];
-        g_free_pages_lists[static_cast<size_t>(PageOrder::_16KB)] = &g_pages.data[i];
+/**
+ * \brief Takes the smallest free block that fits 'order' and splits it down to that size
+*/
+static Error _physical_page_alloc(size_t order, size_t& out_idx)
+{
+    size_t found = order;
+    while (found < PAGE_ORDER_COUNT && s_buddy.free_lists[found].first() == nullptr)
+        found++;
+    if (found == PAGE_ORDER_COUNT)
+        return OutOfMemory;
+
+    auto *page = s_buddy.free_lists[found].first();
+    remove_free_block(page);
+    size_t idx = page2array_index(page);
+
+    // The upper halves we don't need go back to the free lists
+    while (found > order) {
+        found--;
+        push_free_block(idx + order2frames(found), found);
     }
 
+    out_idx = idx;
     return Success;
 }
 
-static void split_page_in_smaller_chunks(PhysicalPage* page, PageOrder page_order)
+static void _physical_page_free(size_t idx, size_t order);
+
+static PhysicalPage *zero_pool_pop()
 {
-    kassert(page != nullptr);
-    kassert(page->next == nullptr);
-    kassert(page_order != PageOrder::_1KB);
-
-    auto chunks_order = smaller_order(page_order);
-    auto page_size = order2page_size(chunks_order);
-
-    struct PhysicalPage* buddies[4] = {
-        addr2page(page2addr(page) + 0 * page_size),
-        addr2page(page2addr(page) + 1 * page_size),
-        addr2page(page2addr(page) + 2 * page_size),
-        addr2page(page2addr(page) + 3 * page_size),
-    };
-    for (auto i = 0; i < 4; i++) {
-        append_page_to_free_pages_list(buddies[i], chunks_order);
+    auto *page = s_zero_pool.pages.pop();
+    if (page != nullptr) {
+        page->prev = page->next = nullptr;
+        s_zero_pool.count--;
     }
+    return page;
 }
 
-static Error _physical_page_alloc(PageOrder order, PhysicalPage*& out_page)
+/**
+ * \brief Like \ref _physical_page_alloc, but falls back to the zeroed pages
+ * if that is the only way to satisfy the request
+*/
+static Error _physical_page_alloc_or_drain(size_t order, size_t& out_idx)
 {
-    switch (order) {
-    case PageOrder::_16KB:
-        if (g_free_pages_lists[static_cast<size_t>(PageOrder::_16KB)] == nullptr) {
-            return OutOfMemory;
-        }
-
-        break;
-    case PageOrder::_4KB:
-        if (g_free_pages_lists[static_cast<size_t>(PageOrder::_4KB)] == nullptr) {
-            struct PhysicalPage* bigger_page;
-            TRY(_physical_page_alloc(PageOrder::_16KB, bigger_page));
-            split_page_in_smaller_chunks(bigger_page, PageOrder::_16KB);
-        }
-
-        break;
-    case PageOrder::_1KB:
-        if (g_free_pages_lists[static_cast<size_t>(PageOrder::_1KB)] == nullptr) {
-            struct PhysicalPage* bigger_page;
-            TRY(_physical_page_alloc(PageOrder::_4KB, bigger_page));
-            split_page_in_smaller_chunks(bigger_page, PageOrder::_4KB);
-        }
-
-        break;
-    default:
-        kassert_not_reached();
+    while (true) {
+        Error rc = _physical_page_alloc(order, out_idx);
+        if (rc.is_success())
+            return rc;
+
+        auto *page = zero_pool_pop();
+        if (page == nullptr)
+            return rc;
+        _physical_page_free(page2array_index(page), static_cast<size_t>(PageOrder::_4KB));
     }
-
-    out_page = pop_page_from_free_pages_list(order);
-
-    return Success;
 }
 
 Error physical_page_alloc(PageOrder order, PhysicalPage*& out_page)
 {
-    TRY(_physical_page_alloc(order, out_page));
+    size_t idx;
+    auto lock = irq_lock();
+    Error rc = _physical_page_alloc_or_drain(static_cast<size_t>(order), idx);
+    if (!rc.is_success()) {
+        release(lock);
+        return rc;
+    }
+    out_page = &g_pages.data[idx];
     out_page->ref_count = 1;
+    release(lock);
     LOGD("Allocated page %p", page2addr(out_page));
 
     return Success;
 }
 
-static Error _physical_page_free(PhysicalPage* page, PageOrder order)
+/**
+ * \brief Gives back a block, merging it with its buddy for as long as that is free too
+*/
+static void _physical_page_free(size_t idx, size_t order)
 {
-    kassert(page != nullptr);
-    LOGD("Freeing page %p", page2addr(page));
+    LOGD("Freeing page %p", page2addr(&g_pages.data[idx]));
+    kassert(idx % order2frames(order) == 0);
 
-    if (order == PageOrder::_16KB) {
-        append_page_to_free_pages_list(page, PageOrder::_16KB);
-        return Success;
-    }
+    while (order + 1 < PAGE_ORDER_COUNT) {
+        size_t buddy_idx = idx ^ order2frames(order);
+        if (buddy_idx + order2frames(order) > g_pages.len)
+            break;
 
-    size_t page_index_in_array = page2array_index(page);
-    size_t distance_between_buddies = order2page_size(order) / _1KB;
-    size_t first_buddy_index_in_array = round_down(page_index_in_array, 4 * distance_between_buddies);
-
-    bool all_buddies_free = true;
-    for (auto i = 0; i < 4; i++) {
-        auto* this_buddy = &g_pages.data[first_buddy_index_in_array + i * distance_between_buddies];
-        kassert(this_buddy->ref_count >= 0);
-        
-        /**
-         * Note that to check if a page is free we cannot rely on the ref_count, because
-         * for example if we are freeing a 4KB page then the ref_count of the page struct
-         * at its index might be 0, but that's because the full page has been split in 4 smaller
-         * ones and one of them is still in use.
-         */
-        if (this_buddy->next == nullptr) {
-            all_buddies_free = false;
+        // Reserved memory is never tagged as free, so it never gets merged
+        auto *buddy = &g_pages.data[buddy_idx];
+        if (buddy->free_order != order)
             break;
-        }
-    }
 
-    if (!all_buddies_free) {
-        append_page_to_free_pages_list(page, order);
-    } else {
-        for (int i = 0; i < 4; i++) {
-            auto page_idx = first_buddy_index_in_array + i * distance_between_buddies;
-
-            // Skip because the page we're freeing now was not yet placed in any free list
-            if (page_idx == page_index_in_array)
-                continue;
-            
-            // FIXME: It's inefficient to iterate over the list all over
-            remove_page_from_free_pages_list(&g_pages.data[page_idx], order);
-        }
-        struct PhysicalPage* bigger_page = &g_pages.data[first_buddy_index_in_array];
-        _physical_page_free(bigger_page, bigger_order(order));
+        remove_free_block(buddy);
+        idx = min(idx, buddy_idx);
+        order++;
     }
 
-    return Success;
+    push_free_block(idx, order);
 }
 
 Error physical_page_free(PhysicalPage* page, PageOrder order)
 {
+    auto lock = irq_lock();
     kassert(page->ref_count > 0);
     page->ref_count--;
     LOGD("Decrementing refcount for physical page %p (new refcount: %" PRId32 ")\n", page2addr(page), page->ref_count);
 
-    if (page->ref_count == 0) {
-        TRY(_physical_page_free(page, order));
+    if (page->ref_count == 0)
+        _physical_page_free(page2array_index(page), static_cast<size_t>(order));
+    release(lock);
+
+    return Success;
+}
+
+Error physical_page_alloc_contiguous(size_t count, PhysicalPage*& first_page)
+{
+    kassert(count > 0);
+
+    size_t order = static_cast<size_t>(PageOrder::_4KB);
+    while (order2frames(order) < count * FRAMES_PER_4KB_PAGE) {
+        if (++order == PAGE_ORDER_COUNT)
+            return OutOfMemory;
     }
 
+    size_t idx;
+    auto lock = irq_lock();
+    if (Error rc = _physical_page_alloc_or_drain(order, idx); !rc.is_success()) {
+        release(lock);
+        return rc;
+    }
+
+    // Split the block in 4KB pages, the ones past 'count' are given back right away
+    for (size_t i = 0; i < order2frames(order); i += FRAMES_PER_4KB_PAGE) {
+        if (i < count * FRAMES_PER_4KB_PAGE)
+            g_pages.data[idx + i].ref_count = 1;
+        else
+            _physical_page_free(idx + i, static_cast<size_t>(PageOrder::_4KB));
+    }
+    release(lock);
+
+    first_page = &g_pages.data[idx];
     return Success;
 }
 
+void physical_page_free_contiguous(PhysicalPage *first_page, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        MUST(physical_page_free(first_page + i * FRAMES_PER_4KB_PAGE, PageOrder::_4KB));
+}
+
+Error physical_page_alloc_zeroed(PhysicalPage*& out_page)
+{
+    auto lock = irq_lock();
+    auto *page = zero_pool_pop();
+    if (page != nullptr) {
+        s_zero_pool.hits++;
+        page->ref_count = 1;
+        release(lock);
+        out_page = page;
+        return Success;
+    }
+    s_zero_pool.misses++;
+    release(lock);
+
+    TRY(physical_page_alloc(PageOrder::_4KB, page));
+    memset(reinterpret_cast<void*>(phys2virt(page2addr(page))), 0, _4KB);
+    out_page = page;
+    return Success;
+}
+
+static size_t free_memory_kb()
+{
+    size_t free_kb = 0;
+    for (size_t order = 0; order < PAGE_ORDER_COUNT; order++)
+        free_kb += s_buddy.free_blocks[order] * order2frames(order);
+    return free_kb;
+}
+
+bool physical_page_refill_zero_pool()
+{
+    auto lock = irq_lock();
+    if (s_zero_pool.count < CONFIG_ZERO_POOL_LOW_WATERMARK)
+        s_zero_pool.refilling = true;
+    if (s_zero_pool.count >= CONFIG_ZERO_POOL_HIGH_WATERMARK || free_memory_kb() < CONFIG_ZERO_POOL_MIN_FREE_KB)
+        s_zero_pool.refilling = false;
+
+    size_t idx;
+    if (!s_zero_pool.refilling || !_physical_page_alloc(static_cast<size_t>(PageOrder::_4KB), idx).is_success()) {
+        release(lock);
+        return false;
+    }
+    release(lock);
+
+    // The page is neither free nor in the pool yet, nobody else can touch it
+    auto *page = &g_pages.data[idx];
+    memset(reinterpret_cast<void*>(phys2virt(page2addr(page))), 0, _4KB);
+
+    lock = irq_lock();
+    s_zero_pool.pages.add(page);
+    s_zero_pool.count++;
+    release(lock);
+
+    return true;
+}
+
 void physical_page_print_statistics()
 {
-    const auto& count_items = [](auto& list) {
-        size_t count = 0;
-        for (auto* page = list; page != nullptr; page = page->next)
-            count++;
-        return count;
-    };
+    size_t free_bytes = 0;
 
     kprintf("Physical memory allocator statistics:\n");
-    kprintf("  Total 1KB pages: %d\n", g_pages.len);
-    kprintf("  Total 4KB pages: %d\n", g_pages.len / 16);
-    kprintf("  Total 16KB pages: %d\n", g_pages.len / 64);
-    kprintf("  Free 1KB pages: %d\n", count_items(g_free_pages_lists[static_cast<size_t>(PageOrder::_1KB)]));
-    kprintf("  Free 4KB pages: %d\n", count_items(g_free_pages_lists[static_cast<size_t>(PageOrder::_4KB)]));
-    kprintf("  Free 16KB pages: %d\n", count_items(g_free_pages_lists[static_cast<size_t>(PageOrder::_16KB)]));
+    kprintf("  Total memory: %d KB\n", g_pages.len);
+    for (size_t order = 0; order < PAGE_ORDER_COUNT; order++) {
+        size_t block_size = order2page_size(static_cast<PageOrder>(order));
+        kprintf("  Free %dKB blocks: %d\n", block_size / _1KB, s_buddy.free_blocks[order]);
+        free_bytes += s_buddy.free_blocks[order] * block_size;
+    }
+    kprintf("  Free memory: %d KB\n", free_bytes / _1KB);
+    kprintf("  Zeroed pages: %d (%d hits, %d misses)\n", s_zero_pool.count, s_zero_pool.hits, s_zero_pool.misses);
 }
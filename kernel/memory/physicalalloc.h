@@ -2,32 +2,52 @@
 
 #include <kernel/base.h>
 #include <kernel/boot/boot.h>
+#include <kernel/lib/intrusivelinkedlist.h>
 #include <stdint.h>
 
 
+/**
+ * There is one of these for every 1KB of RAM.
+ * Blocks of any order are made of consecutive frames, only the first
+ * frame of a block is used to track it.
+*/
 struct PhysicalPage {
+    // Links in the free list of 'free_order', or in the pool of zeroed pages,
+    // only valid while the block is free
+    INTRUSIVE_LINKED_LIST_HEADER(PhysicalPage);
+
     int32_t ref_count;
-    struct PhysicalPage* next;
+    // The order of the free block that starts here, PAGE_NOT_FREE otherwise
+    uint8_t free_order;
 };
 
+static constexpr uint8_t PAGE_NOT_FREE = 0xff;
+
+/**
+ * Block sizes supported by the buddy allocator, each order is twice as big as the previous one
+*/
 enum class PageOrder {
     _1KB,
+    _2KB,
     _4KB,
-    _16KB
+    _8KB,
+    _16KB,
+    _32KB,
+    _64KB,
+    _128KB,
+    _256KB,
+    _512KB,
+    _1MB,
+    _2MB,
+    _4MB,
+    _8MB,
 };
 
-static inline size_t order2page_size(PageOrder order)
+static constexpr size_t PAGE_ORDER_COUNT = static_cast<size_t>(PageOrder::_8MB) + 1;
+
+static inline constexpr size_t order2page_size(PageOrder order)
 {
-    switch (order) {
-    case PageOrder::_16KB:
-        return _16KB;
-    case PageOrder::_4KB:
-        return _4KB;
-    case PageOrder::_1KB:
-        return _1KB;
-    }
-
-    kassert(false);
+    return _1KB << static_cast<size_t>(order);
 }
 
 uintptr_t page2addr(struct PhysicalPage* page);
@@ -42,4 +62,29 @@ Error physical_page_alloc(PageOrder, PhysicalPage*&);
 
 Error physical_page_free(PhysicalPage*, PageOrder);
 
+/**
+ * \brief Allocates 'count' physically contiguous 4KB pages, e.g. for a DMA buffer
+ * Each page is then refcounted on its own as if it was allocated separately,
+ * they can be freed one by one or all together with \ref physical_page_free_contiguous
+*/
+Error physical_page_alloc_contiguous(size_t count, PhysicalPage*& first_page);
+
+void physical_page_free_contiguous(PhysicalPage *first_page, size_t count);
+
+/**
+ * \brief Allocates a 4KB page filled with zeroes
+ * The page comes from the pool of pre-zeroed pages if there are any,
+ * otherwise it is allocated and cleared on the spot.
+*/
+Error physical_page_alloc_zeroed(PhysicalPage*& out_page);
+
+/**
+ * \brief Zeroes one more page for the pool, if it needs it
+ * This is meant to be called when the CPU is idle: it does a single page
+ * at a time so the caller can go back to running threads as soon as
+ * there is something to do.
+ * \return true if a page was added to the pool, false if there is nothing to do
+*/
+bool physical_page_refill_zero_pool();
+
 void physical_page_print_statistics();
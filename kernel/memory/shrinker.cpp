@@ -0,0 +1,26 @@
+#include <kernel/memory/shrinker.h>
+
+// #define LOG_ENABLED
+#define LOG_TAG "SHRINKER"
+#include <kernel/log.h>
+
+
+static IntrusiveLinkedList<Shrinker> s_shrinkers;
+
+
+void shrinker_register(Shrinker *shrinker)
+{
+    s_shrinkers.append(shrinker);
+}
+
+size_t shrinker_reclaim(size_t count)
+{
+    size_t total = 0;
+    s_shrinkers.foreach([&](Shrinker *shrinker) {
+        size_t freed = shrinker->shrink(count);
+        LOGD("'%s' freed %" PRIu32 " objects", shrinker->name, static_cast<uint32_t>(freed));
+        total += freed;
+    });
+
+    return total;
+}
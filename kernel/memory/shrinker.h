@@ -0,0 +1,35 @@
+#pragma once
+
+#include <kernel/base.h>
+#include <kernel/lib/intrusivelinkedlist.h>
+
+
+/**
+ * A cache that can give back memory when the kernel runs out of it.
+ *
+ * The callback must only drop objects nobody is using and must not
+ * allocate memory itself.
+*/
+struct Shrinker {
+    INTRUSIVE_LINKED_LIST_HEADER(Shrinker);
+
+    const char *name;
+    /* Frees up to 'count' objects, returns how many it actually freed */
+    size_t (*shrink)(size_t count);
+};
+
+/**
+ * How many objects an allocation that failed asks the caches for at a time, it
+ * asks again while they keep freeing some: a single failure does not empty them all
+*/
+static constexpr size_t SHRINKER_RECLAIM_BATCH = 32;
+
+void shrinker_register(Shrinker*);
+
+/**
+ * \brief Asks every registered cache to drop up to 'count' unused objects
+ * Must not be called from inside the allocator, it is safe to call it after
+ * an allocation failed and before retrying it.
+ * \return How many objects were freed in total
+*/
+size_t shrinker_reclaim(size_t count);
@@ -0,0 +1,243 @@
+#include <kernel/arch/arch.h>
+#include <kernel/locking/irqlock.h>
+#include <kernel/memory/physicalalloc.h>
+#include <kernel/memory/shrinker.h>
+#include <kernel/memory/vm.h>
+#include "slab.h"
+
+// #define LOG_ENABLED
+#define LOG_TAG "SLAB"
+#include <kernel/log.h>
+
+
+static constexpr size_t MIN_OBJECTS_PER_SLAB = 8;
+static constexpr PageOrder MAX_SLAB_ORDER = PageOrder::_64KB;
+
+/**
+ * Lives at the start of its own memory, so an object finds its slab by
+ * rounding its address down to the slab size
+*/
+struct Slab {
+    INTRUSIVE_LINKED_LIST_HEADER(Slab);
+
+    SlabCache *cache;
+    PhysicalPage *page;
+    void *free_objects;
+    size_t in_use;
+};
+
+static struct {
+    IntrusiveLinkedList<SlabCache> caches;
+    bool shrinker_registered;
+} s_slab;
+
+static size_t slab_shrink(size_t count);
+
+static Shrinker s_slab_shrinker = {
+    .prev = nullptr,
+    .next = nullptr,
+    .name = "slab",
+    .shrink = slab_shrink,
+};
+
+static size_t slab_objects_offset(SlabCache const& cache)
+{
+    return round_up(sizeof(Slab), cache.align);
+}
+
+static void **object_link(SlabCache const& cache, void *object)
+{
+    return reinterpret_cast<void**>(static_cast<uint8_t*>(object) + cache.link_offset);
+}
+
+static void slab_cache_setup(SlabCache& cache)
+{
+    size_t size = max(cache.object_size, sizeof(void*));
+
+    // Small objects get the smallest power of two alignment that keeps them
+    // within a single cache line, bigger ones start at the beginning of a line
+    size_t align = 2 * sizeof(void*);
+    while (align < size && align < ARCH_CACHE_LINE_SIZE)
+        align *= 2;
+
+    // The free list link can overlap the object, unless it has to keep its constructed state
+    if (cache.ctor != nullptr) {
+        cache.link_offset = round_up(cache.object_size, sizeof(void*));
+        size = cache.link_offset + sizeof(void*);
+    } else {
+        cache.link_offset = 0;
+    }
+    cache.align = align;
+    cache.stride = round_up(size, align);
+
+    size_t order = static_cast<size_t>(PageOrder::_4KB);
+    while (true) {
+        cache.slab_order = order;
+        cache.slab_size = order2page_size(static_cast<PageOrder>(order));
+        cache.objects_per_slab = (cache.slab_size - slab_objects_offset(cache)) / cache.stride;
+        if (cache.objects_per_slab >= MIN_OBJECTS_PER_SLAB || order == static_cast<size_t>(MAX_SLAB_ORDER))
+            break;
+        order++;
+    }
+    kassert(cache.objects_per_slab > 0);
+
+    LOGD("Cache '%s': %u bytes objects, stride %u, %u objects per %uKB slab",
+        cache.name, cache.object_size, cache.stride, cache.objects_per_slab, cache.slab_size / _1KB);
+
+    cache.initialized = true;
+    s_slab.caches.append(&cache);
+    if (!s_slab.shrinker_registered) {
+        shrinker_register(&s_slab_shrinker);
+        s_slab.shrinker_registered = true;
+    }
+}
+
+static Slab *slab_create(SlabCache& cache)
+{
+    PhysicalPage *page;
+    if (!physical_page_alloc(static_cast<PageOrder>(cache.slab_order), page).is_success())
+        return nullptr;
+
+    // Blocks are aligned to their size, and so is their address in the linear mapping
+    auto *slab = reinterpret_cast<Slab*>(phys2virt(page2addr(page)));
+    kassert(reinterpret_cast<uintptr_t>(slab) % cache.slab_size == 0);
+    *slab = Slab {
+        .prev = nullptr,
+        .next = nullptr,
+        .cache = &cache,
+        .page = page,
+        .free_objects = nullptr,
+        .in_use = 0,
+    };
+
+    auto *objects = reinterpret_cast<uint8_t*>(slab) + slab_objects_offset(cache);
+    for (size_t i = cache.objects_per_slab; i > 0; i--) {
+        void *object = objects + (i - 1) * cache.stride;
+        if (cache.ctor != nullptr)
+            cache.ctor(object);
+        *object_link(cache, object) = slab->free_objects;
+        slab->free_objects = object;
+    }
+
+    cache.stats.slabs++;
+    return slab;
+}
+
+static void slab_destroy(SlabCache& cache, Slab *slab)
+{
+    kassert(slab->in_use == 0);
+    cache.stats.slabs--;
+    MUST(physical_page_free(slab->page, static_cast<PageOrder>(cache.slab_order)));
+}
+
+static void *slab_try_alloc(SlabCache& cache)
+{
+    auto lock = irq_lock();
+
+    if (!cache.initialized)
+        slab_cache_setup(cache);
+
+    Slab *slab = cache.partial_slabs.first();
+    if (slab == nullptr) {
+        slab = cache.empty_slabs.first();
+        if (slab != nullptr) {
+            cache.empty_slabs.remove(slab);
+        } else if (slab = slab_create(cache); slab == nullptr) {
+            release(lock);
+            return nullptr;
+        }
+        cache.partial_slabs.add(slab);
+    }
+
+    void *object = slab->free_objects;
+    slab->free_objects = *object_link(cache, object);
+    slab->in_use++;
+    if (slab->in_use == cache.objects_per_slab) {
+        cache.partial_slabs.remove(slab);
+        cache.full_slabs.add(slab);
+    }
+
+    cache.stats.allocations++;
+    cache.stats.active_objects++;
+
+    release(lock);
+    return object;
+}
+
+void *slab_alloc(SlabCache& cache)
+{
+    void *object = slab_try_alloc(cache);
+    while (object == nullptr && shrinker_reclaim(SHRINKER_RECLAIM_BATCH) > 0)
+        object = slab_try_alloc(cache);
+
+    return object;
+}
+
+void slab_free(SlabCache& cache, void *object)
+{
+    if (object == nullptr)
+        return;
+
+    auto lock = irq_lock();
+
+    auto *slab = reinterpret_cast<Slab*>(round_down(reinterpret_cast<uintptr_t>(object), cache.slab_size));
+    kassert(slab->cache == &cache);
+    kassert(slab->in_use > 0);
+
+    *object_link(cache, object) = slab->free_objects;
+    slab->free_objects = object;
+    if (slab->in_use-- == cache.objects_per_slab) {
+        cache.full_slabs.remove(slab);
+        cache.partial_slabs.add(slab);
+    }
+
+    // One empty slab is kept around, so that a cache whose objects come and
+    // go all the time (e.g. timers) does not hit the page allocator every time
+    if (slab->in_use == 0) {
+        cache.partial_slabs.remove(slab);
+        if (cache.empty_slabs.first() == nullptr)
+            cache.empty_slabs.add(slab);
+        else
+            slab_destroy(cache, slab);
+    }
+
+    cache.stats.frees++;
+    cache.stats.active_objects--;
+
+    release(lock);
+}
+
+static size_t slab_shrink(size_t count)
+{
+    size_t freed = 0;
+    auto lock = irq_lock();
+
+    s_slab.caches.foreach([&](SlabCache *cache) {
+        while (freed < count) {
+            Slab *slab = cache->empty_slabs.pop();
+            if (slab == nullptr)
+                break;
+            slab_destroy(*cache, slab);
+            freed++;
+        }
+    });
+
+    release(lock);
+    return freed;
+}
+
+void slab_print_statistics()
+{
+    kprintf("Slab caches:\n");
+    s_slab.caches.foreach([](SlabCache *cache) {
+        kprintf("  %-16s %5u active, %5u slabs of %3uKB (%u objects each), %u allocations, %u frees\n",
+            cache->name,
+            cache->stats.active_objects,
+            cache->stats.slabs,
+            cache->slab_size / _1KB,
+            cache->objects_per_slab,
+            cache->stats.allocations,
+            cache->stats.frees
+        );
+    });
+}
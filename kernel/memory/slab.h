@@ -0,0 +1,86 @@
+#pragma once
+
+#include <kernel/base.h>
+#include <kernel/lib/intrusivelinkedlist.h>
+
+
+struct Slab;
+
+/**
+ * A cache of objects that all have the same type.
+ *
+ * Objects are carved out of slabs, physically contiguous blocks taken
+ * straight from the page allocator, and go back to the free list of their
+ * slab when they are freed. They are aligned so that small objects never
+ * straddle a cache line and bigger ones start at the beginning of one.
+ *
+ * If the cache has a constructor it is only run when a slab is created:
+ * objects must be given back to the cache in their constructed state and
+ * are handed out again as they are.
+ *
+ * Objects can be freed from interrupt context.
+*/
+struct SlabCache {
+    INTRUSIVE_LINKED_LIST_HEADER(SlabCache);
+
+    const char *name;
+    size_t object_size;
+    void (*ctor)(void*);
+
+    // The layout is computed when the first slab is created
+    bool initialized;
+    size_t stride;
+    size_t align;
+    size_t link_offset;
+    size_t slab_order;
+    size_t slab_size;
+    size_t objects_per_slab;
+
+    IntrusiveLinkedList<Slab> partial_slabs;
+    IntrusiveLinkedList<Slab> full_slabs;
+    IntrusiveLinkedList<Slab> empty_slabs;
+
+    struct {
+        size_t allocations;
+        size_t frees;
+        size_t active_objects;
+        size_t slabs;
+    } stats;
+};
+
+static inline constexpr SlabCache slab_cache(const char *name, size_t object_size, void (*ctor)(void*) = nullptr)
+{
+    return SlabCache {
+        .prev = nullptr,
+        .next = nullptr,
+        .name = name,
+        .object_size = object_size,
+        .ctor = ctor,
+        .initialized = false,
+        .stride = 0,
+        .align = 0,
+        .link_offset = 0,
+        .slab_order = 0,
+        .slab_size = 0,
+        .objects_per_slab = 0,
+        .partial_slabs = {},
+        .full_slabs = {},
+        .empty_slabs = {},
+        .stats = {},
+    };
+}
+
+/**
+ * \return An object from the cache, nullptr if out of memory
+*/
+void *slab_alloc(SlabCache&);
+
+template<typename T>
+T *slab_alloc(SlabCache& cache)
+{
+    return static_cast<T*>(slab_alloc(cache));
+}
+
+void slab_free(SlabCache&, void *object);
+
+void slab_print_statistics();
@@ -0,0 +1,314 @@
+#include <kernel/drivers/devicemanager.h>
+#include <kernel/irq.h>
+#include <kernel/memory/vm.h>
+#include <kernel/scheduler.h>
+#include "swap.h"
+
+// #define LOG_ENABLED
+#define LOG_TAG "SWAP"
+#include <kernel/log.h>
+
+
+/**
+ * How many entries of the page tables a single call to \ref swap_reclaim
+ * looks at, at most, before it gives up on finding pages to swap out
+*/
+#ifndef CONFIG_SWAP_SCAN_PAGES
+#define CONFIG_SWAP_SCAN_PAGES 16384
+#endif
+
+/**
+ * How many writes in a row the device can fail before swap is turned off,
+ * a single error is not enough to tell a broken device from a bad slot
+*/
+#ifndef CONFIG_SWAP_MAX_WRITE_ERRORS
+#define CONFIG_SWAP_MAX_WRITE_ERRORS 8
+#endif
+
+// Slots are addressed by the 20 address bits of a level 2 entry
+static constexpr uint32_t SWAP_MAX_SLOTS = 1u << 20;
+
+/**
+ * Pages being written out stay here until they are on the device, reading
+ * their slot in the meantime copies them from memory instead.
+ * If the device fails a write, the page goes back to its address space. If
+ * that is not possible, because the slot was shared by a fork in the meantime,
+ * the page stays here until the slot is freed.
+*/
+static constexpr size_t SWAP_MAX_IN_MEMORY = 16;
+
+struct SwapInMemoryPage {
+    uint32_t slot;
+    PhysicalPage *page;
+};
+
+static struct {
+    BlockDevice *device;
+    uint32_t slot_count;
+    uint32_t free_slots;
+    uint32_t next_slot;     // Where the search for a free slot starts
+    uint16_t *ref_counts;
+
+    SwapInMemoryPage in_memory[SWAP_MAX_IN_MEMORY];
+    uint32_t write_errors;  // Since the last successful write
+    bool failed;
+
+    // Where the clock hand is, it moves over the processes in order of pid
+    struct {
+        int pid;
+        uintptr_t address;
+    } hand;
+
+    struct {
+        uint32_t swapped_out;
+        uint32_t swapped_in;
+    } stats;
+} s_swap;
+
+static bool swap_probe(BlockDevice& device)
+{
+    char header[sizeof(SWAP_MAGIC)];
+    if (device.size() < 2 * SWAP_SLOT_SIZE)
+        return false;
+    if (device.read(0, reinterpret_cast<uint8_t*>(header), sizeof(header)) != sizeof(header))
+        return false;
+
+    return memcmp(header, SWAP_MAGIC, sizeof(SWAP_MAGIC) - 1) == 0;
+}
+
+void swap_init()
+{
+    BlockDevice *root = devicemanager_get_root_block_device();
+    BlockDevice *device = nullptr;
+    for (size_t i = 0; auto *candidate = devicemanager_get_block_device(i); i++) {
+        if (candidate != root && swap_probe(*candidate)) {
+            device = candidate;
+            break;
+        }
+    }
+    if (device == nullptr) {
+        LOGI("No swap device found");
+        return;
+    }
+
+    uint32_t slot_count = min<uint64_t>(device->size() / SWAP_SLOT_SIZE, SWAP_MAX_SLOTS);
+    auto *ref_counts = static_cast<uint16_t*>(malloc(slot_count * sizeof(uint16_t)));
+    if (ref_counts == nullptr) {
+        LOGE("Not enough memory to keep track of %" PRIu32 " swap slots", slot_count);
+        return;
+    }
+    memset(ref_counts, 0, slot_count * sizeof(uint16_t));
+
+    // Slot 0 is the header, a swap entry is never 0 either
+    ref_counts[0] = UINT16_MAX;
+
+    s_swap.device = device;
+    s_swap.slot_count = slot_count;
+    s_swap.free_slots = slot_count - 1;
+    s_swap.next_slot = 1;
+    s_swap.ref_counts = ref_counts;
+    kprintf("Swapping to %s, %" PRIu32 " slots (%" PRIu32 "KB)\n", device->name(), slot_count - 1, (slot_count - 1) * (SWAP_SLOT_SIZE / _1KB));
+}
+
+bool swap_is_enabled()
+{
+    return s_swap.device != nullptr && !s_swap.failed;
+}
+
+Error swap_slot_alloc(uint32_t& out_slot)
+{
+    if (!swap_is_enabled() || s_swap.free_slots == 0)
+        return OutOfMemory;
+
+    // Next fit: slots freed behind the cursor get reused on the next lap
+    uint32_t slot = s_swap.next_slot;
+    while (s_swap.ref_counts[slot] != 0)
+        slot = slot + 1 < s_swap.slot_count ? slot + 1 : 1;
+
+    s_swap.ref_counts[slot] = 1;
+    s_swap.free_slots--;
+    s_swap.next_slot = slot + 1 < s_swap.slot_count ? slot + 1 : 1;
+
+    out_slot = slot;
+    return Success;
+}
+
+void swap_slot_ref(uint32_t slot)
+{
+    kassert(slot > 0 && slot < s_swap.slot_count);
+    kassert(s_swap.ref_counts[slot] > 0 && s_swap.ref_counts[slot] < UINT16_MAX);
+    s_swap.ref_counts[slot]++;
+}
+
+static SwapInMemoryPage *swap_find_in_memory(uint32_t slot)
+{
+    for (size_t i = 0; i < array_size(s_swap.in_memory); i++) {
+        if (s_swap.in_memory[i].page != nullptr && s_swap.in_memory[i].slot == slot)
+            return &s_swap.in_memory[i];
+    }
+
+    return nullptr;
+}
+
+void swap_slot_put(uint32_t slot)
+{
+    kassert(slot > 0 && slot < s_swap.slot_count);
+    kassert(s_swap.ref_counts[slot] > 0);
+    if (--s_swap.ref_counts[slot] > 0)
+        return;
+
+    if (auto *in_memory = swap_find_in_memory(slot); in_memory != nullptr) {
+        MUST(physical_page_free(in_memory->page, PageOrder::_4KB));
+        in_memory->page = nullptr;
+    }
+    s_swap.free_slots++;
+}
+
+/**
+ * Talking to the device needs interrupts, this is no different from a syscall:
+ * swapping happens on the kernel stack of a thread that faulted or made one
+*/
+static Error swap_transfer(bool is_write, uint32_t slot, uint8_t *data)
+{
+    bool were_enabled = irq_enabled();
+    irq_enable();
+    int64_t rc = is_write ?
+        s_swap.device->write(slot * SWAP_SLOT_SIZE, data, SWAP_SLOT_SIZE) :
+        s_swap.device->read(slot * SWAP_SLOT_SIZE, data, SWAP_SLOT_SIZE);
+    if (!were_enabled)
+        irq_disable();
+
+    if (rc != SWAP_SLOT_SIZE) {
+        LOGE("Failed to %s slot %" PRIu32 ": %d", is_write ? "write" : "read", slot, (int) rc);
+        // A device that keeps its data in memory (e.g. zram) can run out of it too
+        return rc == -ERR_NOMEM ? OutOfMemory : BadResponse;
+    }
+
+    return Success;
+}
+
+Error swap_read(uint32_t slot, PhysicalPage *page)
+{
+    kassert(slot > 0 && slot < s_swap.slot_count && s_swap.ref_counts[slot] > 0);
+    auto *data = reinterpret_cast<uint8_t*>(phys2virt(page2addr(page)));
+
+    if (auto *in_memory = swap_find_in_memory(slot); in_memory != nullptr) {
+        memcpy(data, reinterpret_cast<void const*>(phys2virt(page2addr(in_memory->page))), SWAP_SLOT_SIZE);
+    } else {
+        TRY(swap_transfer(false, slot, data));
+    }
+
+    s_swap.stats.swapped_in++;
+    return Success;
+}
+
+/**
+ * \brief Gives a page that could not be written out back to the address space
+ * of 'pid', if 'slot' is still only referred to by its entry at 'virt_addr'
+*/
+static bool swap_give_back(SwapInMemoryPage& in_memory, int pid, uintptr_t virt_addr)
+{
+    // One reference is the entry, the other one is held by the writer
+    if (s_swap.ref_counts[in_memory.slot] != 2)
+        return false;
+
+    Process *process = scheduler_next_process(pid - 1);
+    if (process == nullptr || process->pid != pid)
+        return false;
+    if (!vm_swap_cancel(process->address_space, virt_addr, in_memory.slot, in_memory.page))
+        return false;
+
+    in_memory.page = nullptr;
+    return true;
+}
+
+/**
+ * \brief Writes a page the clock just took away from 'pid' at 'virt_addr' to its slot, then frees it
+ * If the write fails, the page is mapped back and the slot is freed, so that
+ * the caller can go on with another one
+*/
+static Error swap_write_out(SwapInMemoryPage& in_memory, uint32_t slot, PhysicalPage *page, int pid, uintptr_t virt_addr)
+{
+    in_memory = SwapInMemoryPage {
+        .slot = slot,
+        .page = page,
+    };
+
+    // The address space can drop the slot while it is being written
+    swap_slot_ref(slot);
+    Error rc = swap_transfer(true, slot, reinterpret_cast<uint8_t*>(phys2virt(page2addr(page))));
+    if (rc.is_success()) {
+        in_memory.page = nullptr;
+        MUST(physical_page_free(page, PageOrder::_4KB));
+        s_swap.stats.swapped_out++;
+        s_swap.write_errors = 0;
+    } else {
+        if (!swap_give_back(in_memory, pid, virt_addr))
+            LOGW("Slot %" PRIu32 " could not be written, its page stays in memory", slot);
+
+        // Running out of memory says nothing about the device, it passes
+        bool is_device_error = rc.generic_error_code != GenericErrorCode::OutOfMemory;
+        if (is_device_error && ++s_swap.write_errors >= CONFIG_SWAP_MAX_WRITE_ERRORS) {
+            LOGE("Turning swap off after %" PRIu32 " failed writes, the pages that are already there can still be read", s_swap.write_errors);
+            s_swap.failed = true;
+        }
+    }
+    swap_slot_put(slot);
+
+    return rc;
+}
+
+static SwapInMemoryPage *swap_reserve_in_memory()
+{
+    for (size_t i = 0; i < array_size(s_swap.in_memory); i++) {
+        if (s_swap.in_memory[i].page == nullptr)
+            return &s_swap.in_memory[i];
+    }
+
+    return nullptr;
+}
+
+size_t swap_reclaim(size_t count)
+{
+    size_t freed = 0;
+    size_t budget = CONFIG_SWAP_SCAN_PAGES;
+
+    while (freed < count && budget > 0 && swap_is_enabled() && s_swap.free_slots > 0) {
+        auto *in_memory = swap_reserve_in_memory();
+        if (in_memory == nullptr)
+            break;
+
+        // Processes can come and go while pages are written out, the hand
+        // only remembers a pid and carries on from the next one if it is gone
+        Process *process = scheduler_next_process(s_swap.hand.pid - 1);
+        if (process == nullptr) {
+            if (s_swap.hand.pid == 0)
+                break;
+            s_swap.hand.pid = 0;
+            s_swap.hand.address = 0;
+            budget--;
+            continue;
+        }
+        if (process->pid != s_swap.hand.pid) {
+            s_swap.hand.pid = process->pid;
+            s_swap.hand.address = 0;
+        }
+
+        PhysicalPage *page;
+        uint32_t slot;
+        if (vm_swap_clock(process->address_space, s_swap.hand.address, budget, page, slot)) {
+            // The hand is left just past the page it picked
+            Error rc = swap_write_out(*in_memory, slot, page, process->pid, s_swap.hand.address - _4KB);
+            if (rc.is_success())
+                freed++;
+            else if (rc.generic_error_code == GenericErrorCode::OutOfMemory)
+                break;
+        } else if (s_swap.hand.address == 0) {
+            s_swap.hand.pid++;
+        }
+    }
+
+    LOGD("Swapped out %u pages (%" PRIu32 " out, %" PRIu32 " in so far, %" PRIu32 " free slots)",
+        freed, s_swap.stats.swapped_out, s_swap.stats.swapped_in, s_swap.free_slots);
+    return freed;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <kernel/base.h>
+#include <kernel/memory/physicalalloc.h>
+
+
+/**
+ * Swap lets the kernel move private pages of user processes out to a block
+ * device when it runs out of memory, they come back when they are accessed.
+ *
+ * The device is split in SWAP_SLOT_SIZE slots. The first one is a header that
+ * marks the device as swap space: it must start with SWAP_MAGIC, any other
+ * disk is left alone. Slots are reference counted like physical pages, after
+ * a fork both address spaces refer to the same slot until they read it back.
+ *
+ * Which pages are swapped out is decided by \ref vm_swap_clock, this only
+ * keeps track of the slots and moves pages to and from the device.
+*/
+
+static constexpr size_t SWAP_SLOT_SIZE = 4 * _1KB;
+static constexpr char SWAP_MAGIC[] = "PI0SWAP1";
+
+/**
+ * \brief Uses the first block device, other than the root one, that starts with the swap header
+*/
+void swap_init();
+
+bool swap_is_enabled();
+
+/**
+ * \brief Reserves a free slot, with a reference count of 1
+*/
+Error swap_slot_alloc(uint32_t& out_slot);
+
+void swap_slot_ref(uint32_t slot);
+
+/**
+ * \brief Drops a reference to 'slot', it becomes free again when there are none left
+*/
+void swap_slot_put(uint32_t slot);
+
+/**
+ * \brief Copies the page stored in 'slot' into 'page'
+ * Can sleep while the device reads it
+*/
+Error swap_read(uint32_t slot, PhysicalPage *page);
+
+/**
+ * \brief Swaps out up to 'count' pages of user processes, freeing them
+ * Can sleep while the device writes them, so it must only be called where a
+ * page fault could be handled: the address spaces can change in the meantime
+ * \return How many pages were freed
+*/
+size_t swap_reclaim(size_t count);
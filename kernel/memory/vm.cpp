@@ -1,4 +1,10 @@
 #include <kernel/base.h>
+#include <kernel/arch/arch.h>
+#include <kernel/irq.h>
+#include <kernel/memory/imagecache.h>
+#include <kernel/memory/shrinker.h>
+#include <kernel/memory/swap.h>
+#include <kernel/vfs/vfs.h>
 #include "vm.h"
 
 #define LOG_ENABLED
@@ -9,8 +15,19 @@
 static constexpr size_t LVL1_ENTRIES = _16KB / sizeof(FirstLevelEntry);
 static constexpr size_t LVL2_ENTRIES = _1KB / sizeof(SecondLevelEntry);
 
+/**
+ * TTBR0 only translates the user area, so each process' level 1 table only
+ * has entries for that and is 16KB >> TTBCR_N big. The kernel is mapped
+ * once by the table in TTBR1, which never changes.
+*/
+static constexpr uint32_t TTBCR_N = 2;
+static constexpr size_t USER_LVL1_ENTRIES = LVL1_ENTRIES >> TTBCR_N;
+static constexpr size_t USER_LVL1_TABLE_SIZE = LVL1_TABLE_SIZE >> TTBCR_N;
+static_assert(areas::user_area.end == (1ull << (32 - TTBCR_N)));
+static_assert(USER_LVL1_TABLE_SIZE == _4KB, "user level 1 tables are allocated as a single page");
+
 static AddressSpace g_kernel_address_space;
-static AddressSpace g_current_address_space;
+static AddressSpace *g_current_address_space;
 static struct {
     // TODO: Use a bitmap instead of an array
     uint8_t used[areas::peripherals.size() / _4KB];
@@ -20,11 +37,87 @@ static struct {
     uint32_t size;
 } s_ram;
 
+/**
+ * When enabled, the first read from a lazily allocated page maps a single
+ * shared page full of zeroes as copy-on-write instead of allocating a new one
+*/
+static constexpr bool USE_SHARED_ZERO_PAGE = true;
+static PhysicalPage *s_zero_page;
+
+/**
+ * Writes to regions at least this big populate 64KB at a time when they can,
+ * smaller ones are not worth the memory that could go unused
+*/
+static constexpr size_t LARGE_PAGE_MIN_REGION_SIZE = _1MB;
+
+/**
+ * How many pages a fault that ran out of memory tries to free before it
+ * gets retried, first from the caches and then by swapping out
+*/
+static constexpr size_t RECLAIM_BATCH = 32;
+
+/**
+ * ASIDs are handed out in order, when they run out a new generation starts:
+ * the whole TLB gets flushed and every address space will get a new ASID
+ * the next time it is switched to. ASID 0 is reserved for the kernel.
+*/
+static constexpr uint32_t MAX_ASID = 255;
+static struct {
+    uint32_t generation;
+    uint32_t next;
+} s_asids = { .generation = 1, .next = 1 };
+
 enum class InitState {
     None, Early, Completed
 };
 static InitState s_init_state = InitState::None;
 
+/**
+ * The hardware table walker does not look into the D-cache, so every
+ * change to a translation table must be written back to memory before
+ * the TLB entries for it get invalidated
+*/
+static inline void sync_table_entries(void const *entries, size_t size)
+{
+    dcache_clean_range(entries, size);
+}
+
+/**
+ * Level 2 entries with both identifier bits clear make the hardware fault, the
+ * swap clock uses the rest of their bits for pages that are in the address space
+ * but are not mapped right now:
+ *  - An aged page is a small page entry with only the identifier cleared, the
+ *    next access maps it back and tells the clock that the page is in use.
+ *    Every page that can be aged has some of the other bits set.
+ *  - A swapped out page only has the number of its swap slot in the address bits
+*/
+static bool vm_entry_is_aged(SecondLevelEntry entry)
+{
+    return (entry.raw & 0b11) == 0 && (entry.raw & 0xffc) != 0;
+}
+
+static bool vm_entry_is_swapped(SecondLevelEntry entry)
+{
+    return entry.raw != 0 && (entry.raw & 0xfff) == 0;
+}
+
+static uint32_t vm_entry_swap_slot(SecondLevelEntry entry)
+{
+    return entry.raw >> 12;
+}
+
+static SecondLevelEntry vm_make_swap_entry(uint32_t slot)
+{
+    kassert(slot != 0 && slot < (1u << 20));
+    return SecondLevelEntry { .raw = slot << 12 };
+}
+
+static void vm_make_young(SecondLevelEntry& entry)
+{
+    kassert(vm_entry_is_aged(entry));
+    entry.raw |= SMALL_PAGE_ENTRY_ID;
+}
+
 void vm_early_init(BootParams const *boot_params)
 {
     s_ram = {
@@ -37,9 +130,15 @@ void vm_early_init(BootParams const *boot_params)
 void vm_init()
 {
     kassert(s_init_state == InitState::Early);
-    g_current_address_space = g_kernel_address_space = AddressSpace {
+    g_kernel_address_space = AddressSpace {
         .ttbr0_page = addr2page(vm_read_current_ttbr0()),
+        .regions = {},
+        .asid = 0,
+        .asid_generation = 0,
+        .brk_start = 0,
+        .brk = 0,
     };
+    g_current_address_space = &g_kernel_address_space;
 
     /**
      * The bootloader had to identity map the physical memory because otherwise
@@ -53,7 +152,16 @@ void vm_init()
     for (uintptr_t i = 0; i < s_ram.size; i += _1MB) {
         table[lvl1_index(s_ram.phys_start_addr + i)].raw = 0;
     }
+    sync_table_entries(table, LVL1_TABLE_SIZE);
+
+    // The kernel's table keeps being TTBR0 for kernel threads, its part
+    // for the user area is now empty
+    write_ttbr1(page2addr(g_kernel_address_space.ttbr0_page));
+    write_ttbcr(TTBCR_N);
     invalidate_tlb();
+
+    MUST(physical_page_alloc(PageOrder::_4KB, s_zero_page));
+    memset(reinterpret_cast<void*>(phys2virt(page2addr(s_zero_page))), 0, _4KB);
     
     s_init_state = InitState::Completed;
 }
@@ -111,7 +219,9 @@ static void *ioremap_early(uintptr_t phys_addr, size_t size)
 
     auto *table = reinterpret_cast<FirstLevelEntry*>(phys2virt(vm_read_current_ttbr0()));
     for (uintptr_t i = 0; i < aligned_size; i += _1MB) {
-        table[lvl1_index(start_of_mapping + i)].section = SectionEntry::make_entry(aligned_phys_addr + i, PageAccessPermissions::PriviledgedOnly);
+        auto& entry = table[lvl1_index(start_of_mapping + i)];
+        entry.section = SectionEntry::make_entry(aligned_phys_addr + i, PageAccessPermissions::PriviledgedOnly, MemoryType::Device);
+        sync_table_entries(&entry, sizeof(entry));
         invalidate_tlb_entry(start_of_mapping + i);
     }
 
@@ -156,7 +266,7 @@ void iounmap(void *addr, size_t size)
 
 struct AddressSpace& vm_current_address_space()
 {
-    return g_current_address_space;
+    return *g_current_address_space;
 }
 
 struct AddressSpace& vm_kernel_address_space()
@@ -164,11 +274,89 @@ struct AddressSpace& vm_kernel_address_space()
     return g_kernel_address_space;
 }
 
+/**
+ * \brief The level 1 entry that translates 'virt_addr' when 'as' is active
+ * Outside of the user area this is always the kernel's entry, shared by everyone
+*/
+static FirstLevelEntry& vm_lvl1_entry(AddressSpace const& as, uintptr_t virt_addr)
+{
+    if (areas::user_area.contains(virt_addr))
+        return as.get_root_table_ptr()[lvl1_index(virt_addr)];
+
+    return g_kernel_address_space.get_root_table_ptr()[lvl1_index(virt_addr)];
+}
+
+static bool vm_has_valid_asid(AddressSpace const& as)
+{
+    return as.asid_generation == s_asids.generation;
+}
+
+/**
+ * \brief Invalidates the TLB entry for a page of 'as', whether it is the current address space or not
+*/
+static void vm_invalidate_tlb_entry(AddressSpace const& as, uintptr_t virt_addr)
+{
+    if (!areas::user_area.contains(virt_addr))
+        invalidate_tlb_entry(virt_addr);
+    else if (vm_has_valid_asid(as))
+        invalidate_tlb_entry(virt_addr, as.asid);
+}
+
+// Everything the user can access is private to its address space
+static bool vm_is_non_global(uintptr_t virt_addr, PageAccessPermissions permissions)
+{
+    return areas::user_area.contains(virt_addr) && permissions != PageAccessPermissions::PriviledgedOnly;
+}
+
+static SmallPageEntry vm_make_small_page_entry(uintptr_t phys_addr, uintptr_t virt_addr, PageAccessPermissions permissions, MemoryType type)
+{
+    auto entry = SmallPageEntry::make_entry(phys_addr, permissions, type);
+    entry.non_global = vm_is_non_global(virt_addr, permissions);
+    return entry;
+}
+
+static LargePageEntry vm_make_large_page_entry(uintptr_t phys_addr, uintptr_t virt_addr, PageAccessPermissions permissions, MemoryType type)
+{
+    auto entry = LargePageEntry::make_entry(phys_addr, permissions, type);
+    entry.non_global = vm_is_non_global(virt_addr, permissions);
+    return entry;
+}
+
+static SectionEntry vm_make_section_entry(uintptr_t phys_addr, uintptr_t virt_addr, PageAccessPermissions permissions, MemoryType type)
+{
+    auto entry = SectionEntry::make_entry(phys_addr, permissions, type);
+    entry.not_global = vm_is_non_global(virt_addr, permissions);
+    return entry;
+}
+
 void vm_switch_address_space(struct AddressSpace& as)
 {
-    asm volatile("mcr p15, 0, %0, c2, c0, 0" ::"r"(page2addr(as.ttbr0_page)));
-    g_current_address_space = as;
-    invalidate_tlb();
+    if (g_current_address_space != nullptr && g_current_address_space->ttbr0_page == as.ttbr0_page) {
+        g_current_address_space = &as;
+        return;
+    }
+
+    bool is_kernel = as.ttbr0_page == g_kernel_address_space.ttbr0_page;
+    bool rollover = false;
+    if (!is_kernel && !vm_has_valid_asid(as)) {
+        if (s_asids.next > MAX_ASID) {
+            s_asids.generation++;
+            s_asids.next = 1;
+            rollover = true;
+        }
+        as.asid = s_asids.next++;
+        as.asid_generation = s_asids.generation;
+    }
+
+    // Go through the reserved ASID while TTBR0 is changing, so that no
+    // entry from the new tables can get tagged with the old ASID or vice versa
+    write_contextidr(0);
+    write_ttbr0(page2addr(as.ttbr0_page));
+    if (rollover)
+        invalidate_tlb();
+    write_contextidr(is_kernel ? 0 : as.asid);
+
+    g_current_address_space = &as;
 }
 
 uintptr_t vm_read_current_ttbr0()
@@ -187,8 +375,7 @@ uintptr_t phys2virt(uintptr_t phys)
 
 uintptr_t virt2phys(uintptr_t virt)
 {
-    auto *table = g_current_address_space.get_root_table_ptr();
-    auto& lvl1_entry = table[lvl1_index(virt)];
+    auto& lvl1_entry = vm_lvl1_entry(*g_current_address_space, virt);
     switch (lvl1_entry.section.identifier) {
     case 0:
         return 0;
@@ -197,6 +384,8 @@ uintptr_t virt2phys(uintptr_t virt)
     case COARSE_PAGE_TABLE_ENTRY_ID: {
         auto *lvl2_table = reinterpret_cast<SecondLevelEntry*>(phys2virt(lvl1_entry.coarse.base_address()));
         auto& lvl2_entry = lvl2_table[lvl2_index(virt)];
+        if (lvl2_entry.is_large_page())
+            return lvl2_entry.large_page.base_address() | (virt & 0x0000ffff);
         return lvl2_entry.small_page.base_address() | (virt & 0x00000fff);
     }
     default:
@@ -207,107 +396,185 @@ uintptr_t virt2phys(uintptr_t virt)
 Error vm_create_address_space(struct AddressSpace& as)
 {
     struct PhysicalPage* as_ttbr0_page;
-    TRY(physical_page_alloc(PageOrder::_16KB, as_ttbr0_page));
-    
-    struct PhysicalPage *as_hack_2nd_level_table_page;
-    if (auto e = physical_page_alloc(PageOrder::_1KB, as_hack_2nd_level_table_page); !e.is_success()) {
-        physical_page_free(as_ttbr0_page, PageOrder::_16KB);
-        return e;
-    }
+    static_assert(USER_LVL1_TABLE_SIZE == _4KB);
+    TRY(physical_page_alloc_zeroed(as_ttbr0_page));
 
     as.ttbr0_page = as_ttbr0_page;
+    as.regions = {};
+    as.asid = 0;
+    as.asid_generation = 0;
+    as.brk_start = 0;
+    as.brk = 0;
 
     FirstLevelEntry* lvl1_table = as.get_root_table_ptr();
-    memset(lvl1_table, 0, LVL1_TABLE_SIZE);
-
-    FirstLevelEntry *kernel_lvl1_table = g_kernel_address_space.get_root_table_ptr();
-    constexpr uintptr_t KERNEL_START = areas::kernel_area.start;
-    for (size_t i = lvl1_index(KERNEL_START); i < LVL1_ENTRIES; i++)
-        lvl1_table[i].raw = kernel_lvl1_table[i].raw;
-
-    /**
-     * HACK: We need to map the vector table at 0x0 for all AS
-     * but we can't just copy kernel_lvl1_table[0].raw directly as
-     * it would break the refcount + leak process data in the first MB
-     * so we need to refcount++ only the very first page
-     * 
-     * The proper fix is to use ARM's 'hivec' bit in the SCR register
-     * and remap the vector table at 0xffff0000.
-     * Meanwhile, this code duplicates only the very first 4KB manually
-     * increments the refcount of that first page
-     */
-    lvl1_table[0].coarse = CoarsePageTableEntry::make_entry(page2addr(as_hack_2nd_level_table_page));
-    {
-        auto *src_table = reinterpret_cast<SecondLevelEntry*>(phys2virt(kernel_lvl1_table[0].coarse.base_address()));
-        struct PhysicalPage *p = addr2page(src_table[0].small_page.base_address());
-        p->ref_count++;
-
-        auto *dst_table = reinterpret_cast<SecondLevelEntry*>(phys2virt(lvl1_table[0].coarse.base_address()));
-        memset(dst_table, 0, LVL2_TABLE_SIZE);
-        dst_table[0].small_page = SmallPageEntry::make_entry(page2addr(p), PageAccessPermissions::PriviledgedOnly);
-    }
+    sync_table_entries(lvl1_table, USER_LVL1_TABLE_SIZE);
 
     return Success;
 }
 
-static Error vm_map_page(FirstLevelEntry* root_table, uintptr_t phys_addr, uintptr_t virt_addr, PageAccessPermissions permissions)
+/**
+ * \brief The level 2 table for 'virt_addr', it is allocated if there isn't one yet
+ * \return nullptr if there is no memory for a new table
+*/
+static SecondLevelEntry *vm_get_lvl2_table(AddressSpace const& as, uintptr_t virt_addr)
 {
-    auto *kernel_lvl1_table = g_kernel_address_space.get_root_table_ptr();
-
-    auto& lvl1_entry = root_table[lvl1_index(virt_addr)];
+    auto& lvl1_entry = vm_lvl1_entry(as, virt_addr);
     if (lvl1_entry.section.identifier == SECTION_ENTRY_ID)
         panic("vm_map_page: Address %p is already mapped to a section", virt_addr);
 
     bool lvl2_table_was_just_allocated = false;
     if (lvl1_entry.raw == 0) {
-        if (areas::kernel_area.contains(virt_addr)) {
-            // This case might happen in the following sequence
-            // - This address space is created
-            // - While this AS is not loaded, a memory allocation happens which causes a new lvl1 table to be allocated
-            // - This AS gets loaded, and a new memory allocation requires to map a new page
-            lvl1_entry.raw = kernel_lvl1_table[lvl1_index(virt_addr)].raw;
-        }
-
-        if (lvl1_entry.raw == 0) {
-            struct PhysicalPage* lvl2_table_page;
-            MUST(physical_page_alloc(PageOrder::_1KB, lvl2_table_page));
-            lvl1_entry.coarse = CoarsePageTableEntry::make_entry(page2addr(lvl2_table_page));
-            lvl2_table_was_just_allocated = true;
-        }
-
-        // The kernel area must be mapped the same way in all address spaces.
-        // We can afford to have different address spaces not mapped the same way since
-        // we can fix them in the page fault handler anyway, but we must always have the
-        // kernel_translation_table be the final source of truth for the kernel area.
-        if (areas::kernel_area.contains(virt_addr) && root_table != kernel_lvl1_table && lvl2_table_was_just_allocated) {
-            kassert(kernel_lvl1_table[lvl1_index(virt_addr)].raw == 0);
-            kernel_lvl1_table[lvl1_index(virt_addr)].coarse = lvl1_entry.coarse;
-        }
+        struct PhysicalPage* lvl2_table_page;
+        if (!physical_page_alloc(PageOrder::_1KB, lvl2_table_page).is_success())
+            return nullptr;
+        lvl1_entry.coarse = CoarsePageTableEntry::make_entry(page2addr(lvl2_table_page));
+        lvl2_table_was_just_allocated = true;
     }
 
     auto *lvl2_table = reinterpret_cast<SecondLevelEntry*>(phys2virt(lvl1_entry.coarse.base_address()));
-    if (lvl2_table_was_just_allocated)
+    if (lvl2_table_was_just_allocated) {
         memset(lvl2_table, 0, LVL2_TABLE_SIZE);
+        sync_table_entries(lvl2_table, LVL2_TABLE_SIZE);
+    }
+    sync_table_entries(&lvl1_entry, sizeof(lvl1_entry));
+
+    return lvl2_table;
+}
 
+static Error vm_map_page(struct AddressSpace& as, uintptr_t phys_addr, uintptr_t virt_addr, PageAccessPermissions permissions, MemoryType type)
+{
+    auto *lvl2_table = vm_get_lvl2_table(as, virt_addr);
+    if (lvl2_table == nullptr)
+        return OutOfMemory;
     auto& lvl2_entry = lvl2_table[lvl2_index(virt_addr)];
     if (lvl2_entry.raw != 0)
         panic("vm_map_page: mapping already exists at %p (currenly mapped to %p)", virt_addr, lvl2_entry.small_page.base_address());
 
-    lvl2_entry.small_page = SmallPageEntry::make_entry(phys_addr, permissions);
+    lvl2_entry.small_page = vm_make_small_page_entry(phys_addr, virt_addr, permissions, type);
+    sync_table_entries(&lvl2_entry, sizeof(lvl2_entry));
 
-    invalidate_tlb_entry(virt_addr);
+    vm_invalidate_tlb_entry(as, virt_addr);
     return Success;
 }
 
-static Error vm_map_page(struct AddressSpace& as, uintptr_t phys_addr, uintptr_t virt_addr, PageAccessPermissions permissions)
+static Error vm_map_large_page(struct AddressSpace& as, uintptr_t phys_addr, uintptr_t virt_addr, PageAccessPermissions permissions, MemoryType type)
 {
-    TRY(vm_map_page(as.get_root_table_ptr(), phys_addr, virt_addr, permissions));
+    kassert(phys_addr % _64KB == 0 && virt_addr % _64KB == 0);
+
+    auto *lvl2_table = vm_get_lvl2_table(as, virt_addr);
+    if (lvl2_table == nullptr)
+        return OutOfMemory;
+    auto *entries = &lvl2_table[lvl2_index(virt_addr)];
+    for (size_t i = 0; i < LARGE_PAGE_REPEAT; i++) {
+        if (entries[i].raw != 0)
+            panic("vm_map_large_page: mapping already exists at %p", virt_addr + i * _4KB);
+    }
+
+    auto entry = vm_make_large_page_entry(phys_addr, virt_addr, permissions, type);
+    for (size_t i = 0; i < LARGE_PAGE_REPEAT; i++)
+        entries[i].large_page = entry;
+    sync_table_entries(entries, LARGE_PAGE_REPEAT * sizeof(*entries));
+
+    vm_invalidate_tlb_entry(as, virt_addr);
     return Success;
 }
 
-Error vm_map(struct AddressSpace& as, struct PhysicalPage* page, uintptr_t virt_addr, PageAccessPermissions permissions)
+static Error vm_map_section(struct AddressSpace& as, uintptr_t phys_addr, uintptr_t virt_addr, PageAccessPermissions permissions, MemoryType type)
+{
+    kassert(phys_addr % _1MB == 0 && virt_addr % _1MB == 0);
+
+    auto& lvl1_entry = vm_lvl1_entry(as, virt_addr);
+    if (lvl1_entry.raw != 0)
+        panic("vm_map_section: Address %p is already mapped", virt_addr);
+
+    lvl1_entry.section = vm_make_section_entry(phys_addr, virt_addr, permissions, type);
+    sync_table_entries(&lvl1_entry, sizeof(lvl1_entry));
+
+    vm_invalidate_tlb_entry(as, virt_addr);
+    return Success;
+}
+
+/**
+ * \brief Turns the section that maps 'virt_addr' into a level 2 table of large pages
+*/
+static Error vm_split_section(AddressSpace const& as, uintptr_t virt_addr)
 {
-    TRY(vm_map_page(as, page2addr(page), virt_addr, permissions));
+    auto& lvl1_entry = vm_lvl1_entry(as, virt_addr);
+    kassert(lvl1_entry.is_section());
+    auto section = lvl1_entry.section;
+    uintptr_t section_start = round_down<uintptr_t>(virt_addr, _1MB);
+
+    struct PhysicalPage* lvl2_table_page;
+    TRY(physical_page_alloc(PageOrder::_1KB, lvl2_table_page));
+    auto *lvl2_table = reinterpret_cast<SecondLevelEntry*>(phys2virt(page2addr(lvl2_table_page)));
+    for (size_t i = 0; i < LVL2_ENTRIES; i++) {
+        uintptr_t offset = round_down<uintptr_t>(i * _4KB, _64KB);
+        lvl2_table[i].large_page = vm_make_large_page_entry(
+            section.base_address() + offset,
+            section_start + offset,
+            section.permissions(),
+            section.memory_type()
+        );
+    }
+    sync_table_entries(lvl2_table, LVL2_TABLE_SIZE);
+
+    lvl1_entry.coarse = CoarsePageTableEntry::make_entry(page2addr(lvl2_table_page));
+    sync_table_entries(&lvl1_entry, sizeof(lvl1_entry));
+    vm_invalidate_tlb_entry(as, section_start);
+
+    return Success;
+}
+
+/**
+ * \brief Turns the large page at 'lvl2_table[index]' into 16 small pages with the same attributes
+*/
+static void vm_split_large_page(AddressSpace const& as, SecondLevelEntry *lvl2_table, uintptr_t virt_addr)
+{
+    size_t first = round_down<size_t>(lvl2_index(virt_addr), LARGE_PAGE_REPEAT);
+    auto large_page = lvl2_table[first].large_page;
+    kassert(lvl2_table[first].is_large_page());
+
+    uintptr_t chunk_start = round_down<uintptr_t>(virt_addr, _64KB);
+    for (size_t i = 0; i < LARGE_PAGE_REPEAT; i++) {
+        lvl2_table[first + i].small_page = vm_make_small_page_entry(
+            large_page.base_address() + i * _4KB,
+            chunk_start + i * _4KB,
+            large_page.permissions(),
+            large_page.memory_type()
+        );
+    }
+    sync_table_entries(&lvl2_table[first], LARGE_PAGE_REPEAT * sizeof(*lvl2_table));
+    vm_invalidate_tlb_entry(as, chunk_start);
+}
+
+Error vm_map_contiguous(struct AddressSpace& as, uintptr_t phys_addr, uintptr_t virt_addr, size_t size, PageAccessPermissions permissions, MemoryType type)
+{
+    kassert(vm_addr_is_page_aligned(phys_addr) && vm_addr_is_page_aligned(virt_addr) && vm_addr_is_page_aligned(size));
+
+    size_t offset = 0;
+    while (offset < size) {
+        uintptr_t phys = phys_addr + offset;
+        uintptr_t virt = virt_addr + offset;
+        size_t left = size - offset;
+
+        if (left >= _1MB && phys % _1MB == 0 && virt % _1MB == 0 && vm_lvl1_entry(as, virt).is_empty()) {
+            TRY(vm_map_section(as, phys, virt, permissions, type));
+            offset += _1MB;
+        } else if (left >= _64KB && phys % _64KB == 0 && virt % _64KB == 0) {
+            TRY(vm_map_large_page(as, phys, virt, permissions, type));
+            offset += _64KB;
+        } else {
+            TRY(vm_map_page(as, phys, virt, permissions, type));
+            offset += _4KB;
+        }
+    }
+
+    return Success;
+}
+
+Error vm_map(struct AddressSpace& as, struct PhysicalPage* page, uintptr_t virt_addr, PageAccessPermissions permissions, MemoryType type)
+{
+    TRY(vm_map_page(as, page2addr(page), virt_addr, permissions, type));
     return Success;
 }
 
@@ -315,17 +582,147 @@ Error vm_map_mmio(struct AddressSpace& as, uintptr_t phys_addr, uintptr_t virt_a
 {
     auto pages_to_map = round_up<size_t>(size, _4KB) / _4KB;
     for (size_t i = 0; i < pages_to_map; i++) {
-        TRY(vm_map_page(as, phys_addr + i * _4KB, virt_addr + i * _4KB, PageAccessPermissions::PriviledgedOnly));
+        TRY(vm_map_page(as, phys_addr + i * _4KB, virt_addr + i * _4KB, PageAccessPermissions::PriviledgedOnly, MemoryType::Device));
     }
 
     return Success;
 }
 
-static Error vm_unmap_page(FirstLevelEntry* root_table, uintptr_t virt_addr, uintptr_t& previously_mapped_physical_address)
+static Error vm_add_region(struct AddressSpace& as, VmRegion const& r)
 {
-    auto& lvl1_entry = root_table[lvl1_index(virt_addr)];
-    if (lvl1_entry.section.identifier == SECTION_ENTRY_ID)
-        panic("vm_unmap_kernel: Address %p is mapped to a section, you can't unmap that!", virt_addr);
+    kassert(vm_addr_is_page_aligned(r.start));
+    kassert(areas::user_area.contains(r.start) && r.end <= areas::user_area.end);
+    if (r.start == r.end)
+        return Success;
+
+    if (as.regions.find([&](VmRegion *other) { return other->start < r.end && r.start < other->end; }))
+        return BadParameters;
+
+    auto *region = static_cast<VmRegion*>(malloc(sizeof(VmRegion)));
+    if (region == nullptr)
+        return OutOfMemory;
+
+    *region = r;
+    if (r.file != nullptr) {
+        region->file = vfs_duplicate(r.file);
+        if (region->file == nullptr) {
+            free(region);
+            return OutOfMemory;
+        }
+    }
+    if (r.image != nullptr)
+        region->image = imagecache_ref(r.image);
+    as.regions.add(region);
+
+    return Success;
+}
+
+static void vm_free_region(VmRegion *region)
+{
+    if (region->image != nullptr)
+        imagecache_put(region->image);
+    if (region->file != nullptr)
+        vfs_close(region->file);
+    free(region);
+}
+
+Error vm_map_anonymous(struct AddressSpace& as, uintptr_t virt_addr, size_t size, PageAccessPermissions permissions)
+{
+    return vm_add_region(as, VmRegion {
+        .prev = nullptr,
+        .next = nullptr,
+        .start = virt_addr,
+        .end = virt_addr + vm_align_up_to_page(size),
+        .permissions = permissions,
+        .file = nullptr,
+        .file_offset = 0,
+        .data_start = 0,
+        .data_end = 0,
+        .image = nullptr,
+        .is_stack = false,
+        .is_shared = false,
+    });
+}
+
+Error vm_map_file(
+    struct AddressSpace& as,
+    uintptr_t virt_addr,
+    size_t size,
+    PageAccessPermissions permissions,
+    FileCustody *file,
+    uint64_t file_offset,
+    uintptr_t data_addr,
+    size_t data_size
+)
+{
+    kassert(file != nullptr);
+    kassert(virt_addr <= data_addr && data_addr + data_size <= virt_addr + vm_align_up_to_page(size));
+
+    uintptr_t end = virt_addr + vm_align_up_to_page(size);
+
+    // Nobody can write to these pages, so every process can map the same ones.
+    // Without memory for the bookkeeping the pages are simply not shared
+    ImageSegment *image = nullptr;
+    if (permissions == PageAccessPermissions::UserReadOnly)
+        image = imagecache_get(file, end - virt_addr, file_offset, data_addr - virt_addr, data_size);
+
+    Error rc = vm_add_region(as, VmRegion {
+        .prev = nullptr,
+        .next = nullptr,
+        .start = virt_addr,
+        .end = end,
+        .permissions = permissions,
+        .file = file,
+        .file_offset = file_offset,
+        .data_start = data_addr,
+        .data_end = data_addr + data_size,
+        .image = image,
+        .is_stack = false,
+        .is_shared = false,
+    });
+    if (image != nullptr)
+        imagecache_put(image);
+
+    return rc;
+}
+
+Error vm_map_shared(struct AddressSpace& as, uintptr_t virt_addr, PhysicalPage *const *pages, size_t count, PageAccessPermissions permissions)
+{
+    uintptr_t end = virt_addr + count * _4KB;
+
+    TRY(vm_add_region(as, VmRegion {
+        .prev = nullptr,
+        .next = nullptr,
+        .start = virt_addr,
+        .end = end,
+        .permissions = permissions,
+        .file = nullptr,
+        .file_offset = 0,
+        .data_start = 0,
+        .data_end = 0,
+        .image = nullptr,
+        .is_stack = false,
+        .is_shared = true,
+    }));
+
+    for (size_t i = 0; i < count; i++) {
+        pages[i]->ref_count++;
+        if (Error rc = vm_map_page(as, page2addr(pages[i]), virt_addr + i * _4KB, permissions, MemoryType::Normal); !rc.is_success()) {
+            MUST(physical_page_free(pages[i], PageOrder::_4KB));
+            MUST(vm_unmap_range(as, virt_addr, end));
+            return rc;
+        }
+    }
+
+    return Success;
+}
+
+static Error vm_unmap_page(AddressSpace const& as, uintptr_t virt_addr, uintptr_t& previously_mapped_physical_address)
+{
+    // Unmapping part of a bigger mapping splits it, the rest stays as it was
+    auto& lvl1_entry = vm_lvl1_entry(as, virt_addr);
+    if (lvl1_entry.is_section())
+        TRY(vm_split_section(as, virt_addr));
 
     if (lvl1_entry.raw == 0) {
         previously_mapped_physical_address = 0;
@@ -338,15 +735,23 @@ static Error vm_unmap_page(FirstLevelEntry* root_table, uintptr_t virt_addr, uin
         previously_mapped_physical_address = 0;
         return Success;
     }
+    if (lvl2_entry.is_large_page())
+        vm_split_large_page(as, lvl2_table, virt_addr);
 
-    previously_mapped_physical_address = lvl2_entry.small_page.base_address();
+    // A swapped out page has nothing to free but its slot
+    if (vm_entry_is_swapped(lvl2_entry)) {
+        swap_slot_put(vm_entry_swap_slot(lvl2_entry));
+        previously_mapped_physical_address = 0;
+    } else {
+        previously_mapped_physical_address = lvl2_entry.small_page.base_address();
+    }
     lvl2_entry.raw = 0;
-    invalidate_tlb_entry(virt_addr);
+    sync_table_entries(&lvl2_entry, sizeof(lvl2_entry));
+    vm_invalidate_tlb_entry(as, virt_addr);
 
-    // If the whole level 2 table is empty, and it's not a kernel area address, we can free it
-    // Note we don't want to unmap lvl1 tables in the kernel address space because
-    // it might cause hard-to-solve inconsistencies with the other address spaces
-    if (!areas::kernel_area.contains(virt_addr)) {
+    // If the whole level 2 table is empty, and it's a user address, we can free it.
+    // The kernel's tables are kept around, they are likely to be needed again
+    if (areas::user_area.contains(virt_addr)) {
         bool whole_lvl2_table_is_empty = true;
         for (size_t i = 0; i < LVL2_ENTRIES; i++) {
             auto& entry = lvl2_table[i];
@@ -357,80 +762,54 @@ static Error vm_unmap_page(FirstLevelEntry* root_table, uintptr_t virt_addr, uin
         }
         if (whole_lvl2_table_is_empty) {
             struct PhysicalPage* p = addr2page(lvl1_entry.coarse.base_address());
-            MUST(physical_page_free(p, PageOrder::_16KB));
+            MUST(physical_page_free(p, PageOrder::_1KB));
             lvl1_entry.raw = 0;
+            sync_table_entries(&lvl1_entry, sizeof(lvl1_entry));
+            vm_invalidate_tlb_entry(as, virt_addr);
         }
     }
 
     return Success;
 }
 
-static Error vm_unmap_page(struct AddressSpace& as, uintptr_t virt_addr, uintptr_t& previously_mapped_page)
-{
-    if (areas::kernel_area.contains(virt_addr))
-        return vm_unmap_page(g_kernel_address_space.get_root_table_ptr(), virt_addr, previously_mapped_page);
-
-    TRY(vm_unmap_page(as.get_root_table_ptr(), virt_addr, previously_mapped_page));
-
-    return Success;
-}
-
 Error vm_unmap(struct AddressSpace& as, uintptr_t virt_addr, uintptr_t &previously_mapped_physical_address)
 {
     TRY(vm_unmap_page(as, virt_addr, previously_mapped_physical_address));
     return Success;
 }
 
-Error vm_copy_from_user(struct AddressSpace& as, void* dest, uintptr_t src, size_t len)
-{
-    if (g_current_address_space.ttbr0_page == as.ttbr0_page) {
-        memcpy(dest, reinterpret_cast<void*>(src), len);
-        return Success;
-    }
-
-    TODO();
-
-    return Success;
-}
-
-Error vm_copy_to_user(struct AddressSpace& as, uintptr_t dest, void const* src, size_t len)
-{
-    if (g_current_address_space.ttbr0_page == as.ttbr0_page) {
-        memcpy(reinterpret_cast<void*>(dest), src, len);
-        return Success;
-    }
-
-    TODO();
-
-    return Success;
-}
-
-Error vm_memset(struct AddressSpace& as, uintptr_t dest, uint8_t val, size_t size)
-{
-    if (g_current_address_space.ttbr0_page == as.ttbr0_page) {
-        memset(reinterpret_cast<void*>(dest), val, size);
-        return Success;
-    }
-
-    TODO();
-
-    return Success;
-}
-
 void vm_free(struct AddressSpace &as)
 {
     LOGD("Freeing address space %p", &as);
     auto *lvl1_table = as.get_root_table_ptr();
     if (lvl1_table == nullptr)
         return;
+
+    if (as.ttbr0_page == g_current_address_space->ttbr0_page)
+        vm_switch_address_space(g_kernel_address_space);
+
+    while (auto *region = as.regions.first()) {
+        as.regions.remove(region);
+        vm_free_region(region);
+    }
+
+    if (vm_has_valid_asid(as))
+        invalidate_tlb_asid(as.asid);
     
     // Note: Do not 'memset' to 0 the pages, their refcount might be > 1 !
 
-    const auto KERNEL_START = areas::kernel_area.start;
-    for (size_t i = 0; i < lvl1_index(KERNEL_START); i++) {
+    // Every 4KB page holds its own reference, whatever the size of the mapping
+    for (size_t i = 0; i < USER_LVL1_ENTRIES; i++) {
         auto &entry = lvl1_table[i]; 
-        if (entry.is_empty() || entry.is_section())
+        if (entry.is_empty())
+            continue;
+
+        if (entry.is_section()) {
+            for (size_t offset = 0; offset < _1MB; offset += _4KB)
+                MUST(physical_page_free(addr2page(entry.section.base_address() + offset), PageOrder::_4KB));
+            entry.raw = 0;
             continue;
+        }
 
         struct PhysicalPage* p = addr2page(entry.coarse.base_address());
         auto *lvl2_table = reinterpret_cast<SecondLevelEntry*>(phys2virt(entry.coarse.base_address()));
@@ -438,8 +817,13 @@ void vm_free(struct AddressSpace &as)
             auto &lvl2_entry = lvl2_table[j];
             if (lvl2_entry.raw == 0)
                 continue;
+            if (vm_entry_is_swapped(lvl2_entry)) {
+                swap_slot_put(vm_entry_swap_slot(lvl2_entry));
+                lvl2_entry.raw = 0;
+                continue;
+            }
             
-            struct PhysicalPage* p = addr2page(lvl2_entry.small_page.base_address());
+            struct PhysicalPage* p = addr2page(lvl2_entry.page_address(j));
             MUST(physical_page_free(p, PageOrder::_4KB));
             lvl2_entry.raw = 0;
         }
@@ -448,24 +832,54 @@ void vm_free(struct AddressSpace &as)
         entry.raw = 0;
     }
 
-    MUST(physical_page_free(as.ttbr0_page, PageOrder::_16KB));
+    MUST(physical_page_free(as.ttbr0_page, PageOrder::_4KB));
     as.ttbr0_page = nullptr;
 }
 
+static bool vm_is_shared_address(AddressSpace& as, uintptr_t virt_addr)
+{
+    auto *region = as.regions.find([&](VmRegion *r) { return r->contains(virt_addr); });
+    return region != nullptr && region->is_shared;
+}
+
 Error vm_fork(AddressSpace &as, AddressSpace &out_forked)
 {
     Error rc = Success;
 
-    constexpr uintptr_t kernel_start_idx = lvl1_index(areas::kernel_area.start);
     auto *src_lvl1 = as.get_root_table_ptr();
     auto *dst_lvl1 = out_forked.get_root_table_ptr();
-    for (size_t i = 0; i < kernel_start_idx; i++) {
+
+    out_forked.brk_start = as.brk_start;
+    out_forked.brk = as.brk;
+
+    for (auto *region = as.regions.last(); region != nullptr; region = region->prev) {
+        if (rc = vm_add_region(out_forked, *region); !rc.is_success()) {
+            LOGW("Failed to copy memory regions to the forked address space");
+            goto error;
+        }
+    }
+
+    for (size_t i = 0; i < USER_LVL1_ENTRIES; i++) {
         auto &entry = src_lvl1[i];
         if (entry.is_empty())
             continue;
         
-        if (entry.is_section())
-            panic("forking sections is not implemented!");
+        // Shared sections (e.g. a mapped framebuffer) are shared as they are,
+        // plain RAM has to be split to become copy-on-write one page at a time
+        if (entry.is_section()) {
+            auto &section = entry.section;
+            if (section.permissions() != PageAccessPermissions::UserFullAccess || section.memory_type() != MemoryType::Normal) {
+                for (size_t offset = 0; offset < _1MB; offset += _4KB)
+                    addr2page(section.base_address() + offset)->ref_count++;
+                dst_lvl1[i].raw = entry.raw;
+                continue;
+            }
+
+            if (rc = vm_split_section(as, i * _1MB); !rc.is_success()) {
+                LOGW("Failed to split section for forked address space");
+                goto error;
+            }
+        }
 
         kassert(entry.is_coarse_page());
         
@@ -476,26 +890,50 @@ Error vm_fork(AddressSpace &as, AddressSpace &out_forked)
         }
         memset((void*) phys2virt(page2addr(pgtable)), 0, LVL2_TABLE_SIZE);
         dst_lvl1[i].coarse = CoarsePageTableEntry::make_entry(page2addr(pgtable));
-        
+
+        auto *src_lvl2 = reinterpret_cast<SecondLevelEntry*>(phys2virt(entry.coarse.base_address()));
+        auto *dst_lvl2 = reinterpret_cast<SecondLevelEntry*>(phys2virt(dst_lvl1[i].coarse.base_address()));
         for (size_t j = 0; j < LVL2_ENTRIES; j++) {
-            auto &dst_lvl2_entry = reinterpret_cast<SecondLevelEntry*>(phys2virt(page2addr(pgtable)))[j];
-            auto &src_lvl2_entry = reinterpret_cast<SecondLevelEntry*>(phys2virt(entry.coarse.base_address()))[j];
+            auto &src_lvl2_entry = src_lvl2[j];
+            auto &dst_lvl2_entry = dst_lvl2[j];
             if (src_lvl2_entry.raw == 0)
                 continue;
-            
-            PhysicalPage *page;
-            if (rc = physical_page_alloc(PageOrder::_4KB, page); !rc.is_success()) {
-                LOGW("Failed to allocate page for forked address space");
-                goto error;
+
+            // Both address spaces read the page back from the same slot
+            if (vm_entry_is_swapped(src_lvl2_entry)) {
+                swap_slot_ref(vm_entry_swap_slot(src_lvl2_entry));
+                dst_lvl2_entry.raw = src_lvl2_entry.raw;
+                continue;
+            }
+            // Only mapped pages can become copy-on-write, the clock will age them again
+            if (vm_entry_is_aged(src_lvl2_entry))
+                vm_make_young(src_lvl2_entry);
+
+            // Plain RAM becomes copy-on-write in both address spaces, anything
+            // else (e.g. a mapped framebuffer) stays shared between the two
+            if (src_lvl2_entry.is_large_page()) {
+                auto &large_page = src_lvl2_entry.large_page;
+                if (large_page.permissions() == PageAccessPermissions::UserFullAccess && large_page.memory_type() == MemoryType::Normal)
+                    vm_split_large_page(as, src_lvl2, i * _1MB + j * _4KB);
+            }
+            if (src_lvl2_entry.is_small_page()) {
+                auto &src_page = src_lvl2_entry.small_page;
+                if (src_page.permissions() == PageAccessPermissions::UserFullAccess && src_page.memory_type() == MemoryType::Normal &&
+                    !vm_is_shared_address(as, i * _1MB + j * _4KB))
+                    src_page.set_copy_on_write(true);
             }
             
-            auto *src = reinterpret_cast<void*>(phys2virt(src_lvl2_entry.small_page.base_address()));
-            auto *dst = reinterpret_cast<void*>(phys2virt(page2addr(page)));
-
-            memcpy(dst, src, _4KB);
-            dst_lvl2_entry.small_page = SmallPageEntry::make_entry(page2addr(page), src_lvl2_entry.small_page.permissions());
+            addr2page(src_lvl2_entry.page_address(j))->ref_count++;
+            dst_lvl2_entry.raw = src_lvl2_entry.raw;
         }
+        sync_table_entries(src_lvl2, LVL2_TABLE_SIZE);
+        sync_table_entries(dst_lvl2, LVL2_TABLE_SIZE);
     }
+    sync_table_entries(dst_lvl1, USER_LVL1_TABLE_SIZE);
+
+    // The parent lost write access to its pages
+    if (vm_has_valid_asid(as))
+        invalidate_tlb_asid(as.asid);
 
     return Success;
 
@@ -505,8 +943,424 @@ error:
     return rc;
 }
 
-PageFaultHandlerResult vm_try_fix_page_fault(uintptr_t instruction_addr, uintptr_t fault_addr)
+/**
+ * \brief The level 2 entry for 'virt_addr', nullptr if the address is not translated by a level 2 table
+*/
+static SecondLevelEntry *vm_find_lvl2_entry(FirstLevelEntry *root_table, uintptr_t virt_addr)
 {
+    auto& lvl1_entry = root_table[lvl1_index(virt_addr)];
+    if (!lvl1_entry.is_coarse_page())
+        return nullptr;
+
+    auto *lvl2_table = reinterpret_cast<SecondLevelEntry*>(phys2virt(lvl1_entry.coarse.base_address()));
+    return &lvl2_table[lvl2_index(virt_addr)];
+}
+
+static SecondLevelEntry *vm_find_small_page_entry(FirstLevelEntry *root_table, uintptr_t virt_addr)
+{
+    auto *lvl2_entry = vm_find_lvl2_entry(root_table, virt_addr);
+    if (lvl2_entry == nullptr || !lvl2_entry->is_small_page())
+        return nullptr;
+    
+    return lvl2_entry;
+}
+
+static bool vm_is_mapped(FirstLevelEntry *root_table, uintptr_t virt_addr)
+{
+    auto& lvl1_entry = root_table[lvl1_index(virt_addr)];
+    if (!lvl1_entry.is_coarse_page())
+        return !lvl1_entry.is_empty();
+
+    auto *lvl2_table = reinterpret_cast<SecondLevelEntry*>(phys2virt(lvl1_entry.coarse.base_address()));
+    return lvl2_table[lvl2_index(virt_addr)].raw != 0;
+}
+
+/**
+ * \brief Maps the whole 64KB around 'fault_addr' with a single large page of zeroes
+ * This is only done for writes to big private zero-filled areas (e.g. the
+ * heap in the .bss) where none of the 64KB has been touched yet, so that
+ * they end up using fewer TLB entries and take 16 times fewer faults
+ * \return false if the page should be populated on its own instead
+*/
+static bool vm_try_populate_large_page(AddressSpace &as, VmRegion const& region, uintptr_t fault_addr)
+{
+    uintptr_t chunk_start = round_down<uintptr_t>(fault_addr, _64KB);
+    uintptr_t chunk_end = chunk_start + _64KB;
+    if (region.is_stack || region.is_shared || region.permissions != PageAccessPermissions::UserFullAccess || region.end - region.start < LARGE_PAGE_MIN_REGION_SIZE)
+        return false;
+    if (chunk_start < region.start || region.end < chunk_end)
+        return false;
+    if (region.file != nullptr && chunk_start < region.data_end && region.data_start < chunk_end)
+        return false;
+
+    auto *root_table = as.get_root_table_ptr();
+    for (uintptr_t addr = chunk_start; addr < chunk_end; addr += _4KB) {
+        if (vm_is_mapped(root_table, addr))
+            return false;
+    }
+
+    PhysicalPage *first_page;
+    if (!physical_page_alloc_contiguous(LARGE_PAGE_REPEAT, first_page).is_success())
+        return false;
+    uintptr_t phys_addr = page2addr(first_page);
+    if (phys_addr % _64KB != 0) {
+        physical_page_free_contiguous(first_page, LARGE_PAGE_REPEAT);
+        return false;
+    }
+
+    memset(reinterpret_cast<void*>(phys2virt(phys_addr)), 0, _64KB);
+    if (!vm_map_large_page(as, phys_addr, chunk_start, region.permissions, MemoryType::Normal).is_success()) {
+        physical_page_free_contiguous(first_page, LARGE_PAGE_REPEAT);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * \brief Maps the page containing 'fault_addr' for a lazily allocated region
+*/
+static Error vm_populate_anonymous_page(AddressSpace &as, VmRegion const& region, uintptr_t fault_addr, bool is_write)
+{
+    uintptr_t virt_addr = vm_align_down_to_page(fault_addr);
+
+    if (USE_SHARED_ZERO_PAGE && !is_write) {
+        TRY(vm_map_page(as, page2addr(s_zero_page), virt_addr, region.permissions, MemoryType::Normal));
+        s_zero_page->ref_count++;
+
+        // A write to the zero page will then go through the copy-on-write path
+        if (region.permissions == PageAccessPermissions::UserFullAccess) {
+            auto *entry = vm_find_small_page_entry(as.get_root_table_ptr(), virt_addr);
+            entry->small_page.set_copy_on_write(true);
+            sync_table_entries(entry, sizeof(*entry));
+            vm_invalidate_tlb_entry(as, virt_addr);
+        }
+        return Success;
+    }
+
+    PhysicalPage *page;
+    TRY(physical_page_alloc_zeroed(page));
+    if (auto e = vm_map_page(as, page2addr(page), virt_addr, region.permissions, MemoryType::Normal); !e.is_success()) {
+        MUST(physical_page_free(page, PageOrder::_4KB));
+        return e;
+    }
+
+    return Success;
+}
+
+/**
+ * \brief Allocates a page and fills it with the contents of the region at 'virt_addr'
+*/
+static Error vm_read_file_page(VmRegion const& region, uintptr_t virt_addr, PhysicalPage *&out_page)
+{
+    PhysicalPage *page;
+    TRY(physical_page_alloc_zeroed(page));
+
+    auto *data = reinterpret_cast<uint8_t*>(phys2virt(page2addr(page)));
+
+    uintptr_t copy_start = max(virt_addr, region.data_start);
+    uintptr_t copy_end = min(virt_addr + _4KB, region.data_end);
+    if (copy_start < copy_end) {
+        // Reading from the disk needs interrupts, this is no different from
+        // a syscall: the fault handler runs on the thread's kernel stack
+        bool were_enabled = irq_enabled();
+        irq_enable();
+        ssize_t rc = vfs_pread(
+            region.file,
+            data + (copy_start - virt_addr),
+            copy_end - copy_start,
+            region.file_offset + (copy_start - region.data_start)
+        );
+        if (!were_enabled)
+            irq_disable();
+
+        if (rc < 0) {
+            LOGE("Failed to read page at %p from file: %d", virt_addr, (int) rc);
+            MUST(physical_page_free(page, PageOrder::_4KB));
+            return BadResponse;
+        }
+    }
+
+    // The page might contain code, which is fetched bypassing the D-cache
+    icache_sync_range(data, _4KB);
+
+    out_page = page;
+    return Success;
+}
+
+/**
+ * \brief Maps the page containing 'fault_addr' for a file-backed region, reading its contents from the file
+ * Pages of a shared region are only read by the first address space that touches them
+*/
+static Error vm_populate_file_page(AddressSpace &as, VmRegion const& region, uintptr_t fault_addr)
+{
+    uintptr_t virt_addr = vm_align_down_to_page(fault_addr);
+    PhysicalPage *page = nullptr;
+
+    // Regions can be shrunk or split, but their data never moves
+    size_t image_offset = 0;
+    if (region.image != nullptr) {
+        image_offset = virt_addr - (region.data_start - region.image->data_offset);
+        page = imagecache_find_page(region.image, image_offset);
+    }
+
+    if (page == nullptr) {
+        TRY(vm_read_file_page(region, virt_addr, page));
+        if (region.image != nullptr)
+            page = imagecache_add_page(region.image, image_offset, page);
+    }
+
+    if (auto e = vm_map_page(as, page2addr(page), virt_addr, region.permissions, MemoryType::Normal); !e.is_success()) {
+        MUST(physical_page_free(page, PageOrder::_4KB));
+        return e;
+    }
+
+    return Success;
+}
+
+/**
+ * \brief Maps the page containing 'fault_addr' for the first time, as if it was just accessed
+*/
+static Error vm_populate_page(AddressSpace &as, VmRegion const& region, uintptr_t fault_addr, bool is_write)
+{
+    // Shared pages are all there from the start, something unmapped this one
+    if (region.is_shared)
+        return BadParameters;
+
+    if (is_write && vm_try_populate_large_page(as, region, fault_addr))
+        return Success;
+
+    if (region.file != nullptr)
+        return vm_populate_file_page(as, region, fault_addr);
+    return vm_populate_anonymous_page(as, region, fault_addr, is_write);
+}
+
+/**
+ * \brief Gives the faulting address space its own writable copy of a copy-on-write page
+ * If nobody else is referencing the page anymore it is made writable in place
+*/
+static Error vm_break_copy_on_write(AddressSpace const& as, SecondLevelEntry &entry, uintptr_t virt_addr)
+{
+    auto &small_page = entry.small_page;
+    PhysicalPage *shared_page = addr2page(small_page.base_address());
+
+    if (shared_page->ref_count > 1) {
+        PhysicalPage *copy;
+        TRY(physical_page_alloc(PageOrder::_4KB, copy));
+        auto *data = reinterpret_cast<void*>(phys2virt(page2addr(copy)));
+        memcpy(data, reinterpret_cast<void const*>(phys2virt(page2addr(shared_page))), _4KB);
+        // The copy might contain code, which is fetched bypassing the D-cache
+        icache_sync_range(data, _4KB);
+        small_page = vm_make_small_page_entry(page2addr(copy), virt_addr, small_page.permissions(), small_page.memory_type());
+        MUST(physical_page_free(shared_page, PageOrder::_4KB));
+    } else {
+        small_page.set_copy_on_write(false);
+    }
+
+    sync_table_entries(&entry, sizeof(entry));
+    vm_invalidate_tlb_entry(as, virt_addr);
+    return Success;
+}
+
+/**
+ * \brief Whether the page at 'virt_addr' was taken away by the swap clock
+*/
+static bool vm_is_paged_out(AddressSpace& as, uintptr_t virt_addr)
+{
+    auto *entry = vm_find_lvl2_entry(as.get_root_table_ptr(), virt_addr);
+    return entry != nullptr && (vm_entry_is_aged(*entry) || vm_entry_is_swapped(*entry));
+}
+
+/**
+ * \brief Maps back the page at 'virt_addr' after the swap clock aged it or swapped it out
+ * Reading a page from the swap device sleeps and the address space can change in
+ * the meantime: the page is only mapped if the entry still refers to the same slot,
+ * otherwise whatever is there now is left for the caller to look at again.
+*/
+static Error vm_page_in(AddressSpace& as, uintptr_t virt_addr)
+{
+    virt_addr = vm_align_down_to_page(virt_addr);
+    auto *entry = vm_find_lvl2_entry(as.get_root_table_ptr(), virt_addr);
+    kassert(entry != nullptr);
+
+    if (vm_entry_is_aged(*entry)) {
+        vm_make_young(*entry);
+        sync_table_entries(entry, sizeof(*entry));
+        vm_invalidate_tlb_entry(as, virt_addr);
+        return Success;
+    }
+
+    uint32_t slot = vm_entry_swap_slot(*entry);
+    PhysicalPage *page;
+    TRY(physical_page_alloc(PageOrder::_4KB, page));
+
+    // Nobody else can get the slot while it is being read, even if the entry goes away
+    swap_slot_ref(slot);
+    Error rc = swap_read(slot, page);
+
+    entry = vm_find_lvl2_entry(as.get_root_table_ptr(), virt_addr);
+    auto *region = as.regions.find([&](VmRegion *r) { return r->contains(virt_addr); });
+    if (rc.is_success() && entry != nullptr && region != nullptr && vm_entry_is_swapped(*entry) && vm_entry_swap_slot(*entry) == slot) {
+        // The page might contain code, which is fetched bypassing the D-cache
+        icache_sync_range(reinterpret_cast<void*>(phys2virt(page2addr(page))), _4KB);
+
+        entry->small_page = vm_make_small_page_entry(page2addr(page), virt_addr, region->permissions, MemoryType::Normal);
+        sync_table_entries(entry, sizeof(*entry));
+        vm_invalidate_tlb_entry(as, virt_addr);
+        swap_slot_put(slot);
+        page = nullptr;
+    }
+
+    swap_slot_put(slot);
+    if (page != nullptr)
+        MUST(physical_page_free(page, PageOrder::_4KB));
+
+    return rc;
+}
+
+/**
+ * \brief Whether the page mapped by 'entry' at 'virt_addr' can be swapped out
+ * Only pages that belong to this address space alone can go: large pages, shared
+ * memory, devices and pages that are also mapped somewhere else (e.g. the zero
+ * page, copy-on-write pages and the pages of executables) always stay
+*/
+static bool vm_is_swappable(AddressSpace& as, SecondLevelEntry entry, uintptr_t virt_addr)
+{
+    if (!entry.is_small_page() && !vm_entry_is_aged(entry))
+        return false;
+    if (entry.small_page.memory_type() != MemoryType::Normal || entry.small_page.permissions() == PageAccessPermissions::PriviledgedOnly)
+        return false;
+
+    auto *page = addr2page(entry.small_page.base_address());
+    if (page == s_zero_page || page->ref_count != 1)
+        return false;
+
+    auto *region = as.regions.find([&](VmRegion *r) { return r->contains(virt_addr); });
+    return region != nullptr && !region->is_shared;
+}
+
+bool vm_swap_clock(AddressSpace& as, uintptr_t& cursor, size_t& budget, PhysicalPage *&out_page, uint32_t& out_slot)
+{
+    auto *root_table = as.get_root_table_ptr();
+    if (root_table == nullptr) {
+        cursor = 0;
+        return false;
+    }
+
+    while (budget > 0 && cursor < areas::user_area.end) {
+        budget--;
+
+        auto& lvl1_entry = root_table[lvl1_index(cursor)];
+        if (!lvl1_entry.is_coarse_page()) {
+            cursor = round_down<uintptr_t>(cursor, _1MB) + _1MB;
+            continue;
+        }
+
+        auto *lvl2_table = reinterpret_cast<SecondLevelEntry*>(phys2virt(lvl1_entry.coarse.base_address()));
+        auto& entry = lvl2_table[lvl2_index(cursor)];
+        uintptr_t virt_addr = cursor;
+        cursor += _4KB;
+        if (!vm_is_swappable(as, entry, virt_addr))
+            continue;
+
+        // Second chance: if the page is used before the hand comes back, it stays
+        if (entry.is_small_page()) {
+            entry.raw &= ~0b11u;
+            sync_table_entries(&entry, sizeof(entry));
+            vm_invalidate_tlb_entry(as, virt_addr);
+            continue;
+        }
+
+        uint32_t slot;
+        if (!swap_slot_alloc(slot).is_success()) {
+            cursor = virt_addr;
+            return false;
+        }
+
+        out_page = addr2page(entry.small_page.base_address());
+        out_slot = slot;
+        entry = vm_make_swap_entry(slot);
+        sync_table_entries(&entry, sizeof(entry));
+        return true;
+    }
+
+    if (cursor >= areas::user_area.end)
+        cursor = 0;
+    return false;
+}
+
+bool vm_swap_cancel(AddressSpace& as, uintptr_t virt_addr, uint32_t slot, PhysicalPage *page)
+{
+    auto *root_table = as.get_root_table_ptr();
+    if (root_table == nullptr)
+        return false;
+
+    auto *entry = vm_find_lvl2_entry(root_table, virt_addr);
+    auto *region = as.regions.find([&](VmRegion *r) { return r->contains(virt_addr); });
+    if (entry == nullptr || region == nullptr || !vm_entry_is_swapped(*entry) || vm_entry_swap_slot(*entry) != slot)
+        return false;
+
+    entry->small_page = vm_make_small_page_entry(page2addr(page), virt_addr, region->permissions, MemoryType::Normal);
+    sync_table_entries(entry, sizeof(*entry));
+    vm_invalidate_tlb_entry(as, virt_addr);
+    swap_slot_put(slot);
+
+    return true;
+}
+
+/**
+ * \brief Tries to free some memory after 'rc' said that there was none left
+ * \return true if something was freed, and whatever failed is worth retrying
+*/
+static bool vm_reclaim_after(Error rc)
+{
+    if (rc.generic_error_code != GenericErrorCode::OutOfMemory)
+        return false;
+
+    return shrinker_reclaim(RECLAIM_BATCH) > 0 || swap_reclaim(RECLAIM_BATCH) > 0;
+}
+
+PageFaultHandlerResult vm_try_fix_page_fault(uintptr_t instruction_addr, uintptr_t fault_addr, bool is_write)
+{
+    // Pages that the swap clock took away come back first, then the
+    // access is retried and goes through the rest of this if it has to
+    if (areas::user_area.contains(fault_addr) && vm_is_paged_out(*g_current_address_space, fault_addr)) {
+        if (Error rc = vm_page_in(*g_current_address_space, fault_addr); rc.is_success() || vm_reclaim_after(rc))
+            return PageFaultHandlerResult::Fixed;
+
+        LOGE("Failed to swap in page at %p", fault_addr);
+        return PageFaultHandlerResult::ProcessFatal;
+    }
+
+    // Writes to a copy-on-write page can come both from the process itself
+    // and from the kernel while it is writing to a user's buffer.
+    // Running out of memory is not fatal as long as some can be freed: the
+    // access is retried and will fault again
+    if (is_write && areas::user_area.contains(fault_addr)) {
+        auto *entry = vm_find_small_page_entry(g_current_address_space->get_root_table_ptr(), fault_addr);
+        if (entry != nullptr && entry->small_page.is_copy_on_write()) {
+            if (Error rc = vm_break_copy_on_write(*g_current_address_space, *entry, fault_addr); rc.is_success() || vm_reclaim_after(rc))
+                return PageFaultHandlerResult::Fixed;
+            
+            LOGE("Out of memory while copying page at %p", fault_addr);
+            return PageFaultHandlerResult::ProcessFatal;
+        }
+    }
+
+    // First access to a page of a lazily allocated region
+    if (areas::user_area.contains(fault_addr)) {
+        auto &as = *g_current_address_space;
+        auto *region = as.regions.find([&](VmRegion *r) { return r->contains(fault_addr); });
+        if (region != nullptr && !vm_is_mapped(as.get_root_table_ptr(), fault_addr)) {
+            if (Error rc = vm_populate_page(as, *region, fault_addr, is_write); rc.is_success() || vm_reclaim_after(rc))
+                return PageFaultHandlerResult::Fixed;
+
+            LOGE("Failed to populate page at %p", fault_addr);
+            return PageFaultHandlerResult::ProcessFatal;
+        }
+    }
+
+
     // This is the user process either trying to illegally access kernel memory
     // or the process messing up with its own memory.
     // Either way, it's a fatal error for the process.
@@ -514,37 +1368,295 @@ PageFaultHandlerResult vm_try_fix_page_fault(uintptr_t instruction_addr, uintptr
         return PageFaultHandlerResult::ProcessFatal;
     }
 
-    kassert(areas::kernel_area.contains(instruction_addr));
+    // The kernel is mapped the same way in every address space, whatever
+    // it faulted on there is nothing that can be fixed: this is a bug
+    return PageFaultHandlerResult::KernelFatal;
+}
+
+/**
+ * \brief The physical address and permissions of whatever maps 'virt_addr' in 'root_table'
+ * \return false if the address is not mapped
+*/
+static bool vm_resolve(FirstLevelEntry *root_table, uintptr_t virt_addr, uintptr_t& out_phys_addr, PageAccessPermissions& out_permissions)
+{
+    auto& lvl1_entry = root_table[lvl1_index(virt_addr)];
+    if (lvl1_entry.is_section()) {
+        out_phys_addr = lvl1_entry.section.base_address() | (virt_addr & (_1MB - 1));
+        out_permissions = lvl1_entry.section.permissions();
+        return true;
+    }
+    if (!lvl1_entry.is_coarse_page())
+        return false;
+
+    auto *lvl2_table = reinterpret_cast<SecondLevelEntry*>(phys2virt(lvl1_entry.coarse.base_address()));
+    auto& lvl2_entry = lvl2_table[lvl2_index(virt_addr)];
+    if (lvl2_entry.is_large_page()) {
+        out_phys_addr = lvl2_entry.large_page.base_address() | (virt_addr & (_64KB - 1));
+        out_permissions = lvl2_entry.large_page.permissions();
+        return true;
+    }
+    if (!lvl2_entry.is_small_page())
+        return false;
+
+    out_phys_addr = lvl2_entry.small_page.base_address() | (virt_addr & (_4KB - 1));
+    out_permissions = lvl2_entry.small_page.permissions();
+    return true;
+}
 
-    // Kernel faulted while accessing user's memory, this is a bug
-    if (!areas::kernel_area.contains(fault_addr)) {
-        return PageFaultHandlerResult::KernelFatal;
+static Error vm_try_user_addr_to_kernel(AddressSpace& as, uintptr_t virt_addr, bool is_write, uint8_t *&out_addr)
+{
+    if (!areas::user_area.contains(virt_addr))
+        return BadParameters;
+
+    auto *root_table = as.get_root_table_ptr();
+    while (vm_is_paged_out(as, virt_addr))
+        TRY(vm_page_in(as, virt_addr));
+
+    if (!vm_is_mapped(root_table, virt_addr)) {
+        auto *region = as.regions.find([&](VmRegion *r) { return r->contains(virt_addr); });
+        if (region == nullptr)
+            return BadParameters;
+        TRY(vm_populate_page(as, *region, virt_addr, is_write));
     }
 
-    kassert(areas::kernel_area.contains(fault_addr));
+    if (is_write) {
+        auto *entry = vm_find_small_page_entry(root_table, virt_addr);
+        if (entry != nullptr && entry->small_page.is_copy_on_write())
+            TRY(vm_break_copy_on_write(as, *entry, virt_addr));
+    }
 
-    // Kernel faulted while accessing kernel memory: there's a chance of recovering.
-    // 
-    // If the fault is due to a missing lvl1 table in the kernel area, but the main
-    // kernel address space has a valid entry, then it's just that the process' address
-    // space was created before the new mapping was added
+    uintptr_t phys_addr;
+    PageAccessPermissions permissions;
+    if (!vm_resolve(root_table, virt_addr, phys_addr, permissions))
+        return BadParameters;
+    if (permissions == PageAccessPermissions::PriviledgedOnly || (is_write && permissions != PageAccessPermissions::UserFullAccess))
+        return BadParameters;
 
+    out_addr = reinterpret_cast<uint8_t*>(phys2virt(phys_addr));
+    return Success;
+}
 
-    uintptr_t phys_ttbr0_addr = vm_read_current_ttbr0();
-    auto *lvl1_kernel_table = g_kernel_address_space.get_root_table_ptr();
+/**
+ * \brief Finds 'virt_addr' of 'as' in the kernel's mapping of the physical memory
+ * This is how the kernel reaches into an address space that is not the current
+ * one: every page is mapped there already, so there is no need to switch TTBR0
+ * or to touch the TLB. Pages that were never accessed are populated, swapped out
+ * ones are read back, and copy-on-write ones are copied before a write, just
+ * like the fault handler would do if the process accessed them itself.
+*/
+static Error vm_user_addr_to_kernel(AddressSpace& as, uintptr_t virt_addr, bool is_write, uint8_t *&out_addr)
+{
+    while (true) {
+        Error rc = vm_try_user_addr_to_kernel(as, virt_addr, is_write, out_addr);
+        if (rc.is_success() || !vm_reclaim_after(rc))
+            return rc;
+    }
+}
 
-    if (lvl1_kernel_table[lvl1_index(fault_addr)].raw == 0)
-        return PageFaultHandlerResult::KernelFatal;
-    
-    FirstLevelEntry kernel_lvl1_entry = lvl1_kernel_table[lvl1_index(fault_addr)];
-    auto *lvl1_ttbr0_table = reinterpret_cast<FirstLevelEntry*>(phys2virt(phys_ttbr0_addr));
-    auto& ttbr0_lvl1_entry = lvl1_ttbr0_table[lvl1_index(fault_addr)];
+/**
+ * \brief Calls 'callback(kernel_addr, offset, size)' for each piece of [addr, addr+len) that lies in a single page
+*/
+template<typename Callback>
+static Error vm_foreach_user_page(AddressSpace& as, uintptr_t addr, size_t len, bool is_write, Callback callback)
+{
+    size_t offset = 0;
+    while (offset < len) {
+        uint8_t *kernel_addr;
+        TRY(vm_user_addr_to_kernel(as, addr + offset, is_write, kernel_addr));
+
+        size_t size = min(len - offset, _4KB - (addr + offset) % _4KB);
+        callback(kernel_addr, offset, size);
+        offset += size;
+    }
 
-    if (ttbr0_lvl1_entry.raw == 0) {
-        ttbr0_lvl1_entry = kernel_lvl1_entry;
-        invalidate_tlb_entry(fault_addr);
-        return PageFaultHandlerResult::Fixed;
+    return Success;
+}
+
+Error vm_map_stack(struct AddressSpace& as, uintptr_t top, size_t max_size)
+{
+    kassert(vm_addr_is_page_aligned(top) && vm_addr_is_page_aligned(max_size) && max_size >= _4KB);
+
+    TRY(vm_add_region(as, VmRegion {
+        .prev = nullptr,
+        .next = nullptr,
+        .start = top - max_size,
+        .end = top,
+        .permissions = PageAccessPermissions::UserFullAccess,
+        .file = nullptr,
+        .file_offset = 0,
+        .data_start = 0,
+        .data_end = 0,
+        .image = nullptr,
+        .is_stack = true,
+        .is_shared = false,
+    }));
+
+    // The thread is going to write there straight away
+    auto *region = as.regions.find([&](VmRegion *r) { return r->start == top - max_size; });
+    if (Error rc = vm_populate_page(as, *region, top - _4KB, true); !rc.is_success()) {
+        as.regions.remove(region);
+        vm_free_region(region);
+        return rc;
     }
 
-    return PageFaultHandlerResult::KernelFatal;
+    return Success;
+}
+
+Error vm_unmap_range(struct AddressSpace& as, uintptr_t start, uintptr_t end)
+{
+    kassert(vm_addr_is_page_aligned(start) && vm_addr_is_page_aligned(end));
+    kassert(areas::user_area.contains(start) && end <= areas::user_area.end);
+    if (start >= end)
+        return Success;
+
+    // A hole in the middle of a region leaves two of them, this is the
+    // only step that can fail so it is done before touching anything else
+    auto *outer = as.regions.find([&](VmRegion *r) { return r->start < start && end < r->end; });
+    if (outer != nullptr) {
+        VmRegion tail = *outer;
+        tail.prev = tail.next = nullptr;
+        tail.start = end;
+        outer->end = start;
+        if (Error rc = vm_add_region(as, tail); !rc.is_success()) {
+            outer->end = tail.end;
+            return rc;
+        }
+    }
+
+    for (auto *region = as.regions.first(); region != nullptr;) {
+        auto *next = region->next;
+        if (start <= region->start && region->end <= end) {
+            as.regions.remove(region);
+            vm_free_region(region);
+        } else if (region->start < start && start < region->end) {
+            region->end = start;
+        } else if (region->start < end && end < region->end) {
+            region->start = end;
+        }
+        region = next;
+    }
+
+    auto *root_table = as.get_root_table_ptr();
+    for (uintptr_t addr = start; addr < end;) {
+        if (root_table[lvl1_index(addr)].is_empty()) {
+            addr = round_down<uintptr_t>(addr, _1MB) + _1MB;
+            continue;
+        }
+
+        uintptr_t phys_addr;
+        TRY(vm_unmap_page(as, addr, phys_addr));
+        if (phys_addr != 0)
+            MUST(physical_page_free(addr2page(phys_addr), PageOrder::_4KB));
+        addr += _4KB;
+    }
+
+    return Success;
+}
+
+bool vm_range_is_free(struct AddressSpace& as, uintptr_t start, uintptr_t end)
+{
+    if (as.regions.find([&](VmRegion *r) { return r->start < end && start < r->end; }))
+        return false;
+
+    // Some pages (e.g. the stacks and mapped devices) are not part of any region
+    auto *root_table = as.get_root_table_ptr();
+    for (uintptr_t addr = start; addr < end;) {
+        if (root_table[lvl1_index(addr)].is_empty()) {
+            addr = round_down<uintptr_t>(addr, _1MB) + _1MB;
+            continue;
+        }
+        if (vm_is_mapped(root_table, addr))
+            return false;
+        addr += _4KB;
+    }
+
+    return true;
+}
+
+Error vm_find_free_range(struct AddressSpace& as, size_t size, uintptr_t& out_start)
+{
+    size = vm_align_up_to_page(size);
+    if (size == 0 || size > areas::user_mmap.size())
+        return BadParameters;
+
+    // First fit, skipping past whatever is in the way
+    uintptr_t candidate = areas::user_mmap.start;
+    while (candidate <= areas::user_mmap.end - size) {
+        auto *region = as.regions.find([&](VmRegion *r) { return r->start < candidate + size && candidate < r->end; });
+        if (region != nullptr) {
+            candidate = region->end;
+            continue;
+        }
+        if (!vm_range_is_free(as, candidate, candidate + size)) {
+            candidate += _4KB;
+            continue;
+        }
+
+        out_start = candidate;
+        return Success;
+    }
+
+    return OutOfMemory;
+}
+
+Error vm_set_brk(struct AddressSpace& as, uintptr_t new_brk)
+{
+    if (new_brk < as.brk_start || new_brk > areas::user_mmap.start)
+        return BadParameters;
+
+    uintptr_t old_end = vm_align_up_to_page(as.brk);
+    uintptr_t new_end = vm_align_up_to_page(new_brk);
+    if (new_end > old_end) {
+        if (!vm_range_is_free(as, old_end, new_end))
+            return OutOfMemory;
+
+        auto *heap = as.regions.find([&](VmRegion *r) {
+            return r->end == old_end && r->start >= as.brk_start && r->file == nullptr;
+        });
+        if (heap != nullptr)
+            heap->end = new_end;
+        else
+            TRY(vm_map_anonymous(as, old_end, new_end - old_end, PageAccessPermissions::UserFullAccess));
+    } else if (new_end < old_end) {
+        TRY(vm_unmap_range(as, new_end, old_end));
+    }
+
+    as.brk = new_brk;
+    return Success;
+}
+
+Error vm_copy_from_user(struct AddressSpace& as, void* dest, uintptr_t src, size_t len)
+{
+    if (g_current_address_space->ttbr0_page == as.ttbr0_page) {
+        memcpy(dest, reinterpret_cast<void*>(src), len);
+        return Success;
+    }
+
+    return vm_foreach_user_page(as, src, len, false, [&](uint8_t *page, size_t offset, size_t size) {
+        memcpy(static_cast<uint8_t*>(dest) + offset, page, size);
+    });
+}
+
+Error vm_copy_to_user(struct AddressSpace& as, uintptr_t dest, void const* src, size_t len)
+{
+    if (g_current_address_space->ttbr0_page == as.ttbr0_page) {
+        memcpy(reinterpret_cast<void*>(dest), src, len);
+        return Success;
+    }
+
+    return vm_foreach_user_page(as, dest, len, true, [&](uint8_t *page, size_t offset, size_t size) {
+        memcpy(page, static_cast<uint8_t const*>(src) + offset, size);
+    });
+}
+
+Error vm_memset(struct AddressSpace& as, uintptr_t dest, uint8_t val, size_t size)
+{
+    if (g_current_address_space->ttbr0_page == as.ttbr0_page) {
+        memset(reinterpret_cast<void*>(dest), val, size);
+        return Success;
+    }
+
+    return vm_foreach_user_page(as, dest, size, true, [&](uint8_t *page, size_t, size_t chunk_size) {
+        memset(page, val, chunk_size);
+    });
 }
@@ -7,6 +7,9 @@
 #include <kernel/memory/physicalalloc.h>
 
 
+struct FileCustody;
+struct ImageSegment;
+
 uintptr_t virt2phys(uintptr_t virt);
 
 uintptr_t phys2virt(uintptr_t phys);
@@ -31,8 +34,46 @@ static inline constexpr uintptr_t vm_align_down_to_page(uintptr_t addr)
     return addr & ~(_4KB - 1);
 }
 
+/**
+ * \brief A range of user memory whose pages are allocated lazily
+ * Pages in a region are not mapped until the first access to them faults,
+ * at that point the page fault handler maps a zero-filled page.
+ * If the region is backed by a file, the part of the page that overlaps
+ * [data_start, data_end) is read from the file instead.
+ * Read-only file-backed regions share their pages with every other address
+ * space that maps the same part of the same file through 'image'.
+*/
+struct VmRegion {
+    INTRUSIVE_LINKED_LIST_HEADER(VmRegion);
+
+    uintptr_t start;
+    uintptr_t end;
+    PageAccessPermissions permissions;
+
+    FileCustody *file;
+    uint64_t file_offset;       // Where 'data_start' is in the file
+    uintptr_t data_start;
+    uintptr_t data_end;
+    ImageSegment *image;        // nullptr if the pages are private
+    bool is_stack;              // Grows a page at a time, never with large pages
+    bool is_shared;             // Mapped up front, writes are seen by everyone mapping the pages, even after a fork
+
+    bool contains(uintptr_t addr) const { return start <= addr && addr < end; }
+};
+
 struct AddressSpace {
     struct PhysicalPage* ttbr0_page;
+    IntrusiveLinkedList<VmRegion> regions;
+
+    // The ASID tags this address space's TLB entries, it is only valid
+    // while 'asid_generation' matches the allocator's current generation
+    uint8_t asid;
+    uint32_t asid_generation;
+
+    // The heap is [brk_start, brk), see \ref vm_set_brk
+    uintptr_t brk_start;
+    uintptr_t brk;
+
     FirstLevelEntry *get_root_table_ptr() const
     {
         if (ttbr0_page == nullptr)
@@ -60,12 +101,85 @@ Error vm_init_kernel_address_space();
 
 Error vm_create_address_space(struct AddressSpace&);
 
-Error vm_map(struct AddressSpace&, struct PhysicalPage*, uintptr_t, PageAccessPermissions);
+Error vm_map(struct AddressSpace&, struct PhysicalPage*, uintptr_t, PageAccessPermissions, MemoryType = MemoryType::Normal);
+
+/**
+ * \brief Maps the physically contiguous [phys_addr, phys_addr+size) at 'virt_addr'
+ * Parts that are suitably aligned on both sides are mapped with 1MB sections
+ * and 64KB large pages, which are split if a part of them gets unmapped later.
+ * Like with \ref vm_map the caller hands over one reference to every 4KB page.
+*/
+Error vm_map_contiguous(struct AddressSpace&, uintptr_t phys_addr, uintptr_t virt_addr, size_t size, PageAccessPermissions, MemoryType = MemoryType::Normal);
 
 Error vm_map_mmio(struct AddressSpace&, uintptr_t phys_addr, uintptr_t virt_addr, size_t size);
 
+/**
+ * \brief Reserves [virt_addr, virt_addr+size) as zero-filled memory, populated on first access
+*/
+Error vm_map_anonymous(struct AddressSpace&, uintptr_t virt_addr, size_t size, PageAccessPermissions);
+
+/**
+ * \brief Reserves a stack of up to 'max_size' bytes that ends at 'top'
+ * Only the topmost page is populated right away, the others are populated
+ * as the stack grows down into them.
+*/
+Error vm_map_stack(struct AddressSpace&, uintptr_t top, size_t max_size);
+
+/**
+ * \brief Reserves [virt_addr, virt_addr+size) as memory populated on first access from a file
+ * The 'data_size' bytes at 'data_addr' are read from 'file' at 'file_offset', the rest of
+ * the range is zero-filled. The address space keeps its own reference to the file.
+ * Read-only mappings share their pages through the image cache.
+*/
+Error vm_map_file(
+    struct AddressSpace&,
+    uintptr_t virt_addr,
+    size_t size,
+    PageAccessPermissions,
+    FileCustody *file,
+    uint64_t file_offset,
+    uintptr_t data_addr,
+    size_t data_size
+);
+
+/**
+ * \brief Maps 'count' pages at 'virt_addr', in order, sharing them with whoever else maps them
+ * Each mapping takes its own reference to the pages. Unlike private memory, they stay
+ * shared with the child address space after a fork instead of becoming copy-on-write.
+*/
+Error vm_map_shared(struct AddressSpace&, uintptr_t virt_addr, PhysicalPage *const *pages, size_t count, PageAccessPermissions);
+
 Error vm_unmap(struct AddressSpace&, uintptr_t, uintptr_t&);
 
+/**
+ * \brief Removes every mapping and region in [start, end), releasing their pages
+ * Regions that only partially overlap the range are shrunk or split in two
+*/
+Error vm_unmap_range(struct AddressSpace&, uintptr_t start, uintptr_t end);
+
+/**
+ * \brief Finds 'size' bytes in \ref areas::user_mmap where nothing is mapped yet
+*/
+Error vm_find_free_range(struct AddressSpace&, size_t size, uintptr_t& out_start);
+
+/**
+ * \brief Whether nothing is mapped or reserved in [start, end)
+*/
+bool vm_range_is_free(struct AddressSpace&, uintptr_t start, uintptr_t end);
+
+/**
+ * \brief Moves the end of the heap to 'new_brk'
+ * The heap is zero-filled memory populated on first access, it can grow
+ * up to the start of \ref areas::user_mmap as long as nothing is in the way.
+ * Memory given back by shrinking it is released immediately.
+*/
+Error vm_set_brk(struct AddressSpace&, uintptr_t new_brk);
+
+/**
+ * Copies to and from an address space that is not the current one go
+ * through the kernel's mapping of the physical memory, the address space
+ * is never switched to. Pages that were never accessed are populated.
+*/
 Error vm_copy_from_user(struct AddressSpace&, void* dest, uintptr_t src, size_t len);
 
 Error vm_copy_to_user(struct AddressSpace& as, uintptr_t dest, void const* src, size_t len);
@@ -78,23 +192,30 @@ void vm_free(struct AddressSpace&);
 
 Error vm_fork(AddressSpace&, AddressSpace&);
 
-template<typename Callback>
-auto vm_using_address_space(struct AddressSpace& as, Callback c)
-{
-    if (as.ttbr0_page == vm_current_address_space().ttbr0_page)
-        return c();
-
-    auto previous = vm_current_address_space();
-    vm_switch_address_space(as);
-    auto result = c();
-    vm_switch_address_space(previous);
-
-    return result;
-}
+/**
+ * \brief Moves the swap clock hand over the private pages of 'as', starting from 'cursor'
+ * There is no hardware accessed bit: the hand unmaps the pages it goes past, and
+ * those that are still unmapped when it comes back were not used in the meantime.
+ * The first of those is replaced by a swap entry and handed to the caller, which
+ * has to write it out to 'out_slot' and drop the reference to 'out_page', or
+ * give it back with \ref vm_swap_cancel.
+ * Every page table entry looked at uses up some of 'budget'. 'cursor' is left
+ * where the hand stopped, back to 0 if it went past the end of the address space.
+ * \return false if no page was picked
+*/
+bool vm_swap_clock(AddressSpace& as, uintptr_t& cursor, size_t& budget, PhysicalPage *&out_page, uint32_t& out_slot);
+
+/**
+ * \brief Maps 'page' back at 'virt_addr' in place of the swap entry that \ref vm_swap_clock left there
+ * For when the page could not be written out. The reference to 'slot' held by
+ * the entry is dropped, the one to 'page' now belongs to the mapping.
+ * \return false if the entry no longer refers to 'slot', nothing changed then
+*/
+bool vm_swap_cancel(AddressSpace& as, uintptr_t virt_addr, uint32_t slot, PhysicalPage *page);
 
 enum class PageFaultHandlerResult {
     Fixed,
     ProcessFatal,
     KernelFatal
 };
-PageFaultHandlerResult vm_try_fix_page_fault(uintptr_t instruction_addr, uintptr_t fault_addr);
+PageFaultHandlerResult vm_try_fix_page_fault(uintptr_t instruction_addr, uintptr_t fault_addr, bool is_write);
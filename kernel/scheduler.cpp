@@ -1,10 +1,12 @@
 #include <unistd.h>
 #include <kernel/arch/arch.h>
 #include <kernel/memory/areas.h>
+#include <kernel/memory/slab.h>
 #include <kernel/memory/vm.h>
 #include <kernel/timer.h>
 #include <kernel/locking/irqlock.h>
 #include <kernel/locking/mutex.h>
+#include <kernel/locking/waitqueue.h>
 #include <kernel/lib/arrayutils.h>
 #include <kernel/lib/intrusivelinkedlist.h>
 #include <kernel/task/elfloader.h>
@@ -18,6 +20,23 @@
 #define LOG_TAG "SCHED"
 #include <kernel/log.h>
 
+/* How long a thread can keep the CPU before being preempted */
+#ifndef CONFIG_SCHEDULER_QUANTUM_MS
+#define CONFIG_SCHEDULER_QUANTUM_MS 10
+#endif
+
+/* Default limit to the size of the user stacks */
+#ifndef CONFIG_USER_STACK_LIMIT
+#define CONFIG_USER_STACK_LIMIT (1 * _1MB)
+#endif
+
+/**
+ * Each thread gets this much address space for its stack, counting down from
+ * the end of the user area. The lowest page is never mapped, so that a thread
+ * that overflows its stack crashes instead of writing over its neighbour's.
+*/
+static constexpr size_t USER_STACK_SLOT_SIZE = 2 * _1MB;
+static constexpr size_t USER_STACK_MAX_SIZE = USER_STACK_SLOT_SIZE - _4KB;
 
 int s_next_available_pid = 0;
 static bool g_scheduler_has_started = false;
@@ -25,7 +44,21 @@ static Thread *s_current_thread = nullptr;
 static Thread *s_all_threads[64] = {0};
 static size_t s_all_threads_len = 0;
 static ContextSwitchFrame *s_scheduler_ctx = nullptr;
+static uint32_t s_slice_start_ms = 0;
+static bool s_need_resched = false;
+
+
+static void process_ctor(void *object)
+{
+    auto *process = static_cast<Process*>(object);
+    for (auto& file : process->openfiles)
+        file = nullptr;
+    process->process_exit_listeners = {};
+}
 
+// Processes go back to their cache without open files and exit listeners
+static SlabCache s_process_cache = slab_cache("process", sizeof(Process), process_ctor);
+static SlabCache s_thread_cache = slab_cache("thread", sizeof(Thread));
 
 static void free_process(Process *process);
 static void free_thread(Thread *thread);
@@ -50,6 +83,7 @@ static void free_process(Process *process)
 
         LOGD("Closing file %d", i);
         vfs_close(custody);
+        process->openfiles[i] = nullptr;
     }
     LOGD("All files closed, freeing address space");
     
@@ -58,7 +92,7 @@ static void free_process(Process *process)
     
     free(process->working_directory);
 
-    kfree(process);
+    slab_free(s_process_cache, process);
 
     release(lock);
 }
@@ -67,7 +101,6 @@ static void free_thread(Thread *thread)
 {
     auto lock = irq_lock();
     Process *parent = thread->process;
-    kfree(thread);
 
     LOGD("Freeing thread %s[%d/%d]", parent->name, parent->pid, thread->tid);
     array_swap_remove(parent->threads.data, parent->threads.count, thread);
@@ -78,6 +111,7 @@ static void free_thread(Thread *thread)
     if (idx != s_all_threads_len) {
         s_all_threads[idx] = nullptr;
     }
+    slab_free(s_thread_cache, thread);
 
     if (parent->threads.count == 0)
         free_process(parent);
@@ -104,31 +138,17 @@ static void free_kernel_stack(void *kernel_stack_ptr)
     physical_page_free(page, PageOrder::_4KB);
 }
 
-static void *alloc_thread_user_stack(AddressSpace *address_space, int tid)
+/**
+ * Only the topmost page of the stack is allocated, the rest is populated
+ * on demand as the thread grows its stack, up to 'limit' bytes
+*/
+static void *alloc_thread_user_stack(AddressSpace *address_space, int tid, size_t limit)
 {
-    static constexpr size_t STARTING_SIZE = _4KB * 4;
-    static constexpr size_t MAX_SIZE = 2 * _1MB;
-    uintptr_t startaddr = areas::KERNEL_VIRT_START_ADDR - (MAX_SIZE * tid);
-
-    PhysicalPage *pages[STARTING_SIZE / _4KB] = {0};
-    for (size_t i = 0; i < array_size(pages); i++) {
-        if (!physical_page_alloc(PageOrder::_4KB, pages[i]).is_success()) {
-
-            for (size_t j = 0; j < i; j++) {
-                physical_page_free(pages[j], PageOrder::_4KB);
-            }
-            return nullptr;
+    uintptr_t startaddr = areas::user_area.end - (USER_STACK_SLOT_SIZE * tid);
+    limit = vm_align_up_to_page(min(max(limit, _4KB), USER_STACK_MAX_SIZE));
 
-        }
-    }
-
-    auto lock = irq_lock();
-    for (size_t i = 0; i < array_size(pages); i++) {
-        uintptr_t virt = startaddr - ((i + 1) * _4KB);
-        MUST(vm_map(*address_space, pages[i], virt, PageAccessPermissions::UserFullAccess));
-    }
-
-    release(lock);
+    if (!vm_map_stack(*address_space, startaddr, limit).is_success())
+        return nullptr;
 
     return reinterpret_cast<void*>(startaddr - 8);
 }
@@ -212,52 +232,61 @@ static void free_array_of_strings(char *const *array, size_t array_size)
  * strings was placed.
  * 
  * This function moves the stack pointer and also aligns it to the ARCH_STACK_ALIGNMENT
- * boundary.
+ * boundary. The stack belongs to 'as', which does not need to be the current address space.
+ * Returns nullptr if the stack could not be written to.
  */
 static uint8_t *push_string_array_to_stack(
+    AddressSpace& as,
     uint8_t *userstack,
     char const* const array[],
     size_t array_size,
     uintptr_t *out_array_start_addr    
 )
 {
-    const char **user_array = nullptr;
+    uintptr_t user_array;
 
     userstack -= sizeof(uintptr_t) * array_size;
-    user_array = reinterpret_cast<const char**>(userstack);
+    user_array = reinterpret_cast<uintptr_t>(userstack);
     
     for (size_t i = 0; i < array_size; i++) {
         size_t len = strlen(array[i]) + 1;
         userstack -= len;
-        memcpy(userstack, array[i], len);
-        user_array[i] = reinterpret_cast<const char*>(userstack);
+        uintptr_t user_string = reinterpret_cast<uintptr_t>(userstack);
+        if (!vm_copy_to_user(as, user_string, array[i], len).is_success() ||
+            !vm_copy_to_user(as, user_array + i * sizeof(uintptr_t), &user_string, sizeof(user_string)).is_success())
+            return nullptr;
         LOGI("String '%s' stack-placed at %p", array[i], userstack);
     }
 
-    *out_array_start_addr = reinterpret_cast<uintptr_t>(user_array);
+    *out_array_start_addr = user_array;
     userstack = (uint8_t*) round_down((uintptr_t) userstack, ARCH_STACK_ALIGNMENT);
 
     return userstack;
 }
 
-static uint8_t *push_process_args(uint8_t *userstack,
+static uint8_t *push_process_args(AddressSpace& as, uint8_t *userstack,
     char *const argv[], size_t argc,
     char *const envp[], size_t envc
 )
 {
     uintptr_t user_argv, user_envp;
 
-    userstack = push_string_array_to_stack(userstack, argv, argc, &user_argv);
-    userstack = push_string_array_to_stack(userstack, envp, envc, &user_envp);
+    userstack = push_string_array_to_stack(as, userstack, argv, argc, &user_argv);
+    if (userstack == nullptr)
+        return nullptr;
+    userstack = push_string_array_to_stack(as, userstack, envp, envc, &user_envp);
+    if (userstack == nullptr)
+        return nullptr;
 
     userstack -= sizeof(ArmCrt0InitialStackState);
-    ArmCrt0InitialStackState *state = (ArmCrt0InitialStackState*) userstack;
-    *state = (ArmCrt0InitialStackState) {
+    ArmCrt0InitialStackState state = {
         .argc = argc,
         .argv = (char**) user_argv,
         .envc = envc,
         .envp = (char**) user_envp,
     };
+    if (!vm_copy_to_user(as, reinterpret_cast<uintptr_t>(userstack), &state, sizeof(state)).is_success())
+        return nullptr;
 
     userstack = (uint8_t*) round_down((uintptr_t) userstack, ARCH_STACK_ALIGNMENT);
 
@@ -284,6 +313,20 @@ static Process *lookup_process_by_pid(int pid)
     return nullptr;
 }
 
+Process *scheduler_next_process(int pid)
+{
+    Process *next = nullptr;
+    for (size_t i = 0; i < array_size(s_all_threads); i++) {
+        Thread *thread = s_all_threads[i];
+        if (thread == nullptr || thread->process->pid <= pid || thread->process->is_zombie())
+            continue;
+        if (next == nullptr || thread->process->pid < next->pid)
+            next = thread->process;
+    }
+
+    return next;
+}
+
 /**
  * \brief Allocates a new process with 1 thread
  * 
@@ -301,9 +344,9 @@ static Process *lookup_process_by_pid(int pid)
 */
 static Process *alloc_process(const char *name, void (*entrypoint)(), bool privileged)
 {
-    Process *new_process = (Process*) malloc(sizeof(Process));
+    Process *new_process = slab_alloc<Process>(s_process_cache);
     Thread **threads_array = (Thread**) malloc(sizeof(Thread*));
-    Thread *first_thread = (Thread*) malloc(sizeof(Thread));
+    Thread *first_thread = slab_alloc<Thread>(s_thread_cache);
     void *user_stack = nullptr;
 
     if (new_process == nullptr || threads_array == nullptr || first_thread == nullptr) {
@@ -313,6 +356,7 @@ static Process *alloc_process(const char *name, void (*entrypoint)(), bool privi
 
     new_process->next_available_tid = 0;
     new_process->exit_code = 0;
+    new_process->stack_limit = CONFIG_USER_STACK_LIMIT;
     new_process->pid = s_next_available_pid++;
     strcpy(const_cast<char*>(new_process->name), name);
     new_process->working_directory = strdup("/");
@@ -330,8 +374,6 @@ static Process *alloc_process(const char *name, void (*entrypoint)(), bool privi
     new_process->threads.allocated = 1;
     new_process->threads.count = 1;
     new_process->threads.data[0] = first_thread;
-    for (size_t i = 0; i < array_size(new_process->openfiles); i++)
-        new_process->openfiles[i] = nullptr;
 
     first_thread->tid = new_process->next_available_tid++;
     first_thread->process = new_process;
@@ -341,10 +383,13 @@ static Process *alloc_process(const char *name, void (*entrypoint)(), bool privi
         goto cleanup;
     }
     first_thread->state = ThreadState::Suspended;
-    user_stack = alloc_thread_user_stack(&new_process->address_space, 0);
-    if (user_stack == nullptr) {
-        LOGE("Failed to allocate user stack for first thread of new process %s\n", name);
-        goto cleanup;
+    // A forked process gets its stack along with the rest of its parent's address space
+    if (entrypoint != nullptr) {
+        user_stack = alloc_thread_user_stack(&new_process->address_space, 0, new_process->stack_limit);
+        if (user_stack == nullptr) {
+            LOGE("Failed to allocate user stack for first thread of new process %s\n", name);
+            goto cleanup;
+        }
     }
 
     arch_create_initial_kernel_stack(
@@ -363,9 +408,9 @@ cleanup:
             free_kernel_stack(new_process->threads.data[0]->kernel_stack_ptr);
         }
     }
-    free(new_process);
+    slab_free(s_process_cache, new_process);
     free(threads_array);
-    free(first_thread);
+    slab_free(s_thread_cache, first_thread);
 
 
     return nullptr;
@@ -400,11 +445,28 @@ void create_first_process(void (*entrypoint)(void))
     s_current_thread = thread;
 }
 
+static void scheduler_tick(InterruptFrame*)
+{
+    if (get_ticks_ms() - s_slice_start_ms >= CONFIG_SCHEDULER_QUANTUM_MS)
+        s_need_resched = true;
+}
+
+void scheduler_preempt_if_needed(InterruptFrame *frame)
+{
+    // Kernel code is not preemptible, the flag stays set until we're back to userspace
+    if (!s_need_resched || !g_scheduler_has_started || !frame->is_from_user_mode())
+        return;
+
+    s_need_resched = false;
+    sys$yield();
+}
+
 void scheduler_start()
 {
-    // timer_install_scheduler_callback(5, scheduler_step);
+    timer_install_scheduler_callback(CONFIG_SCHEDULER_QUANTUM_MS, scheduler_tick);
 
     while (true) {
+        bool has_run_any = false;
         for (size_t i = 0; i < array_size(s_all_threads); i++) {
             Thread *thread = s_all_threads[i];
             if (thread == nullptr)
@@ -415,7 +477,7 @@ void scheduler_start()
                 free_thread(thread);
                 s_all_threads[i] = nullptr;
                 continue;
-            } else if (thread->state == ThreadState::Suspended) {
+            } else if (thread->state == ThreadState::Suspended || thread->state == ThreadState::Blocked) {
                 continue;
             }
 
@@ -427,11 +489,18 @@ void scheduler_start()
             // otherwise 2 cores could end up scheduling the same thread using the same kernel stack
             vm_switch_address_space(thread->process->address_space);
             s_current_thread = thread;
-            arch_context_switch(&s_scheduler_ctx, reinterpret_cast<ContextSwitchFrame*>(thread->kernel_stack_ptr));
+            // Set before the first switch: from now on threads can block and be switched out
             g_scheduler_has_started = true;
+            s_slice_start_ms = get_ticks_ms();
+            s_need_resched = false;
+            arch_context_switch(&s_scheduler_ctx, reinterpret_cast<ContextSwitchFrame*>(thread->kernel_stack_ptr));
+            has_run_any = true;
         }
 
-        cpu_relax();
+        // Everyone is blocked: only an interrupt can make a thread runnable again,
+        // meanwhile zero some pages so that page faults don't have to
+        if (!has_run_any && !physical_page_refill_zero_pool())
+            cpu_relax();
     }
 }
 
@@ -465,7 +534,7 @@ int sys$fork()
 
     LOGI("Forking %s[%d/%d]", current_process->name, current_process->pid, current_thread->tid);
 
-    // entrypoint and priviledged don't matter, we're going to copy the other process state anyway
+    // No entrypoint: the stack and the rest of the state are copied from the current process
     forked = alloc_process(current_process->name, NULL, false);
     if (forked == nullptr) {
         LOGE("Failed to allocate memory to fork process");
@@ -473,6 +542,7 @@ int sys$fork()
         goto failed;
     }
 
+    forked->stack_limit = current_process->stack_limit;
     free(forked->working_directory);
     forked->working_directory = strdup(current_process->working_directory);
     if (forked->working_directory == nullptr) {
@@ -520,7 +590,7 @@ int sys$execve(const char *path, char *const user_argv[], char *const user_envp[
     uint8_t *userstack = nullptr;
     auto *current_process = cpu_current_process();
     auto *current_thread = cpu_current_thread();
-    AddressSpace old_as, new_as;
+    AddressSpace old_as {}, new_as {};
     char **argv = nullptr;
     size_t argc = 0;
     char **envp = nullptr;
@@ -555,14 +625,22 @@ int sys$execve(const char *path, char *const user_argv[], char *const user_envp[
     }
     LOGD("Successsfully loaded ELF file '%s', entrypoint: %p", path, entrypoint);
 
-    userstack = (uint8_t*) alloc_thread_user_stack(&new_as, 0);
+    userstack = (uint8_t*) alloc_thread_user_stack(&new_as, 0, current_process->stack_limit);
     if (userstack == nullptr) {
         LOGE("Failed to allocate user stack for new process");
         rc = -ERR_NOMEM;
         goto cleanup;
     }
-    // NOTE: We're still running with the old address space, pushing
-    // to the userstack here won't put the data on the right stack!
+    // We're still running with the old address space, the arguments are
+    // written to the new stack without switching to it: if this fails
+    // the process can keep running its old program
+    userstack = push_process_args(new_as, userstack, argv, argc, envp, envc);
+    if (userstack == nullptr) {
+        LOGE("Failed to push the arguments on the new process' stack");
+        rc = -ERR_NOMEM;
+        goto cleanup;
+    }
+    kassert((uintptr_t) userstack % ARCH_STACK_ALIGNMENT == 0);
 
     // NOTE: We're going to use the same kernel stack, but we
     // don't need to do anything because the used page is used
@@ -581,8 +659,8 @@ int sys$execve(const char *path, char *const user_argv[], char *const user_envp[
     vm_switch_address_space(current_process->address_space);
     vm_free(old_as);
 
-    userstack = push_process_args(userstack, argv, argc, envp, envc);
-    kassert((uintptr_t) userstack % ARCH_STACK_ALIGNMENT == 0);
+    free_array_of_strings(argv, argc);
+    free_array_of_strings(envp, envc);
     current_thread->iframe->set_thread_start_values(entrypoint, (uintptr_t) userstack);
 
     return 0;
@@ -843,22 +921,50 @@ int sys$poll(api::PollFd *fds, int nfds, int timeout)
     FileCustody *file = nullptr;
     int available_fd = -1;
     uint64_t starttime = get_ticks_ms();
+    WaitQueue::Waiter *waiters = nullptr;
+    WaitQueue **queues = nullptr;
+
+    if (nfds < 0)
+        return -ERR_INVAL;
+
+    for (int i = 0; i < nfds; i++) {
+        if (fds[i].fd < 0)
+            continue;
+
+        if ((unsigned) fds[i].fd >= array_size(current_process->openfiles) || current_process->openfiles[fds[i].fd] == nullptr)
+            return -ERR_BADF;
+    }
 
+    waiters = (WaitQueue::Waiter*) malloc(nfds * sizeof(WaitQueue::Waiter));
+    queues = (WaitQueue**) malloc(nfds * sizeof(WaitQueue*));
+    if (nfds > 0 && (waiters == nullptr || queues == nullptr)) {
+        rc = -ERR_NOMEM;
+        goto cleanup;
+    }
+
+    for (int i = 0; i < nfds; i++) {
+        queues[i] = nullptr;
+        if (fds[i].fd >= 0)
+            queues[i] = vfs_waitqueue(current_process->openfiles[fds[i].fd]);
+    }
+
+    // Sleep on all the files at once, whichever changes first wakes us up
     do {
+        for (int i = 0; i < nfds; i++) {
+            if (queues[i] != nullptr)
+                waitqueue_prepare_wait(*queues[i], waiters[i]);
+        }
+
         for (int i = 0; i < nfds; i++) {
             if (fds[i].fd < 0)
                 continue;
 
-            if ((unsigned) fds[i].fd >= array_size(current_process->openfiles) || current_process->openfiles[fds[i].fd] == nullptr) {
-                rc = -ERR_BADF;
-                goto failed;
-            }
             file = current_process->openfiles[fds[i].fd];
             fds[i].revents = 0;
             rc = vfs_poll(file, fds[i].events, &fds[i].revents);
             if (rc != 0) {
                 LOGW("vfs_poll() failed for fd=%d, rc=%d", fds[i].fd, rc);
-                goto failed;
+                goto cleanup;
             }
 
             if (fds[i].revents != 0) {
@@ -870,36 +976,122 @@ int sys$poll(api::PollFd *fds, int nfds, int timeout)
         if (available_fd != -1)
             break;
 
-        if (timeout > 0 && (int64_t) (get_ticks_ms() - starttime) > timeout) {
-            rc = -ERR_TIMEDOUT;
-            goto failed;
+        uint32_t remaining = 0;
+        if (timeout > 0) {
+            int64_t elapsed = get_ticks_ms() - starttime;
+            if (elapsed >= timeout) {
+                rc = -ERR_TIMEDOUT;
+                goto cleanup;
+            }
+            remaining = timeout - elapsed;
+        }
+
+        waitqueue_block(remaining);
+        for (int i = 0; i < nfds; i++) {
+            if (queues[i] != nullptr)
+                waitqueue_finish_wait(*queues[i], waiters[i]);
         }
-        sys$yield();
     } while(true);
 
     rc = available_fd;
-    return rc;
 
-failed:
+cleanup:
+    for (int i = 0; queues != nullptr && waiters != nullptr && i < nfds; i++) {
+        if (queues[i] != nullptr)
+            waitqueue_finish_wait(*queues[i], waiters[i]);
+    }
+    free(waiters);
+    free(queues);
     return rc;
 }
 
 int sys$mmap(int fd, uintptr_t vaddr, uint32_t length, uint32_t flags)
 {
+    int rc;
     auto *current_process = cpu_current_process();
     auto *current_thread = cpu_current_thread();
+    auto& as = current_process->address_space;
     FileCustody *file = nullptr;
 
     if (!vm_addr_is_page_aligned(vaddr))
         return -ERR_INVAL;
     length = vm_align_up_to_page(length);
+    if (length == 0)
+        return -ERR_INVAL;
+    if (vaddr == 0 && !vm_find_free_range(as, length, vaddr).is_success())
+        return -ERR_NOMEM;
+    if (!areas::user_area.contains(vaddr) || length > areas::user_area.end - vaddr)
+        return -ERR_INVAL;
+
+    if (flags & MF_ANONYMOUS) {
+        LOGD("%s[%d] mmap %" PRIu32 " anonymous bytes at %p", current_thread->process->name, current_thread->tid, length, vaddr);
+        if (!vm_range_is_free(as, vaddr, vaddr + length))
+            return -ERR_EXIST;
+        if (!vm_map_anonymous(as, vaddr, length, PageAccessPermissions::UserFullAccess).is_success())
+            return -ERR_NOMEM;
+        return (int) vaddr;
+    }
 
     if (fd < 0 || (unsigned) fd >= array_size(cpu_current_process()->openfiles) || cpu_current_process()->openfiles[fd] == nullptr)
         return -ERR_BADF;
 
     LOGI("%s[%d] mmap fd %d at %p", current_thread->process->name, current_thread->tid, fd, vaddr);
     file = current_process->openfiles[fd];
-    return vfs_mmap(file, &current_process->address_space, vaddr, length, flags);
+    rc = vfs_mmap(file, &as, vaddr, length, flags);
+    if (rc != 0)
+        return rc;
+
+    return (int) vaddr;
+}
+
+int sys$munmap(uintptr_t vaddr, uint32_t length)
+{
+    auto *current_process = cpu_current_process();
+
+    if (!vm_addr_is_page_aligned(vaddr))
+        return -ERR_INVAL;
+    length = vm_align_up_to_page(length);
+    if (!areas::user_area.contains(vaddr) || length > areas::user_area.end - vaddr)
+        return -ERR_INVAL;
+
+    // The heap only moves with brk and stacks only grow down, a hole in them
+    // would be mapped over or fault later on
+    auto& as = current_process->address_space;
+    uintptr_t end = vaddr + length;
+    if (vaddr < vm_align_up_to_page(as.brk) && as.brk_start < end)
+        return -ERR_INVAL;
+    if (as.regions.find([&](VmRegion *r) { return r->is_stack && r->start < end && vaddr < r->end; }) != nullptr)
+        return -ERR_INVAL;
+
+    if (!vm_unmap_range(as, vaddr, end).is_success())
+        return -ERR_NOMEM;
+
+    return 0;
+}
+
+int sys$brk(uintptr_t new_brk)
+{
+    auto& as = cpu_current_process()->address_space;
+
+    // Like Linux, the current break is returned when it can't be moved
+    if (new_brk != 0 && !vm_set_brk(as, new_brk).is_success())
+        LOGW("%s[%d] failed to move the heap to %p", cpu_current_process()->name, cpu_current_process()->pid, new_brk);
+
+    return (int) as.brk;
+}
+
+int sys$ftruncate(int fd, uint32_t length)
+{
+    auto *current_process = cpu_current_process();
+    FileCustody *file = nullptr;
+
+    if (fd < 0 || (unsigned) fd >= array_size(current_process->openfiles))
+        return -ERR_BADF;
+    file = current_process->openfiles[fd];
+    if (file == nullptr)
+        return -ERR_BADF;
+
+    return vfs_ftruncate(file, length);
 }
 
 int sys$istty(int fd)
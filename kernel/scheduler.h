@@ -10,6 +10,7 @@
 enum class ThreadState {
     Runnable,
     Suspended,
+    Blocked,
     Zombie,
 };
 
@@ -43,6 +44,7 @@ struct Process {
     FileCustody *openfiles[16];
     char *working_directory;
     IntrusiveLinkedList<ProcessExitListener> process_exit_listeners;
+    size_t stack_limit;     // How big the stacks of its threads can grow
 
     struct {
         Thread **data;
@@ -65,10 +67,24 @@ void create_first_process(void (*entrypoint)(void));
 
 void scheduler_start();
 
+/**
+ * \brief Switches to another thread if the current one used up its time slice
+ * Called by the architecture code right before returning to the interrupted
+ * context, which is only preempted if it was running in user mode.
+*/
+void scheduler_preempt_if_needed(InterruptFrame*);
+
 bool scheduler_has_started();
 Process *cpu_current_process();
 Thread *cpu_current_thread();
 
+/**
+ * \brief The running process with the lowest pid greater than 'pid', nullptr if there is none
+ * Lets a walk over every process pick up where it left off after sleeping,
+ * even if some processes came and went in the meantime
+*/
+Process *scheduler_next_process(int pid);
+
 int sys$exit(int exit_code);
 
 int sys$yield();
@@ -105,6 +121,12 @@ int sys$poll(api::PollFd *fds, int nfds, int timeout);
 
 int sys$mmap(int fd, uintptr_t vaddr, uint32_t length, uint32_t flags);
 
+int sys$munmap(uintptr_t vaddr, uint32_t length);
+
+int sys$brk(uintptr_t new_brk);
+
+int sys$ftruncate(int fd, uint32_t length);
+
 int sys$istty(int fd);
 
 int sys$dup2(int oldfd, int newfd);
@@ -5,4 +5,5 @@
 static constexpr size_t _1KB = 1024;
 static constexpr size_t _4KB = 4 * 1024;
 static constexpr size_t _16KB = 16 * 1024;
+static constexpr size_t _64KB = 64 * 1024;
 static constexpr size_t _1MB = 1024 * 1024;
@@ -61,6 +61,15 @@ int dispatch_syscall(InterruptFrame *, sysarg_t syscall,
     case SYS_MMap:
         rc = sys$mmap((int) arg1, (uintptr_t) arg2, (uint32_t) arg3, (uint32_t) arg4);
         break;
+    case SYS_MUnmap:
+        rc = sys$munmap((uintptr_t) arg1, (uint32_t) arg2);
+        break;
+    case SYS_Brk:
+        rc = sys$brk((uintptr_t) arg1);
+        break;
+    case SYS_FTruncate:
+        rc = sys$ftruncate((int) arg1, (uint32_t) arg2);
+        break;
     case SYS_IsTty:
         rc = sys$istty((int) arg1);
         break;
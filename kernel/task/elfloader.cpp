@@ -25,110 +25,152 @@ static int verify_identification(Elf32_Ehdr const *header)
     return 0;
 }
 
-static int try_load_elf(uint8_t const *elf_binary, size_t binary_size, AddressSpace& as, uintptr_t &entry_point)
+static int read_exactly(FileCustody *custody, void *buffer, size_t size, uint64_t offset)
 {
-    int rc = 0;
-    Elf32_Ehdr const* header;
+    ssize_t read = vfs_pread(custody, static_cast<uint8_t*>(buffer), size, offset);
+    if (read < 0)
+        return (int) read;
+    if ((size_t) read != size)
+        return -ERR_NOEXEC;
 
-    if (binary_size < sizeof(Elf32_Ehdr)) {
-        LOGE("Binary is smaller than the ELF header");
-        rc = -ERR_NOEXEC;
-        goto cleanup;
-    }
-    
-    header = reinterpret_cast<Elf32_Ehdr const*>(elf_binary);
-    rc = verify_identification(header);
+    return 0;
+}
+
+static int verify_header(Elf32_Ehdr const *header)
+{
+    int rc = verify_identification(header);
     if (rc != 0) {
         LOGE("Binary didn't pass the identification process");
-        goto cleanup;
+        return rc;
     }
 
     if (header->e_type != ET_EXEC) {
         LOGE("ELF is not executable");
-        rc = -ERR_NOEXEC;
-        goto cleanup;
+        return -ERR_NOEXEC;
     } else if (header->e_machine != EM_ARM) {
         LOGE("ELF is for incompatible architecture"); 
-        rc = -ERR_NOTSUP;
-        goto cleanup;
+        return -ERR_NOTSUP;
+    } else if (header->e_phentsize != sizeof(Elf32_Phdr)) {
+        LOGE("Unexpected program header size %u", (unsigned) header->e_phentsize);
+        return -ERR_NOEXEC;
+    }
+
+    return 0;
+}
+
+/**
+ * Nothing is read from the segments here: each one becomes a region of the
+ * address space whose pages are read from the file on their first access
+*/
+static int map_segment(FileCustody *custody, uint64_t file_size, Elf32_Phdr const& p_hdr, AddressSpace& as)
+{
+    Error error;
+
+    if (p_hdr.p_filesz > p_hdr.p_memsz || p_hdr.p_filesz > file_size || p_hdr.p_offset > file_size - p_hdr.p_filesz) {
+        LOGE("Segment at %p is bigger than the file", p_hdr.p_vaddr);
+        return -ERR_NOEXEC;
     }
 
-    entry_point = header->e_entry;
-
-    rc = vm_using_address_space(as, [&]() {
-        Error error;
-        auto const *program_header = reinterpret_cast<Elf32_Phdr const*>(elf_binary + header->e_phoff);
-        for (size_t i = 0; i < header->e_phnum; i++) {
-            auto const *p_hdr = &program_header[i];
-
-            if (p_hdr->p_type != PT_LOAD)
-                continue;
-            
-            auto start = round_down<uintptr_t>(p_hdr->p_vaddr, 4 * _1KB);
-            auto end = round_up<uintptr_t>(p_hdr->p_paddr + p_hdr->p_memsz, 4 * _1KB);         
-            for (uintptr_t addr = start; addr < end; addr += 4 * _1KB) {
-                struct PhysicalPage* page;
-                error = physical_page_alloc(PageOrder::_4KB, page);
-                if (!error.is_success()) {
-                    LOGE("Failed to alloc physical page");
-                    return -ERR_NOMEM;
-                }
-
-                error = vm_map(as, page, addr, PageAccessPermissions::UserFullAccess);
-                if (!error.is_success()) {
-                    LOGE("Failed to map page %p at virt_addr %p", page2addr(page), addr);
-                    physical_page_free(page, PageOrder::_4KB);
-                    return -ERR_NOMEM;
-                }
-
-                vm_memset(as, addr, 0, 4 * _1KB);
-            }
-
-            if (p_hdr->p_filesz != 0)
-                vm_copy_to_user(as, p_hdr->p_vaddr, elf_binary + p_hdr->p_offset, p_hdr->p_filesz);
+    // Everything must stay below the mmaps and the stacks, so that the image
+    // leaves some room for the heap and never reaches into the kernel
+    uint64_t vaddr_end = static_cast<uint64_t>(p_hdr.p_vaddr) + p_hdr.p_memsz;
+    if (!areas::user_area.contains(p_hdr.p_vaddr) || round_up<uint64_t>(vaddr_end, 4 * _1KB) > areas::user_mmap.start) {
+        LOGE("Segment at %p (%" PRIu32 " bytes) is outside of the user address space", p_hdr.p_vaddr, p_hdr.p_memsz);
+        return -ERR_NOEXEC;
+    }
+
+    auto start = round_down<uintptr_t>(p_hdr.p_vaddr, 4 * _1KB);
+    auto file_end = round_up<uintptr_t>(p_hdr.p_vaddr + p_hdr.p_filesz, 4 * _1KB);
+    auto end = round_up<uintptr_t>(p_hdr.p_vaddr + p_hdr.p_memsz, 4 * _1KB);
+
+    // Segments that are not writable (e.g. the code) are shared between
+    // every process running the same executable
+    if (file_end > start) {
+        error = vm_map_file(
+            as, start, file_end - start,
+            (p_hdr.p_flags & PF_W) ? PageAccessPermissions::UserFullAccess : PageAccessPermissions::UserReadOnly,
+            custody, p_hdr.p_offset,
+            p_hdr.p_vaddr, p_hdr.p_filesz
+        );
+        if (!error.is_success()) {
+            LOGE("Failed to reserve %p-%p for the segment", start, file_end);
+            return -ERR_NOMEM;
         }
+    }
 
-        return 0;
-    });
-    if (rc != 0)
-        goto cleanup;
+    // The rest of the segment (e.g. the .bss) is zero-filled
+    if (end > file_end) {
+        error = vm_map_anonymous(as, file_end, end - file_end, PageAccessPermissions::UserFullAccess);
+        if (!error.is_success()) {
+            LOGE("Failed to reserve %p-%p for the zero-filled part of the segment", file_end, end);
+            return -ERR_NOMEM;
+        }
+    }
 
-    return rc;    
-cleanup:
-    return rc;
+    return 0;
 }
 
 int elf_load_into_address_space(const char *path, uintptr_t *entrypoint, AddressSpace &as)
 {
     int rc;
-    ssize_t fsize, read;
+    ssize_t fsize;
     FileCustody *custody = nullptr;
-    uint8_t *binary = nullptr;
+    Elf32_Ehdr header;
+    Elf32_Phdr *program_headers = nullptr;
+    uintptr_t image_end = 0;
     
     rc = vfs_open(path, OF_RDONLY, &custody);
     if (rc != 0)
         goto cleanup;
 
     fsize = vfs_seek(custody, SEEK_END, 0);
+    if (fsize < 0) {
+        rc = (int) fsize;
+        goto cleanup;
+    }
     vfs_seek(custody, SEEK_SET, 0);
 
-    binary = (uint8_t*) malloc(fsize);
-    if (binary == nullptr) {
+    rc = read_exactly(custody, &header, sizeof(header), 0);
+    if (rc != 0) {
+        LOGE("Failed to read the ELF header");
+        goto cleanup;
+    }
+
+    rc = verify_header(&header);
+    if (rc != 0)
+        goto cleanup;
+
+    program_headers = static_cast<Elf32_Phdr*>(malloc(header.e_phnum * sizeof(Elf32_Phdr)));
+    if (program_headers == nullptr) {
         rc = -ERR_NOMEM;
         goto cleanup;
     }
 
-    LOGD("ELF binary allocated area: %p", binary);
-    read = vfs_read(custody, binary, fsize);
-    if (read < 0) {
-        rc = (int) read;
+    rc = read_exactly(custody, program_headers, header.e_phnum * sizeof(Elf32_Phdr), header.e_phoff);
+    if (rc != 0) {
+        LOGE("Failed to read the program headers");
         goto cleanup;
     }
 
-    rc = try_load_elf(binary, fsize, as, *entrypoint);
+    for (size_t i = 0; i < header.e_phnum; i++) {
+        if (program_headers[i].p_type != PT_LOAD)
+            continue;
+
+        rc = map_segment(custody, fsize, program_headers[i], as);
+        if (rc != 0)
+            goto cleanup;
+
+        auto const& p_hdr = program_headers[i];
+        image_end = max(image_end, round_up<uintptr_t>(p_hdr.p_vaddr + p_hdr.p_memsz, 4 * _1KB));
+    }
+
+    // The heap starts right after the executable and is empty until the program asks for it
+    as.brk_start = as.brk = image_end;
+    *entrypoint = header.e_entry;
 
 cleanup:
-    free(binary);
+    free(program_headers);
+    // The address space keeps its own references to the file
     vfs_close(custody);
 
     return rc;
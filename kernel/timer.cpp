@@ -1,5 +1,5 @@
 #include <kernel/drivers/devicemanager.h>
-#include <kernel/memory/kheap.h>
+#include <kernel/memory/slab.h>
 #include <kernel/locking/irqlock.h>
 
 #include "timer.h"
@@ -23,6 +23,7 @@ struct Timer {
 
 
 static IntrusiveLinkedList<Timer> s_timers;
+static SlabCache s_timer_cache = slab_cache("timer", sizeof(Timer));
 static struct {
     void (*callback)(InterruptFrame*) = [](InterruptFrame*) {};
     uint64_t next_deadline = 0;
@@ -42,7 +43,7 @@ void timer_init()
                 
                 if (timer->type == TimerType::OneShot) {
                     s_timers.remove(timer);
-                    kfree(timer);
+                    slab_free(s_timer_cache, timer);
                 } else {
                     timer->start_time = systimer.ticks();
                 }
@@ -56,6 +57,15 @@ void timer_init()
     }, nullptr);
 }
 
+static Timer *alloc_timer()
+{
+    auto *timer = slab_alloc<Timer>(s_timer_cache);
+    if (timer == nullptr)
+        panic("Out of memory while allocating a timer\n");
+
+    return timer;
+}
+
 static void schedule_timer(Timer *timer, uint64_t ms)
 {
     auto *systimer = devicemanager_get_system_timer_device();
@@ -70,19 +80,28 @@ static void schedule_timer(Timer *timer, uint64_t ms)
     release(lock);
 }
 
-void timer_exec_once(uint64_t ms, TimerCallback callback, void *arg)
+Timer *timer_exec_once(uint64_t ms, TimerCallback callback, void *arg)
 {
-    Timer *timer = reinterpret_cast<Timer*>(mustmalloc(sizeof(Timer)));
+    Timer *timer = alloc_timer();
     timer->type = TimerType::OneShot;
     timer->callback = callback;
     timer->arg = arg;
 
     schedule_timer(timer, ms);
+    return timer;
+}
+
+void timer_cancel(Timer *timer)
+{
+    auto lock = irq_lock();
+    s_timers.remove(timer);
+    release(lock);
+    slab_free(s_timer_cache, timer);
 }
 
 void timer_exec_periodic(uint64_t ms, TimerCallback callback, void *arg)
 {
-    Timer *timer = reinterpret_cast<Timer*>(mustmalloc(sizeof(Timer)));
+    Timer *timer = alloc_timer();
     timer->type = TimerType::Periodic;
     timer->callback = callback;
     timer->arg = arg;
@@ -5,10 +5,18 @@
 
 
 typedef void (*TimerCallback)(void*);
+struct Timer;
 
 void timer_init();
 
-void timer_exec_once(uint64_t ms, TimerCallback callback, void *arg);
+Timer *timer_exec_once(uint64_t ms, TimerCallback callback, void *arg);
+
+/**
+ * \brief Removes a timer that has not fired yet
+ * One-shot timers are freed after firing: the caller must make sure
+ * this is not the case, usually by having the callback set a flag.
+*/
+void timer_cancel(Timer*);
 
 void timer_exec_periodic(uint64_t ms, TimerCallback callback, void *arg);
 
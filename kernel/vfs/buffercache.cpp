@@ -0,0 +1,245 @@
+#include <kernel/memory/shrinker.h>
+#include "buffercache.h"
+
+// #define LOG_ENABLED
+#define LOG_TAG "BCACHE"
+#include <kernel/log.h>
+
+
+#ifndef CONFIG_BCACHE_MAX_BLOCKS
+#define CONFIG_BCACHE_MAX_BLOCKS 256
+#endif
+
+static constexpr size_t BCACHE_BUCKETS = 128;
+
+static struct {
+    Buffer *buckets[BCACHE_BUCKETS];
+    size_t count;
+
+    /* Unreferenced buffers, the most recently used at the head */
+    IntrusiveLinkedList<Buffer> lru;
+
+    bool shrinker_registered;
+} s_bcache;
+
+static size_t bcache_shrink(size_t count);
+
+static Shrinker s_bcache_shrinker = {
+    .prev = nullptr,
+    .next = nullptr,
+    .name = "bcache",
+    .shrink = bcache_shrink,
+};
+
+static Buffer **bcache_bucket(BlockDevice *device, uint64_t block)
+{
+    uint64_t h = block ^ (reinterpret_cast<uintptr_t>(device) >> 4);
+    h *= 0x9e3779b97f4a7c15ull;
+    return &s_bcache.buckets[(h >> 32) % BCACHE_BUCKETS];
+}
+
+static Buffer *bcache_find(BlockDevice *device, uint64_t block)
+{
+    auto *buffer = *bcache_bucket(device, block);
+    while (buffer != nullptr && (buffer->device != device || buffer->block != block))
+        buffer = buffer->hash_next;
+
+    return buffer;
+}
+
+static void bcache_unhash(Buffer *buffer)
+{
+    auto **link = bcache_bucket(buffer->device, buffer->block);
+    while (*link != buffer) {
+        kassert(*link != nullptr);
+        link = &(*link)->hash_next;
+    }
+    *link = buffer->hash_next;
+}
+
+static void bcache_free(Buffer *buffer)
+{
+    kassert(buffer->refcount == 0);
+    bcache_unhash(buffer);
+    s_bcache.lru.remove(buffer);
+    s_bcache.count--;
+
+    free(buffer->data);
+    free(buffer);
+}
+
+static size_t bcache_shrink(size_t count)
+{
+    size_t freed = 0;
+    while (freed < count && s_bcache.lru.last() != nullptr) {
+        bcache_free(s_bcache.lru.last());
+        freed++;
+    }
+
+    return freed;
+}
+
+/**
+ * Returns an unreferenced buffer not in the hash table, either by
+ * recycling the least recently used one or by allocating a new one
+*/
+static Buffer *bcache_alloc()
+{
+    Buffer *buffer = nullptr;
+
+    if (s_bcache.count >= CONFIG_BCACHE_MAX_BLOCKS && s_bcache.lru.last() != nullptr) {
+        buffer = s_bcache.lru.last();
+        s_bcache.lru.remove(buffer);
+        bcache_unhash(buffer);
+        LOGD("Recycling block %" PRIu64, buffer->block);
+        return buffer;
+    }
+
+    if (!s_bcache.shrinker_registered) {
+        shrinker_register(&s_bcache_shrinker);
+        s_bcache.shrinker_registered = true;
+    }
+
+    // When all the buffers are in use the cache grows over its limit,
+    // it will shrink back as they are given back
+    buffer = static_cast<Buffer*>(malloc(sizeof(Buffer)));
+    uint8_t *data = static_cast<uint8_t*>(malloc(BCACHE_BLOCK_SIZE));
+    if (buffer == nullptr || data == nullptr) {
+        free(buffer);
+        free(data);
+        return nullptr;
+    }
+    buffer->data = data;
+    s_bcache.count++;
+
+    return buffer;
+}
+
+static int bcache_fill(Buffer *buffer)
+{
+    uint64_t offset = buffer->block * BCACHE_BLOCK_SIZE;
+    uint64_t device_size = buffer->device->size();
+    if (offset >= device_size)
+        return -ERR_INVAL;
+
+    buffer->length = min<uint64_t>(BCACHE_BLOCK_SIZE, device_size - offset);
+    int64_t rc = buffer->device->read(offset, buffer->data, buffer->length);
+    if (rc < 0) {
+        LOGW("Failed to read block %" PRIu64 ": %d", buffer->block, (int) rc);
+        return (int) rc;
+    } else if ((uint64_t) rc != buffer->length) {
+        LOGW("Short read of block %" PRIu64 ": %" PRId64 " bytes", buffer->block, rc);
+        return -ERR_IO;
+    }
+
+    buffer->valid = true;
+    return 0;
+}
+
+int bcache_get(BlockDevice& device, uint64_t block, Buffer **out_buffer)
+{
+    int rc;
+    Buffer *buffer = bcache_find(&device, block);
+
+    if (buffer != nullptr) {
+        if (buffer->refcount++ == 0)
+            s_bcache.lru.remove(buffer);
+
+        if (!buffer->valid && (rc = bcache_fill(buffer)) != 0) {
+            bcache_put(buffer);
+            return rc;
+        }
+
+        *out_buffer = buffer;
+        return 0;
+    }
+
+    buffer = bcache_alloc();
+    if (buffer == nullptr)
+        return -ERR_NOMEM;
+
+    auto **bucket = bcache_bucket(&device, block);
+    buffer->prev = nullptr;
+    buffer->next = nullptr;
+    buffer->hash_next = *bucket;
+    buffer->device = &device;
+    buffer->block = block;
+    buffer->refcount = 1;
+    buffer->valid = false;
+    buffer->length = 0;
+    *bucket = buffer;
+
+    rc = bcache_fill(buffer);
+    if (rc != 0) {
+        bcache_put(buffer);
+        return rc;
+    }
+
+    *out_buffer = buffer;
+    return 0;
+}
+
+void bcache_put(Buffer *buffer)
+{
+    kassert(buffer->refcount > 0);
+    if (--buffer->refcount > 0)
+        return;
+
+    s_bcache.lru.add(buffer);
+    if (!buffer->valid) {
+        bcache_free(buffer);
+        return;
+    }
+
+    if (s_bcache.count > CONFIG_BCACHE_MAX_BLOCKS)
+        bcache_shrink(s_bcache.count - CONFIG_BCACHE_MAX_BLOCKS);
+}
+
+int64_t bcache_read(BlockDevice& device, uint64_t offset, uint8_t *buffer, size_t size)
+{
+    int rc;
+    size_t bytes_read = 0;
+
+    while (bytes_read < size) {
+        Buffer *block;
+        uint64_t offset_in_block = offset % BCACHE_BLOCK_SIZE;
+
+        rc = bcache_get(device, offset / BCACHE_BLOCK_SIZE, &block);
+        if (rc == -ERR_INVAL)
+            break; // Past the end of the device
+        if (rc != 0)
+            return rc;
+
+        if (offset_in_block >= block->length) {
+            bcache_put(block);
+            break;
+        }
+        size_t chunk = min<uint64_t>(size - bytes_read, block->length - offset_in_block);
+        memcpy(buffer, block->data + offset_in_block, chunk);
+        bcache_put(block);
+
+        bytes_read += chunk;
+        buffer += chunk;
+        offset += chunk;
+    }
+
+    return bytes_read;
+}
+
+void bcache_invalidate(BlockDevice& device, uint64_t offset, uint64_t size)
+{
+    if (size == 0)
+        return;
+
+    uint64_t last = (offset + size - 1) / BCACHE_BLOCK_SIZE;
+    for (uint64_t block = offset / BCACHE_BLOCK_SIZE; block <= last; block++) {
+        Buffer *buffer = bcache_find(&device, block);
+        if (buffer == nullptr)
+            continue;
+
+        LOGD("Invalidating block %" PRIu64, block);
+        buffer->valid = false;
+        if (buffer->refcount == 0)
+            bcache_free(buffer);
+    }
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <kernel/base.h>
+#include <kernel/drivers/device.h>
+#include <kernel/lib/intrusivelinkedlist.h>
+
+
+/**
+ * The buffer cache (bcache) keeps recently used blocks of block devices in
+ * memory, keyed by (device, block). Filesystems read their metadata through
+ * it instead of going to the device every time, file data is cached by the
+ * page cache instead.
+ *
+ * A buffer returned by \ref bcache_get stays valid until it is given back
+ * with \ref bcache_put. Unreferenced buffers are kept on an LRU list and
+ * recycled when the cache holds more than CONFIG_BCACHE_MAX_BLOCKS blocks,
+ * or when the kernel runs low on memory.
+*/
+
+static constexpr size_t BCACHE_BLOCK_SIZE = 4 * _1KB;
+
+struct Buffer {
+    /* Links in the LRU list, only valid while the buffer is unreferenced */
+    INTRUSIVE_LINKED_LIST_HEADER(Buffer);
+    Buffer *hash_next;
+
+    BlockDevice *device;
+    uint64_t block;
+    int refcount;
+    bool valid;
+
+    /* How much of 'data' is backed by the device, less than a block only at its end */
+    size_t length;
+    uint8_t *data;
+};
+
+/**
+ * \brief Gets a reference to a block, reading it from the device if it is not cached
+ * \param block Index of the BCACHE_BLOCK_SIZE-sized block in the device
+ * \return 0 on success, -errno on failure
+*/
+int bcache_get(BlockDevice&, uint64_t block, Buffer **out_buffer);
+
+void bcache_put(Buffer*);
+
+/**
+ * \brief Copies 'size' bytes at byte 'offset' of the device into 'buffer' through the cache
+ * \return The number of bytes read, or -errno on failure
+*/
+int64_t bcache_read(BlockDevice&, uint64_t offset, uint8_t *buffer, size_t size);
+
+/**
+ * \brief Forgets the cached contents of [offset, offset+size) of the device
+ * Must be called after something wrote to the device without going through the cache
+*/
+void bcache_invalidate(BlockDevice&, uint64_t offset, uint64_t size);
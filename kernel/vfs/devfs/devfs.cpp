@@ -1,5 +1,6 @@
 #include <kernel/base.h>
 #include <kernel/drivers/devicemanager.h>
+#include <kernel/vfs/buffercache.h>
 #include "devfs.h"
 
 #define LOG_ENABLED
@@ -29,6 +30,7 @@ static int64_t devfs_file_inode_write(Inode *self, int64_t offset, const uint8_t
 static int32_t devfs_file_inode_ioctl(Inode *self, uint32_t request, void *argp);
 static uint64_t devfs_file_inode_seek(Inode *self, uint64_t current, int whence, int32_t offset);
 static int32_t devfs_file_inode_poll(Inode *self, uint32_t events, uint32_t *out_revents);
+static WaitQueue *devfs_file_inode_waitqueue(Inode *self);
 static int32_t devfs_file_inode_mmap(Inode*, AddressSpace*, uintptr_t, uint32_t, uint32_t);
 static int32_t devfs_file_inode_istty(Inode*);
 
@@ -42,6 +44,7 @@ static struct FilesystemOps s_devfs_ops {
     .on_mount = devfs_fs_on_mount,
     .open_inode = devfs_fs_open_inode,
     .close_inode = devfs_fs_close_inode,
+    .uses_page_cache = false,
 };
 
 static struct InodeOps s_devfs_inode_ops {
@@ -53,7 +56,9 @@ static struct InodeFileOps s_devfs_inode_file_ops {
     .seek = devfs_file_inode_seek,
     .ioctl = devfs_file_inode_ioctl,
     .poll = devfs_file_inode_poll,
+    .waitqueue = devfs_file_inode_waitqueue,
     .mmap = devfs_file_inode_mmap,
+    .ftruncate = fs_file_inode_ftruncate_not_supported,
     .istty = devfs_file_inode_istty,
 };
 
@@ -174,7 +179,13 @@ static int64_t devfs_file_inode_read(Inode *self, int64_t offset, uint8_t *buffe
 static int64_t devfs_file_inode_write(Inode *self, int64_t offset, const uint8_t *buffer, size_t size)
 {
     DevFSInodeCtx *ctx = (DevFSInodeCtx*) self->opaque;
-    return ctx->device->write(offset, buffer, size);
+    int64_t rc = ctx->device->write(offset, buffer, size);
+
+    // Filesystems on this device read it through the buffer cache
+    if (ctx->type == MountableDeviceType::BlockDevice && rc > 0)
+        bcache_invalidate(*reinterpret_cast<BlockDevice*>(ctx->device), offset, rc);
+
+    return rc;
 }
 
 static int32_t devfs_file_inode_ioctl(Inode *self, uint32_t ioctl, void *argp)
@@ -206,6 +217,12 @@ static int32_t devfs_file_inode_poll(Inode *self, uint32_t events, uint32_t *out
     return ctx->device->poll(events, out_revents);
 }
 
+static WaitQueue *devfs_file_inode_waitqueue(Inode *self)
+{
+    DevFSInodeCtx *ctx = (DevFSInodeCtx*) self->opaque;
+    return &ctx->device->waitqueue();
+}
+
 static int32_t devfs_file_inode_mmap(Inode *self, AddressSpace *as, uintptr_t vaddr, uint32_t length, uint32_t flags)
 {
     DevFSInodeCtx *ctx = (DevFSInodeCtx*) self->opaque;
@@ -312,7 +329,6 @@ int devfs_create(Filesystem **out_fs)
     *ctx = DevFSFilesystemCtx {};
     **out_fs = (Filesystem) {
         .ops = &s_devfs_ops,
-        .icache = {},
         .root = 0,
         .opaque = ctx,
     };
@@ -1,6 +1,7 @@
 #include <dirent.h>
 #include "fat32.h"
 #include "fat32_structures.h"
+#include <kernel/vfs/buffercache.h>
 
 // #define LOG_ENABLED
 #define LOG_TAG "FAT32"
@@ -17,7 +18,8 @@
 
 
 static constexpr uint32_t SECTOR_SIZE = 512;
-static constexpr uint32_t INVALID_SECTOR = 0xffffffff;
+static_assert(BCACHE_BLOCK_SIZE % SECTOR_SIZE == 0,
+    "A sector must never span two blocks of the buffer cache");
 
 static_assert(sizeof(fat32::BiosParameterBlock) == SECTOR_SIZE,
     "BPB size must be equal to sector size");
@@ -29,11 +31,6 @@ struct Fat32FilesystemCtx {
     fat32::BiosParameterBlock bpb;
     fat32::FSInfo info;
     uint64_t sector_size;
-
-    struct {
-        uint32_t sector_idx;
-        uint8_t buffer[SECTOR_SIZE];
-    } fatcache;
 };
 
 struct Fat32OpenInodeCtx {
@@ -60,6 +57,7 @@ static struct FilesystemOps s_fat32_ops {
     .on_mount = fat32_fs_on_mount,
     .open_inode = fat32_fs_open_inode,
     .close_inode = fat32_fs_close_inode,
+    .uses_page_cache = true,
 };
 
 static struct InodeOps s_fat32_inode_ops {
@@ -71,7 +69,9 @@ static struct InodeFileOps s_fat32_inode_file_ops {
     .seek = fat32_file_inode_seek,
     .ioctl = fat32_file_inode_ioctl,
     .poll = fs_file_inode_poll_always_ready,
-    .mmap = fs_file_inode_mmap_not_supported,
+    .waitqueue = nullptr,
+    .mmap = nullptr,
+    .ftruncate = fs_file_inode_ftruncate_not_supported,
     .istty = fs_file_inode_istty_always_false
 };
 
@@ -87,39 +87,41 @@ static inline constexpr uint32_t cluster_idx_to_sector(fat32::BiosParameterBlock
     return bpb.BPB_RsvdSecCnt + bpb.BPB_NumFATs * bpb.BPB_FATSz32 + (cluster_idx - 2) * bpb.BPB_SecPerClus;
 }
 
-static inline int read_sector(Fat32FilesystemCtx *ctx, uint64_t sector_idx, void *buffer)
+/**
+ * Gets the cached block that contains a sector, 'out_sector' points to the
+ * sector's data inside it. The block must be given back with bcache_put
+*/
+static int get_sector(Fat32FilesystemCtx *ctx, uint64_t sector_idx, Buffer **out_buffer, uint8_t **out_sector)
 {
-    int64_t rc = ctx->storage->read(ctx->sector_size * sector_idx, reinterpret_cast<uint8_t*>(buffer), ctx->sector_size);
-    
-    if (rc == (int64_t) ctx->sector_size)
-        return 0;
-    else if (rc > 0)
+    uint64_t offset = ctx->sector_size * sector_idx;
+    int rc = bcache_get(*ctx->storage, offset / BCACHE_BLOCK_SIZE, out_buffer);
+    if (rc != 0)
+        return rc;
+
+    if (offset % BCACHE_BLOCK_SIZE + ctx->sector_size > (*out_buffer)->length) {
+        bcache_put(*out_buffer);
         return -ERR_IO;
+    }
 
-    return rc;
+    *out_sector = (*out_buffer)->data + offset % BCACHE_BLOCK_SIZE;
+    return 0;
 }
 
 static int next_cluster(Fat32FilesystemCtx *ctx, uint32_t cluster, uint32_t& next_cluster)
 {
-    ssize_t rc = 0;
+    int rc = 0;
     auto& bpb = ctx->bpb;
     auto fat_offset = cluster * 4;
     auto fat_sector = bpb.BPB_RsvdSecCnt + (fat_offset / SECTOR_SIZE);
     auto fat_sector_offset = fat_offset % SECTOR_SIZE;
+    Buffer *buffer;
+    uint8_t *sector;
 
-    if (ctx->fatcache.sector_idx != fat_sector) {
-        // Because the underlying storage might trash the buffer if it fails to read
-        ctx->fatcache.sector_idx = INVALID_SECTOR;
-        rc = read_sector(ctx, fat_sector, ctx->fatcache.buffer);
-        if (rc < 0) {
-            return (int) rc;
-        }
-
-        ctx->fatcache.sector_idx = fat_sector;
-    }
-
-    uint32_t *p = reinterpret_cast<uint32_t*>(ctx->fatcache.buffer + fat_sector_offset);
+    TRY(get_sector(ctx, fat_sector, &buffer, &sector));
+    uint32_t *p = reinterpret_cast<uint32_t*>(sector + fat_sector_offset);
     next_cluster = (*p) & 0x0fffffff;
+    bcache_put(buffer);
+
     return 0;
 }
 
@@ -176,10 +178,11 @@ static int foreach_8_3_directory_entry(Fat32FilesystemCtx *fsctx, uint32_t clust
         uint32_t cluster_start_sector = cluster_idx_to_sector(fsctx->bpb, next_cluster_idx);
         for (uint32_t sector_idx = 0; sector_idx < fsctx->bpb.BPB_SecPerClus; sector_idx++) {
             uint32_t i;
-            uint8_t sector[SECTOR_SIZE];
-            auto *entries = reinterpret_cast<fat32::DirectoryEntry8_3*>(sector);
+            Buffer *buffer;
+            uint8_t *sector;
 
-            TRY(read_sector(fsctx, cluster_start_sector + sector_idx, sector));
+            TRY(get_sector(fsctx, cluster_start_sector + sector_idx, &buffer, &sector));
+            auto *entries = reinterpret_cast<fat32::DirectoryEntry8_3*>(sector);
             for (i = 0; i < DIR_ENTRIES_IN_SECTOR; i++) {
                 if (entries[i].is_end_of_directory())
                     break;
@@ -187,11 +190,13 @@ static int foreach_8_3_directory_entry(Fat32FilesystemCtx *fsctx, uint32_t clust
                     continue;
 
                 if (handle_entry_cb(entry_idx, entries[i])) {
+                    bcache_put(buffer);
                     return 0;
                 }
 
                 entry_idx++;
             }
+            bcache_put(buffer);
 
             if (i != DIR_ENTRIES_IN_SECTOR) {
                 LOGD("Reached end of directory (%" PRIu32 " entries read)", i);
@@ -337,20 +342,34 @@ static int64_t fat32_file_inode_read(Inode *self, int64_t offset, uint8_t *buffe
         offset / (ctx->bpb.BPB_SecPerClus * ctx->sector_size),
         current_cluster));
 
+    // File data is cached by the page cache, it goes straight from the device
+    // to the buffer: through the buffer cache it would be cached twice and
+    // push the FAT and the directories out of it
+    uint64_t cluster_size = ctx->bpb.BPB_SecPerClus * ctx->sector_size;
     auto remaining_size = size;
     auto current_offset = offset;
     while (remaining_size > 0) {
-        auto offset_in_cluster = current_offset % (ctx->bpb.BPB_SecPerClus * ctx->sector_size);
-        auto remaining_size_in_cluster = min<uint64_t>(remaining_size, ctx->bpb.BPB_SecPerClus * ctx->sector_size - offset_in_cluster);
-
+        auto offset_in_cluster = current_offset % cluster_size;
         uint64_t diskoff = ctx->sector_size * cluster_idx_to_sector(ctx->bpb, current_cluster) + offset_in_cluster;
 
-        int64_t read = ctx->storage->read(diskoff, buffer, remaining_size_in_cluster);
+        // Clusters that follow each other on the disk are read with a single request
+        uint64_t to_read = min<uint64_t>(remaining_size, cluster_size - offset_in_cluster);
+        uint32_t last_cluster = current_cluster;
+        while (to_read < remaining_size) {
+            uint32_t next;
+            TRY(next_cluster(ctx, last_cluster, next));
+            if (next != last_cluster + 1)
+                break;
+            last_cluster = next;
+            to_read += min<uint64_t>(remaining_size - to_read, cluster_size);
+        }
+
+        int64_t read = ctx->storage->read(diskoff, buffer, to_read);
         if (read < 0) {
             LOGW("Storage read returned an error: %d", (int) read);
             return (int) read;
-        } else if ((uint64_t) read != remaining_size_in_cluster) {
-            LOGW("Storage read returned %" PRId64 " bytes, expected %" PRIu64 " bytes", read, remaining_size_in_cluster);
+        } else if ((uint64_t) read != to_read) {
+            LOGW("Storage read returned %" PRId64 " bytes, expected %" PRIu64 " bytes", read, to_read);
             return -ERR_IO;
         }
 
@@ -360,7 +379,7 @@ static int64_t fat32_file_inode_read(Inode *self, int64_t offset, uint8_t *buffe
         buffer += read;
 
         if (remaining_size > 0) {
-            TRY(next_cluster(ctx, current_cluster, current_cluster));
+            TRY(next_cluster(ctx, last_cluster, current_cluster));
             if (current_cluster >= 0x0ffffff8 || current_cluster < 2)
                 return -ERR_IO;
         }
@@ -478,20 +497,13 @@ int fat32_try_create(BlockDevice &storage, Filesystem **out_fs)
         .bpb = bpb,
         .info = fs_info,
         .sector_size = bpb.BPB_BytsPerSec,
-        .fatcache = {
-            .sector_idx = INVALID_SECTOR,
-            .buffer = {0},
-        },
     };
 
     *fs = Filesystem {
         .ops = &s_fat32_ops,
-        .icache = {},
         .root = 2, // cluster of the root directory
         .opaque = ctx,
     };
-    // FIXME: We should handle this, but the init's impl always succeeds anyway
-    kassert(0 == inode_cache_init(&fs->icache));
 
     *out_fs = fs;
     return 0;
@@ -1,61 +1,192 @@
 #include "fs.h"
 #include "fat32/fat32.h"
+#include <kernel/memory/shrinker.h>
+#include <kernel/memory/slab.h>
 
 #define LOG_ENABLED
 #define LOG_TAG "FS"
 #include <kernel/log.h>
 
 
-Inode *icache_lookup(InodeCache *icache, InodeIdentifier identifier)
+#ifndef CONFIG_ICACHE_MAX_UNUSED
+#define CONFIG_ICACHE_MAX_UNUSED 256
+#endif
+
+static constexpr size_t ICACHE_INITIAL_BUCKETS = 64;
+
+struct InodeCacheEntry {
+    /* Links in the LRU list, only valid while the inode is unreferenced */
+    INTRUSIVE_LINKED_LIST_HEADER(InodeCacheEntry);
+    InodeCacheEntry *hash_next;
+
+    Inode inode;
+};
+
+static struct {
+    InodeCacheEntry **buckets;
+    size_t bucket_count;
+    size_t entry_count;
+
+    /* Unreferenced inodes, the most recently used at the head */
+    IntrusiveLinkedList<InodeCacheEntry> lru;
+    size_t lru_count;
+} s_icache;
+
+static SlabCache s_icache_entries = slab_cache("inode", sizeof(InodeCacheEntry));
+
+static size_t icache_shrink(size_t count);
+
+static Shrinker s_icache_shrinker = {
+    .prev = nullptr,
+    .next = nullptr,
+    .name = "icache",
+    .shrink = icache_shrink,
+};
+
+static InodeCacheEntry *inode2entry(Inode *inode)
 {
-    auto *entry = icache->list.find_first([&](InodeCache::Entry *entry) {
-        return entry->identifier == identifier;
-    });
+    return reinterpret_cast<InodeCacheEntry*>(reinterpret_cast<uintptr_t>(inode) - offsetof(InodeCacheEntry, inode));
+}
+
+static size_t icache_hash(Filesystem *fs, InodeIdentifier identifier, size_t bucket_count)
+{
+    uint64_t h = identifier ^ (reinterpret_cast<uintptr_t>(fs) >> 4);
+    h *= 0x9e3779b97f4a7c15ull;
+    return (h >> 32) & (bucket_count - 1);
+}
+
+static InodeCacheEntry **icache_bucket(Filesystem *fs, InodeIdentifier identifier)
+{
+    return &s_icache.buckets[icache_hash(fs, identifier, s_icache.bucket_count)];
+}
+
+/* Doubles the number of buckets, so that the chains stay short however many inodes there are */
+static void icache_grow()
+{
+    size_t new_count = s_icache.bucket_count == 0 ? ICACHE_INITIAL_BUCKETS : s_icache.bucket_count * 2;
+    auto **new_buckets = static_cast<InodeCacheEntry**>(malloc(new_count * sizeof(InodeCacheEntry*)));
+    if (new_buckets == nullptr) {
+        // Not fatal, the chains just get longer
+        LOGW("Failed to grow icache to %" PRIu32 " buckets", new_count);
+        return;
+    }
+    memset(new_buckets, 0, new_count * sizeof(InodeCacheEntry*));
+
+    for (size_t i = 0; i < s_icache.bucket_count; i++) {
+        auto *entry = s_icache.buckets[i];
+        while (entry != nullptr) {
+            auto *next = entry->hash_next;
+            size_t idx = icache_hash(entry->inode.filesystem, entry->inode.identifier, new_count);
+            entry->hash_next = new_buckets[idx];
+            new_buckets[idx] = entry;
+            entry = next;
+        }
+    }
+
+    free(s_icache.buckets);
+    s_icache.buckets = new_buckets;
+    s_icache.bucket_count = new_count;
+}
+
+Inode *icache_lookup(Filesystem *fs, InodeIdentifier identifier)
+{
+    if (s_icache.bucket_count == 0)
+        return nullptr;
+
+    auto *entry = *icache_bucket(fs, identifier);
+    while (entry != nullptr && (entry->inode.filesystem != fs || entry->inode.identifier != identifier))
+        entry = entry->hash_next;
+
     if (entry == nullptr) {
         LOGD("Looking up inode %" PRIu64 " in icache ... failed", identifier);
         return nullptr;
     }
 
-    LOGD("Looking up inode %" PRIu64 " in icache ... found (refcount: %d)", identifier, entry->inode->refcount);
-    return entry->inode;
+    LOGD("Looking up inode %" PRIu64 " in icache ... found (refcount: %d)", identifier, entry->inode.refcount);
+    return &entry->inode;
 }
 
-int icache_insert(InodeCache *icache, InodeIdentifier identifier, Inode *inode)
+Inode *icache_insert(Inode const& inode)
 {
-    kassert(icache_lookup(icache, identifier) == nullptr);
+    kassert(inode.filesystem != nullptr);
+    kassert(icache_lookup(inode.filesystem, inode.identifier) == nullptr);
+
+    if (s_icache.bucket_count == 0)
+        shrinker_register(&s_icache_shrinker);
+    if (s_icache.entry_count >= 2 * s_icache.bucket_count)
+        icache_grow();
+    if (s_icache.bucket_count == 0)
+        return nullptr;
 
-    auto *entry = (InodeCache::Entry*) malloc(sizeof(InodeCache::Entry));
+    auto *entry = slab_alloc<InodeCacheEntry>(s_icache_entries);
     if (entry == nullptr)
-        return -ERR_NOMEM;
+        return nullptr;
 
-    *entry = InodeCache::Entry {
+    auto **bucket = icache_bucket(inode.filesystem, inode.identifier);
+    *entry = InodeCacheEntry {
         .prev = nullptr,
         .next = nullptr,
-        .identifier = identifier,
-        .inode = inode
+        .hash_next = *bucket,
+        .inode = inode,
     };
-    icache->list.add(entry);
+    entry->inode.refcount = 0;
+    *bucket = entry;
+    s_icache.entry_count++;
 
-    LOGD("Inserting inode %" PRIu64 " into icache", identifier);
-    return 0;
+    s_icache.lru.add(entry);
+    s_icache.lru_count++;
+
+    LOGD("Inserting inode %" PRIu64 " into icache", inode.identifier);
+    return &entry->inode;
 }
 
-#if 0
-static Inode *icache_remove(InodeCache *icache, InodeIdentifier identifier)
+void icache_get(Inode *inode)
 {
-    auto *entry = icache->list.find_first([&](InodeCache::Entry *entry) {
-        return entry->identifier == identifier;
-    });
-    if (entry == nullptr)
-        return nullptr;
-    
-    icache->list.remove(entry);
-    Inode *inode = entry->inode;
-    free(entry);
+    kassert(inode->refcount == 0);
+    s_icache.lru.remove(inode2entry(inode));
+    s_icache.lru_count--;
+}
+
+void icache_put(Inode *inode)
+{
+    kassert(inode->refcount == 0);
+    s_icache.lru.add(inode2entry(inode));
+    s_icache.lru_count++;
 
-    return inode;
+    if (s_icache.lru_count > CONFIG_ICACHE_MAX_UNUSED)
+        icache_shrink(s_icache.lru_count - CONFIG_ICACHE_MAX_UNUSED);
+}
+
+void icache_remove(Inode *inode)
+{
+    kassert(inode->refcount == 0);
+    auto *entry = inode2entry(inode);
+
+    auto **link = icache_bucket(inode->filesystem, inode->identifier);
+    while (*link != entry) {
+        kassert(*link != nullptr);
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+    s_icache.entry_count--;
+
+    s_icache.lru.remove(entry);
+    s_icache.lru_count--;
+
+    LOGD("Removing inode %" PRIu64 " from icache", inode->identifier);
+    slab_free(s_icache_entries, entry);
+}
+
+static size_t icache_shrink(size_t count)
+{
+    size_t freed = 0;
+    while (freed < count && s_icache.lru.last() != nullptr) {
+        icache_remove(&s_icache.lru.last()->inode);
+        freed++;
+    }
+
+    return freed;
 }
-#endif
 
 
 uint64_t default_checked_seek(uint64_t filesize, uint64_t current, int whence, int32_t offset)
@@ -115,6 +246,11 @@ int32_t fs_file_inode_mmap_not_supported(Inode*, AddressSpace*, uintptr_t, uint3
     return -ERR_NOTSUP;
 }
 
+int fs_file_inode_ftruncate_not_supported(Inode*, uint64_t)
+{
+    return -ERR_NOTSUP;
+}
+
 int fs_dir_inode_create_not_supported(Inode*, const char*, InodeType, Inode *)
 {
     return -ERR_NOTSUP;
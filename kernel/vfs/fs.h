@@ -28,7 +28,11 @@ struct InodeFileOps {
     uint64_t (*seek)(Inode *self, uint64_t current, int whence, int32_t offset);
     int32_t (*ioctl)(Inode *self, uint32_t request, void *argp);
     int32_t (*poll)(Inode *self, uint32_t events, uint32_t *out_revents);
+    /* Optional: where to sleep until 'poll' might report something different, nullptr if it never changes */
+    WaitQueue *(*waitqueue)(Inode *self);
+    /* Optional for regular files: nullptr maps them read-only, reading their pages on first access */
     int32_t (*mmap)(Inode *self, AddressSpace *as, uintptr_t vaddr, uint32_t length, uint32_t flags);
+    int (*ftruncate)(Inode *self, uint64_t size);
     int32_t (*istty)(Inode *self);
 };
 
@@ -78,32 +82,42 @@ struct FilesystemOps {
 
     int (*open_inode)(Filesystem*, Inode*);
     int (*close_inode)(Filesystem*, Inode*);
-};
-
-struct InodeCache {
-    struct Entry {
-        INTRUSIVE_LINKED_LIST_HEADER(InodeCache::Entry);
 
-        InodeIdentifier identifier;
-        Inode *inode;
-    };
-    IntrusiveLinkedList<InodeCache::Entry> list;
+    /* Regular files are read through the page cache, see pagecache.h */
+    bool uses_page_cache;
 };
 
 struct Filesystem {
     FilesystemOps const *ops;
-    InodeCache icache;
     InodeIdentifier root;
     void *opaque;
 };
 
-static inline int inode_cache_init(InodeCache *icache) { icache->list = {nullptr, nullptr}; return 0; }
+/**
+ * The inode cache (icache) holds the inodes of all filesystems, keyed by
+ * (filesystem, identifier).
+ *
+ * Inodes with a refcount of 0 are closed but stay in the cache, on an LRU
+ * list, until they are looked up again or evicted: either because there are
+ * more than CONFIG_ICACHE_MAX_UNUSED of them or because the kernel is low
+ * on memory.
+*/
+Inode *icache_lookup(Filesystem*, InodeIdentifier);
+
+/**
+ * \brief Adds a copy of 'inode' to the cache, as unreferenced
+ * \return The cached inode, or nullptr if there was no memory for it
+*/
+Inode *icache_insert(Inode const& inode);
 
-int icache_insert(InodeCache *icache, InodeIdentifier identifier, Inode *inode);
+/* The inode went from 0 to 1 references, it cannot be evicted anymore */
+void icache_get(Inode*);
 
-Inode *icache_lookup(InodeCache *icache, InodeIdentifier identifier);
+/* The inode went from 1 to 0 references and was closed, it can be evicted */
+void icache_put(Inode*);
 
-static inline void inode_cache_free(InodeCache*) { TODO(); }
+/* Removes an unreferenced inode from the cache and frees it */
+void icache_remove(Inode*);
 
 uint64_t default_checked_seek(uint64_t filesize, uint64_t current, int whence, int32_t offset);
 
@@ -113,6 +127,7 @@ int32_t fs_inode_ioctl_not_supported(Inode*, uint32_t, void*);
 uint64_t fs_inode_seek_not_supported(Inode*, uint64_t, int, int32_t);
 int32_t fs_file_inode_poll_always_ready(Inode *self, uint32_t events, uint32_t *out_revents);
 int32_t fs_file_inode_mmap_not_supported(Inode*, AddressSpace*, uintptr_t, uint32_t, uint32_t);
+int fs_file_inode_ftruncate_not_supported(Inode*, uint64_t);
 int32_t fs_file_inode_istty_always_false(Inode*);
 int fs_dir_inode_create_not_supported(Inode*, const char*, InodeType, Inode *);
 int fs_dir_inode_mkdir_not_supported(Inode*, const char *);
@@ -0,0 +1,285 @@
+#include <kernel/memory/shrinker.h>
+#include <kernel/memory/slab.h>
+#include <kernel/memory/vm.h>
+#include "pagecache.h"
+
+// #define LOG_ENABLED
+#define LOG_TAG "PCACHE"
+#include <kernel/log.h>
+
+
+#ifndef CONFIG_PCACHE_MAX_PAGES
+#define CONFIG_PCACHE_MAX_PAGES 1024
+#endif
+
+static constexpr size_t PCACHE_BUCKETS = 256;
+
+static struct {
+    CachedPage *buckets[PCACHE_BUCKETS];
+    size_t count;
+
+    IntrusiveLinkedList<CachedPage> lru;
+
+    /**
+     * Bumped every time some pages are invalidated: a page that was being
+     * read in the meantime might hold old data and is not cached
+    */
+    uint32_t generation;
+
+    bool shrinker_registered;
+} s_pcache;
+
+static SlabCache s_cached_page_cache = slab_cache("pcache-page", sizeof(CachedPage));
+
+static size_t pcache_shrink(size_t count);
+
+static Shrinker s_pcache_shrinker = {
+    .prev = nullptr,
+    .next = nullptr,
+    .name = "pcache",
+    .shrink = pcache_shrink,
+};
+
+static CachedPage **pcache_bucket(Filesystem *filesystem, InodeIdentifier identifier, uint64_t index)
+{
+    uint64_t h = index ^ identifier ^ (reinterpret_cast<uintptr_t>(filesystem) >> 4);
+    h *= 0x9e3779b97f4a7c15ull;
+    return &s_pcache.buckets[(h >> 32) % PCACHE_BUCKETS];
+}
+
+static CachedPage *pcache_find(Filesystem *filesystem, InodeIdentifier identifier, uint64_t index)
+{
+    auto *page = *pcache_bucket(filesystem, identifier, index);
+    while (page != nullptr && (page->filesystem != filesystem || page->identifier != identifier || page->index != index))
+        page = page->hash_next;
+
+    return page;
+}
+
+static void pcache_unhash(CachedPage *page)
+{
+    auto **link = pcache_bucket(page->filesystem, page->identifier, page->index);
+    while (*link != page) {
+        kassert(*link != nullptr);
+        link = &(*link)->hash_next;
+    }
+    *link = page->hash_next;
+    page->is_hashed = false;
+    s_pcache.count--;
+}
+
+static uint8_t *pcache_data(CachedPage const *page)
+{
+    return reinterpret_cast<uint8_t*>(phys2virt(page2addr(page->page)));
+}
+
+static void pcache_free(CachedPage *page)
+{
+    kassert(page->refcount == 0 && !page->is_hashed);
+    MUST(physical_page_free(page->page, PageOrder::_4KB));
+    slab_free(s_cached_page_cache, page);
+}
+
+/**
+ * \brief Takes an unreferenced page out of the cache and frees it
+*/
+static void pcache_evict(CachedPage *page)
+{
+    LOGD("Evicting page %" PRIu64 " of inode %" PRIu64, page->index, page->identifier);
+    pcache_unhash(page);
+    s_pcache.lru.remove(page);
+    pcache_free(page);
+}
+
+static size_t pcache_shrink(size_t count)
+{
+    size_t freed = 0;
+    while (freed < count && s_pcache.lru.last() != nullptr) {
+        pcache_evict(s_pcache.lru.last());
+        freed++;
+    }
+
+    return freed;
+}
+
+/**
+ * \brief Reads a page of the file with the inode's read function
+ * \return 0 on success, -errno on failure. The page is not in the cache yet,
+ *         the caller owns the only reference to it
+*/
+static int pcache_fill(Inode *inode, uint64_t index, CachedPage **out_page)
+{
+    auto *page = slab_alloc<CachedPage>(s_cached_page_cache);
+    if (page == nullptr)
+        return -ERR_NOMEM;
+
+    PhysicalPage *physical_page;
+    if (!physical_page_alloc(PageOrder::_4KB, physical_page).is_success()) {
+        slab_free(s_cached_page_cache, page);
+        return -ERR_NOMEM;
+    }
+
+    *page = CachedPage {
+        .prev = nullptr,
+        .next = nullptr,
+        .hash_next = nullptr,
+        .filesystem = inode->filesystem,
+        .identifier = inode->identifier,
+        .index = index,
+        .refcount = 1,
+        .is_hashed = false,
+        .length = 0,
+        .page = physical_page,
+    };
+
+    int64_t rc = inode->file_ops->read(inode, index * PCACHE_PAGE_SIZE, pcache_data(page), PCACHE_PAGE_SIZE);
+    if (rc < 0) {
+        LOGW("Failed to read page %" PRIu64 " of inode %" PRIu64 ": %d", index, inode->identifier, (int) rc);
+        page->refcount = 0;
+        pcache_free(page);
+        return (int) rc;
+    }
+    page->length = rc;
+
+    *out_page = page;
+    return 0;
+}
+
+static void pcache_put(CachedPage *page)
+{
+    kassert(page->refcount > 0);
+    if (--page->refcount > 0)
+        return;
+
+    if (!page->is_hashed) {
+        pcache_free(page);
+        return;
+    }
+
+    s_pcache.lru.add(page);
+    if (s_pcache.count > CONFIG_PCACHE_MAX_PAGES)
+        pcache_shrink(s_pcache.count - CONFIG_PCACHE_MAX_PAGES);
+}
+
+/**
+ * \brief Gets a reference to a page of the file, reading it if it is not cached
+ * Reading the page can sleep, if the file changed in the meantime the page is
+ * handed out anyway but it is not cached: the caller's reference is the only one
+*/
+static int pcache_get(Inode *inode, uint64_t index, CachedPage **out_page)
+{
+    CachedPage *page = pcache_find(inode->filesystem, inode->identifier, index);
+    if (page != nullptr) {
+        if (page->refcount++ == 0)
+            s_pcache.lru.remove(page);
+        *out_page = page;
+        return 0;
+    }
+
+    uint32_t generation = s_pcache.generation;
+    if (int rc = pcache_fill(inode, index, &page); rc != 0)
+        return rc;
+
+    // Someone else might have read the same page in the meantime
+    if (auto *cached = pcache_find(inode->filesystem, inode->identifier, index); cached != nullptr) {
+        pcache_put(page);
+        if (cached->refcount++ == 0)
+            s_pcache.lru.remove(cached);
+        *out_page = cached;
+        return 0;
+    }
+
+    if (generation == s_pcache.generation) {
+        if (!s_pcache.shrinker_registered) {
+            shrinker_register(&s_pcache_shrinker);
+            s_pcache.shrinker_registered = true;
+        }
+
+        auto **bucket = pcache_bucket(page->filesystem, page->identifier, page->index);
+        page->hash_next = *bucket;
+        *bucket = page;
+        page->is_hashed = true;
+        s_pcache.count++;
+    }
+
+    *out_page = page;
+    return 0;
+}
+
+int64_t pcache_read(Inode *inode, uint64_t offset, uint8_t *buffer, size_t size)
+{
+    int rc;
+    size_t bytes_read = 0;
+
+    if (offset >= inode->size)
+        return 0;
+    size = min<uint64_t>(size, inode->size - offset);
+
+    while (bytes_read < size) {
+        uint64_t offset_in_page = offset % PCACHE_PAGE_SIZE;
+
+        CachedPage *page;
+        rc = pcache_get(inode, offset / PCACHE_PAGE_SIZE, &page);
+        if (rc == -ERR_NOMEM) {
+            // Not being able to cache the file is no reason not to read it
+            int64_t read = inode->file_ops->read(inode, offset, buffer, size - bytes_read);
+            return read < 0 ? read : bytes_read + read;
+        } else if (rc != 0) {
+            return rc;
+        }
+
+        // The copy can fault and sleep, the reference keeps the page around until it is done
+        size_t chunk = 0;
+        if (offset_in_page < page->length) {
+            chunk = min<uint64_t>(size - bytes_read, page->length - offset_in_page);
+            memcpy(buffer, pcache_data(page) + offset_in_page, chunk);
+        }
+        pcache_put(page);
+
+        if (chunk == 0)
+            break;
+        bytes_read += chunk;
+        buffer += chunk;
+        offset += chunk;
+    }
+
+    return bytes_read;
+}
+
+static void pcache_invalidate_page(CachedPage *page)
+{
+    LOGD("Invalidating page %" PRIu64 " of inode %" PRIu64, page->index, page->identifier);
+    if (page->refcount == 0)
+        pcache_evict(page);
+    else
+        pcache_unhash(page);
+}
+
+void pcache_invalidate(Inode *inode, uint64_t offset, uint64_t size)
+{
+    if (size == 0)
+        return;
+
+    s_pcache.generation++;
+
+    uint64_t first = offset / PCACHE_PAGE_SIZE;
+    uint64_t last = (offset + size - 1) / PCACHE_PAGE_SIZE;
+
+    // Big ranges, e.g. a truncated file, have fewer pages cached than they span
+    if (last - first >= s_pcache.count) {
+        for (size_t i = 0; i < PCACHE_BUCKETS; i++) {
+            for (auto *page = s_pcache.buckets[i]; page != nullptr;) {
+                auto *next = page->hash_next;
+                if (page->filesystem == inode->filesystem && page->identifier == inode->identifier && first <= page->index && page->index <= last)
+                    pcache_invalidate_page(page);
+                page = next;
+            }
+        }
+        return;
+    }
+
+    for (uint64_t index = first; index <= last; index++) {
+        if (auto *page = pcache_find(inode->filesystem, inode->identifier, index); page != nullptr)
+            pcache_invalidate_page(page);
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <kernel/base.h>
+#include <kernel/lib/intrusivelinkedlist.h>
+#include <kernel/memory/physicalalloc.h>
+#include <kernel/vfs/fs.h>
+
+
+/**
+ * The page cache (pcache) keeps the contents of regular files in memory,
+ * in PCACHE_PAGE_SIZE pages keyed by (filesystem, inode, page index).
+ *
+ * Only filesystems that set 'uses_page_cache' go through it: their reads
+ * are served from the cache with a single copy, and only the pages that
+ * are not cached yet are read with the inode's read function. Pages are
+ * keyed by the inode's identifier, not by the inode itself, so they stay
+ * cached after the inode is evicted from the icache.
+ *
+ * A page stays valid while someone holds a reference to it, e.g. while its
+ * contents are copied to a user buffer, which can fault and sleep. Unreferenced
+ * pages are kept on an LRU list and recycled when the cache holds more than
+ * CONFIG_PCACHE_MAX_PAGES pages, or when the kernel runs low on memory.
+*/
+
+static constexpr size_t PCACHE_PAGE_SIZE = 4 * _1KB;
+
+struct CachedPage {
+    /* Links in the LRU list, only valid while the page is unreferenced */
+    INTRUSIVE_LINKED_LIST_HEADER(CachedPage);
+    CachedPage *hash_next;
+
+    Filesystem *filesystem;
+    InodeIdentifier identifier;
+    uint64_t index;
+    int refcount;
+    /* Pages invalidated while referenced leave the cache, the last reference frees them */
+    bool is_hashed;
+
+    /* How much of the page is file data, less than a page only at the end of the file */
+    size_t length;
+    PhysicalPage *page;
+};
+
+/**
+ * \brief Copies 'size' bytes at 'offset' of a regular file into 'buffer' through the cache
+ * \return The number of bytes read, or -errno on failure
+*/
+int64_t pcache_read(Inode*, uint64_t offset, uint8_t *buffer, size_t size);
+
+/**
+ * \brief Forgets the cached pages of the file that overlap [offset, offset+size)
+ * Must be called after that part of the file changed, e.g. after a write.
+ * Only pages before the end of the file are ever cached.
+*/
+void pcache_invalidate(Inode*, uint64_t offset, uint64_t size);
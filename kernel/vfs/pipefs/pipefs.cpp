@@ -10,6 +10,7 @@ struct PipeFSFilesystemCtx {
 
 struct PipeFSInodeCtx {
     RingBuffer<4096, uint8_t> data;
+    WaitQueue waitqueue;
 };
 
 static int pipefs_fs_on_mount(Filesystem *self, Inode *out_root);
@@ -19,6 +20,7 @@ static int pipefs_fs_close_inode(Filesystem*, Inode*);
 static int64_t pipefs_file_inode_read(Inode *self, int64_t offset, uint8_t *buffer, size_t size);
 static int64_t pipefs_file_inode_write(Inode *self, int64_t offset, const uint8_t *buffer, size_t size);
 static int32_t pipefs_file_inode_poll(Inode *self, uint32_t events, uint32_t *out_revents);
+static WaitQueue *pipefs_file_inode_waitqueue(Inode *self);
 
 static int pipefs_dir_inode_lookup(Inode *self, const char *name, Inode *out_inode);
 
@@ -26,6 +28,7 @@ static struct FilesystemOps s_pipefs_ops {
     .on_mount = pipefs_fs_on_mount,
     .open_inode = pipefs_fs_open_inode,
     .close_inode = pipefs_fs_close_inode,
+    .uses_page_cache = false,
 };
 
 static struct InodeOps s_pipefs_inode_ops {
@@ -37,7 +40,9 @@ static struct InodeFileOps s_pipefs_inode_file_ops {
     .seek = fs_inode_seek_not_supported,
     .ioctl = fs_inode_ioctl_not_supported,
     .poll = pipefs_file_inode_poll,
+    .waitqueue = pipefs_file_inode_waitqueue,
     .mmap = fs_file_inode_mmap_not_supported,
+    .ftruncate = fs_file_inode_ftruncate_not_supported,
     .istty = fs_file_inode_istty_always_false,
 };
 
@@ -115,6 +120,7 @@ static int pipefs_fs_open_inode(Filesystem*, Inode *inode)
 
     LOGI("Created pipe inode (id: %" PRIu64 ")", inode->identifier);
     ctx->data.clear();
+    waitqueue_init(ctx->waitqueue);
 
     inode->opaque = ctx;
     return 0;
@@ -135,6 +141,7 @@ static int64_t pipefs_file_inode_read(Inode *self, int64_t, uint8_t *buffer, siz
     }
 
     LOGD("Read %" PRIu32 " bytes from pipe (id: %" PRIu64 ")", bytes_read, self->identifier);
+    waitqueue_wake_all(ctx->waitqueue);
     return bytes_read;
 }
 
@@ -151,6 +158,7 @@ static int64_t pipefs_file_inode_write(Inode *self, int64_t, const uint8_t *buff
         ctx->data.push(buffer[bytes_written++]);
     }
 
+    waitqueue_wake_all(ctx->waitqueue);
     return bytes_written;
 }
 
@@ -171,6 +179,12 @@ static int32_t pipefs_file_inode_poll(Inode *self, uint32_t events, uint32_t *ou
     return 0;
 }
 
+static WaitQueue *pipefs_file_inode_waitqueue(Inode *self)
+{
+    auto *ctx = static_cast<PipeFSInodeCtx*>(self->opaque);
+    return &ctx->waitqueue;
+}
+
 static int pipefs_fs_close_inode(Filesystem*, Inode *inode)
 {
     if (inode->identifier == 0)
@@ -196,7 +210,6 @@ int pipefs_create(Filesystem **out_fs)
     };
     **out_fs = (Filesystem) {
         .ops = &s_pipefs_ops,
-        .icache = {},
         .root = 0,
         .opaque = ctx,
     };
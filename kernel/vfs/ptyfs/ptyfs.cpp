@@ -23,6 +23,7 @@ static int64_t ptyfs_file_inode_write(Inode *self, int64_t offset, const uint8_t
 static int32_t ptyfs_file_inode_ioctl(Inode *self, uint32_t request, void *argp);
 static uint64_t ptyfs_file_inode_seek(Inode *self, uint64_t current, int whence, int32_t offset);
 static int32_t ptyfs_file_inode_poll(Inode *self, uint32_t events, uint32_t *out_revents);
+static WaitQueue *ptyfs_file_inode_waitqueue(Inode *self);
 static int32_t ptyfs_file_inode_mmap(Inode*, AddressSpace*, uintptr_t, uint32_t, uint32_t);
 static int32_t ptyfs_file_inode_istty(Inode*);
 
@@ -34,6 +35,7 @@ static struct FilesystemOps s_ptyfs_ops {
     .on_mount = ptyfs_fs_on_mount,
     .open_inode = ptyfs_fs_open_inode,
     .close_inode = ptyfs_fs_close_inode,
+    .uses_page_cache = false,
 };
 
 static struct InodeOps s_ptyfs_inode_ops {
@@ -45,7 +47,9 @@ static struct InodeFileOps s_ptyfs_inode_file_ops {
     .seek = ptyfs_file_inode_seek,
     .ioctl = ptyfs_file_inode_ioctl,
     .poll = ptyfs_file_inode_poll,
+    .waitqueue = ptyfs_file_inode_waitqueue,
     .mmap = ptyfs_file_inode_mmap,
+    .ftruncate = fs_file_inode_ftruncate_not_supported,
     .istty = ptyfs_file_inode_istty,
 };
 
@@ -208,6 +212,11 @@ static int32_t ptyfs_file_inode_poll(Inode *self, uint32_t events, uint32_t *out
     return get_device_by_inode(self)->poll(events, out_revents);
 }
 
+static WaitQueue *ptyfs_file_inode_waitqueue(Inode *self)
+{
+    return &get_device_by_inode(self)->waitqueue();
+}
+
 static int32_t ptyfs_file_inode_mmap(Inode *self, AddressSpace *as, uintptr_t vaddr, uint32_t length, uint32_t flags)
 {
     return get_device_by_inode(self)->mmap(as, vaddr, length, flags);
@@ -333,7 +342,6 @@ int ptyfs_create(Filesystem **out_fs)
 
     **out_fs = (Filesystem) {
         .ops = &s_ptyfs_ops,
-        .icache = {},
         .root = ROOT_INODE_ID,
         .opaque = ctx,
     };
@@ -0,0 +1,397 @@
+#include <kernel/memory/physicalalloc.h>
+#include <kernel/memory/vm.h>
+#include <sys/dirent.h>
+#include "shmfs.h"
+
+// #define LOG_ENABLED
+#define LOG_TAG "SHMFS"
+#include <kernel/log.h>
+
+
+#ifndef CONFIG_SHM_MAX_SIZE
+#define CONFIG_SHM_MAX_SIZE (32 * _1MB)
+#endif
+
+static constexpr size_t MAX_NAME_LEN = 63;
+
+struct ShmObject {
+    INTRUSIVE_LINKED_LIST_HEADER(ShmObject);
+
+    char name[MAX_NAME_LEN + 1];
+    InodeIdentifier identifier;
+    int open_count;
+
+    uint64_t size;
+    size_t page_count;
+    PhysicalPage **pages;
+};
+
+struct ShmFSFilesystemCtx {
+    IntrusiveLinkedList<ShmObject> objects;
+    uint64_t next_object_id;
+};
+
+static int shmfs_fs_on_mount(Filesystem *self, Inode *out_root);
+static int shmfs_fs_open_inode(Filesystem*, Inode*);
+static int shmfs_fs_close_inode(Filesystem*, Inode*);
+
+static int64_t shmfs_file_inode_read(Inode *self, int64_t offset, uint8_t *buffer, size_t size);
+static int64_t shmfs_file_inode_write(Inode *self, int64_t offset, const uint8_t *buffer, size_t size);
+static uint64_t shmfs_file_inode_seek(Inode *self, uint64_t current, int whence, int32_t offset);
+static int32_t shmfs_file_inode_mmap(Inode *self, AddressSpace *as, uintptr_t vaddr, uint32_t length, uint32_t flags);
+static int shmfs_file_inode_ftruncate(Inode *self, uint64_t size);
+
+static int shmfs_dir_inode_lookup(Inode *self, const char *name, Inode *out_inode);
+static int shmfs_dir_inode_create(Inode *self, const char *name, InodeType type, Inode *out_inode);
+static int64_t shmfs_dir_inode_getdents(Inode *self, int64_t offset, struct dirent *entries, size_t count);
+
+static struct FilesystemOps s_shmfs_ops {
+    .on_mount = shmfs_fs_on_mount,
+    .open_inode = shmfs_fs_open_inode,
+    .close_inode = shmfs_fs_close_inode,
+    .uses_page_cache = false,
+};
+
+static struct InodeOps s_shmfs_inode_ops {
+};
+
+static struct InodeFileOps s_shmfs_inode_file_ops {
+    .read = shmfs_file_inode_read,
+    .write = shmfs_file_inode_write,
+    .seek = shmfs_file_inode_seek,
+    .ioctl = fs_inode_ioctl_not_supported,
+    .poll = fs_file_inode_poll_always_ready,
+    .waitqueue = nullptr,
+    .mmap = shmfs_file_inode_mmap,
+    .ftruncate = shmfs_file_inode_ftruncate,
+    .istty = fs_file_inode_istty_always_false,
+};
+
+static struct InodeDirOps s_shmfs_inode_dir_ops {
+    .lookup = shmfs_dir_inode_lookup,
+    .create = shmfs_dir_inode_create,
+    .unlink = fs_dir_inode_unlink_not_supported,
+    .getdents = shmfs_dir_inode_getdents,
+};
+
+static ShmFSFilesystemCtx *get_ctx(Filesystem *fs)
+{
+    return static_cast<ShmFSFilesystemCtx*>(fs->opaque);
+}
+
+static uint8_t *page_data(ShmObject const *object, size_t index)
+{
+    return reinterpret_cast<uint8_t*>(phys2virt(page2addr(object->pages[index])));
+}
+
+// Copying to or from user memory can fault and sleep, while a concurrent
+// ftruncate could free the page: the copy holds a reference to it
+static PhysicalPage *get_page(ShmObject const *object, size_t index)
+{
+    if (index >= object->page_count)
+        return nullptr;
+
+    PhysicalPage *page = object->pages[index];
+    page->ref_count++;
+    return page;
+}
+
+static void fill_inode(Filesystem *fs, ShmObject const *object, Inode *out)
+{
+    *out = (Inode) {
+        .refcount = 0,
+        .type = InodeType::RegularFile,
+        .identifier = object->identifier,
+        .filesystem = fs,
+        .devmajor = 0,
+        .devminor = 0,
+        .mode = 0666,
+        .uid = 0,
+        .gid = 0,
+        .size = object->size,
+        .access_time = {},
+        .creation_time = {},
+        .modification_time = {},
+        .blksize = _4KB,
+        .opaque = nullptr,
+        .ops = &s_shmfs_inode_ops,
+        .file_ops = &s_shmfs_inode_file_ops,
+    };
+}
+
+static void free_object(ShmFSFilesystemCtx *ctx, ShmObject *object)
+{
+    LOGI("Destroying shared memory object '%s'", object->name);
+    for (size_t i = 0; i < object->page_count; i++)
+        MUST(physical_page_free(object->pages[i], PageOrder::_4KB));
+
+    ctx->objects.remove(object);
+    free(object->pages);
+    free(object);
+}
+
+static int shmfs_dir_inode_lookup(Inode *self, const char *name, Inode *out_inode)
+{
+    auto *object = get_ctx(self->filesystem)->objects.find([&](ShmObject *o) {
+        return strcmp(o->name, name) == 0;
+    });
+    if (object == nullptr)
+        return -ERR_NOENT;
+
+    fill_inode(self->filesystem, object, out_inode);
+    return 0;
+}
+
+static int shmfs_dir_inode_create(Inode *self, const char *name, InodeType type, Inode *out_inode)
+{
+    auto *ctx = get_ctx(self->filesystem);
+
+    if (type != InodeType::RegularFile)
+        return -ERR_INVAL;
+
+    if (strlen(name) > MAX_NAME_LEN)
+        return -ERR_NAMETOOLONG;
+
+    if (ctx->objects.find([&](ShmObject *o) { return strcmp(o->name, name) == 0; }) != nullptr)
+        return -ERR_EXIST;
+
+    auto *object = static_cast<ShmObject*>(malloc(sizeof(ShmObject)));
+    if (object == nullptr)
+        return -ERR_NOMEM;
+
+    *object = ShmObject {
+        .prev = nullptr,
+        .next = nullptr,
+        .name = {},
+        .identifier = ctx->next_object_id++,
+        .open_count = 0,
+        .size = 0,
+        .page_count = 0,
+        .pages = nullptr,
+    };
+    strcpy(object->name, name);
+    ctx->objects.add(object);
+
+    LOGI("Created shared memory object '%s' (id: %" PRIu64 ")", name, object->identifier);
+    fill_inode(self->filesystem, object, out_inode);
+    return 0;
+}
+
+static int64_t shmfs_dir_inode_getdents(Inode *self, int64_t offset, struct dirent *entries, size_t count)
+{
+    int64_t bytes_read = 0;
+
+    get_ctx(self->filesystem)->objects.foreach([&](ShmObject *object) {
+        if (count == 0)
+            return;
+
+        // Skip entries until we reach the offset
+        if (offset > 0) {
+            offset -= sizeof(struct dirent);
+            return;
+        }
+
+        *entries = (struct dirent) {
+            .d_ino = object->identifier,
+            .d_type = DT_REG,
+            .d_name = {},
+        };
+        strncpy(entries->d_name, object->name, array_size(entries->d_name) - 1);
+        entries->d_name[array_size(entries->d_name) - 1] = '\0';
+
+        entries++;
+        bytes_read += sizeof(struct dirent);
+        count--;
+    });
+
+    return bytes_read;
+}
+
+static int shmfs_file_inode_ftruncate(Inode *self, uint64_t size)
+{
+    auto *object = static_cast<ShmObject*>(self->opaque);
+
+    if (size > CONFIG_SHM_MAX_SIZE)
+        return -ERR_NOSPACE;
+
+    size_t page_count = round_up<uint64_t>(size, _4KB) / _4KB;
+    if (page_count > object->page_count) {
+        auto **pages = static_cast<PhysicalPage**>(realloc(object->pages, page_count * sizeof(PhysicalPage*)));
+        if (pages == nullptr)
+            return -ERR_NOMEM;
+        object->pages = pages;
+
+        for (size_t i = object->page_count; i < page_count; i++) {
+            if (!physical_page_alloc_zeroed(object->pages[i]).is_success()) {
+                while (i-- > object->page_count)
+                    MUST(physical_page_free(object->pages[i], PageOrder::_4KB));
+                return -ERR_NOMEM;
+            }
+        }
+    } else {
+        for (size_t i = page_count; i < object->page_count; i++)
+            MUST(physical_page_free(object->pages[i], PageOrder::_4KB));
+    }
+    object->page_count = page_count;
+
+    // Whatever was past the end reads as zeroes if the object grows again
+    if (size < object->size && size % _4KB != 0)
+        memset(page_data(object, size / _4KB) + size % _4KB, 0, _4KB - size % _4KB);
+
+    object->size = size;
+    self->size = size;
+    return 0;
+}
+
+static int64_t shmfs_file_inode_read(Inode *self, int64_t offset, uint8_t *buffer, size_t size)
+{
+    auto *object = static_cast<ShmObject*>(self->opaque);
+
+    if ((uint64_t) offset >= object->size)
+        return 0;
+    size = min<uint64_t>(size, object->size - offset);
+
+    size_t bytes_read = 0;
+    while (bytes_read < size) {
+        size_t offset_in_page = offset % _4KB;
+        size_t chunk = min(size - bytes_read, _4KB - offset_in_page);
+        PhysicalPage *page = get_page(object, offset / _4KB);
+        if (page == nullptr)
+            break;
+        memcpy(buffer + bytes_read, reinterpret_cast<uint8_t*>(phys2virt(page2addr(page))) + offset_in_page, chunk);
+        MUST(physical_page_free(page, PageOrder::_4KB));
+        bytes_read += chunk;
+        offset += chunk;
+    }
+
+    return bytes_read;
+}
+
+static int64_t shmfs_file_inode_write(Inode *self, int64_t offset, const uint8_t *buffer, size_t size)
+{
+    auto *object = static_cast<ShmObject*>(self->opaque);
+
+    if ((uint64_t) offset + size > object->size) {
+        int rc = shmfs_file_inode_ftruncate(self, offset + size);
+        if (rc < 0)
+            return rc;
+    }
+
+    size_t bytes_written = 0;
+    while (bytes_written < size) {
+        size_t offset_in_page = offset % _4KB;
+        size_t chunk = min(size - bytes_written, _4KB - offset_in_page);
+        PhysicalPage *page = get_page(object, offset / _4KB);
+        if (page == nullptr)
+            break;
+        memcpy(reinterpret_cast<uint8_t*>(phys2virt(page2addr(page))) + offset_in_page, buffer + bytes_written, chunk);
+        MUST(physical_page_free(page, PageOrder::_4KB));
+        bytes_written += chunk;
+        offset += chunk;
+    }
+
+    return bytes_written;
+}
+
+static uint64_t shmfs_file_inode_seek(Inode *self, uint64_t current, int whence, int32_t offset)
+{
+    return default_checked_seek(self->size, current, whence, offset);
+}
+
+static int32_t shmfs_file_inode_mmap(Inode *self, AddressSpace *as, uintptr_t vaddr, uint32_t length, uint32_t flags)
+{
+    auto *object = static_cast<ShmObject*>(self->opaque);
+
+    // A private copy of the object would need copy-on-write for its pages
+    if ((flags & MF_SHARED) == 0)
+        return -ERR_NOTSUP;
+
+    if (length > object->page_count * _4KB)
+        return -ERR_INVAL;
+
+    if (!vm_range_is_free(*as, vaddr, vaddr + length))
+        return -ERR_EXIST;
+
+    LOGI("Mapping %" PRIu32 " bytes of '%s' at %p", length, object->name, vaddr);
+    if (!vm_map_shared(*as, vaddr, object->pages, length / _4KB, PageAccessPermissions::UserFullAccess).is_success())
+        return -ERR_NOMEM;
+
+    return 0;
+}
+
+static int shmfs_fs_on_mount(Filesystem *self, Inode *out_root)
+{
+    *out_root = (Inode) {
+        .refcount = 0,
+        .type = InodeType::Directory,
+        .identifier = 0,
+        .filesystem = self,
+        .devmajor = 0,
+        .devminor = 0,
+        .mode = 0777,
+        .uid = 0,
+        .gid = 0,
+        .size = 0,
+        .access_time = {},
+        .creation_time = {},
+        .modification_time = {},
+        .blksize = _4KB,
+        .opaque = nullptr,
+        .ops = &s_shmfs_inode_ops,
+        .dir_ops = &s_shmfs_inode_dir_ops,
+    };
+
+    return 0;
+}
+
+static int shmfs_fs_open_inode(Filesystem *fs, Inode *inode)
+{
+    if (inode->identifier == 0)
+        return 0;
+
+    auto *object = get_ctx(fs)->objects.find([&](ShmObject *o) {
+        return o->identifier == inode->identifier;
+    });
+    if (object == nullptr)
+        return -ERR_NOENT;
+
+    object->open_count++;
+    inode->opaque = object;
+    return 0;
+}
+
+static int shmfs_fs_close_inode(Filesystem *fs, Inode *inode)
+{
+    if (inode->identifier == 0)
+        return 0;
+
+    auto *object = static_cast<ShmObject*>(inode->opaque);
+    inode->opaque = nullptr;
+    if (--object->open_count == 0)
+        free_object(get_ctx(fs), object);
+
+    return 0;
+}
+
+int shmfs_create(Filesystem **out_fs)
+{
+    uint8_t *mem = static_cast<uint8_t*>(malloc(sizeof(Filesystem) + sizeof(ShmFSFilesystemCtx)));
+    if (!mem)
+        return -ERR_NOMEM;
+
+    *out_fs = reinterpret_cast<Filesystem*>(mem);
+    auto *ctx = reinterpret_cast<ShmFSFilesystemCtx*>(mem + sizeof(Filesystem));
+
+    *ctx = ShmFSFilesystemCtx {
+        .objects = {},
+        .next_object_id = 1,
+    };
+    **out_fs = (Filesystem) {
+        .ops = &s_shmfs_ops,
+        .root = 0,
+        .opaque = ctx,
+    };
+
+    LOGI("Created shmfs");
+    return 0;
+}
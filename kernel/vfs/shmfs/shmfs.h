@@ -0,0 +1,19 @@
+#pragma once
+
+#include <kernel/vfs/fs.h>
+#include <kernel/vfs/vfs.h>
+
+
+/**
+ * Shared memory objects, mounted at /shm/.
+ *
+ * Opening "/shm/<name>" with OF_CREATE makes a new, empty object, which is
+ * given a size with ftruncate and then mapped with MF_SHARED: everyone
+ * mapping it gets the same physical pages, so data moves between processes
+ * without the kernel copying it. Each page is refcounted, the object and
+ * every mapping hold one reference each.
+ *
+ * An object goes away with its name when nobody has it open anymore, the
+ * pages stay around for as long as somebody still has them mapped.
+*/
+int shmfs_create(Filesystem **out_fs);
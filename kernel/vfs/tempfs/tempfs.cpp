@@ -54,6 +54,7 @@ static struct FilesystemOps s_tempfs_ops {
     .on_mount = tempfs_fs_on_mount,
     .open_inode = tempfs_fs_open_inode,
     .close_inode = tempfs_fs_close_inode,
+    .uses_page_cache = false,
 };
 
 static struct InodeOps s_tempfs_inode_ops {
@@ -65,7 +66,9 @@ static struct InodeFileOps s_tempfs_inode_file_ops {
     .seek = tempfs_file_inode_seek,
     .ioctl = fs_inode_ioctl_not_supported,
     .poll = fs_file_inode_poll_always_ready,
-    .mmap = fs_file_inode_mmap_not_supported,
+    .waitqueue = nullptr,
+    .mmap = nullptr,
+    .ftruncate = tempfs_file_inode_ftruncate,
     .istty = fs_file_inode_istty_always_false,
 };
 
@@ -436,7 +439,6 @@ int tempfs_create(Filesystem **out_fs, size_t capacity)
     };
     **out_fs = (Filesystem) {
         .ops = &s_tempfs_ops,
-        .icache = {},
         .root = reinterpret_cast<uintptr_t>(ctx->root),
         .opaque = ctx,
     };
@@ -1,7 +1,10 @@
 #include <dirent.h>
 #include "vfs.h"
 #include "fs.h"
+#include "pagecache.h"
 
+#include <kernel/memory/slab.h>
+#include <kernel/memory/vm.h>
 #include <kernel/scheduler.h>
 
 // #define LOG_ENABLED
@@ -11,14 +14,12 @@
 /**
  * 
  * ## The Inode Cache (icache)
- * The inode cache is where all the currently open inodes are stored.
+ * The inode cache is where all the known inodes are stored, see fs.h
  * 
- * Every entry in it must be unique and opened by at least 1 process.
- * It should not be possible to get an inode from the icache that
- * has a refcount of 0, or that it is not currently open.
- * 
- * If an inode is returned from the icache, it can be assumed that the
- * inode's open function has been previously called and it was successful
+ * Every entry in it is unique. An inode with a refcount greater than 0
+ * is open: its filesystem's open function has been called and it was
+ * successful. An inode with a refcount of 0 is closed and must be opened
+ * again with open_inode before it is used.
  */
 
 
@@ -51,6 +52,7 @@ static int open_inode(Inode *inode)
         return rc;
     }
 
+    icache_get(inode);
     inode->refcount = 1;
     return 0;
 }
@@ -67,20 +69,24 @@ static void close_inode(Inode *inode)
     }
 
     inode->filesystem->ops->close_inode(inode->filesystem, inode);
+    inode->refcount = 0;
+    icache_put(inode);
 }
 
+static SlabCache s_custody_cache = slab_cache("file-custody", sizeof(FileCustody));
+
 static void free_custody(FileCustody *custody)
 {
     if (custody == nullptr)
         return;
     
     close_inode(custody->inode);
-    free(custody);
+    slab_free(s_custody_cache, custody);
 }
 
 static int alloc_custody(Inode *inode, uint32_t flags, FileCustody **out_custody)
 {
-    auto *custody = static_cast<FileCustody*>(malloc(sizeof(FileCustody)));
+    auto *custody = slab_alloc<FileCustody>(s_custody_cache);
     if (!custody)
         return -ERR_NOMEM;
     
@@ -91,6 +97,24 @@ static int alloc_custody(Inode *inode, uint32_t flags, FileCustody **out_custody
     return 0;
 }
 
+static int insert_and_open_inode(Inode const& inode, Inode **out_inode)
+{
+    int rc;
+
+    *out_inode = icache_insert(inode);
+    if (*out_inode == nullptr)
+        return -ERR_NOMEM;
+
+    rc = open_inode(*out_inode);
+    if (rc != 0) {
+        icache_remove(*out_inode);
+        *out_inode = nullptr;
+        return rc;
+    }
+
+    return 0;
+}
+
 static int lookup_inode(Inode *parent, const char *name, Inode **out_inode)
 {
     int rc;
@@ -104,32 +128,15 @@ static int lookup_inode(Inode *parent, const char *name, Inode **out_inode)
     }
     LOGI("Found");
 
-    *out_inode = icache_lookup(&parent->filesystem->icache, temp.identifier);
-    if (*out_inode != nullptr)
+    *out_inode = icache_lookup(parent->filesystem, temp.identifier);
+    if (*out_inode != nullptr) {
+        // A closed inode might be stale, the filesystem just gave us a fresh copy
+        if ((*out_inode)->refcount == 0)
+            **out_inode = temp;
         return open_inode(*out_inode);
-
-    *out_inode = (Inode*) malloc(sizeof(Inode));
-    if (*out_inode == nullptr)
-        return -ERR_NOMEM;
-        
-    **out_inode = temp;
-    (*out_inode)->refcount = 0;
-    rc = open_inode(*out_inode);
-    if (rc != 0) {
-        free(*out_inode);
-        *out_inode = nullptr;
-        return rc;
-    }
-    
-    rc = icache_insert(&parent->filesystem->icache, temp.identifier, *out_inode);
-    if (rc != 0) {
-        close_inode(*out_inode);
-        free(*out_inode);
-        *out_inode = nullptr;
-        return rc;
     }
 
-    return 0;
+    return insert_and_open_inode(temp, out_inode);
 }
 
 /**
@@ -160,7 +167,7 @@ static int traverse_in_fs(Filesystem *fs, const char *fs_relative_canonicalized_
     int rc = 0;
 
     Inode *parent = nullptr;
-    Inode *inode = icache_lookup(&fs->icache, fs->root);
+    Inode *inode = icache_lookup(fs, fs->root);
     if (inode == nullptr) {
         LOGE("root inode %lu not found", fs->root);
         return -ERR_NOENT;
@@ -300,31 +307,14 @@ static int create_inode(Inode *parent, const char *name, InodeType type, Inode *
         return rc;
     }
     
-    *out_inode = icache_lookup(&parent->filesystem->icache, temp.identifier);
-    kassert(*out_inode == nullptr);
-
-    *out_inode = (Inode*) malloc(sizeof(Inode));
-    if (*out_inode == nullptr)
-        return -ERR_NOMEM;
-        
-    **out_inode = temp;
-    (*out_inode)->refcount = 0;
-    rc = open_inode(*out_inode);
-    if (rc != 0) {
-        free(*out_inode);
-        *out_inode = nullptr;
-        return rc;
-    }
-    
-    rc = icache_insert(&parent->filesystem->icache, temp.identifier, *out_inode);
-    if (rc != 0) {
-        close_inode(*out_inode);
-        free(*out_inode);
-        *out_inode = nullptr;
-        return rc;
+    // A closed inode with the same identifier may be left over from a deleted file
+    Inode *stale = icache_lookup(parent->filesystem, temp.identifier);
+    if (stale != nullptr) {
+        kassert(stale->refcount == 0);
+        icache_remove(stale);
     }
 
-    return 0;
+    return insert_and_open_inode(temp, out_inode);
 }
 
 int vfs_open(const char *path, uint32_t flags, FileCustody **out_custody)
@@ -388,13 +378,13 @@ int vfs_open(const char *workdir, const char *path, uint32_t flags, FileCustody
 int vfs_mount(const char *path, Filesystem &fs)
 {
     int rc = 0;
-    Inode *root_inode = (Inode*) malloc(sizeof(Inode));
+    Inode root = {};
+    Inode *root_inode = nullptr;
     char *cpath = canonicalize_path(path);
     auto *mp = (MountPoint*) malloc(sizeof(MountPoint));
-    if (cpath == nullptr || mp == nullptr || root_inode == nullptr) {
+    if (cpath == nullptr || mp == nullptr) {
         free(cpath);
         free(mp);
-        free(root_inode);
         return -ERR_NOMEM;
     }
     
@@ -414,10 +404,10 @@ int vfs_mount(const char *path, Filesystem &fs)
         s_mountpoints.add(mp);
     }
 
-    fs.ops->on_mount(&fs, root_inode);
-    rc = open_inode(root_inode);
+    fs.ops->on_mount(&fs, &root);
+    // The root inode is kept open for as long as the filesystem is mounted
+    rc = insert_and_open_inode(root, &root_inode);
     kassert(rc == 0); // TODO: handle this error
-    icache_insert(&fs.icache, root_inode->identifier, root_inode);
 
 
     s_mountpoints.foreach([&](MountPoint *mp) {
@@ -427,6 +417,48 @@ int vfs_mount(const char *path, Filesystem &fs)
     return rc;
 }
 
+/**
+ * Sleeps until polling the file reports at least one of 'events'.
+ * Files without a wait queue never change their poll result and are not waited on.
+*/
+static void wait_for_events(FileCustody *custody, uint32_t events)
+{
+    WaitQueue *queue = vfs_waitqueue(custody);
+    if (queue == nullptr)
+        return;
+
+    waitqueue_wait_until(*queue, [&]() {
+        uint32_t revents = 0;
+        return vfs_poll(custody, events, &revents) != 0 || (revents & events) != 0;
+    });
+}
+
+static bool uses_page_cache(Inode const *inode)
+{
+    return inode->type == InodeType::RegularFile && inode->filesystem != nullptr && inode->filesystem->ops->uses_page_cache;
+}
+
+/**
+ * \brief Forgets the cached pages of a file after [offset, offset+size) changed
+ * Only pages before the old end of the file can be cached: when the file grows,
+ * the old last page is the only other one that changes
+*/
+static void invalidate_cached_range(Inode *inode, uint64_t old_size, uint64_t offset, uint64_t size)
+{
+    uint64_t start = min(offset, old_size);
+    uint64_t end = min(offset + size, round_up<uint64_t>(old_size, PCACHE_PAGE_SIZE));
+    if (start < end)
+        pcache_invalidate(inode, start, end - start);
+}
+
+static int64_t read_file(Inode *inode, int64_t offset, uint8_t *buffer, size_t size)
+{
+    if (uses_page_cache(inode))
+        return pcache_read(inode, offset, buffer, size);
+
+    return inode->file_ops->read(inode, offset, buffer, size);
+}
+
 ssize_t vfs_read(FileCustody *custody, uint8_t *buffer, uint32_t size)
 {
     bool is_dir = custody->inode->type == InodeType::Directory;
@@ -439,18 +471,14 @@ ssize_t vfs_read(FileCustody *custody, uint8_t *buffer, uint32_t size)
         return -ERR_PERM;
     }
 
-    if ((custody->flags & OF_NONBLOCK) == 0 && !is_dir) {
-        uint32_t events = 0;
-        while (vfs_poll(custody, F_POLLIN, &events) == 0 && (events & F_POLLIN) == 0) {
-            sys$yield();
-        }
-    }
+    if ((custody->flags & OF_NONBLOCK) == 0 && !is_dir)
+        wait_for_events(custody, F_POLLIN);
 
     LOGI("vfs_read(%" PRIu32 " bytes, custody offset @ %" PRIu64 ")", size, custody->offset);
     auto *inode = custody->inode;
     ssize_t rc = 0;
     if (!is_dir) {
-        rc = inode->file_ops->read(inode, custody->offset, buffer, size);
+        rc = read_file(inode, custody->offset, buffer, size);
     } else {
         rc = inode->dir_ops->getdents(inode, custody->offset, (struct dirent*) buffer, size / sizeof(struct dirent));
     }
@@ -460,6 +488,17 @@ ssize_t vfs_read(FileCustody *custody, uint8_t *buffer, uint32_t size)
     return rc;
 }
 
+ssize_t vfs_pread(FileCustody *custody, uint8_t *buffer, uint32_t size, uint64_t offset)
+{
+    if (custody->inode->type == InodeType::Directory)
+        return -ERR_ISDIR;
+
+    if ((custody->flags & OF_ACCMODE) == OF_WRONLY)
+        return -ERR_PERM;
+
+    return read_file(custody->inode, offset, buffer, size);
+}
+
 ssize_t vfs_write(FileCustody *custody, uint8_t const *buffer, uint32_t size)
 {
     if (custody->inode->type == InodeType::Directory)
@@ -470,15 +509,14 @@ ssize_t vfs_write(FileCustody *custody, uint8_t const *buffer, uint32_t size)
         return -ERR_PERM;
     }
 
-    if ((custody->flags & OF_NONBLOCK) == 0) {
-        uint32_t events = 0;
-        while (vfs_poll(custody, F_POLLOUT, &events) == 0 && (events & F_POLLOUT) == 0) {
-            sys$yield();
-        }
-    }
+    if ((custody->flags & OF_NONBLOCK) == 0)
+        wait_for_events(custody, F_POLLOUT);
 
     auto *inode = custody->inode;
+    uint64_t old_size = inode->size;
     ssize_t rc = inode->file_ops->write(inode, custody->offset, buffer, size);
+    if (uses_page_cache(inode) && rc > 0)
+        invalidate_cached_range(inode, old_size, custody->offset, rc);
     if (rc > 0)
         vfs_seek(custody, SEEK_CUR, rc);
 
@@ -543,7 +581,7 @@ int vfs_fstat(FileCustody *custody, api::Stat *stat)
 
 FileCustody* vfs_duplicate(FileCustody *custody)
 {
-    auto *dup = (FileCustody*) malloc(sizeof(FileCustody));
+    auto *dup = slab_alloc<FileCustody>(s_custody_cache);
     if (dup == nullptr)
         return nullptr;
     
@@ -594,14 +632,73 @@ int32_t vfs_poll(FileCustody *custody, uint32_t events, uint32_t *out_revents)
     return custody->inode->file_ops->poll(custody->inode, events, out_revents);
 }
 
+WaitQueue *vfs_waitqueue(FileCustody *custody)
+{
+    if (custody->inode->type == InodeType::Directory || custody->inode->file_ops->waitqueue == nullptr)
+        return nullptr;
+
+    return custody->inode->file_ops->waitqueue(custody->inode);
+}
+
+/**
+ * Unless their filesystem says otherwise, regular files are all mapped the
+ * same way: pages are read through the inode's read function the first time
+ * they are accessed and, being read-only, are shared by every process that
+ * maps the same file. Pages past the end of the file are zero-filled.
+*/
+static int mmap_regular_file(FileCustody *custody, AddressSpace *as, uintptr_t vaddr, uint32_t length, uint32_t flags)
+{
+    if ((custody->flags & OF_ACCMODE) == OF_WRONLY)
+        return -ERR_PERM;
+
+    if ((flags & (MF_SHARED | MF_PRIVATE)) == 0 || (flags & (MF_SHARED | MF_PRIVATE)) == (MF_SHARED | MF_PRIVATE))
+        return -ERR_INVAL;
+
+    if (!vm_range_is_free(*as, vaddr, vaddr + length))
+        return -ERR_EXIST;
+
+    uint32_t data_size = min<uint64_t>(length, custody->inode->size);
+    Error rc = vm_map_file(*as, vaddr, length, PageAccessPermissions::UserReadOnly, custody, 0, vaddr, data_size);
+    if (!rc.is_success())
+        return -ERR_NOMEM;
+
+    return 0;
+}
+
 int vfs_mmap(FileCustody *custody, AddressSpace *as, uintptr_t vaddr, uint32_t length, uint32_t flags)
 {
     if (custody->inode->type == InodeType::Directory)
         return -ERR_ISDIR;
 
+    if (custody->inode->type == InodeType::RegularFile && custody->inode->file_ops->mmap == nullptr)
+        return mmap_regular_file(custody, as, vaddr, length, flags);
+
+    // Filesystems that map regular files themselves (e.g. shared memory) map them writable
+    if (custody->inode->type == InodeType::RegularFile && (custody->flags & OF_ACCMODE) != OF_RDWR)
+        return -ERR_PERM;
+
     return custody->inode->file_ops->mmap(custody->inode, as, vaddr, length, flags);
 }
 
+int vfs_ftruncate(FileCustody *custody, uint64_t size)
+{
+    auto *inode = custody->inode;
+    if (inode->type != InodeType::RegularFile)
+        return -ERR_INVAL;
+
+    if ((custody->flags & OF_ACCMODE) == OF_RDONLY)
+        return -ERR_PERM;
+
+    uint64_t old_size = inode->size;
+    int rc = inode->file_ops->ftruncate(inode, size);
+    if (uses_page_cache(inode)) {
+        uint64_t changed_from = min(old_size, inode->size);
+        invalidate_cached_range(inode, old_size, changed_from, max(old_size, inode->size) - changed_from);
+    }
+
+    return rc;
+}
+
 int vfs_istty(FileCustody *custody)
 {
     if (custody->inode->type != InodeType::CharacterDevice)
@@ -21,6 +21,11 @@ ssize_t vfs_read(FileCustody*, uint8_t *buffer, uint32_t size);
 
 ssize_t vfs_write(FileCustody*, uint8_t const *buffer, uint32_t size);
 
+/**
+ * \brief Reads at 'offset' without moving the custody's offset and without waiting for data
+*/
+ssize_t vfs_pread(FileCustody*, uint8_t *buffer, uint32_t size, uint64_t offset);
+
 ssize_t vfs_seek(FileCustody*, int whence, int32_t);
 
 int vfs_close(FileCustody*);
@@ -37,6 +42,11 @@ int vfs_create_pipe(FileCustody **out_sender_custody, FileCustody **out_receiver
 
 int32_t vfs_poll(FileCustody *custody, uint32_t events, uint32_t *out_revents);
 
+WaitQueue *vfs_waitqueue(FileCustody *custody);
+
 int vfs_mmap(FileCustody *custody, AddressSpace *as, uintptr_t vaddr, uint32_t length, uint32_t flags);
 
+/* Sets the size of a regular file, the new part reads as zeroes */
+int vfs_ftruncate(FileCustody *custody, uint64_t size);
+
 int vfs_istty(FileCustody *custody);
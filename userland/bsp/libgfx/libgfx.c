@@ -15,6 +15,62 @@ static Font g_default_font;
 static void _draw_circle(Display *display, int x, int y, int radius, uint32_t color);
 static void _draw_line(Display *display, int x1, int y1, int x2, int y2, int thickness, uint32_t color);
 
+void display_add_damage(Display *display, int x, int y, int w, int h)
+{
+    int x1 = MAX(0, MIN(x, x + w));
+    int x2 = MIN(display->width, MAX(x, x + w));
+    int y1 = MAX(0, MIN(y, y + h));
+    int y2 = MIN(display->height, MAX(y, y + h));
+    if (x1 >= x2 || y1 >= y2)
+        return;
+
+    for (uint32_t i = 0; i < display->damage.count; i++) {
+        FramebufferRect *r = &display->damage.rects[i];
+        if ((int) r->x <= x1 && (int) r->y <= y1 &&
+            x2 <= (int) (r->x + r->width) && y2 <= (int) (r->y + r->height))
+            return;
+    }
+
+    if (display->damage.count == FBIO_MAX_DAMAGE_RECTS) {
+        // Out of space: collapse everything into a single bounding box
+        for (uint32_t i = 0; i < display->damage.count; i++) {
+            FramebufferRect *r = &display->damage.rects[i];
+            x1 = MIN(x1, (int) r->x);
+            y1 = MIN(y1, (int) r->y);
+            x2 = MAX(x2, (int) (r->x + r->width));
+            y2 = MAX(y2, (int) (r->y + r->height));
+        }
+        display->damage.count = 0;
+    }
+
+    display->damage.rects[display->damage.count++] = (FramebufferRect) {
+        .x = x1,
+        .y = y1,
+        .width = x2 - x1,
+        .height = y2 - y1,
+    };
+}
+
+void display_damage_all(Display *display)
+{
+    display->damage.count = 0;
+    display_add_damage(display, 0, 0, display->width, display->height);
+}
+
+int display_flush_damage(Display *display, int fd)
+{
+    if (display->damage.count == 0)
+        return 0;
+
+    FramebufferDamage damage = {
+        .count = display->damage.count,
+        .rects = display->damage.rects,
+    };
+    int rc = sys_ioctl(fd, FBIO_REFRESH_RECTS, &damage);
+    display->damage.count = 0;
+    return rc;
+}
+
 inline static void set_pixel(Display* display, int x, int y, uint32_t color)
 {
     if (x >= 0 && x < display->width && y >= 0 && y < display->height) {
@@ -29,6 +85,7 @@ void draw_filled_rect(Display *display, int x, int y, int w, int h, uint32_t col
     int y1 = MAX(0, MIN(y, y + h));
     int y2 = MIN(display->height, MAX(y, y + h));
 
+    display_add_damage(display, x1, y1, x2 - x1, y2 - y1);
     for (int y = y1; y < y2; y++) {
         uint32_t *fb = &display->framebuffer[y * display->width + x1];
         for (int x = x1; x < x2; x++, fb++) {
@@ -46,6 +103,7 @@ void draw_outlined_rect(Display *display, int x, int y, int w, int h, int thickn
     int y2 = MIN(display->height, MAX(y, y + h));
 
     printf("x1: %d, x2: %d, y1: %d, y2: %d\n", x1, x2, y1, y2);
+    display_add_damage(display, x1, y1, x2 - x1 + 1, y2 - y1 + 1);
 
     for (int i = 0; i < thickness; i++) {
         for (int _x = x1; _x < x2; _x++) {
@@ -91,6 +149,7 @@ static void _draw_circle(Display *display, int x, int y, int radius, uint32_t co
 
 void draw_circle(Display *display, int x, int y, int radius, uint32_t color)
 {
+    display_add_damage(display, x - radius, y - radius, 2 * radius + 1, 2 * radius + 1);
     _draw_circle(display, x, y, radius, color);
 }
 
@@ -144,6 +203,14 @@ static void _draw_line(Display *display, int x1, int y1, int x2, int y2, int thi
 
 void draw_line(Display *display, int x1, int y1, int x2, int y2, int thickness, uint32_t color)
 {
+    int half_thickness = thickness / 2;
+    display_add_damage(
+        display,
+        MIN(x1, x2) - half_thickness,
+        MIN(y1, y2) - half_thickness,
+        abs(x2 - x1) + 2 * half_thickness + 1,
+        abs(y2 - y1) + 2 * half_thickness + 1
+    );
     _draw_line(display, x1, y1, x2, y2, thickness, color);
 }
 
@@ -180,6 +247,9 @@ void draw_char(Display *display, Font *font, char c, int x, int y, int scale, ui
 
     uint8_t const* start_of_glyph = &font->data[sizeof(font->header) + font->header.bytes_per_glyph * c];
 
+    // Covers the draw_filled_rect calls below too, those will find it already there
+    display_add_damage(display, x, y, 8 * scale, font->header.height * scale);
+
     for (size_t glyph_y = 0; glyph_y < font->header.height; glyph_y++) {
         uint8_t glyph_row = start_of_glyph[glyph_y];
         for (size_t glyph_x = 0; glyph_x < 8; glyph_x++) {
@@ -2,6 +2,7 @@
 
 #include "libmmath.h"
 #include <stdint.h>
+#include <api/syscalls.h>
 
 
 #define PIXELFMT_ARGB8 1
@@ -38,6 +39,12 @@ typedef struct Display {
     struct {
         int (*refresh)(struct Display*);
     } ops;
+
+    /* Regions drawn to since the last call to display_flush_damage */
+    struct {
+        FramebufferRect rects[FBIO_MAX_DAMAGE_RECTS];
+        uint32_t count;
+    } damage;
 } Display;
 
 typedef struct PSFFont {
@@ -74,3 +81,17 @@ void draw_char(Display* window, Font* font, char c, int x, int y, int scale, uin
 void draw_text(Display* window, Font* font, char const* text, int x, int y, int scale, uint32_t color);
 
 uint32_t get_opposite_color(uint32_t color);
+
+/*
+ * Marks a region of the display as changed. The draw_* functions already
+ * do this for what they touch, use it when writing to the framebuffer directly.
+ */
+void display_add_damage(Display* display, int x, int y, int w, int h);
+
+void display_damage_all(Display* display);
+
+/*
+ * Asks the framebuffer device 'fd' to refresh only the changed regions
+ * of the display, then forgets about them
+ */
+int display_flush_damage(Display* display, int fd);
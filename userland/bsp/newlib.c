@@ -31,8 +31,7 @@ void _exit(int status)
     while(1);
 }
 
-static uint8_t s_heap[16 * 1024 * 1024];
-static uint8_t *s_brk = s_heap;
+static uint8_t *s_brk = NULL;
 static const char *OUT_OF_MEMORY_ERROR_MSG = "\n"
     "@@@@@@@@@@@@@@@@@@@@@@@@@\n"
     "@@@@@ OUT OF MEMORY @@@@@\n"
@@ -40,8 +39,11 @@ static const char *OUT_OF_MEMORY_ERROR_MSG = "\n"
 
 void* _sbrk(int incr)
 {
+    if (s_brk == NULL)
+        s_brk = (uint8_t*) sys_brk(NULL);
+
     uint8_t *brk = s_brk;
-    if (s_brk + incr > s_heap + sizeof(s_heap)) {
+    if ((uint8_t*) sys_brk(s_brk + incr) != s_brk + incr) {
         write(STDERR_FILENO, OUT_OF_MEMORY_ERROR_MSG, sizeof(OUT_OF_MEMORY_ERROR_MSG));
         exit(-1);
         return NULL;
@@ -62,8 +62,8 @@ static int open_framebuffer()
     }
 
     // This is completely arbitrary...
-    s_fb.addr = (uint8_t*) 0x80000000;
-    if (0 != (rc = sys_mmap(s_fb.fd, s_fb.addr, s_fb.info.pitch * s_fb.info.height, 0))) {
+    s_fb.addr = (uint8_t*) 0x30000000;
+    if ((rc = sys_mmap(s_fb.fd, s_fb.addr, s_fb.info.pitch * s_fb.info.height, 0)) < 0) {
         fprintf(stderr, "sys_ioctl(FBIO_MAP) failed\n");
         goto cleanup;
     }
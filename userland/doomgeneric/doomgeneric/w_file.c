@@ -37,6 +37,10 @@ extern wad_file_class_t win32_wad_file;
 extern wad_file_class_t posix_wad_file;
 #endif 
 
+#ifdef HAVE_MYOS_MMAP
+extern wad_file_class_t myos_wad_file;
+#endif
+
 static wad_file_class_t *wad_file_classes[] = 
 {
 /*
@@ -46,6 +50,9 @@ static wad_file_class_t *wad_file_classes[] =
 */
 #ifdef HAVE_MMAP
     &posix_wad_file,
+#endif
+#ifdef HAVE_MYOS_MMAP
+    &myos_wad_file,
 #endif
     &stdc_wad_file,
 };
@@ -59,8 +66,15 @@ wad_file_t *W_OpenFile(char *path)
     // Use the OS's virtual memory subsystem to map WAD files
     // directly into memory.
     //
+    // On myos this is the default: the mappings are read-only and
+    // their pages are shared, -nommap reads the lumps instead.
+    //
 
+#ifdef HAVE_MYOS_MMAP
+    if (M_CheckParm("-nommap"))
+#else
     if (!M_CheckParm("-mmap"))
+#endif
     {
         return stdc_wad_file.OpenFile(path);
     }
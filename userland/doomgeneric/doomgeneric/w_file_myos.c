@@ -0,0 +1,102 @@
+//
+// Copyright(C) 1993-1996 Id Software, Inc.
+// Copyright(C) 2005-2014 Simon Howard
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// DESCRIPTION:
+//	WAD I/O functions, using read-only file mappings.
+//
+
+#include <string.h>
+
+#include "w_file.h"
+#include "z_zone.h"
+
+// After Doom's headers, <stdbool.h> would clash with its boolean type
+#include <api/syscalls.h>
+
+extern wad_file_class_t myos_wad_file;
+
+static wad_file_t *W_MyOS_OpenFile(char *path)
+{
+    wad_file_t *result;
+    Stat stat;
+    int fd;
+    int mapped;
+
+    fd = sys_open(path, OF_RDONLY, 0);
+
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    if (sys_fstat(fd, &stat) < 0 || stat.st_size == 0)
+    {
+        sys_close(fd);
+        return NULL;
+    }
+
+    // The pages are read on first access and shared with every other
+    // process that has the same WAD mapped. The mapping keeps its own
+    // reference to the file, so the descriptor is not needed anymore.
+
+    mapped = sys_mmap(fd, NULL, stat.st_size, MF_PRIVATE);
+    sys_close(fd);
+
+    if (mapped < 0)
+    {
+        return NULL;
+    }
+
+    result = Z_Malloc(sizeof(wad_file_t), PU_STATIC, 0);
+    result->file_class = &myos_wad_file;
+    result->mapped = (byte *) mapped;
+    result->length = stat.st_size;
+
+    return result;
+}
+
+static void W_MyOS_CloseFile(wad_file_t *wad)
+{
+    sys_munmap(wad->mapped, wad->length);
+    Z_Free(wad);
+}
+
+// Read data from the specified position in the file into the 
+// provided buffer.  Returns the number of bytes read.
+
+size_t W_MyOS_Read(wad_file_t *wad, unsigned int offset,
+                   void *buffer, size_t buffer_len)
+{
+    if (offset >= wad->length)
+    {
+        return 0;
+    }
+
+    if (buffer_len > wad->length - offset)
+    {
+        buffer_len = wad->length - offset;
+    }
+
+    memcpy(buffer, wad->mapped + offset, buffer_len);
+
+    return buffer_len;
+}
+
+
+wad_file_class_t myos_wad_file = 
+{
+    W_MyOS_OpenFile,
+    W_MyOS_CloseFile,
+    W_MyOS_Read,
+};
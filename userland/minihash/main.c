@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <api/syscalls.h>
 
 
 
@@ -13,6 +14,29 @@ static void hash_update(uint8_t *data, size_t len, uint32_t *hash)
     }
 }
 
+/* Hashes the file straight from its pages, without copying it. Returns false if it can't be mapped */
+static bool hash_mapped_file(const char *path, uint32_t *hash)
+{
+    int fd = sys_open(path, OF_RDONLY, 0);
+    if (fd < 0)
+        return false;
+
+    Stat stat;
+    if (sys_fstat(fd, &stat) < 0 || stat.st_size == 0) {
+        sys_close(fd);
+        return false;
+    }
+
+    int rc = sys_mmap(fd, NULL, stat.st_size, MF_PRIVATE);
+    sys_close(fd);
+    if (rc < 0)
+        return false;
+
+    hash_update((uint8_t*) rc, stat.st_size, hash);
+    sys_munmap((void*) rc, stat.st_size);
+    return true;
+}
+
 int main(int argc, char **argv)
 {
     if (argc < 2) {
@@ -20,6 +44,12 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    uint32_t hash = 0;
+    if (hash_mapped_file(argv[1], &hash)) {
+        printf("%" PRIu32 "\n", hash);
+        return 0;
+    }
+
     FILE *fp = fopen(argv[1], "r");
     if (!fp) {
         fprintf(stderr, "Failed to open file %s\n", argv[1]);
@@ -28,7 +58,6 @@ int main(int argc, char **argv)
 
     uint8_t buf[4096];
     size_t len;
-    uint32_t hash = 0;
     while ((len = fread(buf, 1, sizeof(buf), fp)) > 0) {
         hash_update(buf, len, &hash);
     }
@@ -868,6 +868,10 @@ static void flanterm_fb_full_refresh(struct flanterm_context *_ctx) {
 
     uint32_t default_bg = ctx->default_bg;
 
+    if (ctx->damage_callback != NULL) {
+        ctx->damage_callback(_ctx, ctx->damage_data, 0, 0, ctx->width, ctx->height);
+    }
+
     for (size_t y = 0; y < ctx->height; y++) {
         for (size_t x = 0; x < ctx->width; x++) {
             if (ctx->canvas != NULL) {
@@ -1250,3 +1254,30 @@ fail:
 
     return NULL;
 }
+
+static void plot_char_and_damage(struct flanterm_context *_ctx, struct flanterm_fb_char *c, size_t x, size_t y) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    ctx->plot_char_undamaged(_ctx, c, x, y);
+    ctx->damage_callback(_ctx, ctx->damage_data,
+                         ctx->offset_x + x * ctx->glyph_width, ctx->offset_y + y * ctx->glyph_height,
+                         ctx->glyph_width, ctx->glyph_height);
+}
+
+void flanterm_fb_set_damage_callback(
+    struct flanterm_context *_ctx,
+    void (*callback)(struct flanterm_context *ctx, void *data, size_t x, size_t y, size_t width, size_t height),
+    void *data
+) {
+    struct flanterm_fb_context *ctx = (void *)_ctx;
+
+    if (callback != NULL && ctx->damage_callback == NULL) {
+        ctx->plot_char_undamaged = ctx->plot_char;
+        ctx->plot_char = plot_char_and_damage;
+    } else if (callback == NULL && ctx->damage_callback != NULL) {
+        ctx->plot_char = ctx->plot_char_undamaged;
+    }
+
+    ctx->damage_callback = callback;
+    ctx->damage_data = data;
+}
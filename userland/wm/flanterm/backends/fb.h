@@ -61,6 +61,13 @@ struct flanterm_context *flanterm_fb_init(
     size_t margin
 );
 
+/* Calls 'callback' with every rectangle of the framebuffer, in pixels, that gets drawn. Pass NULL to stop. */
+void flanterm_fb_set_damage_callback(
+    struct flanterm_context *ctx,
+    void (*callback)(struct flanterm_context *ctx, void *data, size_t x, size_t y, size_t width, size_t height),
+    void *data
+);
+
 #ifdef __cplusplus
 }
 #endif
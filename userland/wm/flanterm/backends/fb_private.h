@@ -112,6 +112,10 @@ struct flanterm_fb_context {
 
     size_t old_cursor_x;
     size_t old_cursor_y;
+
+    void (*plot_char_undamaged)(struct flanterm_context *ctx, struct flanterm_fb_char *c, size_t x, size_t y);
+    void (*damage_callback)(struct flanterm_context *ctx, void *data, size_t x, size_t y, size_t width, size_t height);
+    void *damage_data;
 };
 
 #ifdef __cplusplus
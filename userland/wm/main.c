@@ -6,6 +6,7 @@
 #include <sys/termios.h>
 
 #include <api/syscalls.h>
+#include <libgfx/libgfx.h>
 #include "flanterm/flanterm.h"
 #include "flanterm/backends/fb.h"
 
@@ -18,6 +19,16 @@
 static struct flanterm_context *ft_ctx;
 static int display_fd;
 
+/* Only used to keep track of what flanterm drew since the last refresh */
+static Display display;
+
+
+static void damage_callback(struct flanterm_context *ctx, void *data, size_t x, size_t y, size_t width, size_t height)
+{
+    (void) ctx;
+    display_add_damage((Display*) data, x, y, width, height);
+}
+
 
 static void terminal_callback(struct flanterm_context *ctx, void *data, uint64_t type, uint64_t arg1, uint64_t arg2, uint64_t arg3) {
     (void)ctx;
@@ -92,8 +103,8 @@ static int open_framebuffer_display(const char *path)
     }
 
     // This is completely arbitrary...
-    f = (uint32_t*) 0x80000000;
-    if (0 != (rc = sys_mmap(fd, f, fbinfo.pitch * fbinfo.height, 0))) {
+    f = (uint32_t*) 0x30000000;
+    if ((rc = sys_mmap(fd, f, fbinfo.pitch * fbinfo.height, 0)) < 0) {
         fprintf(stderr, "sys_ioctl(FBIO_MAP) failed\n");
         goto cleanup;
     }
@@ -115,7 +126,17 @@ static int open_framebuffer_display(const char *path)
         fprintf(stderr, "flanterm_fb_init() failed\n");
         goto cleanup;
     }
-    
+
+    display = (Display) {
+        .framebuffer = f,
+        .pitch = fbinfo.pitch,
+        .width = fbinfo.width,
+        .height = fbinfo.height,
+    };
+    // flanterm_fb_init already drew the whole screen once
+    display_damage_all(&display);
+
+    flanterm_fb_set_damage_callback(ft_ctx, damage_callback, &display);
 
     display_fd = fd;
 
@@ -233,6 +254,6 @@ int main(int argc, char *argv[])
             }
         }
 
-        sys_ioctl(display_fd, FBIO_REFRESH, 0);
+        display_flush_damage(&display, display_fd);
     }
 }